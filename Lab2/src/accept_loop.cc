@@ -0,0 +1,146 @@
+/// accept_loop.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "accept_loop.h"
+#include "metrics.h"
+#include "reporter.h"
+#include "server.h"
+
+namespace simple_http_server
+{
+
+AcceptLoop::AcceptLoop(Server &server, std::unique_ptr<TCPSocket> listener)
+    : server_(server), listener_(std::move(listener))
+{
+    epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listener_->fd();
+    // Non-blocking (see TCPSocket::set_blocking): a connection reset
+    // before it is accepted must not block the loop.
+    if (epoll_fd_ < 0 || !listener_->set_blocking(true) ||
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listener_->fd(), &ev) < 0)
+    {
+        report(ERROR) << "fail creating the accept loop: " << strerror(errno) << std::endl;
+        abort();
+    }
+}
+
+AcceptLoop::~AcceptLoop()
+{
+    ::close(epoll_fd_);
+}
+
+void AcceptLoop::run()
+{
+    static const int MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;)
+    {
+        // Until the oldest waiting connection is due.
+        int timeout = -1;
+        for (auto list : { &fresh_, &idle_ })
+        {
+            if (list->empty())
+                continue;
+            unsigned long long now = now_ns(), deadline = list->front().deadline;
+            int ms = deadline > now ? (deadline - now) / 1000000 + 1 : 0;
+            if (timeout < 0 || ms < timeout)
+                timeout = ms;
+        }
+
+        int n = ::epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR)
+        {
+            report(ERROR) << "accept loop failed: " << strerror(errno) << std::endl;
+            abort();
+        }
+
+        // Accepted after the others are served, which may free the
+        // descriptor a new connection gets.
+        bool accepting = false;
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.fd == listener_->fd())
+            {
+                accepting = true;
+                continue;
+            }
+
+            // A closed peer is readable too, serving it sees the end.
+            auto found = waiting_.find(events[i].data.fd);
+            if (found == waiting_.end())
+                continue;
+            bool first = found->second->first;
+            std::unique_ptr<TCPSocket> sock = unwait(found->second);
+            if ((sock = server_.serve_connection(std::move(sock), first)))
+                wait(std::move(sock), false);
+        }
+        if (accepting)
+            accept();
+
+        unsigned long long now = now_ns();
+        while (!fresh_.empty() && fresh_.front().deadline <= now)
+            expire(unwait(fresh_.begin()), Server::TIMEOUT_HEADER);
+        while (!idle_.empty() && idle_.front().deadline <= now)
+            expire(unwait(idle_.begin()), Server::TIMEOUT_IDLE);
+    }
+}
+
+void AcceptLoop::accept()
+{
+    std::unique_ptr<TCPSocket> sock(new TCPSocket());
+    std::string client_ip;
+    uint16_t client_port;
+
+    // Gone meanwhile, or out of descriptors: the next event tells.
+    if (!listener_->accept(*sock, client_ip, client_port))
+        return;
+    Metrics::connection_opened();
+    wait(std::move(sock), true);
+}
+
+void AcceptLoop::wait(std::unique_ptr<TCPSocket> sock, bool first)
+{
+    int fd = sock->fd();
+    unsigned long long deadline =
+        now_ns() + server_.timeouts[first ? Server::TIMEOUT_HEADER : Server::TIMEOUT_IDLE] * 1000000ULL;
+    std::list<Waiting> &list = first ? fresh_ : idle_;
+    auto it = list.insert(list.end(), Waiting{ std::move(sock), deadline, first });
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd;
+    if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        report(ERROR) << "fail watching connection: " << strerror(errno) << std::endl;
+        it->sock->close();
+        list.erase(it);
+        Metrics::connection_closed();
+        return;
+    }
+    waiting_[fd] = it;
+}
+
+std::unique_ptr<TCPSocket> AcceptLoop::unwait(std::list<Waiting>::iterator it)
+{
+    std::unique_ptr<TCPSocket> sock = std::move(it->sock);
+    ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, sock->fd(), nullptr);
+    waiting_.erase(sock->fd());
+    (it->first ? fresh_ : idle_).erase(it);
+    return sock;
+}
+
+void AcceptLoop::expire(std::unique_ptr<TCPSocket> sock, int kind)
+{
+    server_.timeouts_fired[kind]++;
+    sock->close();
+    Metrics::connection_closed();
+}
+
+}   // namespace simple_http_server
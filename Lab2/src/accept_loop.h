@@ -0,0 +1,68 @@
+/// accept_loop.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef ACCEPT_LOOP_H
+#define ACCEPT_LOOP_H
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "tcp_socket.h"
+
+namespace simple_http_server
+{
+
+class Server;
+
+/// Event loop of the SO_REUSEPORT mode, one per core: an epoll set over
+/// its own listening socket and the connections it accepted.
+///
+/// A connection is only served once it is readable, on the thread of
+/// the loop, until no byte of it is left buffered; it then waits in the
+/// set again for its next request. Connections that keep silent do not
+/// hold the loop: they are closed after the header timeout of the
+/// server if they never sent a request, the idle timeout otherwise. A
+/// request being received or answered, and an HTTP/2 connection, still
+/// hold it up to their deadlines.
+class AcceptLoop
+{
+public:
+    /// Take [listener], bound and listening.
+    AcceptLoop(Server &server, std::unique_ptr<TCPSocket> listener);
+    ~AcceptLoop();
+
+    /// Accept and serve. Never returns.
+    void run();
+
+private:
+    /// Connection waiting for its next request, closed at [deadline]
+    /// (see [now_ns]). [first] is set until it sent one.
+    struct Waiting
+    {
+        std::unique_ptr<TCPSocket> sock;
+        unsigned long long deadline;
+        bool first;
+    };
+
+    /// Accept one connection.
+    void accept();
+    /// Let [sock] wait in the set. Closed on failure.
+    void wait(std::unique_ptr<TCPSocket> sock, bool first);
+    /// Unregister the waiting [it] and take its socket.
+    std::unique_ptr<TCPSocket> unwait(std::list<Waiting>::iterator it);
+    /// Close [sock] past its deadline of [kind] (Server::TimeoutKind).
+    void expire(std::unique_ptr<TCPSocket> sock, int kind);
+
+    Server &server_;
+    std::unique_ptr<TCPSocket> listener_;
+    int epoll_fd_;
+    /// Waiting connections by deadline: the ones that never sent a
+    /// request, then the kept-alive ones.
+    std::list<Waiting> fresh_;
+    std::list<Waiting> idle_;
+    std::unordered_map<int, std::list<Waiting>::iterator> waiting_;
+};
+
+}   // namespace simple_http_server
+
+#endif
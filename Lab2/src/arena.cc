@@ -0,0 +1,107 @@
+/// arena.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include "arena.h"
+
+namespace simple_http_server
+{
+
+/// Largest first block an arena grows to keep.
+static const size_t MAX_FIRST_BLOCK = 1 << 20;
+
+static size_t align_up(size_t n, size_t align)
+{
+    return (n + align - 1) & ~(align - 1);
+}
+
+Arena::Arena(size_t block_size)
+    : block_size_(block_size), first_(nullptr), current_(nullptr),
+      pos_(nullptr), end_(nullptr), cleanups_(nullptr), used_(0)
+{}
+
+Arena::~Arena()
+{
+    reset();
+    if (first_)
+        std::free(first_);
+}
+
+void *Arena::allocate(size_t n, size_t align)
+{
+    uintptr_t p = align_up(reinterpret_cast<uintptr_t>(pos_), align);
+    if (!pos_ || p + n > reinterpret_cast<uintptr_t>(end_))
+    {
+        grow(n, align);
+        p = align_up(reinterpret_cast<uintptr_t>(pos_), align);
+    }
+
+    pos_ = reinterpret_cast<char *>(p + n);
+    used_ += n;
+    return reinterpret_cast<void *>(p);
+}
+
+void Arena::grow(size_t n, size_t align)
+{
+    static const size_t HEADER = align_up(sizeof(Block), alignof(std::max_align_t));
+
+    // Larger requests get a block of their own.
+    size_t size = std::max(block_size_, HEADER + n + align);
+    Block *b = static_cast<Block *>(std::malloc(size));
+    if (!b)
+        throw std::bad_alloc();
+    b->next = nullptr;
+    b->size = size;
+
+    if (current_)
+        current_->next = b;
+    else
+        first_ = b;
+    current_ = b;
+    pos_ = reinterpret_cast<char *>(b) + HEADER;
+    end_ = reinterpret_cast<char *>(b) + size;
+}
+
+void Arena::reset()
+{
+    for (Cleanup *c = cleanups_; c; c = c->next)
+        c->destroy(c->obj);
+    cleanups_ = nullptr;
+
+    if (first_ && first_->next)
+    {
+        // The request did not fit, size the first block after it so
+        // the next one does.
+        size_t total = 0;
+        for (Block *b = first_; b; )
+        {
+            Block *next = b->next;
+            total += b->size;
+            std::free(b);
+            b = next;
+        }
+        block_size_ = std::min(align_up(total, DEFAULT_BLOCK_SIZE), MAX_FIRST_BLOCK);
+        first_ = nullptr;
+    }
+
+    current_ = nullptr;
+    pos_ = end_ = nullptr;
+    if (first_)
+    {
+        // Rewind into the kept block.
+        current_ = first_;
+        pos_ = reinterpret_cast<char *>(first_) + align_up(sizeof(Block), alignof(std::max_align_t));
+        end_ = reinterpret_cast<char *>(first_) + first_->size;
+    }
+    used_ = 0;
+}
+
+Arena &Arena::local()
+{
+    static thread_local Arena arena;
+    return arena;
+}
+
+} // namespace simple_http_server
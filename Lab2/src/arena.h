@@ -0,0 +1,90 @@
+/// arena.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace simple_http_server
+{
+
+/// Monotonic allocator for memory that dies with the request.
+///
+/// Allocation bumps a pointer into the current block; nothing is freed
+/// individually. [reset] runs the destructors of the objects built with
+/// [make], in reverse order, and rewinds to the first block, which is
+/// kept. Once the first block is big enough for a typical request, the
+/// request allocates nothing from the heap.
+class Arena
+{
+public:
+    static const size_t DEFAULT_BLOCK_SIZE = 8 << 10;
+
+    explicit Arena(size_t block_size = DEFAULT_BLOCK_SIZE);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    void operator=(const Arena&) = delete;
+
+    /// [n] bytes aligned to [align], a power of two.
+    void *allocate(size_t n, size_t align = alignof(std::max_align_t));
+
+    /// Build a T in the arena. It is destroyed by [reset].
+    template <class T, class... Args>
+    T *make(Args&&... args)
+    {
+        Cleanup *c = static_cast<Cleanup *>(allocate(sizeof(Cleanup), alignof(Cleanup)));
+        T *obj = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        c->destroy = &destroy<T>;
+        c->obj = obj;
+        c->next = cleanups_;
+        cleanups_ = c;
+        return obj;
+    }
+
+    /// Destroy what [make] built and release all but the first block.
+    void reset();
+
+    /// Bytes handed out since the last reset.
+    size_t used() const { return used_; }
+
+    /// Per-thread arena. A worker serves one request at a time, so
+    /// every connection it serves reuses the same blocks.
+    static Arena &local();
+
+private:
+    struct Block
+    {
+        Block *next;
+        size_t size;
+    };
+
+    struct Cleanup
+    {
+        void (*destroy)(void *);
+        void *obj;
+        Cleanup *next;
+    };
+
+    template <class T>
+    static void destroy(void *obj) { static_cast<T *>(obj)->~T(); }
+
+    /// Chain a block holding at least [n] bytes aligned to [align].
+    void grow(size_t n, size_t align);
+
+    size_t block_size_;
+    /// The first block, kept across resets, then the others.
+    Block *first_;
+    Block *current_;
+    char *pos_;
+    char *end_;
+    Cleanup *cleanups_;
+    size_t used_;
+};
+
+}   // namespace simple_http_server
+
+#endif
@@ -0,0 +1,165 @@
+/// body_stream.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <algorithm>
+#include "body_stream.h"
+#include "reporter.h"
+
+namespace simple_http_server
+{
+
+/// Size of the pieces bodies are moved in.
+static const size_t PIECE_SIZE = 16 << 10;
+/// Longest chunk size line or trailer block accepted.
+static const size_t MAX_CHUNK_LINE = 4 << 10;
+
+/// Parse the decimal [value]. Return false unless it is all digits.
+static bool parse_length(StringRef value, long long &n)
+{
+    if (value.empty() || value.length > 18)
+        return false;
+
+    n = 0;
+    for (size_t i = 0; i < value.length; i++)
+    {
+        if (value.data[i] < '0' || value.data[i] > '9')
+            return false;
+        n = n * 10 + (value.data[i] - '0');
+    }
+    return true;
+}
+
+BodyReader::BodyReader(TCPSocket &sock, Headers const &headers)
+    : sock_(sock), valid_(true), chunked_(false), length_(0), left_(0),
+      in_chunk_(false), done_(false), failed_(false)
+{
+    // Both framings, or lengths that differ, would let a proxy in front
+    // and this server disagree on where the request ends (RFC 7230
+    // section 3.3.3). Codings other than chunked are not supported.
+    StringRef const *cl = headers.get(Headers::CONTENT_LENGTH);
+    if (StringRef const *te = headers.get(Headers::TRANSFER_ENCODING))
+    {
+        chunked_ = headers.contains_token(Headers::TRANSFER_ENCODING, "chunked");
+        valid_ = chunked_ && te->length == 7 && !cl;
+    }
+    else if (cl)
+        valid_ = headers.consistent(Headers::CONTENT_LENGTH) && parse_length(*cl, length_);
+
+    left_ = chunked_ ? 0 : length_;
+    done_ = !valid_ || (!chunked_ && length_ == 0);
+    failed_ = !valid_;
+}
+
+bool BodyReader::next_chunk()
+{
+    // CRLF closing the previous chunk.
+    if (in_chunk_)
+    {
+        std::string crlf = sock_.recv_line(MAX_CHUNK_LINE);
+        if (crlf != "\r\n" && crlf != "\n")
+            return false;
+        in_chunk_ = false;
+    }
+
+    std::string line = sock_.recv_line(MAX_CHUNK_LINE);
+    if (line.empty())
+        return false;
+
+    // Hex size, then possibly ";extensions".
+    long long size = 0;
+    size_t i = 0;
+    for (; i < line.length(); i++)
+    {
+        char c = line[i];
+        int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            break;
+        if (size > (1LL << 56))
+            return false;
+        size = size * 16 + digit;
+    }
+    if (i == 0 || (line[i] != ';' && line[i] != '\r' && line[i] != '\n' && line[i] != ' '))
+        return false;
+
+    if (size > 0)
+    {
+        left_ = size;
+        in_chunk_ = true;
+        return true;
+    }
+
+    // Last chunk, skip the trailers up to the empty line.
+    std::string trailers;
+    if (!sock_.recv_head(trailers, MAX_CHUNK_LINE))
+        return false;
+    done_ = true;
+    return true;
+}
+
+int BodyReader::read(char *buffer, size_t n)
+{
+    if (failed_)
+        return -1;
+
+    if (chunked_ && left_ == 0 && !done_ && !next_chunk())
+    {
+        failed_ = true;
+        return -1;
+    }
+    if (done_ || n == 0)
+        return 0;
+
+    int got = sock_.recv(buffer, std::min<long long>(n, left_));
+    if (got <= 0)
+    {
+        // The body ended early.
+        failed_ = true;
+        return -1;
+    }
+
+    left_ -= got;
+    if (!chunked_ && left_ == 0)
+        done_ = true;
+    return got;
+}
+
+bool BodyReader::drain()
+{
+    char buf[4 << 10];
+    int n;
+    while ((n = read(buf, sizeof(buf))) > 0)
+        ;
+    return n == 0;
+}
+
+void EchoHandler::handle(Request const &req, BodyReader &body, ResponseWriter &out)
+{
+    StringRef const *type = req.headers.get(Headers::CONTENT_TYPE);
+
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::OK, "OK")
+           .header("Content-type", type ? type->str() : "application/octet-stream");
+    if (!req.keep_alive)
+        builder.header("Connection", "close");
+    if (!out.start(builder.finish(), -1))
+        return;
+
+    char buf[PIECE_SIZE];
+    int n;
+    while ((n = body.read(buf, sizeof(buf))) > 0)
+        if (!out.write(buf, n))
+            return;
+
+    if (n < 0)
+        report(WARN) << "echo: request body ended early" << std::endl;
+    else
+        out.finish();
+}
+
+} // namespace simple_http_server
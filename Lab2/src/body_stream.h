@@ -0,0 +1,79 @@
+/// body_stream.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef BODY_STREAM_H
+#define BODY_STREAM_H
+
+#include <string>
+#include "message.h"
+#include "response_builder.h"
+#include "response_writer.h"
+#include "tcp_socket.h"
+
+namespace simple_http_server
+{
+
+/// Reads a request body piece by piece, framed either by
+/// Transfer-Encoding: chunked (decoded here) or by Content-Length.
+class BodyReader
+{
+public:
+    BodyReader(TCPSocket &sock, Headers const &headers);
+
+    /// False if the framing headers are malformed, conflicting or
+    /// unsupported.
+    bool valid() const { return valid_; }
+    bool chunked() const { return chunked_; }
+    /// Total length announced by Content-Length, -1 when chunked.
+    long long length() const { return chunked_ ? -1 : length_; }
+
+    /// Read up to [n] bytes of body. Return 0 at the end of the body,
+    /// -1 on error or malformed chunk.
+    int read(char *buffer, size_t n);
+    /// Read and discard the rest of the body in bounded pieces.
+    bool drain();
+
+    /// The whole body, and trailers if any, has been consumed.
+    bool done() const { return done_; }
+    bool failed() const { return failed_; }
+
+private:
+    /// Read the next chunk size line, or the trailers after the last one.
+    bool next_chunk();
+
+    TCPSocket &sock_;
+    bool valid_;
+    bool chunked_;
+    long long length_;
+    /// Bytes left in the body or in the current chunk.
+    long long left_;
+    /// A chunk is being read, its CRLF is still to be consumed.
+    bool in_chunk_;
+    bool done_;
+    bool failed_;
+};
+
+/// Handler of requests whose bodies are not buffered. Pieces of the
+/// body are pulled from [body] and the response is pushed through
+/// [out], so memory use does not depend on the body sizes. A handler
+/// is shared by all workers.
+class StreamHandler
+{
+public:
+    virtual ~StreamHandler() = default;
+
+    /// Answer [req]. The caller ends the response and drains what is
+    /// left of [body] if the handler did not.
+    virtual void handle(Request const &req, BodyReader &body, ResponseWriter &out) = 0;
+};
+
+/// Sends the request body back as it arrives.
+class EchoHandler : public StreamHandler
+{
+public:
+    virtual void handle(Request const &req, BodyReader &body, ResponseWriter &out) override;
+};
+
+}   // namespace simple_http_server
+
+#endif
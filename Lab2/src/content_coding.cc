@@ -0,0 +1,169 @@
+/// content_coding.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <zlib.h>
+#include <strings.h>
+#include "content_coding.h"
+
+namespace simple_http_server
+{
+
+namespace
+{
+
+struct MimeType
+{
+    const char *extension;
+    const char *type;
+};
+
+const MimeType MIME_TYPES[] = {
+    { "html", "text/html" },
+    { "htm", "text/html" },
+    { "css", "text/css" },
+    { "js", "application/javascript" },
+    { "mjs", "application/javascript" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "txt", "text/plain" },
+    { "csv", "text/csv" },
+    { "md", "text/markdown" },
+    { "svg", "image/svg+xml" },
+    { "wasm", "application/wasm" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "ico", "image/x-icon" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "pdf", "application/pdf" },
+    { "mp4", "video/mp4" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" },
+};
+
+const char *COMPRESSIBLE[] = {
+    "application/javascript", "application/json", "application/xml",
+    "application/wasm", "image/svg+xml",
+};
+
+/// Trim blanks around [b, e).
+void trim(const char *&b, const char *&e)
+{
+    while (b < e && (*b == ' ' || *b == '\t'))
+        b++;
+    while (e > b && (e[-1] == ' ' || e[-1] == '\t'))
+        e--;
+}
+
+/// Whether the parameters [b, e) of an Accept-Encoding item, each
+/// following a ';', carry q=0.
+bool zero_quality(const char *b, const char *e)
+{
+    while (b < e)
+    {
+        const char *semi = static_cast<const char *>(std::memchr(b + 1, ';', e - b - 1));
+        const char *pe = semi ? semi : e;
+        const char *pb = b + 1;
+        trim(pb, pe);
+
+        if (pe - pb >= 2 && (pb[0] == 'q' || pb[0] == 'Q') && pb[1] == '=')
+        {
+            // "0", "0." or "0.000": a zero and only zeros after.
+            const char *v = pb + 2;
+            if (v == pe || *v != '0')
+                return false;
+            for (v++; v < pe; v++)
+                if (*v != '.' && *v != '0')
+                    return false;
+            return true;
+        }
+        b = semi ? semi : e;
+    }
+    return false;
+}
+
+} // namespace
+
+const char *mime_type(std::string const &path)
+{
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+    {
+        const char *ext = path.c_str() + dot + 1;
+        for (MimeType const &m : MIME_TYPES)
+            if (::strcasecmp(ext, m.extension) == 0)
+                return m.type;
+    }
+    return "application/octet-stream";
+}
+
+bool compressible(const char *type)
+{
+    if (std::strncmp(type, "text/", 5) == 0)
+        return true;
+    for (const char *t : COMPRESSIBLE)
+        if (std::strcmp(type, t) == 0)
+            return true;
+    return false;
+}
+
+bool accepts_gzip(StringRef const *accept)
+{
+    if (!accept)
+        return false;
+
+    // gzip by name wins over "*", whatever their order.
+    bool gzip = false, gzip_listed = false;
+    bool any = false;
+    const char *p = accept->data;
+    const char *end = accept->data + accept->length;
+    while (p < end)
+    {
+        const char *comma = static_cast<const char *>(std::memchr(p, ',', end - p));
+        if (!comma)
+            comma = end;
+
+        const char *semi = static_cast<const char *>(std::memchr(p, ';', comma - p));
+        const char *b = p, *e = semi ? semi : comma;
+        trim(b, e);
+        StringRef coding(b, e - b);
+        bool ok = !semi || !zero_quality(semi, comma);
+
+        if (coding.equals_nocase("gzip") || coding.equals_nocase("x-gzip"))
+        {
+            gzip_listed = true;
+            gzip = gzip || ok;
+        }
+        else if (coding == "*")
+            any = ok;
+        p = comma + 1;
+    }
+    return gzip_listed ? gzip : any;
+}
+
+bool gzip_compress(const char *data, size_t len, std::string &out)
+{
+    z_stream z;
+    std::memset(&z, 0, sizeof(z));
+    // 15 bits of window, +16 for the gzip header and trailer.
+    if (::deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    out.resize(::deflateBound(&z, len));
+    z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    z.avail_in = len;
+    z.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    z.avail_out = out.size();
+
+    // The bound leaves room for everything in a single call.
+    int ret = ::deflate(&z, Z_FINISH);
+    out.resize(z.total_out);
+    ::deflateEnd(&z);
+    return ret == Z_STREAM_END;
+}
+
+}   // namespace simple_http_server
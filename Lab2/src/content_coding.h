@@ -0,0 +1,32 @@
+/// content_coding.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef CONTENT_CODING_H
+#define CONTENT_CODING_H
+
+#include <string>
+#include "message.h"
+
+namespace simple_http_server
+{
+
+/// MIME type of the file [path] by its extension, e.g. "text/css".
+/// application/octet-stream if the extension is unknown.
+const char *mime_type(std::string const &path);
+
+/// Whether representations of [type] are worth compressing: text and
+/// the structured formats (scripts, JSON, XML, SVG), as opposed to
+/// media and archives that are compressed already.
+bool compressible(const char *type);
+
+/// Whether the Accept-Encoding value [accept], nullptr if absent, lets
+/// gzip be sent: listed, or covered by "*", with a non-zero q-value.
+bool accepts_gzip(StringRef const *accept);
+
+/// Compress [len] bytes of [data] into [out] in the gzip format (RFC
+/// 1952). Return false on failure.
+bool gzip_compress(const char *data, size_t len, std::string &out);
+
+}   // namespace simple_http_server
+
+#endif
@@ -0,0 +1,165 @@
+/// file_cache.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <cstdio>
+#include <functional>
+#include "file_cache.h"
+#include "message.h"
+
+namespace simple_http_server
+{
+
+FileCache::FileCache(size_t capacity, size_t max_entry_size, size_t n_shards)
+    : capacity_(capacity), max_entry_size_(max_entry_size),
+      hits_(0), misses_(0), evictions_(0)
+{
+    if (n_shards == 0)
+        n_shards = 1;
+    shard_capacity_ = capacity / n_shards;
+
+    for (size_t i = 0; i < n_shards; i++)
+        shards_.emplace_back(new Shard());
+}
+
+FileCache::Validators FileCache::Validators::of(struct stat const &st)
+{
+    char etag[80];
+    int n = std::snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx.%lx\"",
+                          static_cast<unsigned long long>(st.st_ino),
+                          static_cast<unsigned long long>(st.st_size),
+                          static_cast<unsigned long long>(st.st_mtim.tv_sec),
+                          static_cast<unsigned long>(st.st_mtim.tv_nsec));
+
+    Validators v;
+    v.etag.assign(etag, n);
+    v.last_modified = format_http_date(st.st_mtime);
+    return v;
+}
+
+bool FileCache::cacheable(struct stat const &st) const
+{
+    return capacity_ > 0 &&
+           static_cast<size_t>(st.st_size) <= max_entry_size_ &&
+           static_cast<size_t>(st.st_size) <= shard_capacity_;
+}
+
+FileCache::Shard &FileCache::shard_of(std::string const &path)
+{
+    return *shards_[std::hash<std::string>()(path) % shards_.size()];
+}
+
+bool FileCache::fresh(Entry const &e, struct stat const &st)
+{
+    return e.ino == st.st_ino &&
+           e.size == st.st_size &&
+           e.mtime.tv_sec == st.st_mtim.tv_sec &&
+           e.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+FileCache::response_ptr FileCache::get(std::string const &path, struct stat const &st,
+                                       Validators *validators)
+{
+    Shard &shard = shard_of(path);
+    std::lock_guard<std::mutex> lock(shard.m);
+
+    auto it = shard.index.find(path);
+    if (it == shard.index.end())
+    {
+        misses_++;
+        return nullptr;
+    }
+
+    auto entry = it->second;
+    if (!fresh(*entry, st))
+    {
+        // Stale, the file has been modified.
+        shard.bytes -= entry->response->size();
+        shard.lru.erase(entry);
+        shard.index.erase(it);
+        misses_++;
+        return nullptr;
+    }
+
+    // Move to front.
+    shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+    hits_++;
+    if (validators)
+        *validators = entry->validators;
+    return entry->response;
+}
+
+void FileCache::put(std::string const &path, struct stat const &st, response_ptr response,
+                    Validators const &validators)
+{
+    if (!response || response->size() > shard_capacity_)
+        return;
+
+    Shard &shard = shard_of(path);
+    std::lock_guard<std::mutex> lock(shard.m);
+
+    auto it = shard.index.find(path);
+    if (it != shard.index.end())
+    {
+        shard.bytes -= it->second->response->size();
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+
+    Entry e;
+    e.path = path;
+    e.ino = st.st_ino;
+    e.size = st.st_size;
+    e.mtime = st.st_mtim;
+    e.response = std::move(response);
+    e.validators = validators;
+
+    shard.bytes += e.response->size();
+    shard.lru.push_front(std::move(e));
+    shard.index[path] = shard.lru.begin();
+
+    // Evict from the back.
+    while (shard.bytes > shard_capacity_)
+    {
+        Entry &victim = shard.lru.back();
+        shard.bytes -= victim.response->size();
+        shard.index.erase(victim.path);
+        shard.lru.pop_back();
+        evictions_++;
+    }
+}
+
+size_t FileCache::bytes() const
+{
+    size_t n = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard->m);
+        n += shard->bytes;
+    }
+    return n;
+}
+
+size_t FileCache::entries() const
+{
+    size_t n = 0;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard->m);
+        n += shard->lru.size();
+    }
+    return n;
+}
+
+std::vector<std::string> FileCache::paths() const
+{
+    std::vector<std::string> v;
+    for (auto &shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard->m);
+        for (Entry const &e : shard->lru)
+            v.push_back(e.path);
+    }
+    return v;
+}
+
+} // namespace simple_http_server
@@ -0,0 +1,105 @@
+/// file_cache.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace simple_http_server
+{
+
+/// Sharded LRU cache of complete, pre-serialized responses for small
+/// static files, keyed by resolved path. An entry is only valid for the
+/// exact (inode, size, mtime) it was built from, so a file changed on
+/// disk is detected by the stat(2) the caller does anyway.
+class FileCache
+{
+public:
+    typedef std::shared_ptr<const std::string> response_ptr;
+
+    /// Validators of a version of a file.
+    struct Validators
+    {
+        /// Strong, derived from inode, size and mtime.
+        std::string etag;
+        std::string last_modified;
+
+        static Validators of(struct stat const &st);
+    };
+
+    /// [capacity] bounds the total bytes of cached responses, 0 disables
+    /// the cache. Files larger than [max_entry_size] are never cached.
+    FileCache(size_t capacity, size_t max_entry_size, size_t n_shards = 16);
+
+    FileCache(const FileCache&) = delete;
+    void operator=(const FileCache&) = delete;
+
+    /// Whether a file described by [st] should go through the cache.
+    bool cacheable(struct stat const &st) const;
+
+    /// Return the cached response of [path] if it is still fresh
+    /// according to [st], nullptr otherwise. On a hit, [validators] is
+    /// set to the ones stored along.
+    response_ptr get(std::string const &path, struct stat const &st,
+                     Validators *validators = nullptr);
+
+    /// Insert or replace the response of [path], evicting least
+    /// recently used entries of the shard when over capacity.
+    void put(std::string const &path, struct stat const &st, response_ptr response,
+             Validators const &validators);
+
+    /// Statistics.
+    size_t capacity() const { return capacity_; }
+    size_t max_entry_size() const { return max_entry_size_; }
+    unsigned long long hits() const { return hits_; }
+    unsigned long long misses() const { return misses_; }
+    unsigned long long evictions() const { return evictions_; }
+    size_t bytes() const;
+    size_t entries() const;
+    /// Paths of the entries, the most recently used of each shard first.
+    std::vector<std::string> paths() const;
+
+private:
+    struct Entry
+    {
+        std::string path;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        response_ptr response;
+        Validators validators;
+    };
+
+    struct Shard
+    {
+        mutable std::mutex m;
+        /// Most recently used at the front.
+        std::list<Entry> lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        size_t bytes = 0;
+    };
+
+    Shard &shard_of(std::string const &path);
+    static bool fresh(Entry const &e, struct stat const &st);
+
+    size_t capacity_;
+    size_t max_entry_size_;
+    size_t shard_capacity_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    std::atomic<unsigned long long> hits_;
+    std::atomic<unsigned long long> misses_;
+    std::atomic<unsigned long long> evictions_;
+};
+
+}   // namespace simple_http_server
+
+#endif
@@ -0,0 +1,244 @@
+/// hot_upgrade.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include "hot_upgrade.h"
+#include "reporter.h"
+
+namespace simple_http_server
+{
+
+namespace
+{
+
+/// A successor gets this long to load its cache and start accepting.
+const int READY_TIMEOUT_S = 60;
+/// Bound of the list of cached paths.
+const uint64_t MAX_LIST = 64 << 20;
+
+bool send_all(int fd, const char *p, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool recv_all(int fd, char *p, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool address(std::string const &path, struct sockaddr_un &addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr.sun_path))
+    {
+        report(ERROR) << "upgrade socket path too long: " << path << std::endl;
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.length());
+    return true;
+}
+
+} // namespace
+
+HotUpgrade::HotUpgrade(std::string const &path)
+    : path_(path), listener_(-1), peer_(-1)
+{
+}
+
+HotUpgrade::~HotUpgrade()
+{
+    // The path is left to the successor.
+    if (listener_ >= 0)
+        ::close(listener_);
+    if (peer_ >= 0)
+        ::close(peer_);
+}
+
+int HotUpgrade::take_over(std::vector<std::string> &warm)
+{
+    struct sockaddr_un addr;
+    if (!address(path_, addr))
+        return -1;
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+    {
+        // Nobody to take over from: the first start.
+        if (errno != ENOENT && errno != ECONNREFUSED)
+            report(WARN) << "fail connecting to " << path_ << ": " << strerror(errno) << std::endl;
+        ::close(fd);
+        return -1;
+    }
+
+    // The listening socket comes along with the length of the list.
+    uint64_t len = 0;
+    struct iovec iov = { &len, sizeof(len) };
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do
+        n = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    while (n < 0 && errno == EINTR);
+
+    int listen_fd = -1;
+    struct cmsghdr *c = n > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        std::memcpy(&listen_fd, CMSG_DATA(c), sizeof(int));
+
+    std::string list;
+    bool ok = listen_fd >= 0 && recv_all(fd, reinterpret_cast<char *>(&len) + n, sizeof(len) - n) &&
+              len <= MAX_LIST;
+    if (ok)
+    {
+        list.resize(len);
+        ok = recv_all(fd, &list[0], len);
+    }
+    if (!ok)
+    {
+        report(ERROR) << "fail taking the listening socket over from " << path_ << std::endl;
+        if (listen_fd >= 0)
+            ::close(listen_fd);
+        ::close(fd);
+        return -1;
+    }
+
+    size_t pos = 0, nl;
+    while ((nl = list.find('\n', pos)) != std::string::npos)
+    {
+        warm.push_back(list.substr(pos, nl - pos));
+        pos = nl + 1;
+    }
+
+    peer_ = fd;
+    return listen_fd;
+}
+
+void HotUpgrade::ready()
+{
+    if (peer_ < 0)
+        return;
+    if (!send_all(peer_, "R", 1))
+        report(WARN) << "the server taken over is gone" << std::endl;
+    ::close(peer_);
+    peer_ = -1;
+}
+
+bool HotUpgrade::listen()
+{
+    struct sockaddr_un addr;
+    if (!address(path_, addr))
+        return false;
+
+    listener_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ::unlink(path_.c_str());
+    if (listener_ < 0 ||
+        ::bind(listener_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        // Whoever may connect gets the listening socket.
+        ::chmod(path_.c_str(), 0600) < 0 ||
+        ::listen(listener_, 1) < 0)
+    {
+        report(ERROR) << "fail listening on " << path_ << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool HotUpgrade::wait()
+{
+    do
+        peer_ = ::accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+    while (peer_ < 0 && errno == EINTR);
+    return peer_ >= 0;
+}
+
+bool HotUpgrade::hand_over(int fd, std::vector<std::string> const &warm)
+{
+    int c = peer_;
+    peer_ = -1;
+    if (c < 0)
+        return false;
+
+    std::string list;
+    for (std::string const &path : warm)
+        list.append(path).push_back('\n');
+    uint64_t len = list.length();
+
+    struct iovec iov = { &len, sizeof(len) };
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    std::memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+    struct timeval timeout = { READY_TIMEOUT_S, 0 };
+    ::setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    ssize_t n;
+    do
+        n = ::sendmsg(c, &msg, MSG_NOSIGNAL);
+    while (n < 0 && errno == EINTR);
+
+    char ok = 0;
+    bool ready = n > 0 &&
+                 send_all(c, reinterpret_cast<const char *>(&len) + n, sizeof(len) - n) &&
+                 send_all(c, list.data(), list.length()) &&
+                 recv_all(c, &ok, 1) && ok == 'R';
+    ::close(c);
+    if (!ready)
+        report(WARN) << "successor left before taking over" << std::endl;
+    return ready;
+}
+
+}   // namespace simple_http_server
@@ -0,0 +1,65 @@
+/// hot_upgrade.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef HOT_UPGRADE_H
+#define HOT_UPGRADE_H
+
+#include <string>
+#include <vector>
+
+namespace simple_http_server
+{
+
+/// Hand-over of the listening socket from a running server to its
+/// successor, e.g. a new binary, through a Unix socket at [path].
+///
+/// The running server listens on [path]. A successor connects to it and
+/// receives the listening socket (SCM_RIGHTS) along with the paths in
+/// the file cache of the running server, which it loads. Once it accepts
+/// connections it says it is ready; the running server then stops
+/// accepting and drains its connections, and the successor listens on
+/// [path] for the next upgrade. The socket is never closed in between,
+/// so no connection is refused: those waiting in the backlog are
+/// accepted by either process.
+class HotUpgrade
+{
+public:
+    explicit HotUpgrade(std::string const &path);
+    ~HotUpgrade();
+
+    HotUpgrade(const HotUpgrade&) = delete;
+    void operator=(const HotUpgrade&) = delete;
+
+    /* Successor side. */
+
+    /// Take over the listening socket of the server at [path]. Return
+    /// its fd and set [warm] to the paths it had cached, most recently
+    /// used first. -1 if no server answers there.
+    int take_over(std::vector<std::string> &warm);
+    /// Tell the server taken over that this one accepts connections.
+    void ready();
+
+    /* Running server side. */
+
+    /// Listen on [path] for a successor, replacing any socket file left.
+    bool listen();
+    /// Wait for a successor to connect.
+    bool wait();
+    /// Hand the successor the listening socket [fd] and [warm]. Return
+    /// true once it is ready, false if it went away.
+    bool hand_over(int fd, std::vector<std::string> const &warm);
+
+    std::string const &path() const { return path_; }
+
+private:
+    std::string path_;
+    /// Listening on [path_].
+    int listener_;
+    /// Connection to the server taken over until it is told ready, or
+    /// to the successor until it is.
+    int peer_;
+};
+
+}   // namespace simple_http_server
+
+#endif
@@ -0,0 +1,553 @@
+/// hpack.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <cstdint>
+#include <limits>
+#include "hpack.h"
+
+namespace simple_http_server
+{
+
+namespace
+{
+
+struct StaticEntry
+{
+    const char *name;
+    const char *value;
+};
+
+/// RFC 7541 appendix A.
+static const StaticEntry STATIC_TABLE[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/// RFC 7541 appendix B, by symbol. The code of EOS is 30 ones.
+static const uint32_t HUFFMAN_CODES[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t HUFFMAN_LENGTHS[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/// Binary tree of the Huffman code, the leaves holding symbols.
+class HuffmanTree
+{
+public:
+    struct Node
+    {
+        /// Children by bit, 0 if none: the root is nobody's child.
+        int child[2];
+        int symbol;
+    };
+
+    HuffmanTree()
+    {
+        nodes_.push_back(Node{{0, 0}, -1});
+        for (int sym = 0; sym < 256; sym++)
+        {
+            int n = 0;
+            for (int i = HUFFMAN_LENGTHS[sym] - 1; i >= 0; i--)
+            {
+                int bit = (HUFFMAN_CODES[sym] >> i) & 1;
+                if (!nodes_[n].child[bit])
+                {
+                    nodes_[n].child[bit] = nodes_.size();
+                    nodes_.push_back(Node{{0, 0}, -1});
+                }
+                n = nodes_[n].child[bit];
+            }
+            nodes_[n].symbol = sym;
+        }
+    }
+
+    Node const &operator[](int i) const { return nodes_[i]; }
+
+    static HuffmanTree const &get()
+    {
+        static const HuffmanTree tree;
+        return tree;
+    }
+
+private:
+    std::vector<Node> nodes_;
+};
+
+std::vector<HeaderField> const &static_fields()
+{
+    static const std::vector<HeaderField> fields(
+        [] {
+            std::vector<HeaderField> v;
+            for (StaticEntry const &e : STATIC_TABLE)
+                v.emplace_back(e.name, e.value);
+            return v;
+        }());
+    return fields;
+}
+
+} // namespace
+
+void hpack_encode_int(std::string &out, uint8_t first, int n, uint64_t value)
+{
+    uint64_t max = (1u << n) - 1;
+    if (value < max)
+    {
+        out.push_back(static_cast<char>(first | value));
+        return;
+    }
+
+    out.push_back(static_cast<char>(first | max));
+    value -= max;
+    while (value >= 128)
+    {
+        out.push_back(static_cast<char>(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool hpack_decode_int(const uint8_t *&p, const uint8_t *end, int n, uint64_t &value)
+{
+    if (p == end)
+        return false;
+
+    uint64_t max = (1u << n) - 1;
+    value = *p++ & max;
+    if (value < max)
+        return true;
+
+    // No header needs more than 28 bits, longer encodings are hostile.
+    for (int shift = 0; shift <= 28; shift += 7)
+    {
+        if (p == end)
+            return false;
+        uint8_t b = *p++;
+        value += static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+size_t huffman_length(std::string const &s)
+{
+    size_t bits = 0;
+    for (unsigned char c : s)
+        bits += HUFFMAN_LENGTHS[c];
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(std::string const &s, std::string &out)
+{
+    uint64_t acc = 0;
+    int bits = 0;
+    for (unsigned char c : s)
+    {
+        acc = (acc << HUFFMAN_LENGTHS[c]) | HUFFMAN_CODES[c];
+        bits += HUFFMAN_LENGTHS[c];
+        while (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back(static_cast<char>(acc >> bits));
+        }
+    }
+
+    // Padded with the most significant bits of EOS.
+    if (bits > 0)
+        out.push_back(static_cast<char>((acc << (8 - bits)) | (0xff >> bits)));
+}
+
+bool huffman_decode(const uint8_t *data, size_t len, std::string &out)
+{
+    HuffmanTree const &tree = HuffmanTree::get();
+    int node = 0;
+    // Bits read since the last symbol, and whether they were all ones.
+    int depth = 0;
+    bool ones = true;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int b = 7; b >= 0; b--)
+        {
+            int bit = (data[i] >> b) & 1;
+            node = tree[node].child[bit];
+            // Only EOS leads nowhere, and it may not be sent.
+            if (!node)
+                return false;
+            depth++;
+            ones = ones && bit;
+
+            if (tree[node].symbol >= 0)
+            {
+                out.push_back(static_cast<char>(tree[node].symbol));
+                node = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+
+    // Padding is shorter than a byte and a prefix of EOS.
+    return depth < 8 && ones;
+}
+
+HpackTable::HpackTable(size_t capacity)
+    : size_(0), capacity_(capacity)
+{
+}
+
+HeaderField const *HpackTable::get(size_t index) const
+{
+    if (index == 0)
+        return nullptr;
+    if (index <= STATIC_SIZE)
+        return &static_fields()[index - 1];
+    index -= STATIC_SIZE + 1;
+    return index < entries_.size() ? &entries_[index] : nullptr;
+}
+
+size_t HpackTable::find(std::string const &name, std::string const &value, bool &name_only) const
+{
+    size_t by_name = 0;
+    std::vector<HeaderField> const &fields = static_fields();
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        if (fields[i].name != name)
+            continue;
+        if (fields[i].value == value)
+        {
+            name_only = false;
+            return i + 1;
+        }
+        if (!by_name)
+            by_name = i + 1;
+    }
+
+    for (size_t i = 0; i < entries_.size(); i++)
+    {
+        if (entries_[i].name != name)
+            continue;
+        if (entries_[i].value == value)
+        {
+            name_only = false;
+            return STATIC_SIZE + i + 1;
+        }
+        if (!by_name)
+            by_name = STATIC_SIZE + i + 1;
+    }
+
+    name_only = true;
+    return by_name;
+}
+
+void HpackTable::add(std::string const &name, std::string const &value)
+{
+    size_t size = entry_size(name, value);
+    // A field larger than the table empties it and is not added.
+    if (size > capacity_)
+    {
+        evict(0);
+        return;
+    }
+
+    evict(capacity_ - size);
+    entries_.emplace_front(name, value);
+    size_ += size;
+}
+
+void HpackTable::set_capacity(size_t capacity)
+{
+    capacity_ = capacity;
+    evict(capacity);
+}
+
+void HpackTable::evict(size_t limit)
+{
+    while (size_ > limit)
+    {
+        size_ -= entry_size(entries_.back().name, entries_.back().value);
+        entries_.pop_back();
+    }
+}
+
+HpackDecoder::HpackDecoder(size_t max_capacity)
+    : table_(max_capacity), max_capacity_(max_capacity)
+{
+}
+
+bool HpackDecoder::decode_string(const uint8_t *&p, const uint8_t *end, std::string &s)
+{
+    if (p == end)
+        return false;
+    bool huffman = *p & 0x80;
+
+    uint64_t len;
+    if (!hpack_decode_int(p, end, 7, len) || len > static_cast<uint64_t>(end - p))
+        return false;
+
+    s.clear();
+    bool ok = true;
+    if (huffman)
+        ok = huffman_decode(p, len, s);
+    else
+        s.assign(reinterpret_cast<const char *>(p), len);
+    p += len;
+    return ok;
+}
+
+bool HpackDecoder::decode(const uint8_t *data, size_t len, std::vector<HeaderField> &fields)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    bool first = true;
+
+    while (p < end)
+    {
+        uint8_t b = *p;
+        uint64_t index;
+
+        if (b & 0x80)
+        {
+            // Indexed field.
+            if (!hpack_decode_int(p, end, 7, index))
+                return false;
+            HeaderField const *f = table_.get(index);
+            if (!f)
+                return false;
+            fields.push_back(*f);
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            // Table size update, only ahead of the fields.
+            uint64_t capacity;
+            if (!first || !hpack_decode_int(p, end, 5, capacity) || capacity > max_capacity_)
+                return false;
+            table_.set_capacity(capacity);
+            continue;
+        }
+        else
+        {
+            // Literal, with incremental indexing or not (never indexed
+            // makes no difference to a server).
+            bool indexing = (b & 0xc0) == 0x40;
+            if (!hpack_decode_int(p, end, indexing ? 6 : 4, index))
+                return false;
+
+            HeaderField f;
+            if (index)
+            {
+                HeaderField const *named = table_.get(index);
+                if (!named)
+                    return false;
+                f.name = named->name;
+            }
+            else if (!decode_string(p, end, f.name))
+                return false;
+            if (!decode_string(p, end, f.value))
+                return false;
+
+            if (indexing)
+                table_.add(f.name, f.value);
+            fields.push_back(std::move(f));
+        }
+        first = false;
+    }
+    return true;
+}
+
+HpackEncoder::HpackEncoder()
+    : min_capacity_(std::numeric_limits<size_t>::max())
+{
+}
+
+void HpackEncoder::set_max_capacity(size_t n)
+{
+    // The table never grows past the default, it is plenty for a server.
+    if (n > HpackTable::DEFAULT_CAPACITY)
+        n = HpackTable::DEFAULT_CAPACITY;
+    if (n == table_.capacity())
+        return;
+    if (n < min_capacity_)
+        min_capacity_ = n;
+    table_.set_capacity(n);
+}
+
+bool HpackEncoder::indexable(HeaderField const &f)
+{
+    static const char *changing[] = {
+        "content-length", "date", "etag", "last-modified", "expires", "age",
+        "set-cookie", "location", "content-range",
+    };
+    for (const char *name : changing)
+        if (f.name == name)
+            return false;
+    return true;
+}
+
+static void encode_string(std::string const &s, std::string &out)
+{
+    size_t huffman = huffman_length(s);
+    if (huffman < s.length())
+    {
+        hpack_encode_int(out, 0x80, 7, huffman);
+        huffman_encode(s, out);
+    }
+    else
+    {
+        hpack_encode_int(out, 0, 7, s.length());
+        out.append(s);
+    }
+}
+
+void HpackEncoder::encode(std::vector<HeaderField> const &fields, std::string &out)
+{
+    // The decoder must see the smallest capacity too if it grew since.
+    if (min_capacity_ != std::numeric_limits<size_t>::max())
+    {
+        hpack_encode_int(out, 0x20, 5, min_capacity_);
+        if (min_capacity_ != table_.capacity())
+            hpack_encode_int(out, 0x20, 5, table_.capacity());
+        min_capacity_ = std::numeric_limits<size_t>::max();
+    }
+
+    for (HeaderField const &f : fields)
+    {
+        bool name_only;
+        size_t index = table_.find(f.name, f.value, name_only);
+        if (index && !name_only)
+        {
+            hpack_encode_int(out, 0x80, 7, index);
+            continue;
+        }
+
+        // Literals larger than a quarter of the table would flush it.
+        bool indexing = indexable(f) &&
+                        HpackTable::entry_size(f.name, f.value) <= table_.capacity() / 4;
+        hpack_encode_int(out, indexing ? 0x40 : 0, indexing ? 6 : 4, index);
+        if (!index)
+            encode_string(f.name, out);
+        encode_string(f.value, out);
+        if (indexing)
+            table_.add(f.name, f.value);
+    }
+}
+
+}   // namespace simple_http_server
@@ -0,0 +1,119 @@
+/// hpack.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace simple_http_server
+{
+
+/// A field of an HTTP/2 header block. Names are lowercase.
+struct HeaderField
+{
+    std::string name;
+    std::string value;
+
+    HeaderField() {}
+    HeaderField(std::string const &name, std::string const &value) : name(name), value(value) {}
+};
+
+/// Fields a header block may refer to by index (RFC 7541 section 2.3):
+/// the static table, then the fields added by one side of the connection,
+/// newest first. The oldest are evicted past [capacity] bytes, a field
+/// counting its name, its value and 32 bytes of overhead.
+class HpackTable
+{
+public:
+    static const size_t DEFAULT_CAPACITY = 4096;
+    static const size_t STATIC_SIZE = 61;
+
+    explicit HpackTable(size_t capacity = DEFAULT_CAPACITY);
+
+    /// Field at the 1-based [index], nullptr past the end.
+    HeaderField const *get(size_t index) const;
+    /// Index of the field [name: value], else with [name_only] set the
+    /// index of a field named [name]. 0 if there is neither.
+    size_t find(std::string const &name, std::string const &value, bool &name_only) const;
+    void add(std::string const &name, std::string const &value);
+
+    void set_capacity(size_t capacity);
+    size_t capacity() const { return capacity_; }
+
+    static size_t entry_size(std::string const &name, std::string const &value)
+    {
+        return name.length() + value.length() + 32;
+    }
+
+private:
+    /// Evict down to [limit] bytes.
+    void evict(size_t limit);
+
+    std::deque<HeaderField> entries_;
+    size_t size_;
+    size_t capacity_;
+};
+
+/// Decoder of the header blocks received on a connection.
+class HpackDecoder
+{
+public:
+    /// [max_capacity] is the SETTINGS_HEADER_TABLE_SIZE announced.
+    explicit HpackDecoder(size_t max_capacity = HpackTable::DEFAULT_CAPACITY);
+
+    /// Append the fields of the complete block [data] to [fields]. A
+    /// failure is a compression error: the table may be out of sync with
+    /// the encoder, the connection cannot go on.
+    bool decode(const uint8_t *data, size_t len, std::vector<HeaderField> &fields);
+
+private:
+    bool decode_string(const uint8_t *&p, const uint8_t *end, std::string &s);
+
+    HpackTable table_;
+    size_t max_capacity_;
+};
+
+/// Encoder of the header blocks sent on a connection.
+///
+/// Fields are sent by index when the table has them. The others are
+/// added to the table unless their value is unlikely to repeat (sizes,
+/// dates, validators), so a header such as Server costs one byte from
+/// the second response of the connection on. Strings are Huffman coded
+/// when that is shorter.
+class HpackEncoder
+{
+public:
+    HpackEncoder();
+
+    /// The peer announced [n] as its SETTINGS_HEADER_TABLE_SIZE. The
+    /// change is signalled at the start of the next block.
+    void set_max_capacity(size_t n);
+
+    /// Append the block of [fields] to [out].
+    void encode(std::vector<HeaderField> const &fields, std::string &out);
+
+private:
+    static bool indexable(HeaderField const &f);
+
+    HpackTable table_;
+    /// Smallest capacity since the last block, SIZE_MAX if unchanged.
+    size_t min_capacity_;
+};
+
+/// Integer with an [n]-bit prefix (RFC 7541 section 5.1), [first] holding
+/// the bits of the first byte above the prefix.
+void hpack_encode_int(std::string &out, uint8_t first, int n, uint64_t value);
+bool hpack_decode_int(const uint8_t *&p, const uint8_t *end, int n, uint64_t &value);
+
+/// Huffman code of RFC 7541 appendix B.
+void huffman_encode(std::string const &s, std::string &out);
+size_t huffman_length(std::string const &s);
+bool huffman_decode(const uint8_t *data, size_t len, std::string &out);
+
+}   // namespace simple_http_server
+
+#endif
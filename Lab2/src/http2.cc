@@ -0,0 +1,981 @@
+/// http2.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include "http2.h"
+#include "body_stream.h"
+#include "metrics.h"
+#include "reporter.h"
+#include "server.h"
+
+namespace simple_http_server
+{
+
+const char Http2Connection::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+std::atomic<unsigned long long> Http2Connection::connections_total_(0);
+std::atomic<unsigned long long> Http2Connection::streams_total_(0);
+
+namespace
+{
+
+const uint8_t FLAG_END_STREAM = 0x1;
+const uint8_t FLAG_ACK = 0x1;
+const uint8_t FLAG_END_HEADERS = 0x4;
+const uint8_t FLAG_PADDED = 0x8;
+const uint8_t FLAG_PRIORITY = 0x20;
+
+const uint16_t SETTINGS_HEADER_TABLE_SIZE = 0x1;
+const uint16_t SETTINGS_ENABLE_PUSH = 0x2;
+const uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+const uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+const uint16_t SETTINGS_MAX_FRAME_SIZE = 0x5;
+
+/// Window of a connection and its streams until SETTINGS say otherwise.
+const long long DEFAULT_WINDOW = 65535;
+const long long MAX_WINDOW = 0x7fffffff;
+/// Largest frame either side sends until SETTINGS say otherwise.
+const size_t DEFAULT_MAX_FRAME = 16384;
+
+/// What we accept: the windows let a client upload without waiting for
+/// a WINDOW_UPDATE every 64KB.
+const uint32_t MAX_STREAMS = 100;
+const uint32_t RECV_WINDOW = 1 << 20;
+const size_t MAX_HEADER_BLOCK = 64 << 10;
+
+/// Frames queued past this are sent before more are produced.
+const size_t FLUSH_SIZE = 64 << 10;
+
+uint32_t read32(const uint8_t *p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/// Decode unpadded base64url, as in HTTP2-Settings.
+bool base64url_decode(StringRef in, std::string &out)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < in.length; i++)
+    {
+        char c = in.data[i];
+        int v;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-')
+            v = 62;
+        else if (c == '_')
+            v = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back(static_cast<char>(acc >> bits));
+        }
+    }
+    return true;
+}
+
+/// Headers meaningful to one HTTP/1.1 connection only, banned in HTTP/2.
+bool connection_specific(std::string const &name)
+{
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade";
+}
+
+} // namespace
+
+void Http2Connection::Deadline::arm(int kind)
+{
+    kind_ = kind;
+    server_.timers.arm(*this, server_.timeouts[kind]);
+}
+
+void Http2Connection::Deadline::cancel()
+{
+    server_.timers.cancel(*this);
+}
+
+void Http2Connection::Deadline::expire()
+{
+    server_.timeouts_fired[kind_.load()]++;
+    sock_.shutdown(SHUT_RDWR);
+}
+
+Http2Connection::Stream::~Stream()
+{
+    for (Piece const &p : out)
+        if (p.fd >= 0)
+            ::close(p.fd);
+}
+
+Http2Connection::Http2Connection(Server &server, TCPSocket &sock)
+    : server_(server), sock_(sock), deadline_(server, sock),
+      last_stream_id_(0), continued_(0), continued_end_stream_(false),
+      got_settings_(false), goaway_(false), broken_(false), answering_(nullptr),
+      peer_initial_window_(DEFAULT_WINDOW), peer_max_frame_(DEFAULT_MAX_FRAME),
+      window_(DEFAULT_WINDOW), unacked_(0)
+{
+    connections_total_++;
+}
+
+Http2Connection::~Http2Connection()
+{
+    deadline_.cancel();
+}
+
+void Http2Connection::serve(Request *upgrade, StringRef settings)
+{
+    // Our SETTINGS open the connection, then the connection window is
+    // widened like the ones of the streams.
+    uint8_t ours[12];
+    ours[0] = 0;
+    ours[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(ours + 2, MAX_STREAMS);
+    ours[6] = 0;
+    ours[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+    put32(ours + 8, RECV_WINDOW);
+    frame(SETTINGS, 0, 0, ours, sizeof(ours));
+
+    uint8_t increment[4];
+    put32(increment, RECV_WINDOW - DEFAULT_WINDOW);
+    frame(WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+
+    if (upgrade)
+    {
+        std::string payload;
+        if (!base64url_decode(settings, payload) || payload.length() % 6 ||
+            apply_settings(reinterpret_cast<const uint8_t *>(payload.data()), payload.length()) != NO_ERROR)
+        {
+            connection_error(PROTOCOL_ERROR, "invalid HTTP2-Settings");
+            flush();
+            return;
+        }
+
+        // The preface comes first, a handler may wait for frames after it.
+        deadline_.arm(Server::TIMEOUT_HEADER);
+        char preface[PREFACE_LENGTH];
+        if (!flush() || sock_.recv_bytes(preface, PREFACE_LENGTH) != static_cast<int>(PREFACE_LENGTH) ||
+            std::memcmp(preface, PREFACE, PREFACE_LENGTH) != 0)
+            return;
+
+        // The request was complete, stream 1 is half closed already.
+        Stream &s = open(1);
+        s.remote_closed = true;
+        streams_total_++;
+        respond(s, *upgrade);
+    }
+
+    for (;;)
+    {
+        answer();
+        if (broken_)
+            break;
+
+        // Frames produced from what was received in one go leave together.
+        bool more = schedule();
+        if ((more || sock_.buffered() == 0) && !flush())
+            break;
+        if (more)
+            continue;
+
+        reap();
+        // A server handing over to its successor takes no new streams.
+        if (server_.draining && !goaway_)
+        {
+            goaway(NO_ERROR);
+            goaway_ = true;
+            continue;
+        }
+        if (goaway_ && streams_.empty())
+            break;
+
+        if (sock_.buffered() == 0)
+            deadline_.arm(streams_.empty() ? Server::TIMEOUT_IDLE : Server::TIMEOUT_BODY);
+        if (!read_frame())
+            break;
+    }
+
+    schedule();
+    flush();
+}
+
+bool Http2Connection::read_frame()
+{
+    uint8_t head[9];
+    if (sock_.recv_bytes(head, sizeof(head)) != static_cast<int>(sizeof(head)))
+        return false;
+
+    size_t len = (head[0] << 16) | (head[1] << 8) | head[2];
+    FrameType type = static_cast<FrameType>(head[3]);
+    uint8_t flags = head[4];
+    uint32_t id = read32(head + 5) & 0x7fffffff;
+
+    if (len > DEFAULT_MAX_FRAME)
+        return connection_error(FRAME_SIZE_ERROR, "frame too large");
+    in_.resize(len);
+    if (len > 0 && sock_.recv_bytes(in_.data(), len) != static_cast<int>(len))
+        return false;
+    const uint8_t *p = in_.data();
+
+    if (!got_settings_ && type != SETTINGS)
+        return connection_error(PROTOCOL_ERROR, "preface without SETTINGS");
+    if (continued_ && (type != CONTINUATION || id != continued_))
+        return connection_error(PROTOCOL_ERROR, "interrupted header block");
+
+    switch (type)
+    {
+    case HEADERS:
+        return on_headers(flags, id, p, len);
+
+    case CONTINUATION:
+        if (!continued_)
+            return connection_error(PROTOCOL_ERROR, "unexpected CONTINUATION");
+        if (block_.length() + len > MAX_HEADER_BLOCK)
+            return connection_error(PROTOCOL_ERROR, "header block too large");
+        block_.append(reinterpret_cast<const char *>(p), len);
+        if (flags & FLAG_END_HEADERS)
+        {
+            continued_ = 0;
+            return end_headers(id, continued_end_stream_);
+        }
+        return true;
+
+    case DATA:
+        return on_data(flags, id, p, len);
+
+    case PRIORITY:
+        if (id == 0)
+            return connection_error(PROTOCOL_ERROR, "PRIORITY on stream 0");
+        if (len != 5)
+            rst_stream(id, FRAME_SIZE_ERROR);
+        return true;
+
+    case RST_STREAM:
+        if (id == 0 || id > last_stream_id_)
+            return connection_error(PROTOCOL_ERROR, "RST_STREAM on idle stream");
+        if (len != 4)
+            return connection_error(FRAME_SIZE_ERROR, "bad RST_STREAM");
+        if (streams_.count(id))
+            close_stream(streams_.find(id));
+        return true;
+
+    case SETTINGS:
+        return on_settings(flags, id, p, len);
+
+    case PUSH_PROMISE:
+        return connection_error(PROTOCOL_ERROR, "PUSH_PROMISE from client");
+
+    case PING:
+        if (id != 0)
+            return connection_error(PROTOCOL_ERROR, "PING on a stream");
+        if (len != 8)
+            return connection_error(FRAME_SIZE_ERROR, "bad PING");
+        if (!(flags & FLAG_ACK))
+            frame(PING, FLAG_ACK, 0, p, len);
+        return true;
+
+    case GOAWAY:
+        if (id != 0)
+            return connection_error(PROTOCOL_ERROR, "GOAWAY on a stream");
+        // No new streams, the open ones are still answered.
+        goaway_ = true;
+        return true;
+
+    case WINDOW_UPDATE:
+        return on_window_update(id, p, len);
+
+    default:
+        // Unknown frame types are ignored.
+        return true;
+    }
+}
+
+Http2Connection::Stream &Http2Connection::open(uint32_t id)
+{
+    Stream &s = streams_[id];
+    s.id = id;
+    s.remote_closed = false;
+    s.answered = false;
+    s.complete = false;
+    s.ended = false;
+    s.reset = false;
+    s.queued = 0;
+    s.window = peer_initial_window_;
+    s.unacked = 0;
+    last_stream_id_ = id;
+    return s;
+}
+
+bool Http2Connection::on_headers(uint8_t flags, uint32_t id, const uint8_t *p, size_t len)
+{
+    if (id == 0 || !(id & 1))
+        return connection_error(PROTOCOL_ERROR, "HEADERS on a server stream");
+
+    size_t pad = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1)
+            return connection_error(PROTOCOL_ERROR, "bad padding");
+        pad = *p++;
+        len--;
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        // Priorities are not honored, every stream gets its turn.
+        if (len < 5)
+            return connection_error(FRAME_SIZE_ERROR, "bad HEADERS");
+        p += 5;
+        len -= 5;
+    }
+    if (pad > len)
+        return connection_error(PROTOCOL_ERROR, "bad padding");
+    len -= pad;
+
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+    {
+        if (id <= last_stream_id_)
+            return connection_error(STREAM_CLOSED, "HEADERS on a closed stream");
+        open(id);
+    }
+    else if (it->second.remote_closed)
+        return connection_error(STREAM_CLOSED, "HEADERS on a closed stream");
+
+    block_.assign(reinterpret_cast<const char *>(p), len);
+    if (flags & FLAG_END_HEADERS)
+        return end_headers(id, flags & FLAG_END_STREAM);
+
+    continued_ = id;
+    continued_end_stream_ = flags & FLAG_END_STREAM;
+    return true;
+}
+
+bool Http2Connection::end_headers(uint32_t id, bool end_stream)
+{
+    // Decoded even for a refused stream, or the tables would diverge.
+    std::vector<HeaderField> fields;
+    if (!decoder_.decode(reinterpret_cast<const uint8_t *>(block_.data()), block_.length(), fields))
+        return connection_error(COMPRESSION_ERROR, "bad header block");
+
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+        return true;
+    Stream &s = it->second;
+
+    if (!s.fields.empty())
+    {
+        // Trailers, which must end the request. They are dropped.
+        if (!end_stream)
+        {
+            rst_stream(id, PROTOCOL_ERROR);
+            close_stream(it);
+            return true;
+        }
+        s.remote_closed = true;
+        return true;
+    }
+
+    if (fields.empty() || streams_.size() > MAX_STREAMS)
+    {
+        rst_stream(id, fields.empty() ? PROTOCOL_ERROR : REFUSED_STREAM);
+        streams_.erase(it);
+        return true;
+    }
+
+    s.fields.swap(fields);
+    streams_total_++;
+    s.remote_closed = end_stream;
+    return true;
+}
+
+bool Http2Connection::on_data(uint8_t flags, uint32_t id, const uint8_t *p, size_t len)
+{
+    if (id == 0)
+        return connection_error(PROTOCOL_ERROR, "DATA on stream 0");
+    if (id > last_stream_id_)
+        return connection_error(PROTOCOL_ERROR, "DATA on idle stream");
+
+    // The whole payload counts against the window, padding included.
+    size_t counted = len;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1 || p[0] >= len)
+            return connection_error(PROTOCOL_ERROR, "bad padding");
+        len -= 1 + p[0];
+        p++;
+    }
+
+    unacked_ += counted;
+    if (unacked_ >= RECV_WINDOW / 2)
+    {
+        uint8_t increment[4];
+        put32(increment, unacked_);
+        frame(WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+        unacked_ = 0;
+    }
+
+    // Late DATA of a stream already answered and reset is ignored.
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+        return true;
+    Stream &s = it->second;
+    if (s.remote_closed)
+    {
+        rst_stream(id, STREAM_CLOSED);
+        close_stream(it);
+        return true;
+    }
+
+    if (!s.answered)
+    {
+        s.body.insert(s.body.end(), p, p + len);
+        if (s.body.size() > server_.max_body_size)
+        {
+            // Answered now, the rest of the body is discarded.
+            StreamWriter out(*this, s);
+            server_.payload_too_large(out);
+            std::vector<char>().swap(s.body);
+        }
+    }
+
+    if (flags & FLAG_END_STREAM)
+    {
+        s.remote_closed = true;
+        return true;
+    }
+
+    s.unacked += counted;
+    if (s.unacked >= RECV_WINDOW / 2)
+    {
+        uint8_t increment[4];
+        put32(increment, s.unacked);
+        frame(WINDOW_UPDATE, 0, id, increment, sizeof(increment));
+        s.unacked = 0;
+    }
+    return true;
+}
+
+bool Http2Connection::on_settings(uint8_t flags, uint32_t id, const uint8_t *p, size_t len)
+{
+    if (id != 0)
+        return connection_error(PROTOCOL_ERROR, "SETTINGS on a stream");
+    if (flags & FLAG_ACK)
+    {
+        if (len != 0)
+            return connection_error(FRAME_SIZE_ERROR, "bad SETTINGS ack");
+        return true;
+    }
+    if (len % 6)
+        return connection_error(FRAME_SIZE_ERROR, "bad SETTINGS");
+
+    ErrorCode error = apply_settings(p, len);
+    if (error != NO_ERROR)
+        return connection_error(error, "bad SETTINGS");
+
+    got_settings_ = true;
+    frame(SETTINGS, FLAG_ACK, 0, nullptr, 0);
+    return true;
+}
+
+Http2Connection::ErrorCode Http2Connection::apply_settings(const uint8_t *p, size_t len)
+{
+    for (size_t i = 0; i + 6 <= len; i += 6)
+    {
+        uint16_t param = (p[i] << 8) | p[i + 1];
+        uint32_t value = read32(p + i + 2);
+
+        switch (param)
+        {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            encoder_.set_max_capacity(value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+                return PROTOCOL_ERROR;
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > MAX_WINDOW)
+                return FLOW_CONTROL_ERROR;
+            // Applies to the open streams too.
+            for (auto &kv : streams_)
+                kv.second.window += value - peer_initial_window_;
+            peer_initial_window_ = value;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < DEFAULT_MAX_FRAME || value > 0xffffff)
+                return PROTOCOL_ERROR;
+            peer_max_frame_ = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return NO_ERROR;
+}
+
+bool Http2Connection::on_window_update(uint32_t id, const uint8_t *p, size_t len)
+{
+    if (len != 4)
+        return connection_error(FRAME_SIZE_ERROR, "bad WINDOW_UPDATE");
+    uint32_t increment = read32(p) & 0x7fffffff;
+
+    if (id == 0)
+    {
+        if (increment == 0)
+            return connection_error(PROTOCOL_ERROR, "empty WINDOW_UPDATE");
+        window_ += increment;
+        if (window_ > MAX_WINDOW)
+            return connection_error(FLOW_CONTROL_ERROR, "window overflow");
+        return true;
+    }
+
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+    {
+        if (id > last_stream_id_)
+            return connection_error(PROTOCOL_ERROR, "WINDOW_UPDATE on idle stream");
+        return true;
+    }
+
+    Stream &s = it->second;
+    s.window += increment;
+    if (increment == 0 || s.window > MAX_WINDOW)
+    {
+        rst_stream(id, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        close_stream(it);
+    }
+    return true;
+}
+
+void Http2Connection::respond(Stream &s)
+{
+    Request req;
+    req.version = "HTTP/1.1";
+    req.keep_alive = true;
+
+    // Fields are views into the stream, which outlives the request.
+    StringRef authority;
+    for (HeaderField const &f : s.fields)
+    {
+        if (f.name.empty() || f.name[0] != ':')
+            req.headers.add(f.name, f.value);
+        else if (f.name == ":method")
+            req.method = f.value;
+        else if (f.name == ":path")
+            req.resource = f.value;
+        else if (f.name == ":authority")
+            authority = f.value;
+    }
+    if (req.method.empty() || req.resource.empty())
+    {
+        rst_stream(s.id, PROTOCOL_ERROR);
+        s.answered = s.ended = true;
+        return;
+    }
+    if (!authority.empty() && !req.headers.get(Headers::HOST))
+        req.headers.add("host", authority);
+
+    // Handlers know the body by its length, the frames delimited it.
+    req.headers.erase("transfer-encoding");
+    if (!s.body.empty())
+        req.headers.set("Content-Length", std::to_string(s.body.size()));
+    req.body.swap(s.body);
+
+    respond(s, req);
+}
+
+void Http2Connection::answer()
+{
+    // A handler may add and drop streams, the search starts over.
+    for (;;)
+    {
+        auto it = std::find_if(streams_.begin(), streams_.end(),
+                               [](std::pair<const uint32_t, Stream> const &kv)
+                               { return kv.second.remote_closed && !kv.second.answered && !kv.second.ended; });
+        if (it == streams_.end() || broken_)
+            return;
+        respond(it->second);
+    }
+}
+
+void Http2Connection::respond(Stream &s, Request &req)
+{
+    unsigned long long received = now_ns();
+    Metrics::note_status(0);
+
+    answering_ = &s;
+    StreamWriter out(*this, s);
+    RouteMatch match;
+    if (server_.find_route(req, match) && match.route->stream)
+    {
+        // The body came whole in DATA frames.
+        TCPSocket body_sock;
+        body_sock.adopt(-1, req.body.data(), req.body.size());
+        BodyReader body(body_sock, req.headers);
+        server_.serve_stream(*match.route->stream, req, body, out);
+    }
+    else
+        server_.dispatch(req, out);
+    answering_ = nullptr;
+    s.answered = true;
+
+    // Cut short by the handler, the client must not take it as complete.
+    if (s.reset)
+        streams_.erase(s.id);
+    else if (!s.ended && (!out.started() || !out.finished()))
+    {
+        if (!out.started())
+            report(ERROR) << "h2: handler sent no response" << std::endl;
+        rst_stream(s.id, INTERNAL_ERROR);
+        streams_.erase(s.id);
+    }
+    Metrics::record_request(req.method, Metrics::last_status(), now_ns() - received);
+}
+
+bool Http2Connection::headers(Stream &s, StringRef head, bool end_stream)
+{
+    // "HTTP/1.1 200 OK\r\n", then the fields up to the empty line.
+    const char *line_end = static_cast<const char *>(::memmem(head.data, head.length, "\r\n", 2));
+    if (head.length < 12 || std::memcmp(head.data, "HTTP/", 5) != 0 || !line_end)
+        return false;
+
+    std::vector<HeaderField> fields;
+    fields.emplace_back(":status", std::string(head.data + 9, 3));
+
+    Headers parsed;
+    const char *end = head.data + head.length;
+    if (!server_.parse_headers(StringRef(line_end + 2, end - line_end - 2), parsed))
+        return false;
+    for (size_t i = 0; i < parsed.size(); i++)
+    {
+        std::string name = parsed[i].name.str();
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (!connection_specific(name))
+            fields.emplace_back(name, parsed[i].value.str());
+    }
+
+    std::string block;
+    encoder_.encode(fields, block);
+
+    // The block goes in one HEADERS frame and as many CONTINUATION
+    // frames as the frame size of the peer requires.
+    size_t pos = 0;
+    do
+    {
+        size_t n = std::min(block.length() - pos, peer_max_frame_);
+        uint8_t flags = pos + n == block.length() ? FLAG_END_HEADERS : 0;
+        if (pos == 0 && end_stream)
+            flags |= FLAG_END_STREAM;
+        frame(pos == 0 ? HEADERS : CONTINUATION, flags, s.id, block.data() + pos, n);
+        pos += n;
+    } while (pos < block.length());
+
+    s.answered = true;
+    if (end_stream)
+        s.complete = s.ended = true;
+    return true;
+}
+
+bool Http2Connection::pump(Stream &s)
+{
+    while (!s.ended && s.queued >= FLUSH_SIZE && !broken_)
+    {
+        bool more = schedule();
+        if (!flush())
+        {
+            broken_ = true;
+            break;
+        }
+        if (more || s.queued < FLUSH_SIZE)
+            continue;
+
+        // Out of window, the peer opens it with its frames.
+        deadline_.arm(Server::TIMEOUT_WRITE);
+        if (!read_frame())
+            broken_ = true;
+    }
+    return !s.reset && !broken_;
+}
+
+void Http2Connection::close_stream(std::map<uint32_t, Stream>::iterator it)
+{
+    Stream &s = it->second;
+    if (&s != answering_)
+    {
+        streams_.erase(it);
+        return;
+    }
+
+    // Its handler still writes to it, it goes once answered.
+    for (Piece const &p : s.out)
+        if (p.fd >= 0)
+            ::close(p.fd);
+    s.out.clear();
+    s.queued = 0;
+    s.ended = s.reset = true;
+}
+
+bool Http2Connection::StreamWriter::send(StringRef head, const void *body, size_t len)
+{
+    Metrics::note_status(status_code(head));
+    started_ = finished_ = true;
+    if (s_.answered || s_.ended || !conn_.headers(s_, head, len == 0))
+    {
+        failed_ = true;
+        return false;
+    }
+    s_.complete = true;
+    if (len > 0)
+        return push(Piece{std::string(static_cast<const char *>(body), len), -1, 0, len});
+    return true;
+}
+
+bool Http2Connection::StreamWriter::start(StringRef head, long long length)
+{
+    Metrics::note_status(status_code(head));
+    started_ = true;
+    failed_ = s_.answered || s_.ended || !conn_.headers(s_, head, false);
+    return !failed_;
+}
+
+bool Http2Connection::StreamWriter::write(const void *data, size_t len)
+{
+    if (failed_ || finished_)
+        return false;
+    if (len == 0)
+        return true;
+    return push(Piece{std::string(static_cast<const char *>(data), len), -1, 0, len});
+}
+
+bool Http2Connection::StreamWriter::write_file(int fd, off_t offset, size_t count)
+{
+    if (failed_ || finished_)
+        return false;
+    if (count == 0)
+        return true;
+
+    // Read as its frames are sent, the stream owns a descriptor.
+    int dup = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dup < 0)
+    {
+        failed_ = true;
+        return false;
+    }
+    return push(Piece{std::string(), dup, offset, count});
+}
+
+bool Http2Connection::StreamWriter::finish()
+{
+    if (failed_ || finished_)
+        return !failed_;
+    finished_ = true;
+    s_.complete = true;
+    return true;
+}
+
+bool Http2Connection::StreamWriter::push(Piece p)
+{
+    if (s_.ended)
+    {
+        if (p.fd >= 0)
+            ::close(p.fd);
+        failed_ = true;
+        return false;
+    }
+    if (p.fd < 0)
+        s_.queued += p.length;
+    s_.out.push_back(std::move(p));
+    failed_ = !conn_.pump(s_);
+    return !failed_;
+}
+
+bool Http2Connection::schedule()
+{
+    // One frame per stream and round, so a large response does not hold
+    // back the others.
+    bool progress = true;
+    while (progress && window_ > 0)
+    {
+        progress = false;
+        for (auto &kv : streams_)
+        {
+            Stream &s = kv.second;
+            if (!s.answered || s.ended)
+                continue;
+
+            // The end came after the last of the body.
+            if (s.out.empty())
+            {
+                if (s.complete)
+                {
+                    frame(DATA, FLAG_END_STREAM, s.id, nullptr, 0);
+                    s.ended = true;
+                }
+                continue;
+            }
+            if (s.window <= 0)
+                continue;
+
+            Piece &p = s.out.front();
+            long long room = std::min<long long>(std::min(window_, s.window), peer_max_frame_);
+            size_t n = std::min<long long>(p.length, room);
+            bool consumed = n == p.length;
+            bool last = consumed && s.out.size() == 1 && s.complete;
+            if (!data_frame(s, n, last))
+            {
+                report(ERROR) << "h2: fail reading response body" << std::endl;
+                rst_stream(s.id, INTERNAL_ERROR);
+                s.ended = s.reset = true;
+                continue;
+            }
+            s.window -= n;
+            window_ -= n;
+            progress = true;
+
+            if (consumed)
+            {
+                if (p.fd >= 0)
+                    ::close(p.fd);
+                s.out.pop_front();
+            }
+            s.ended = last;
+            if (out_.length() >= FLUSH_SIZE)
+                return true;
+            if (window_ <= 0)
+                break;
+        }
+    }
+    return false;
+}
+
+bool Http2Connection::data_frame(Stream &s, size_t n, bool last)
+{
+    Piece &p = s.out.front();
+    if (p.fd < 0)
+    {
+        frame(DATA, last ? FLAG_END_STREAM : 0, s.id, p.data.data() + p.offset, n);
+        p.offset += n;
+        p.length -= n;
+        s.queued -= n;
+        return true;
+    }
+
+    // Read straight behind the frame header.
+    size_t start = out_.length();
+    frame(DATA, last ? FLAG_END_STREAM : 0, s.id, nullptr, 0);
+    out_[start] = n >> 16;
+    out_[start + 1] = n >> 8;
+    out_[start + 2] = n;
+    out_.resize(start + 9 + n);
+
+    size_t got = 0;
+    while (got < n)
+    {
+        ssize_t r = ::pread(p.fd, &out_[start + 9 + got], n - got, p.offset + got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            // The file shrank underneath us.
+            out_.resize(start);
+            return false;
+        }
+        got += r;
+    }
+    p.offset += n;
+    p.length -= n;
+    return true;
+}
+
+bool Http2Connection::flush()
+{
+    if (out_.empty())
+        return true;
+
+    deadline_.arm(Server::TIMEOUT_WRITE);
+    bool ok = sock_.send(out_.data(), out_.length()) >= 0;
+    out_.clear();
+    return ok;
+}
+
+void Http2Connection::reap()
+{
+    for (auto it = streams_.begin(); it != streams_.end();)
+    {
+        Stream &s = it->second;
+        if (!s.ended)
+        {
+            ++it;
+            continue;
+        }
+
+        // Answered before the request was over, the rest is not wanted.
+        if (!s.remote_closed)
+            rst_stream(s.id, NO_ERROR);
+        it = streams_.erase(it);
+    }
+}
+
+void Http2Connection::frame(FrameType type, uint8_t flags, uint32_t id,
+                            const void *payload, size_t len)
+{
+    uint8_t head[9];
+    head[0] = len >> 16;
+    head[1] = len >> 8;
+    head[2] = len;
+    head[3] = type;
+    head[4] = flags;
+    put32(head + 5, id);
+    out_.append(reinterpret_cast<const char *>(head), sizeof(head));
+    if (len > 0)
+        out_.append(static_cast<const char *>(payload), len);
+}
+
+void Http2Connection::rst_stream(uint32_t id, ErrorCode code)
+{
+    uint8_t payload[4];
+    put32(payload, code);
+    frame(RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+void Http2Connection::goaway(ErrorCode code)
+{
+    uint8_t payload[8];
+    put32(payload, last_stream_id_);
+    put32(payload + 4, code);
+    frame(GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+bool Http2Connection::connection_error(ErrorCode code, const char *what)
+{
+    report(WARN) << "h2: " << what << std::endl;
+    goaway(code);
+    goaway_ = true;
+    return false;
+}
+
+}   // namespace simple_http_server
@@ -0,0 +1,256 @@
+/// http2.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "hpack.h"
+#include "message.h"
+#include "response_writer.h"
+#include "tcp_socket.h"
+#include "timer_wheel.h"
+
+namespace simple_http_server
+{
+
+class Server;
+
+/// HTTP/2 over cleartext TCP (h2c, RFC 7540) on one connection.
+///
+/// The client either starts with the connection preface ("prior
+/// knowledge") or upgrades an HTTP/1.1 request with "Upgrade: h2c".
+/// Requests then come as streams multiplexed on the connection, their
+/// header blocks compressed with HPACK.
+///
+/// Each complete request is served by the handlers of the server,
+/// writing through a StreamWriter that queues the head of the response
+/// as a HEADERS frame and its body as DATA frames. Responses of all the
+/// streams are interleaved within the flow control windows of the peer,
+/// and frames produced from the same batch of received bytes leave in a
+/// single send. Files are read as their DATA frames are sent, and a
+/// handler writing more than the peer takes waits for it, handling its
+/// frames meanwhile: a response is streamed with about a window of it
+/// queued, whatever its size.
+class Http2Connection
+{
+public:
+    /// "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n".
+    static const char PREFACE[];
+    static const size_t PREFACE_LENGTH = 24;
+
+    Http2Connection(Server &server, TCPSocket &sock);
+    ~Http2Connection();
+
+    Http2Connection(const Http2Connection&) = delete;
+    void operator=(const Http2Connection&) = delete;
+
+    /// Serve the connection until it is closed. The client preface has
+    /// been received, unless the connection was upgraded by [upgrade],
+    /// which is then answered as stream 1. [settings] is the value of
+    /// its HTTP2-Settings header.
+    void serve(Request *upgrade = nullptr, StringRef settings = StringRef());
+
+    /// Connections and streams served so far.
+    static unsigned long long connections() { return connections_total_; }
+    static unsigned long long streams() { return streams_total_; }
+
+private:
+    enum FrameType
+    {
+        DATA = 0x0,
+        HEADERS = 0x1,
+        PRIORITY = 0x2,
+        RST_STREAM = 0x3,
+        SETTINGS = 0x4,
+        PUSH_PROMISE = 0x5,
+        PING = 0x6,
+        GOAWAY = 0x7,
+        WINDOW_UPDATE = 0x8,
+        CONTINUATION = 0x9
+    };
+
+    enum ErrorCode
+    {
+        NO_ERROR = 0x0,
+        PROTOCOL_ERROR = 0x1,
+        INTERNAL_ERROR = 0x2,
+        FLOW_CONTROL_ERROR = 0x3,
+        STREAM_CLOSED = 0x5,
+        FRAME_SIZE_ERROR = 0x6,
+        REFUSED_STREAM = 0x7,
+        COMPRESSION_ERROR = 0x9
+    };
+
+    /// Part of a response body still to send: [length] bytes of [data]
+    /// from [offset] on, or of the file [fd] if it is set.
+    struct Piece
+    {
+        std::string data;
+        int fd;
+        off_t offset;
+        size_t length;
+    };
+
+    struct Stream
+    {
+        Stream() {}
+        ~Stream();
+        Stream(const Stream&) = delete;
+        void operator=(const Stream&) = delete;
+
+        uint32_t id;
+        std::vector<HeaderField> fields;
+        std::vector<char> body;
+        /// The client sent END_STREAM.
+        bool remote_closed;
+        /// The HEADERS of the response are queued.
+        bool answered;
+        /// The whole response is queued.
+        bool complete;
+        /// END_STREAM or RST_STREAM was sent.
+        bool ended;
+        /// RST_STREAM was sent or received.
+        bool reset;
+        /// Rest of the body of the response, [queued] bytes of it held
+        /// in memory rather than read from files as they are sent.
+        std::deque<Piece> out;
+        size_t queued;
+        /// Bytes the peer accepts on this stream. Goes negative when the
+        /// peer shrinks its initial window.
+        long long window;
+        /// DATA received but not acknowledged with a WINDOW_UPDATE.
+        size_t unacked;
+    };
+
+    /// Queues the response of a stream, see [pump].
+    class StreamWriter : public ResponseWriter
+    {
+    public:
+        StreamWriter(Http2Connection &conn, Stream &s) : conn_(conn), s_(s) {}
+
+        virtual bool send(StringRef head, const void *body, size_t len) override;
+        virtual bool start(StringRef head, long long length) override;
+        virtual bool write(const void *data, size_t len) override;
+        virtual bool write_file(int fd, off_t offset, size_t count) override;
+        virtual bool finish() override;
+        virtual bool framed() const override { return true; }
+
+    private:
+        /// Queue [p] and let [conn_] send what it can.
+        bool push(Piece p);
+
+        Http2Connection &conn_;
+        Stream &s_;
+    };
+
+    /// Shuts the connection down when the deadline passes.
+    class Deadline : public Timer
+    {
+    public:
+        Deadline(Server &server, TCPSocket &sock) : server_(server), sock_(sock), kind_(0) {}
+        ~Deadline() { cancel(); }
+        void arm(int kind);
+        void cancel();
+
+    protected:
+        virtual void expire() override;
+
+    private:
+        Server &server_;
+        TCPSocket &sock_;
+        std::atomic<int> kind_;
+    };
+
+    /// Read and handle one frame. Return false once the connection is
+    /// to be closed.
+    bool read_frame();
+    bool on_headers(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+    bool on_data(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+    bool on_settings(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+    bool on_window_update(uint32_t id, const uint8_t *p, size_t len);
+    /// Decode the complete header block of stream [id].
+    bool end_headers(uint32_t id, bool end_stream);
+    /// Apply the parameters of a SETTINGS payload. Return an error code.
+    ErrorCode apply_settings(const uint8_t *p, size_t len);
+
+    /// Answer the streams whose request is complete. Requests are never
+    /// answered while frames are handled, which a handler may wait for.
+    void answer();
+    /// Run the request of [s] through the handlers of the server.
+    void respond(Stream &s, Request &req);
+    void respond(Stream &s);
+    /// Queue the HEADERS frame of [head], the head of an HTTP/1.1
+    /// response, on [s]. Return false if it is malformed.
+    bool headers(Stream &s, StringRef head, bool end_stream);
+    /// Send what is queued on [s] until less than a frame batch is left
+    /// in memory, handling the frames of the peer while its windows are
+    /// closed. Return false if [s] or the connection failed.
+    bool pump(Stream &s);
+    /// Reset the stream at [it], removed unless it is being answered.
+    void close_stream(std::map<uint32_t, Stream>::iterator it);
+
+    /// Queue DATA frames within the windows, round robin over streams.
+    /// Return true when it stopped because enough is queued to be sent.
+    bool schedule();
+    /// Send what is queued. Return false on failure.
+    bool flush();
+    /// Drop the streams whose response is sent.
+    void reap();
+    /// Open stream [id] with the windows in force.
+    Stream &open(uint32_t id);
+
+    void frame(FrameType type, uint8_t flags, uint32_t id, const void *payload, size_t len);
+    /// DATA frame of the next [n] bytes of [s]. Return false if they
+    /// could not be read.
+    bool data_frame(Stream &s, size_t n, bool last);
+    void rst_stream(uint32_t id, ErrorCode code);
+    void goaway(ErrorCode code);
+    bool connection_error(ErrorCode code, const char *what);
+
+    Server &server_;
+    TCPSocket &sock_;
+    Deadline deadline_;
+
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+
+    std::map<uint32_t, Stream> streams_;
+    /// Highest stream opened by the client.
+    uint32_t last_stream_id_;
+    /// Stream of the header block being continued, 0 if none, and
+    /// whether its HEADERS frame ended the stream.
+    uint32_t continued_;
+    bool continued_end_stream_;
+    std::string block_;
+    bool got_settings_;
+    bool goaway_;
+    /// The connection failed while a request was answered.
+    bool broken_;
+    /// Stream whose request is being answered, nullptr if none.
+    Stream *answering_;
+
+    /// Settings of the peer.
+    long long peer_initial_window_;
+    size_t peer_max_frame_;
+    /// Bytes the peer accepts on the connection.
+    long long window_;
+    /// DATA received on the connection but not acknowledged.
+    size_t unacked_;
+
+    /// Frame being received and frames to send.
+    std::vector<uint8_t> in_;
+    std::string out_;
+
+    static std::atomic<unsigned long long> connections_total_;
+    static std::atomic<unsigned long long> streams_total_;
+};
+
+}   // namespace simple_http_server
+
+#endif
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <getopt.h>
+#include <csignal>
 #include "server.h"
+#include "body_stream.h"
 #include "tcp_socket.h"
 #include "reporter.h"
 using namespace simple_http_server;
@@ -10,6 +12,31 @@ static struct option long_options[] = {
     { "port", required_argument, NULL, 'p' },
     { "proxy", required_argument, NULL, 'x' },
     { "number-thread", required_argument, NULL, 'n' },
+    { "cache-size", required_argument, NULL, 'c' },
+    { "cache-max-entry", required_argument, NULL, 'e' },
+    { "gzip-cache-size", required_argument, NULL, 'g' },
+    { "gzip-max-entry", required_argument, NULL, 'G' },
+    { "static-store", required_argument, NULL, 'm' },
+    { "log-level", required_argument, NULL, 'l' },
+    { "reuseport", required_argument, NULL, 'r' },
+    { "io-uring", required_argument, NULL, 'u' },
+    { "proxy-pool", required_argument, NULL, 'P' },
+    { "proxy-pipeline", required_argument, NULL, 'D' },
+    { "proxy-cache-size", required_argument, NULL, 'C' },
+    { "proxy-cache-max-entry", required_argument, NULL, 'E' },
+    { "proxy-cache-dir", required_argument, NULL, 'd' },
+    { "proxy-cache-disk-size", required_argument, NULL, 'S' },
+    { "proxy-cache-ttl", required_argument, NULL, 't' },
+    { "header-timeout", required_argument, NULL, 'H' },
+    { "body-timeout", required_argument, NULL, 'B' },
+    { "idle-timeout", required_argument, NULL, 'I' },
+    { "write-timeout", required_argument, NULL, 'W' },
+    { "max-body-size", required_argument, NULL, 'M' },
+    { "max-queue", required_argument, NULL, 'q' },
+    { "queue-target-delay", required_argument, NULL, 'Q' },
+    { "upgrade-socket", required_argument, NULL, 'U' },
+    { "drain-timeout", required_argument, NULL, 'T' },
+    { "echo", no_argument, NULL, 'o' },
     { 0, 0, 0, 0 }
 };
 
@@ -19,8 +46,33 @@ static void print_usage(char *const prog)
     std::cerr << "[OPTION] can be the following:" << std::endl;
     std::cerr << "\t" << "--ip " << "ip_address" << std::endl;
     std::cerr << "\t" << "--port " << "port_number" << std::endl;
-    std::cerr << "\t" << "--proxy " << "proxy_address" << std::endl;
+    std::cerr << "\t" << "--proxy " << "proxy_address (host:port)" << std::endl;
+    std::cerr << "\t" << "--proxy-pool " << "n (upstream connections)" << std::endl;
+    std::cerr << "\t" << "--proxy-pipeline " << "n (outstanding requests per upstream connection)" << std::endl;
+    std::cerr << "\t" << "--proxy-cache-size " << "bytes (memory tier, 0 disables the proxy cache)" << std::endl;
+    std::cerr << "\t" << "--proxy-cache-max-entry " << "bytes" << std::endl;
+    std::cerr << "\t" << "--proxy-cache-dir " << "dir (enables the disk tier)" << std::endl;
+    std::cerr << "\t" << "--proxy-cache-disk-size " << "bytes" << std::endl;
+    std::cerr << "\t" << "--proxy-cache-ttl " << "seconds (for responses without freshness info)" << std::endl;
     std::cerr << "\t" << "--number-thread " << "n" << std::endl;
+    std::cerr << "\t" << "--cache-size " << "bytes (0 disables the file cache)" << std::endl;
+    std::cerr << "\t" << "--cache-max-entry " << "bytes" << std::endl;
+    std::cerr << "\t" << "--gzip-cache-size " << "bytes (0 disables compressing files)" << std::endl;
+    std::cerr << "\t" << "--gzip-max-entry " << "bytes (largest file compressed)" << std::endl;
+    std::cerr << "\t" << "--static-store " << "bytes (largest file mapped at start and on SIGHUP, 0 disables)" << std::endl;
+    std::cerr << "\t" << "--log-level " << "error|warn|info" << std::endl;
+    std::cerr << "\t" << "--reuseport " << "n (SO_REUSEPORT epoll loops pinned to cores; replaces the thread pool, --number-thread is ignored)" << std::endl;
+    std::cerr << "\t" << "--io-uring " << "n (io_uring loops in front of the thread pool, falls back without io_uring)" << std::endl;
+    std::cerr << "\t" << "--header-timeout " << "ms (request line and headers)" << std::endl;
+    std::cerr << "\t" << "--body-timeout " << "ms" << std::endl;
+    std::cerr << "\t" << "--idle-timeout " << "ms (between requests of a kept-alive connection)" << std::endl;
+    std::cerr << "\t" << "--write-timeout " << "ms (without progress while producing and sending a response)" << std::endl;
+    std::cerr << "\t" << "--max-queue " << "n (connections waiting for a worker, more are shed with 503)" << std::endl;
+    std::cerr << "\t" << "--queue-target-delay " << "ms (shed connections waiting longer, 0 disables)" << std::endl;
+    std::cerr << "\t" << "--max-body-size " << "bytes (request bodies buffered for the proxy and forms)" << std::endl;
+    std::cerr << "\t" << "--upgrade-socket " << "path (take the port over from the server there, hand it to the next)" << std::endl;
+    std::cerr << "\t" << "--drain-timeout " << "ms (connections left to end after handing over)" << std::endl;
+    std::cerr << "\t" << "--echo " << "(serve POST /echo, streaming the request body back)" << std::endl;
 }
 
 int main(int argc, char *const argv[])
@@ -28,6 +80,32 @@ int main(int argc, char *const argv[])
     std::string ip = "127.0.0.1";
     uint16_t port = 8888;
     size_t thread_num = 8;
+    size_t cache_size = 64 << 20;
+    size_t cache_max_entry = 256 << 10;
+    size_t gzip_cache_size = 16 << 20;
+    size_t gzip_max_entry = 1 << 20;
+    size_t static_store = 0;
+    int log_level = ReportSeverityINFO;
+    size_t acceptors = 0;
+    size_t rings = 0;
+    std::string upstream;
+    size_t proxy_pool = 8;
+    size_t proxy_pipeline = 4;
+    size_t proxy_cache_size = 64 << 20;
+    size_t proxy_cache_max_entry = 1 << 20;
+    std::string proxy_cache_dir;
+    size_t proxy_cache_disk_size = 1 << 30;
+    long proxy_cache_ttl = 0;
+    unsigned long header_timeout = 10000;
+    unsigned long body_timeout = 30000;
+    unsigned long idle_timeout = 5000;
+    unsigned long write_timeout = 60000;
+    size_t max_body_size = 8 << 20;
+    size_t max_queue = 1024;
+    unsigned long queue_target_delay = 0;
+    std::string upgrade_socket;
+    unsigned long drain_timeout = 30000;
+    bool echo = false;
 
     int oc;
     while ((oc = getopt_long(argc, argv, ":", long_options, NULL)) != -1) {
@@ -39,18 +117,119 @@ int main(int argc, char *const argv[])
             port = std::stoi(std::string(optarg)); 
             break;
         case 'x':
-            std::cerr << "proxy mode is currently not supported" << std::endl;
-            abort();
+            upstream = std::string(optarg);
+            break;
+        case 'P':
+            proxy_pool = std::stoul(std::string(optarg));
+            break;
+        case 'D':
+            proxy_pipeline = std::stoul(std::string(optarg));
+            break;
+        case 'C':
+            proxy_cache_size = std::stoul(std::string(optarg));
+            break;
+        case 'E':
+            proxy_cache_max_entry = std::stoul(std::string(optarg));
+            break;
+        case 'd':
+            proxy_cache_dir = std::string(optarg);
+            break;
+        case 'S':
+            proxy_cache_disk_size = std::stoul(std::string(optarg));
+            break;
+        case 't':
+            proxy_cache_ttl = std::stol(std::string(optarg));
+            break;
+        case 'H':
+            header_timeout = std::stoul(std::string(optarg));
+            break;
+        case 'B':
+            body_timeout = std::stoul(std::string(optarg));
+            break;
+        case 'I':
+            idle_timeout = std::stoul(std::string(optarg));
+            break;
+        case 'W':
+            write_timeout = std::stoul(std::string(optarg));
+            break;
+        case 'q':
+            max_queue = std::stoul(std::string(optarg));
+            break;
+        case 'Q':
+            queue_target_delay = std::stoul(std::string(optarg));
+            break;
+        case 'M':
+            max_body_size = std::stoul(std::string(optarg));
+            break;
+        case 'U':
+            upgrade_socket = std::string(optarg);
+            break;
+        case 'T':
+            drain_timeout = std::stoul(std::string(optarg));
+            break;
         case 'n':
             thread_num = std::stoul(std::string(optarg)); 
             break;
+        case 'c':
+            cache_size = std::stoul(std::string(optarg));
+            break;
+        case 'e':
+            cache_max_entry = std::stoul(std::string(optarg));
+            break;
+        case 'g':
+            gzip_cache_size = std::stoul(std::string(optarg));
+            break;
+        case 'G':
+            gzip_max_entry = std::stoul(std::string(optarg));
+            break;
+        case 'm':
+            static_store = std::stoul(std::string(optarg));
+            break;
+        case 'o':
+            echo = true;
+            break;
+        case 'r':
+            acceptors = std::stoul(std::string(optarg));
+            break;
+        case 'u':
+            rings = std::stoul(std::string(optarg));
+            break;
+        case 'l':
+            if (std::string(optarg) == "error")
+                log_level = ReportSeverityERROR;
+            else if (std::string(optarg) == "warn")
+                log_level = ReportSeverityWARN;
+            else
+                log_level = ReportSeverityINFO;
+            break;
         default:
             print_usage(argv[0]);
             break;
         }
     }
 
-    initialize_reporter("err_server.log", "warn_server.log", "info_server.log");
+    // A client closing early must not kill the whole server.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    initialize_reporter("err_server.log", "warn_server.log", "info_server.log", log_level);
     Server server(ip, port, "", thread_num);
+    server.set_file_cache(cache_size, cache_max_entry);
+    server.set_gzip_cache(gzip_cache_size, gzip_max_entry);
+    server.set_static_store(static_store);
+    server.set_acceptors(acceptors);
+    server.set_io_uring(rings);
+    server.set_admission(max_queue, queue_target_delay);
+    server.set_timeouts(header_timeout, body_timeout, idle_timeout, write_timeout);
+    server.set_max_body_size(max_body_size);
+    if (!upgrade_socket.empty())
+        server.set_hot_upgrade(upgrade_socket, drain_timeout);
+    if (echo)
+        server.add_stream_handler("/echo", std::make_shared<EchoHandler>());
+    if (!upstream.empty())
+    {
+        server.set_proxy(upstream, proxy_pool, proxy_pipeline);
+        server.set_proxy_cache(proxy_cache_size, proxy_cache_max_entry,
+                               proxy_cache_dir, proxy_cache_disk_size, proxy_cache_ttl);
+    }
     server.start();
 }
@@ -1,18 +1,312 @@
+#include <cstdlib>
 #include <vector>
 #include <sstream>
+#include <strings.h>
 
 #include "reporter.h"
 #include "message.h"
+#include "response_builder.h"
 
 namespace simple_http_server
 {
 
+bool parse_http_date(std::string const &s, std::time_t &t)
+{
+    struct tm tm;
+    std::memset(&tm, 0, sizeof(tm));
+    if (!::strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S", &tm))
+        return false;
+    t = ::timegm(&tm);
+    return true;
+}
+
+std::string format_http_date(std::time_t t)
+{
+    struct tm tm;
+    char buf[64];
+    ::gmtime_r(&t, &tm);
+    size_t n = std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buf, n);
+}
+
+RangeResult parse_range(std::string const &value, long long size,
+                        std::vector<ByteRange> &ranges, size_t max_ranges)
+{
+    ranges.clear();
+    if (value.compare(0, 6, "bytes=") != 0)
+        return RANGE_IGNORED;
+
+    const char *p = value.c_str() + 6;
+    size_t specs = 0;
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (++specs > max_ranges)
+            return RANGE_IGNORED;
+
+        // "first-last", "first-" or "-suffix".
+        char *end;
+        long long first = -1, last = -1;
+        if (*p != '-')
+        {
+            if (*p < '0' || *p > '9')
+                return RANGE_IGNORED;
+            first = std::strtoll(p, &end, 10);
+            p = end;
+        }
+        if (*p++ != '-')
+            return RANGE_IGNORED;
+        if (*p >= '0' && *p <= '9')
+        {
+            last = std::strtoll(p, &end, 10);
+            p = end;
+        }
+        if (first < 0 && last < 0)
+            return RANGE_IGNORED;
+        if (first >= 0 && last >= 0 && last < first)
+            return RANGE_IGNORED;
+
+        if (first < 0)
+        {
+            // The last [last] bytes.
+            if (last > 0 && size > 0)
+                ranges.push_back(ByteRange{ last > size ? 0 : size - last, size - 1 });
+        }
+        else if (first < size)
+            ranges.push_back(ByteRange{ first, last < 0 || last >= size ? size - 1 : last });
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0')
+            break;
+        if (*p++ != ',')
+            return RANGE_IGNORED;
+    }
+
+    return ranges.empty() ? RANGE_UNSATISFIABLE : RANGE_SATISFIABLE;
+}
+
+bool StringRef::equals_nocase(StringRef other) const
+{
+    return length == other.length && ::strncasecmp(data, other.data, length) == 0;
+}
+
+bool StringRef::operator==(StringRef other) const
+{
+    return length == other.length && std::memcmp(data, other.data, length) == 0;
+}
+
+Headers::Headers()
+    : size_(0)
+{
+    for (auto &f : first_)
+        f = 0;
+}
+
+Headers::Headers(const Headers &other)
+    : Headers()
+{
+    *this = other;
+}
+
+Headers &Headers::operator=(const Headers &other)
+{
+    if (this == &other)
+        return *this;
+
+    clear();
+    for (size_t i = 0; i < other.size(); i++)
+    {
+        Field const &f = other[i];
+        if (f.owned)
+            set(f.name.str(), f.value.str());
+        else
+            push(f);
+    }
+    return *this;
+}
+
+Headers::Known Headers::classify(StringRef name)
+{
+    static const StringRef names[KNOWN_COUNT] = {
+        "Content-Length", "Content-Type", "Connection", "Host",
+        "Transfer-Encoding", "If-None-Match", "If-Modified-Since",
+        "Range", "Accept-Encoding"
+    };
+
+    // Only compare names of the right length.
+    for (int k = 0; k < KNOWN_COUNT; k++)
+        if (names[k].length == name.length && names[k].equals_nocase(name))
+            return static_cast<Known>(k);
+    return UNKNOWN;
+}
+
+void Headers::push(Field const &f)
+{
+    if (size_ < INLINE_FIELDS)
+        fields_[size_] = f;
+    else
+        more_.push_back(f);
+    size_++;
+
+    if (f.known != UNKNOWN && !first_[f.known])
+        first_[f.known] = size_;
+}
+
+void Headers::add(StringRef name, StringRef value)
+{
+    Field f;
+    f.name = name;
+    f.value = value;
+    f.known = classify(name);
+    f.owned = false;
+    push(f);
+}
+
+void Headers::set(std::string const &name, std::string const &value)
+{
+    erase(name);
+
+    owned_.push_back(name);
+    StringRef n = owned_.back();
+    owned_.push_back(value);
+    StringRef v = owned_.back();
+
+    Field f;
+    f.name = n;
+    f.value = v;
+    f.known = classify(n);
+    f.owned = true;
+    push(f);
+}
+
+void Headers::erase(StringRef name)
+{
+    Known known = classify(name);
+    if (known != UNKNOWN && !first_[known])
+        return;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < size_; i++)
+    {
+        Field const &f = at(i);
+        if (known != UNKNOWN ? f.known == known : f.name.equals_nocase(name))
+            continue;
+        if (kept != i)
+            at(kept) = f;
+        kept++;
+    }
+
+    if (kept == size_)
+        return;
+    size_ = kept;
+    if (size_ <= INLINE_FIELDS)
+        more_.clear();
+    else
+        more_.resize(size_ - INLINE_FIELDS);
+    reindex();
+}
+
+void Headers::clear()
+{
+    size_ = 0;
+    more_.clear();
+    owned_.clear();
+    reindex();
+}
+
+void Headers::reindex()
+{
+    for (auto &f : first_)
+        f = 0;
+    for (size_t i = size_; i > 0; i--)
+    {
+        Known k = at(i - 1).known;
+        if (k != UNKNOWN)
+            first_[k] = i;
+    }
+}
+
+StringRef const *Headers::get(Known name) const
+{
+    if (name == UNKNOWN || !first_[name])
+        return nullptr;
+    return &(*this)[first_[name] - 1].value;
+}
+
+StringRef const *Headers::get(StringRef name) const
+{
+    Known known = classify(name);
+    if (known != UNKNOWN)
+        return get(known);
+
+    for (size_t i = 0; i < size_; i++)
+        if ((*this)[i].name.equals_nocase(name))
+            return &(*this)[i].value;
+    return nullptr;
+}
+
+bool Headers::contains_token(StringRef name, StringRef token) const
+{
+    return has_token(get(name), token);
+}
+
+bool Headers::contains_token(Known name, StringRef token) const
+{
+    return has_token(get(name), token);
+}
+
+bool Headers::consistent(Known name) const
+{
+    StringRef const *first = get(name);
+    if (!first)
+        return true;
+    for (size_t i = first_[name]; i < size_; i++)
+        if ((*this)[i].known == name && (*this)[i].value != *first)
+            return false;
+    return true;
+}
+
+bool Headers::has_token(StringRef const *value, StringRef token)
+{
+    if (!value)
+        return false;
+
+    const char *p = value->data;
+    const char *end = value->data + value->length;
+    while (p <= end)
+    {
+        const char *comma = static_cast<const char *>(std::memchr(p, ',', end - p));
+        if (!comma)
+            comma = end;
+
+        // Trim the item.
+        const char *b = p, *e = comma;
+        while (b < e && (*b == ' ' || *b == '\t'))
+            b++;
+        while (e > b && (e[-1] == ' ' || e[-1] == '\t'))
+            e--;
+
+        if (StringRef(b, e - b).equals_nocase(token))
+            return true;
+        p = comma + 1;
+    }
+    return false;
+}
+
 std::string Headers::serialize() const
 {
     std::string str;
 
-    for (auto &KV : *this)
-        str += KV.first + ": " + KV.second + LINE_END;
+    for (size_t i = 0; i < size_; i++)
+    {
+        Field const &f = (*this)[i];
+        str.append(f.name.data, f.name.length);
+        str.append(": ", 2);
+        str.append(f.value.data, f.value.length);
+        str.append(LINE_END);
+    }
     return str;
 }
 
@@ -20,8 +314,8 @@ Request::Request()
 {
     version = "HTTP/1.1";
     method = "";
-    headers.reset(new Headers());
     resource = "";
+    keep_alive = true;
     body = {};
 }
 
@@ -29,15 +323,14 @@ std::string Request::serialize() const
 {
     std::stringstream str_stream;
     // Request line.
-    str_stream << method << " " << resource  << version << LINE_END;
+    str_stream << method << " " << resource << " " << version << LINE_END;
 
     // Headers.
-    str_stream << headers->serialize();
+    str_stream << headers.serialize();
     str_stream << LINE_END;
 
     // Body.
-    std::string data(body.begin(), body.end());
-    str_stream << data << LINE_END;
+    str_stream.write(body.data(), body.size());
     return str_stream.str();
 }
 
@@ -45,25 +338,25 @@ Response::Response()
 {
     version = "HTTP/1.1";
     method = "";
-    headers.reset(new Headers());
     status_code = 0;
     status = "";
     body = {};
 }
 
-std::string Response::serialize() const
+std::string Response::serialize_header() const
 {
-    std::stringstream str_stream;
-    // Response line.
-    str_stream << version << " " << std::to_string(status_code) << " " << status << LINE_END;
-
-    // Headers.
-    str_stream << headers->serialize() << LINE_END;
+    ResponseBuilder builder;
+    builder.start(status_code, status, version);
+    for (size_t i = 0; i < headers.size(); i++)
+        builder.header(headers[i].name.str(), headers[i].value.str());
+    return builder.finish();
+}
 
-    // Body.
-    std::string data(body.begin(), body.end());
-    str_stream << data << LINE_END;
-    return str_stream.str();
+std::string Response::serialize() const
+{
+    std::string str = serialize_header();
+    str.append(body.begin(), body.end());
+    return str;
 }
 
 }
\ No newline at end of file
@@ -6,21 +6,144 @@
 #define MESSAGE_H
 
 #include <vector>
+#include <list>
 #include <memory>
 #include <cassert>
-#include <unordered_map>
+#include <cstring>
 #include <string>
+#include <ctime>
 
 namespace simple_http_server
 {
 
 static const std::string LINE_END = "\r\n";
 
-/// K/V pairs HTTP headers.
-class Headers : public std::unordered_map<std::string, std::string>
+/// Parse an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+bool parse_http_date(std::string const &s, std::time_t &t);
+/// Format [t] as an IMF-fixdate.
+std::string format_http_date(std::time_t t);
+
+/// Inclusive range [first, last] of the bytes of a representation.
+struct ByteRange
+{
+    long long first;
+    long long last;
+
+    long long length() const { return last - first + 1; }
+};
+
+enum RangeResult { RANGE_IGNORED, RANGE_SATISFIABLE, RANGE_UNSATISFIABLE };
+
+/// Parse the value of a Range header against a representation of [size]
+/// bytes into [ranges], clipped to the size and in the order asked.
+/// Malformed values and more than [max_ranges] ranges are ignored, the
+/// whole representation being served instead.
+RangeResult parse_range(std::string const &value, long long size,
+                        std::vector<ByteRange> &ranges, size_t max_ranges = 16);
+
+/// Characters owned by someone else, e.g. a request buffer.
+struct StringRef
+{
+    const char *data;
+    size_t length;
+
+    StringRef() : data(""), length(0) {}
+    StringRef(const char *data, size_t length) : data(data), length(length) {}
+    StringRef(const char *s) : data(s), length(std::strlen(s)) {}
+    StringRef(std::string const &s) : data(s.data()), length(s.length()) {}
+
+    std::string str() const { return std::string(data, length); }
+    bool empty() const { return length == 0; }
+    bool equals_nocase(StringRef other) const;
+    bool operator==(StringRef other) const;
+    bool operator!=(StringRef other) const { return !(*this == other); }
+};
+
+/// HTTP headers as a flat table of fields in arrival order.
+///
+/// Fields added with [add] are views, typically into the request head
+/// they were parsed from, which must outlive the table. Fields given
+/// with [set] are copied. Names compare case-insensitively; the headers
+/// in [Known] are classified once when added, so looking them up is a
+/// single index. Up to [INLINE_FIELDS] fields need no allocation.
+class Headers
 {
 public:
+    enum Known
+    {
+        CONTENT_LENGTH,
+        CONTENT_TYPE,
+        CONNECTION,
+        HOST,
+        TRANSFER_ENCODING,
+        IF_NONE_MATCH,
+        IF_MODIFIED_SINCE,
+        RANGE,
+        ACCEPT_ENCODING,
+        KNOWN_COUNT,
+        UNKNOWN = KNOWN_COUNT
+    };
+
+    struct Field
+    {
+        StringRef name;
+        StringRef value;
+        Known known;
+        /// Points into [owned_].
+        bool owned;
+    };
+
+    static const size_t INLINE_FIELDS = 32;
+
+    Headers();
+    /// Views of [other] stay views, copied fields are copied again.
+    Headers(const Headers &other);
+    Headers &operator=(const Headers &other);
+
+    /// Append a field referring to [name] and [value].
+    void add(StringRef name, StringRef value);
+    /// Replace all fields named [name] with a copy of [name: value].
+    void set(std::string const &name, std::string const &value);
+    /// Remove all fields named [name].
+    void erase(StringRef name);
+    void clear();
+
+    /// First field named [name], nullptr if absent.
+    StringRef const *get(Known name) const;
+    StringRef const *get(StringRef name) const;
+    /// Whether the comma separated value of [name] contains [token],
+    /// both compared case-insensitively. E.g. Connection: close.
+    bool contains_token(StringRef name, StringRef token) const;
+    bool contains_token(Known name, StringRef token) const;
+    /// Whether all the fields named [name] have the same value, as
+    /// repeated Content-Length fields must.
+    bool consistent(Known name) const;
+
+    size_t size() const { return size_; }
+    Field const &operator[](size_t i) const
+    {
+        return i < INLINE_FIELDS ? fields_[i] : more_[i - INLINE_FIELDS];
+    }
+
     std::string serialize() const;
+
+    static Known classify(StringRef name);
+
+private:
+    Field &at(size_t i) { return i < INLINE_FIELDS ? fields_[i] : more_[i - INLINE_FIELDS]; }
+    void push(Field const &f);
+    /// Rebuild [first_] after fields were removed.
+    void reindex();
+    static bool has_token(StringRef const *value, StringRef token);
+
+    Field fields_[INLINE_FIELDS];
+    std::vector<Field> more_;
+    size_t size_;
+    /// Index + 1 of the first field of each known name, 0 if absent.
+    unsigned short first_[KNOWN_COUNT];
+    /// Storage of the fields given to [set]. A list, unlike a deque,
+    /// allocates nothing while empty.
+    std::list<std::string> owned_;
 };
 
 /// Base HTTP message.
@@ -28,7 +151,10 @@ struct Message
 {
     std::string version;
     std::string method;
-    std::unique_ptr<Headers> headers;
+    /// Raw header lines the fields of [headers] may refer to, owned by
+    /// whoever received them.
+    StringRef head;
+    Headers headers;
     std::vector<char> body;
 
     virtual ~Message() = default;
@@ -39,6 +165,8 @@ struct Message
 struct Request : public Message
 {
     std::string resource;
+    /// False once the client asked to close the connection.
+    bool keep_alive;
 
     Request();
     virtual std::string serialize() const override;
@@ -52,16 +180,24 @@ struct Response : public Message
 
     Response();
     virtual std::string serialize() const override;
+    /// Serialize response line and headers only, ending with
+    /// the empty line. Used when the body is sent separately.
+    std::string serialize_header() const;
 
     /// Common status code.
     static const int OK = 200;
     static const int CREATED = 201;
     static const int ACCEPTED = 202;
     static const int NO_CONTENT = 203;
+    static const int PARTIAL_CONTENT = 206;
+    static const int NOT_MODIFIED = 304;
     static const int BAD_REQUEST = 400;
     static const int FORBIDDEN = 403;
     static const int NOT_FOUND = 404;
+    static const int METHOD_NOT_ALLOWED = 405;
     static const int REQUEST_TIMEOUT = 408;
+    static const int PAYLOAD_TOO_LARGE = 413;
+    static const int RANGE_NOT_SATISFIABLE = 416;
     static const int INTERNAL_SERVER_ERROR = 500;
     static const int BAD_GATEWAY = 502;
     static const int SERVICE_UNAVALABLE = 503;
@@ -0,0 +1,265 @@
+/// metrics.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "metrics.h"
+
+namespace simple_http_server
+{
+
+namespace
+{
+
+const char *METHODS[] = { "GET", "POST", "HEAD", "OTHER" };
+const int METHOD_COUNT = 4;
+
+/// Statuses with their own series, anything else is "other".
+const int STATUSES[] = { 200, 206, 304, 400, 404, 408, 413, 500, 501, 502, 503 };
+const int STATUS_COUNT = sizeof(STATUSES) / sizeof(STATUSES[0]) + 1;
+
+const char *PHASES[] = { "accept_to_first_byte", "parse", "handler", "send" };
+
+int method_slot(std::string const &method)
+{
+    for (int i = 0; i < METHOD_COUNT - 1; i++)
+        if (method == METHODS[i])
+            return i;
+    return METHOD_COUNT - 1;
+}
+
+int status_slot(int status)
+{
+    for (int i = 0; i < STATUS_COUNT - 1; i++)
+        if (status == STATUSES[i])
+            return i;
+    return STATUS_COUNT - 1;
+}
+
+/// Everything a thread records.
+struct Shard
+{
+    Histogram phases[Metrics::PHASE_COUNT];
+    Histogram requests[METHOD_COUNT][STATUS_COUNT];
+};
+
+/// Shards are kept after their thread exits so counters never go back.
+std::mutex registry_m;
+std::vector<std::unique_ptr<Shard>> registry;
+
+Shard &local_shard()
+{
+    static thread_local Shard *shard = nullptr;
+    if (!shard)
+    {
+        std::unique_ptr<Shard> s(new Shard());
+        shard = s.get();
+        std::lock_guard<std::mutex> lock(registry_m);
+        registry.push_back(std::move(s));
+    }
+    return *shard;
+}
+
+thread_local int status_noted = 0;
+
+/// Cumulative buckets exported, in microseconds (powers of 4).
+const unsigned long long EXPORT_BOUNDS[] = {
+    1, 4, 16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216
+};
+
+struct Merged
+{
+    unsigned long long counts[Histogram::BUCKETS];
+    unsigned long long sum;
+    unsigned long long total;
+
+    Merged() : sum(0), total(0)
+    {
+        for (auto &c : counts)
+            c = 0;
+    }
+
+    void finish()
+    {
+        for (auto c : counts)
+            total += c;
+    }
+
+    /// Value below which [q] of the samples fall, in microseconds.
+    unsigned long long quantile(double q) const
+    {
+        unsigned long long rank = static_cast<unsigned long long>(q * total);
+        unsigned long long seen = 0;
+        for (int b = 0; b < Histogram::BUCKETS; b++)
+        {
+            seen += counts[b];
+            if (seen > rank)
+                return b + 1 < Histogram::BUCKETS ? Histogram::lower_bound(b + 1) : Histogram::lower_bound(b);
+        }
+        return 0;
+    }
+};
+
+void append(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void append(std::string &out, const char *fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = std::vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out.append(buf, std::min<size_t>(n, sizeof(buf) - 1));
+}
+
+/// Emit _bucket, _sum and _count lines of a histogram series.
+void render_histogram(std::string &out, const char *name, std::string const &labels, Merged const &m)
+{
+    unsigned long long cumulative = 0;
+    int b = 0;
+    for (auto bound : EXPORT_BOUNDS)
+    {
+        while (b < Histogram::BUCKETS && Histogram::lower_bound(b) < bound)
+            cumulative += m.counts[b++];
+        append(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels.c_str(), bound / 1e6, cumulative);
+    }
+    append(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels.c_str(), m.total);
+    append(out, "%s_sum{%s} %g\n", name, labels.c_str(), m.sum / 1e6);
+    append(out, "%s_count{%s} %llu\n", name, labels.c_str(), m.total);
+}
+
+} // namespace
+
+std::atomic<long> Metrics::active_connections_(0);
+std::atomic<unsigned long long> Metrics::connections_total_(0);
+
+int Histogram::bucket_of(unsigned long long us)
+{
+    if (us < SUB_BUCKETS)
+        return us;
+
+    int e = 63 - __builtin_clzll(us);
+    int b = SUB_BUCKETS + (e - 3) * SUB_BUCKETS + ((us >> (e - 3)) & (SUB_BUCKETS - 1));
+    return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+unsigned long long Histogram::lower_bound(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    int e = (bucket - SUB_BUCKETS) / SUB_BUCKETS + 3;
+    unsigned long long sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+    return (1ULL << e) + (sub << (e - 3));
+}
+
+void Histogram::record(unsigned long long us)
+{
+    counts_[bucket_of(us)].add(1);
+    sum_.add(us);
+}
+
+void Histogram::merge_into(unsigned long long *counts, unsigned long long &sum) const
+{
+    for (int b = 0; b < BUCKETS; b++)
+        counts[b] += counts_[b].get();
+    sum += sum_.get();
+}
+
+void Metrics::record_phase(Phase phase, unsigned long long ns)
+{
+    local_shard().phases[phase].record(ns / 1000);
+}
+
+void Metrics::record_request(std::string const &method, int status, unsigned long long ns)
+{
+    local_shard().requests[method_slot(method)][status_slot(status)].record(ns / 1000);
+}
+
+void Metrics::note_status(int status)
+{
+    status_noted = status;
+}
+
+int Metrics::last_status()
+{
+    return status_noted;
+}
+
+void Metrics::connection_opened()
+{
+    active_connections_++;
+    connections_total_++;
+}
+
+void Metrics::connection_closed()
+{
+    active_connections_--;
+}
+
+void Metrics::render(std::string &out)
+{
+    std::vector<Shard *> shards;
+    {
+        std::lock_guard<std::mutex> lock(registry_m);
+        for (auto &s : registry)
+            shards.push_back(s.get());
+    }
+
+    out.append("# HELP httpserver_connections_active Client connections being served.\n");
+    out.append("# TYPE httpserver_connections_active gauge\n");
+    append(out, "httpserver_connections_active %ld\n", active_connections());
+    out.append("# HELP httpserver_connections_total Client connections accepted.\n");
+    out.append("# TYPE httpserver_connections_total counter\n");
+    append(out, "httpserver_connections_total %llu\n", connections_total_.load());
+
+    // Per phase.
+    std::vector<Merged> phases(PHASE_COUNT);
+    for (auto shard : shards)
+        for (int p = 0; p < PHASE_COUNT; p++)
+            shard->phases[p].merge_into(phases[p].counts, phases[p].sum);
+
+    out.append("# HELP httpserver_phase_duration_seconds Time spent in each phase of a request.\n");
+    out.append("# TYPE httpserver_phase_duration_seconds histogram\n");
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        Merged &m = phases[p];
+        m.finish();
+        render_histogram(out, "httpserver_phase_duration_seconds",
+                         std::string("phase=\"") + PHASES[p] + "\"", m);
+    }
+
+    out.append("# HELP httpserver_phase_duration_quantile_seconds Phase latency percentiles.\n");
+    out.append("# TYPE httpserver_phase_duration_quantile_seconds gauge\n");
+    for (int p = 0; p < PHASE_COUNT; p++)
+        for (double q : { 0.5, 0.9, 0.99, 0.999 })
+            append(out, "httpserver_phase_duration_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %g\n",
+                   PHASES[p], q, phases[p].quantile(q) / 1e6);
+
+    // Per method and status, only series that have seen requests.
+    out.append("# HELP httpserver_request_duration_seconds Time from request line to response sent.\n");
+    out.append("# TYPE httpserver_request_duration_seconds histogram\n");
+    for (int mi = 0; mi < METHOD_COUNT; mi++)
+        for (int si = 0; si < STATUS_COUNT; si++)
+        {
+            Merged m;
+            for (auto shard : shards)
+                shard->requests[mi][si].merge_into(m.counts, m.sum);
+            m.finish();
+            if (m.total == 0)
+                continue;
+
+            char labels[64];
+            if (si < STATUS_COUNT - 1)
+                std::snprintf(labels, sizeof(labels), "method=\"%s\",status=\"%d\"", METHODS[mi], STATUSES[si]);
+            else
+                std::snprintf(labels, sizeof(labels), "method=\"%s\",status=\"other\"", METHODS[mi]);
+            render_histogram(out, "httpserver_request_duration_seconds", labels, m);
+        }
+}
+
+} // namespace simple_http_server
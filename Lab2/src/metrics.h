@@ -0,0 +1,104 @@
+/// metrics.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace simple_http_server
+{
+
+/// Monotonic time in nanoseconds.
+inline unsigned long long now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Counter written by a single thread and read by any. Avoids the
+/// locked read-modify-write of fetch_add.
+class LocalCounter
+{
+public:
+    LocalCounter() : v_(0) {}
+    void add(unsigned long long n)
+    {
+        v_.store(v_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    unsigned long long get() const { return v_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<unsigned long long> v_;
+};
+
+/// Log-linear latency histogram in microseconds, HDR style: every power
+/// of two is split into 8 linear sub-buckets, giving ~12% precision from
+/// 1us to over an hour. Single writer.
+class Histogram
+{
+public:
+    static const int SUB_BUCKETS = 8;
+    static const int BUCKETS = SUB_BUCKETS + 29 * SUB_BUCKETS;
+
+    void record(unsigned long long us);
+
+    /// Add this histogram's counts into [counts] (size BUCKETS).
+    void merge_into(unsigned long long *counts, unsigned long long &sum) const;
+
+    static int bucket_of(unsigned long long us);
+    /// Smallest value falling into [bucket].
+    static unsigned long long lower_bound(int bucket);
+
+private:
+    LocalCounter counts_[BUCKETS];
+    LocalCounter sum_;
+};
+
+/// Process-wide request metrics.
+///
+/// Each thread records into its own shard without any lock; a scrape
+/// sums all shards. Latencies are kept per request phase and per
+/// (method, status) pair.
+class Metrics
+{
+public:
+    enum Phase
+    {
+        /// Accept to the first request line received (includes queueing).
+        ACCEPT_TO_FIRST_BYTE,
+        /// Request line received to headers and body parsed.
+        PARSE,
+        /// Handler time, excluding time blocked in socket sends.
+        HANDLER,
+        /// Time spent sending the response.
+        SEND,
+        PHASE_COUNT
+    };
+
+    static void record_phase(Phase phase, unsigned long long ns);
+    /// A complete request of [method] answered with [status] in [ns].
+    static void record_request(std::string const &method, int status, unsigned long long ns);
+
+    /// Status of the response being sent by this thread, noted by the
+    /// ResponseWriter sending it.
+    static void note_status(int status);
+    static int last_status();
+
+    static void connection_opened();
+    static void connection_closed();
+    static long active_connections() { return active_connections_; }
+
+    /// Append all request metrics in Prometheus text format to [out].
+    static void render(std::string &out);
+
+private:
+    static std::atomic<long> active_connections_;
+    static std::atomic<unsigned long long> connections_total_;
+};
+
+}   // namespace simple_http_server
+
+#endif
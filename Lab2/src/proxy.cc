@@ -0,0 +1,453 @@
+/// proxy.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include "metrics.h"
+#include "proxy.h"
+#include "reporter.h"
+#include "response_builder.h"
+
+namespace simple_http_server
+{
+
+/// Bytes relayed per recv/send round.
+static const size_t RELAY_CHUNK = 16 << 10;
+/// Give up on an upstream that stays silent that long.
+static const int UPSTREAM_TIMEOUT_MS = 30000;
+
+static bool iequals(std::string const &a, const char *b)
+{
+    return ::strcasecmp(a.c_str(), b) == 0;
+}
+
+/// Headers that only apply to a single connection and are never
+/// forwarded. Transfer-Encoding is handled separately.
+static bool hop_by_hop(StringRef name)
+{
+    static const char *names[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE",
+        "Trailer", "Upgrade", "Expect"
+    };
+
+    for (auto n : names)
+        if (name.equals_nocase(n))
+            return true;
+    return false;
+}
+
+static std::string trim(std::string const &s)
+{
+    size_t b = 0, e = s.length();
+    while (b < e && (s[b] == ' ' || s[b] == '\t'))
+        b++;
+    while (e > b && (s[e - 1] == ' ' || s[e - 1] == '\t' || s[e - 1] == '\r' || s[e - 1] == '\n'))
+        e--;
+    return s.substr(b, e - b);
+}
+
+static bool idempotent(std::string const &method)
+{
+    return method == "GET" || method == "HEAD" || method == "PUT" ||
+           method == "DELETE" || method == "OPTIONS";
+}
+
+Proxy::Proxy(std::string const &upstream, size_t pool_size, size_t pipeline_depth)
+    : port_(80), pipeline_depth_(pipeline_depth ? pipeline_depth : 1)
+{
+    std::string addr = upstream;
+    if (addr.compare(0, 7, "http://") == 0)
+        addr = addr.substr(7);
+    while (!addr.empty() && addr.back() == '/')
+        addr.pop_back();
+
+    std::string host = addr;
+    size_t colon = addr.rfind(':');
+    if (colon != std::string::npos)
+    {
+        host = addr.substr(0, colon);
+        port_ = std::atoi(addr.c_str() + colon + 1);
+    }
+
+    // Resolve once, TCPSocket only deals with dotted addresses.
+    struct addrinfo hints, *res;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (::getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0)
+    {
+        report(ERROR) << "cannot resolve upstream " << host << std::endl;
+        abort();
+    }
+
+    char buf[INET_ADDRSTRLEN];
+    auto sin = reinterpret_cast<struct sockaddr_in *>(res->ai_addr);
+    ip_ = ::inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf));
+    ::freeaddrinfo(res);
+
+    for (size_t i = 0; i < (pool_size ? pool_size : 1); i++)
+        pool_.emplace_back(new Upstream());
+
+    report(INFO) << "proxying to " << ip_ << ":" << port_ << " with " << pool_.size()
+                 << " connections, pipeline depth " << pipeline_depth_ << std::endl;
+}
+
+Proxy::Upstream &Proxy::acquire()
+{
+    std::unique_lock<std::mutex> lock(m_);
+
+    for (;;)
+    {
+        Upstream *best = nullptr;
+        for (auto &up : pool_)
+        {
+            if (up->broken)
+            {
+                // Wait for every user of the old stream to leave.
+                if (up->in_flight > 0)
+                    continue;
+                up->broken = false;
+                up->reset = true;
+                up->next_ticket = up->serving = 0;
+            }
+
+            if (up->in_flight >= pipeline_depth_)
+                continue;
+            if (!best || up->in_flight < best->in_flight)
+                best = up.get();
+        }
+
+        if (best)
+        {
+            best->in_flight++;
+            return *best;
+        }
+        cond_.wait(lock);
+    }
+}
+
+void Proxy::release(Upstream &up, bool broken)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    if (broken)
+        up.broken = true;
+    up.in_flight--;
+    cond_.notify_all();
+}
+
+bool Proxy::send_request(Upstream &up, Request const &req, unsigned long long &ticket)
+{
+    std::string head;
+    head.reserve(512);
+    head.append(req.method).append(" ").append(req.resource).append(" HTTP/1.1").append(LINE_END);
+    Headers const &headers = req.headers;
+    for (size_t i = 0; i < headers.size(); i++)
+    {
+        Headers::Field const &f = headers[i];
+        if (f.known == Headers::CONTENT_LENGTH || f.known == Headers::TRANSFER_ENCODING ||
+            hop_by_hop(f.name))
+            continue;
+        head.append(f.name.data, f.name.length).append(": ", 2)
+            .append(f.value.data, f.value.length).append(LINE_END);
+    }
+    if (!req.body.empty())
+        head.append("Content-Length: ").append(std::to_string(req.body.size())).append(LINE_END);
+    head.append(LINE_END);
+
+    std::lock_guard<std::mutex> send_lock(up.send_m);
+
+    bool reset, alone;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        reset = up.reset;
+        up.reset = false;
+        alone = up.in_flight == 1;
+    }
+
+    // The upstream may have closed an idle connection, reopen it as
+    // long as nobody else is waiting on it.
+    if (!reset && up.sock && up.sock->peer_closed())
+    {
+        if (!alone)
+            return false;
+        reset = true;
+    }
+
+    if (reset || !up.sock)
+    {
+        up.sock.reset(new TCPSocket());
+        if (!up.sock->connect(ip_, port_))
+        {
+            up.sock.reset();
+            return false;
+        }
+        up.sock->set_recv_timeout(UPSTREAM_TIMEOUT_MS);
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char *>(head.data());
+    iov[0].iov_len = head.length();
+    iov[1].iov_base = const_cast<char *>(req.body.data());
+    iov[1].iov_len = req.body.size();
+    if (up.sock->sendv(iov, 2) < 0)
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_);
+    ticket = up.next_ticket++;
+    return true;
+}
+
+std::string UpstreamHead::serialize() const
+{
+    std::string head = status_line;
+    for (auto &KV : headers)
+        head.append(KV.first).append(": ").append(KV.second).append(LINE_END);
+    return head;
+}
+
+ClientSink::ClientSink(ResponseWriter &out, bool keep_alive)
+    : out_(out), keep_alive_(keep_alive)
+{
+}
+
+bool ClientSink::on_head(UpstreamHead const &head)
+{
+    if (head.has_body && head.length < 0 && !out_.framed())
+        keep_alive_ = false;
+
+    std::string str = head.serialize();
+    if (!keep_alive_)
+        str.append("Connection: close").append(LINE_END);
+    str.append(LINE_END);
+
+    if (!head.has_body)
+        return out_.send(str, nullptr, 0);
+    return out_.start(str, head.length);
+}
+
+bool ClientSink::on_body(const char *data, size_t len)
+{
+    return out_.write(data, len);
+}
+
+bool ClientSink::on_end()
+{
+    return out_.finish();
+}
+
+/// Copy [n] bytes from [from] to [to]. [n] < 0 copies until EOF.
+static bool relay_bytes(TCPSocket &from, ResponseSink &to, long long n)
+{
+    char buf[RELAY_CHUNK];
+
+    while (n != 0)
+    {
+        size_t want = (n < 0 || n > static_cast<long long>(sizeof(buf))) ? sizeof(buf) : n;
+        int got = from.recv(buf, want);
+        if (got == 0 && n < 0)
+            return true;
+        if (got <= 0 || !to.on_body(buf, got))
+            return false;
+        if (n > 0)
+            n -= got;
+    }
+    return true;
+}
+
+/// Relay the data of a chunked body, chunk by chunk. Trailers are
+/// dropped.
+static bool relay_chunked(TCPSocket &from, ResponseSink &to)
+{
+    for (;;)
+    {
+        std::string size_line = from.recv_line();
+        if (size_line.empty())
+            return false;
+
+        long long size = std::strtoll(size_line.c_str(), nullptr, 16);
+        if (size < 0)
+            return false;
+        if (size == 0)
+            break;
+
+        // Chunk data and its CRLF.
+        if (!relay_bytes(from, to, size))
+            return false;
+        std::string crlf = from.recv_line();
+        if (crlf != LINE_END && crlf != "\n")
+            return false;
+    }
+
+    // Trailers up to the empty line.
+    for (;;)
+    {
+        std::string line = from.recv_line();
+        if (line.empty())
+            return false;
+        if (line == LINE_END || line == "\n")
+            return true;
+    }
+}
+
+bool Proxy::relay_response(Upstream &up, Request const &req, ResponseSink &sink,
+                           bool &started, bool &upstream_keep)
+{
+    TCPSocket &from = *up.sock;
+    UpstreamHead head;
+
+    head.status_line = from.recv_line();
+    if (head.status_line.empty() || head.status_line.back() != '\n')
+        return false;
+
+    size_t sp = head.status_line.find(' ');
+    if (sp == std::string::npos)
+        return false;
+    head.code = std::atoi(head.status_line.c_str() + sp + 1);
+    if (head.status_line.compare(0, 8, "HTTP/1.0") == 0)
+        upstream_keep = false;
+
+    bool chunked = false, has_length = false;
+    long long length = 0;
+
+    for (;;)
+    {
+        std::string line = from.recv_line();
+        if (line.empty())
+            return false;
+        if (line == LINE_END || line == "\n")
+            break;
+
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string name = trim(line.substr(0, colon));
+        std::string value = trim(line.substr(colon + 1));
+
+        if (iequals(name, "Connection"))
+        {
+            if (value.find("close") != std::string::npos)
+                upstream_keep = false;
+            continue;
+        }
+        if (hop_by_hop(name))
+            continue;
+
+        if (iequals(name, "Content-Length"))
+        {
+            has_length = true;
+            length = std::strtoll(value.c_str(), nullptr, 10);
+            if (length < 0)
+                return false;
+        }
+        else if (iequals(name, "Transfer-Encoding"))
+        {
+            // Framing, redone by the sink.
+            if (value.find("chunked") != std::string::npos)
+            {
+                chunked = true;
+                continue;
+            }
+        }
+
+        head.headers.emplace_back(std::move(name), std::move(value));
+    }
+
+    int code = head.code;
+    head.has_body = !(req.method == "HEAD" || code / 100 == 1 || code == 204 || code == 304);
+    head.close_delimited = head.has_body && !chunked && !has_length;
+    head.chunked = head.has_body && chunked;
+    head.length = head.has_body && !chunked && has_length ? length : -1;
+    if (head.close_delimited)
+        upstream_keep = false;
+
+    started = true;
+    if (!sink.on_head(head))
+        return false;
+
+    if (!head.has_body)
+        return sink.on_end();
+    bool ok = chunked ? relay_chunked(from, sink) : relay_bytes(from, sink, has_length ? length : -1);
+    return ok && sink.on_end();
+}
+
+bool Proxy::fetch(Request const &req, ResponseSink &sink, bool &started)
+{
+    started = false;
+
+    // Retry once on a fresh connection when nothing reached the sink.
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        Upstream &up = acquire();
+
+        unsigned long long ticket;
+        if (!send_request(up, req, ticket))
+        {
+            // Nothing was processed upstream, safe to retry any method.
+            release(up, true);
+            continue;
+        }
+
+        bool my_turn;
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            cond_.wait(lock, [&] { return up.broken || up.serving == ticket; });
+            my_turn = !up.broken;
+        }
+
+        bool upstream_keep = true;
+        bool ok = my_turn && relay_response(up, req, sink, started, upstream_keep);
+
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            if (my_turn)
+                up.serving++;
+        }
+        release(up, !ok || !upstream_keep);
+
+        if (ok)
+            return true;
+        if (started)
+        {
+            report(ERROR) << "upstream response interrupted for " << req.resource << std::endl;
+            return false;
+        }
+        if (!idempotent(req.method))
+            break;
+    }
+
+    return false;
+}
+
+bool Proxy::forward(Request const &req, ResponseWriter &out)
+{
+    ClientSink sink(out, req.keep_alive);
+    bool started;
+
+    if (fetch(req, sink, started))
+        return sink.keep_alive();
+
+    if (!started)
+        bad_gateway(out);
+    return false;
+}
+
+void Proxy::bad_gateway(ResponseWriter &out)
+{
+    static const std::string body =
+        "<html><title>502 Bad Gateway</title><body>\r\n"
+        "<p>Upstream server unavailable</p>\r\n"
+        "</body></html>\r\n";
+
+    report(ERROR) << "bad gateway " << ip_ << ":" << port_ << std::endl;
+    ResponseBuilder::local().start(Response::BAD_GATEWAY, "Bad Gateway")
+                            .header("Content-type", "text/html")
+                            .header("Content-length", body.length())
+                            .header("Connection", "close")
+                            .send(out, body.data(), body.length());
+}
+
+} // namespace simple_http_server
@@ -0,0 +1,148 @@
+/// proxy.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "body_stream.h"
+#include "message.h"
+#include "response_writer.h"
+#include "tcp_socket.h"
+
+namespace simple_http_server
+{
+
+/// Status line and end-to-end headers of an upstream response.
+struct UpstreamHead
+{
+    /// Ends with CRLF.
+    std::string status_line;
+    int code;
+    /// Without Transfer-Encoding, see [chunked].
+    std::vector<std::pair<std::string, std::string>> headers;
+    /// False for HEAD requests, 1xx, 204 and 304.
+    bool has_body;
+    /// The body ends when the upstream closes.
+    bool close_delimited;
+    /// The body came in chunks, its length is not known up front.
+    bool chunked;
+    /// Of the body, -1 if not known up front.
+    long long length;
+
+    /// Status line and headers, without the terminating empty line.
+    std::string serialize() const;
+};
+
+/// Consumer of an upstream response.
+class ResponseSink
+{
+public:
+    virtual ~ResponseSink() = default;
+    virtual bool on_head(UpstreamHead const &head) = 0;
+    /// Body bytes, chunks decoded.
+    virtual bool on_body(const char *data, size_t len) = 0;
+    /// The whole body was passed on.
+    virtual bool on_end() { return true; }
+};
+
+/// Streams a response to a client. Bodies of unknown length are framed
+/// again by [out], or sent up to the close if it cannot.
+class ClientSink : public ResponseSink
+{
+public:
+    ClientSink(ResponseWriter &out, bool keep_alive);
+    virtual bool on_head(UpstreamHead const &head) override;
+    virtual bool on_body(const char *data, size_t len) override;
+    virtual bool on_end() override;
+
+    /// Whether the client connection can be kept after the response.
+    bool keep_alive() const { return keep_alive_; }
+
+private:
+    ResponseWriter &out_;
+    bool keep_alive_;
+};
+
+/// Reverse proxy forwarding requests to a single upstream server.
+///
+/// Upstream connections are persistent and shared by all workers. A
+/// connection carries up to [pipeline_depth] outstanding requests: a
+/// worker writes its request, takes a ticket and waits for the responses
+/// queued before it to be relayed before it reads its own. Response
+/// bodies are relayed in fixed-size pieces and never buffered whole.
+class Proxy
+{
+public:
+    /// [upstream] is "host:port", optionally prefixed with "http://".
+    Proxy(std::string const &upstream, size_t pool_size = 8, size_t pipeline_depth = 4);
+
+    Proxy(const Proxy&) = delete;
+    void operator=(const Proxy&) = delete;
+
+    /// Forward [req] and relay the upstream response to [out].
+    /// Return whether the client connection can be kept alive.
+    bool forward(Request const &req, ResponseWriter &out);
+
+    /// Forward [req] and pass the upstream response to [sink]. [started]
+    /// tells whether [sink] got anything, i.e. whether the failure can
+    /// still be reported to the client.
+    bool fetch(Request const &req, ResponseSink &sink, bool &started);
+
+    /// Reply 502 to the client.
+    void bad_gateway(ResponseWriter &out);
+
+    std::string const &upstream_ip() const { return ip_; }
+    uint16_t upstream_port() const { return port_; }
+
+private:
+    /// One persistent upstream connection.
+    struct Upstream
+    {
+        std::unique_ptr<TCPSocket> sock;
+        /// Serializes writes and ticket assignment.
+        std::mutex send_m;
+
+        /* Guarded by [Proxy::m_]. */
+        /// [sock] must be (re)connected before the next write.
+        bool reset = true;
+        /// Ticket of the next request written.
+        unsigned long long next_ticket = 0;
+        /// Ticket whose response is read next.
+        unsigned long long serving = 0;
+        /// Requests written or about to be written, not yet relayed.
+        size_t in_flight = 0;
+        /// Stream out of sync or closed. Reset once [in_flight] is 0.
+        bool broken = false;
+    };
+
+    /// Pick the least loaded usable connection, waiting if every one is
+    /// at [pipeline_depth]. Accounts the caller in [in_flight].
+    Upstream &acquire();
+    /// Give back a connection taken with [acquire].
+    void release(Upstream &up, bool broken);
+
+    /// Send [req] on [up] and return its ticket, or false on error.
+    bool send_request(Upstream &up, Request const &req, unsigned long long &ticket);
+
+    /// Relay one response from [up] to [sink]. [upstream_keep] is
+    /// cleared when [up] cannot carry further responses.
+    bool relay_response(Upstream &up, Request const &req, ResponseSink &sink,
+                        bool &started, bool &upstream_keep);
+
+    std::string ip_;
+    uint16_t port_;
+    size_t pipeline_depth_;
+
+    std::vector<std::unique_ptr<Upstream>> pool_;
+    std::mutex m_;
+    std::condition_variable cond_;
+};
+
+}   // namespace simple_http_server
+
+#endif
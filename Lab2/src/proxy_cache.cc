@@ -0,0 +1,555 @@
+/// proxy_cache.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "proxy_cache.h"
+#include "reporter.h"
+
+namespace simple_http_server
+{
+
+typedef std::vector<std::pair<std::string, std::string>> header_list;
+
+/// Prefix of the files owned by the disk tier.
+static const char *DISK_PREFIX = "pc-";
+/// Resources whose Vary is remembered at most.
+static const size_t MAX_VARIED = 1 << 16;
+
+static std::string const *find_header(header_list const &headers, const char *name)
+{
+    for (auto &KV : headers)
+        if (::strcasecmp(KV.first.c_str(), name) == 0)
+            return &KV.second;
+    return nullptr;
+}
+
+/// Tee of the upstream response: streams it to the client and keeps a
+/// copy when it may be stored.
+class ProxyCache::CacheSink : public ResponseSink
+{
+public:
+    CacheSink(ProxyCache &cache, ResponseWriter &out, bool keep_alive, bool revalidating)
+        : cache_(cache), client_(out, keep_alive), revalidating_(revalidating),
+          not_modified_(false), storable_(false), chunked_(false)
+    {
+    }
+
+    virtual bool on_head(UpstreamHead const &head) override
+    {
+        std::time_t now = std::time(nullptr);
+
+        // The stale copy is still good, the caller answers from it.
+        if (revalidating_ && head.code == 304)
+        {
+            not_modified_ = true;
+            ttl_ = std::max(cache_.lifetime(head.headers, now), 0L);
+            return true;
+        }
+
+        long ttl = -1;
+        if (head.code == 200 && head.has_body && !head.close_delimited)
+            ttl = cache_.lifetime(head.headers, now);
+
+        storable_ = ttl >= 0;
+        chunked_ = head.chunked;
+        if (storable_)
+        {
+            entry_.reset(new Entry());
+            entry_->head = head.serialize();
+            entry_->stored = now;
+            entry_->expires = now + ttl;
+            if (auto etag = find_header(head.headers, "ETag"))
+                entry_->etag = *etag;
+            if (auto lm = find_header(head.headers, "Last-Modified"))
+                entry_->last_modified = *lm;
+            entry_->vary = vary(head.headers);
+        }
+        return client_.on_head(head);
+    }
+
+    /// Lowercase names listed by the Vary of [headers], "*" included.
+    static std::vector<std::string> vary(header_list const &headers)
+    {
+        std::vector<std::string> names;
+        for (auto &KV : headers)
+        {
+            if (::strcasecmp(KV.first.c_str(), "Vary") != 0)
+                continue;
+            size_t pos = 0;
+            while (pos < KV.second.length())
+            {
+                size_t end = std::min(KV.second.find(',', pos), KV.second.length());
+                std::string name = KV.second.substr(pos, end - pos);
+                name.erase(0, name.find_first_not_of(" \t"));
+                name.erase(name.find_last_not_of(" \t") + 1);
+                std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                if (!name.empty())
+                    names.push_back(name);
+                pos = end + 1;
+            }
+        }
+        return names;
+    }
+
+    virtual bool on_body(const char *data, size_t len) override
+    {
+        if (storable_)
+        {
+            if (body_.size() + len + entry_->head.size() > cache_.max_entry_size_)
+            {
+                // Too large, only relay it.
+                storable_ = false;
+                std::string().swap(body_);
+            }
+            else
+                body_.append(data, len);
+        }
+        return client_.on_body(data, len);
+    }
+
+    virtual bool on_end() override
+    {
+        return client_.on_end();
+    }
+
+    bool not_modified() const { return not_modified_; }
+    long ttl() const { return ttl_; }
+    bool keep_alive() const { return client_.keep_alive(); }
+
+    /// The stored copy of a completely relayed response, if any.
+    entry_ptr entry()
+    {
+        if (!storable_)
+            return nullptr;
+
+        // Stored whole, the length is known now.
+        if (chunked_)
+            entry_->head.append("Content-Length: ").append(std::to_string(body_.size())).append(LINE_END);
+
+        std::shared_ptr<std::string> body(new std::string());
+        body->swap(body_);
+        entry_->body.data = body->data();
+        entry_->body.size = body->size();
+        entry_->body.owner = body;
+        return entry_;
+    }
+
+private:
+    ProxyCache &cache_;
+    ClientSink client_;
+    bool revalidating_;
+    bool not_modified_;
+    bool storable_;
+    bool chunked_;
+    long ttl_ = 0;
+    entry_ptr entry_;
+    std::string body_;
+};
+
+ProxyCache::ProxyCache(Proxy &proxy, size_t memory_capacity, size_t max_entry_size,
+                       std::string const &disk_dir, size_t disk_capacity,
+                       long default_ttl)
+    : proxy_(proxy), max_entry_size_(max_entry_size), disk_dir_(disk_dir),
+      default_ttl_(default_ttl), hits_(0), misses_(0), revalidations_(0),
+      collapsed_(0), bytes_saved_(0)
+{
+    memory_.capacity = memory_capacity;
+    disk_.capacity = disk_dir.empty() ? 0 : disk_capacity;
+
+    if (disk_.capacity == 0)
+        return;
+
+    // Files of a previous run are not indexed, remove them.
+    ::mkdir(disk_dir_.c_str(), 0700);
+    DIR *dir = ::opendir(disk_dir_.c_str());
+    if (!dir)
+    {
+        report(ERROR) << "cannot open cache dir " << disk_dir_ << ", disk tier disabled" << std::endl;
+        disk_.capacity = 0;
+        return;
+    }
+    while (struct dirent *ent = ::readdir(dir))
+        if (std::strncmp(ent->d_name, DISK_PREFIX, std::strlen(DISK_PREFIX)) == 0)
+            ::unlink((disk_dir_ + "/" + ent->d_name).c_str());
+    ::closedir(dir);
+}
+
+double ProxyCache::hit_ratio() const
+{
+    unsigned long long total = hits_ + misses_;
+    return total ? static_cast<double>(hits_) / total : 0.0;
+}
+
+size_t ProxyCache::memory_bytes() const
+{
+    std::lock_guard<std::mutex> lock(m_);
+    return memory_.bytes;
+}
+
+size_t ProxyCache::disk_bytes() const
+{
+    std::lock_guard<std::mutex> lock(m_);
+    return disk_.bytes;
+}
+
+bool ProxyCache::cacheable_request(Request const &req)
+{
+    if (req.method != "GET")
+        return false;
+
+    // Requests that need the upstream's own answer.
+    Headers const &h = req.headers;
+    return !h.get("Authorization") && !h.get(Headers::RANGE) &&
+           !h.get(Headers::IF_NONE_MATCH) && !h.get(Headers::IF_MODIFIED_SINCE) &&
+           !h.contains_token("Cache-Control", "no-store") &&
+           !h.contains_token("Cache-Control", "no-cache");
+}
+
+long ProxyCache::lifetime(header_list const &headers, std::time_t now) const
+{
+    bool validators = find_header(headers, "ETag") || find_header(headers, "Last-Modified");
+    bool is_public = false;
+    long max_age = -1, s_maxage = -1;
+
+    // Varies on more than request headers.
+    std::vector<std::string> vary = CacheSink::vary(headers);
+    if (std::find(vary.begin(), vary.end(), "*") != vary.end())
+        return -1;
+
+    if (auto cc = find_header(headers, "Cache-Control"))
+    {
+        size_t pos = 0;
+        while (pos < cc->length())
+        {
+            size_t end = cc->find(',', pos);
+            if (end == std::string::npos)
+                end = cc->length();
+            std::string token = cc->substr(pos, end - pos);
+            token.erase(0, token.find_first_not_of(" \t"));
+            pos = end + 1;
+
+            if (::strcasecmp(token.c_str(), "no-store") == 0 ||
+                ::strcasecmp(token.c_str(), "private") == 0)
+                return -1;
+            if (::strcasecmp(token.c_str(), "no-cache") == 0)
+                return validators ? 0 : -1;
+            if (::strcasecmp(token.c_str(), "public") == 0)
+                is_public = true;
+            else if (::strncasecmp(token.c_str(), "max-age=", 8) == 0)
+                max_age = std::atol(token.c_str() + 8);
+            else if (::strncasecmp(token.c_str(), "s-maxage=", 9) == 0)
+                s_maxage = std::atol(token.c_str() + 9);
+        }
+    }
+
+    // A cookie set for one client must not be replayed to the others,
+    // unless the upstream says the response is the same for everyone.
+    if (!is_public && find_header(headers, "Set-Cookie"))
+        return -1;
+
+    if (s_maxage >= 0)
+        return s_maxage;
+    if (max_age >= 0)
+        return max_age;
+
+    std::time_t date = now, t;
+    if (auto d = find_header(headers, "Date"))
+        if (parse_http_date(*d, t))
+            date = t;
+
+    if (auto expires = find_header(headers, "Expires"))
+    {
+        // An invalid date means already expired.
+        if (!parse_http_date(*expires, t))
+            return validators ? 0 : -1;
+        return std::max(0L, static_cast<long>(t - date));
+    }
+
+    if (default_ttl_ > 0)
+        return default_ttl_;
+
+    // Heuristic freshness, RFC 7234 4.2.2.
+    if (auto lm = find_header(headers, "Last-Modified"))
+        if (parse_http_date(*lm, t) && t < date)
+            return std::min(static_cast<long>(date - t) / 10, 86400L);
+
+    return validators ? 0 : -1;
+}
+
+std::string ProxyCache::variant_key(std::string const &resource, std::vector<std::string> const &vary,
+                                    Request const &req)
+{
+    std::string key = resource;
+    for (auto &name : vary)
+    {
+        StringRef const *value = req.headers.get(StringRef(name));
+        key.append("\n").append(name).append(": ");
+        if (value)
+            key.append(value->data, value->length);
+    }
+    return key;
+}
+
+ProxyCache::entry_ptr ProxyCache::lookup(std::string const &key)
+{
+    for (Tier *tier : { &memory_, &disk_ })
+    {
+        auto it = tier->index.find(key);
+        if (it != tier->index.end())
+        {
+            tier->lru.splice(tier->lru.begin(), tier->lru, it->second);
+            return *it->second;
+        }
+    }
+    return nullptr;
+}
+
+void ProxyCache::erase(Tier &tier, std::string const &key)
+{
+    auto it = tier.index.find(key);
+    if (it == tier.index.end())
+        return;
+
+    entry_ptr e = *it->second;
+    tier.bytes -= e->size();
+    tier.lru.erase(it->second);
+    tier.index.erase(it);
+
+    // Mappings in use stay valid after the unlink.
+    if (&tier == &disk_)
+        ::unlink(e->path.c_str());
+}
+
+std::vector<ProxyCache::entry_ptr> ProxyCache::insert(Tier &tier, entry_ptr e)
+{
+    std::vector<entry_ptr> evicted;
+
+    erase(tier, e->key);
+    if (e->size() > tier.capacity)
+    {
+        evicted.push_back(e);
+        return evicted;
+    }
+
+    tier.bytes += e->size();
+    tier.lru.push_front(e);
+    tier.index[e->key] = tier.lru.begin();
+
+    while (tier.bytes > tier.capacity)
+    {
+        entry_ptr victim = tier.lru.back();
+        tier.bytes -= victim->size();
+        tier.index.erase(victim->key);
+        tier.lru.pop_back();
+        evicted.push_back(victim);
+    }
+    return evicted;
+}
+
+void ProxyCache::store(entry_ptr e)
+{
+    std::vector<entry_ptr> victims;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        erase(disk_, e->key);
+        e->path.clear();
+        victims = insert(memory_, e);
+    }
+
+    if (disk_.capacity == 0)
+        return;
+
+    // Demote what memory evicted, writing files without the lock.
+    for (auto &victim : victims)
+    {
+        entry_ptr on_disk = write_to_disk(*victim);
+        if (!on_disk)
+            continue;
+
+        std::lock_guard<std::mutex> lock(m_);
+        if (memory_.index.count(on_disk->key))
+        {
+            // Stored again meanwhile.
+            ::unlink(on_disk->path.c_str());
+            continue;
+        }
+        for (auto &dropped : insert(disk_, on_disk))
+            ::unlink(dropped->path.c_str());
+    }
+}
+
+ProxyCache::entry_ptr ProxyCache::write_to_disk(Entry const &e)
+{
+    static std::atomic<unsigned long long> file_id(0);
+
+    if (e.body.size == 0 || e.size() > disk_.capacity)
+        return nullptr;
+
+    std::string path = disk_dir_ + "/" + DISK_PREFIX + std::to_string(file_id++);
+    int fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (fd < 0)
+        return nullptr;
+
+    size_t written = 0;
+    while (written < e.body.size)
+    {
+        ssize_t n = ::write(fd, e.body.data + written, e.body.size - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        written += n;
+    }
+
+    void *addr = MAP_FAILED;
+    if (written == e.body.size)
+        addr = ::mmap(nullptr, e.body.size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (addr == MAP_FAILED)
+    {
+        ::unlink(path.c_str());
+        return nullptr;
+    }
+
+    entry_ptr d(new Entry(e));
+    size_t size = e.body.size;
+    d->path = path;
+    d->body.data = static_cast<const char *>(addr);
+    d->body.owner = std::shared_ptr<void>(addr, [size](void *p) { ::munmap(p, size); });
+    return d;
+}
+
+bool ProxyCache::send_entry(Entry const &e, ResponseWriter &out, bool keep_alive)
+{
+    std::string head = e.head;
+    long age = std::max(0L, static_cast<long>(std::time(nullptr) - e.stored));
+    head.append("Age: ").append(std::to_string(age)).append(LINE_END);
+    if (!keep_alive)
+        head.append("Connection: close").append(LINE_END);
+    head.append(LINE_END);
+
+    return out.send(head, e.body.data, e.body.size) && keep_alive;
+}
+
+bool ProxyCache::serve(Request const &req, ResponseWriter &out)
+{
+    if (!cacheable_request(req))
+        return proxy_.forward(req, out);
+
+    StringRef const *host = req.headers.get(Headers::HOST);
+    std::string resource = (host ? host->str() : "") + req.resource;
+    std::time_t now = std::time(nullptr);
+
+    std::unique_lock<std::mutex> lock(m_);
+    auto varied = vary_.find(resource);
+    std::string key = varied == vary_.end() ? resource : variant_key(resource, varied->second, req);
+    entry_ptr cached = lookup(key);
+    if (cached && cached->expires > now)
+    {
+        lock.unlock();
+        hits_++;
+        bytes_saved_ += cached->size();
+        return send_entry(*cached, out, req.keep_alive);
+    }
+
+    // Someone is already fetching it, wait for the result.
+    auto it = flights_.find(key);
+    if (it != flights_.end())
+    {
+        std::shared_ptr<Flight> flight = it->second;
+        cond_.wait(lock, [&] { return flight->done; });
+        entry_ptr result = flight->result;
+        lock.unlock();
+
+        // Only if the response turned out to vary on none of the headers
+        // this request differs in.
+        if (result && variant_key(resource, result->vary, req) == result->key)
+        {
+            collapsed_++;
+            hits_++;
+            bytes_saved_ += result->size();
+            return send_entry(*result, out, req.keep_alive);
+        }
+        misses_++;
+        return proxy_.forward(req, out);
+    }
+
+    std::shared_ptr<Flight> flight(new Flight());
+    flights_[key] = flight;
+    lock.unlock();
+
+    // A stale entry with validators is revalidated instead of refetched.
+    bool revalidate = cached && (!cached->etag.empty() || !cached->last_modified.empty());
+    Request upstream_req;
+    upstream_req.method = req.method;
+    upstream_req.resource = req.resource;
+    upstream_req.keep_alive = req.keep_alive;
+    upstream_req.headers = req.headers;
+    if (revalidate && !cached->etag.empty())
+        upstream_req.headers.set("If-None-Match", cached->etag);
+    if (revalidate && !cached->last_modified.empty())
+        upstream_req.headers.set("If-Modified-Since", cached->last_modified);
+
+    CacheSink sink(*this, out, req.keep_alive, revalidate);
+    bool started;
+    bool ok = proxy_.fetch(upstream_req, sink, started);
+    bool keep_alive = false;
+    entry_ptr result;
+
+    if (ok && sink.not_modified())
+    {
+        result.reset(new Entry(*cached));
+        result->stored = now;
+        result->expires = now + sink.ttl();
+        revalidations_++;
+        hits_++;
+        bytes_saved_ += cached->body.size;
+        keep_alive = send_entry(*result, out, req.keep_alive);
+    }
+    else
+    {
+        misses_++;
+        if (ok)
+        {
+            result = sink.entry();
+            keep_alive = sink.keep_alive();
+        }
+        else if (!started)
+            proxy_.bad_gateway(out);
+    }
+
+    if (result)
+    {
+        result->key = variant_key(resource, result->vary, req);
+        store(result);
+    }
+
+    lock.lock();
+    if (result && result->vary.empty())
+        vary_.erase(resource);
+    else if (result)
+    {
+        if (vary_.size() >= MAX_VARIED)
+            vary_.clear();
+        vary_[resource] = result->vary;
+    }
+    flight->done = true;
+    flight->result = result;
+    flights_.erase(key);
+    cond_.notify_all();
+
+    return ok && keep_alive;
+}
+
+} // namespace simple_http_server
@@ -0,0 +1,152 @@
+/// proxy_cache.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef PROXY_CACHE_H
+#define PROXY_CACHE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "message.h"
+#include "proxy.h"
+#include "tcp_socket.h"
+
+namespace simple_http_server
+{
+
+/// HTTP cache in front of the proxy upstream.
+///
+/// Only GET responses with status 200 are stored, one variant per value
+/// of the request headers their Vary lists. Freshness follows
+/// Cache-Control (no-store, private, no-cache, max-age, s-maxage), then
+/// Expires, then [default_ttl], then 10% of the Last-Modified age. Stale
+/// entries with an ETag or Last-Modified are revalidated with a
+/// conditional request. Entries live in a memory tier; when a disk
+/// directory is given, entries evicted from memory move to files that
+/// are served through mmap(2). Concurrent misses on the same key wait
+/// for a single upstream fetch.
+class ProxyCache
+{
+public:
+    ProxyCache(Proxy &proxy, size_t memory_capacity, size_t max_entry_size,
+               std::string const &disk_dir = "", size_t disk_capacity = 0,
+               long default_ttl = 0);
+
+    ProxyCache(const ProxyCache&) = delete;
+    void operator=(const ProxyCache&) = delete;
+
+    /// Answer [req] to [out] from the cache or through the proxy. Return
+    /// whether the client connection can be kept alive.
+    bool serve(Request const &req, ResponseWriter &out);
+
+    /// Statistics.
+    unsigned long long hits() const { return hits_; }
+    unsigned long long misses() const { return misses_; }
+    unsigned long long revalidations() const { return revalidations_; }
+    unsigned long long collapsed() const { return collapsed_; }
+    /// Bytes answered without being transferred from the upstream.
+    unsigned long long bytes_saved() const { return bytes_saved_; }
+    double hit_ratio() const;
+    size_t memory_bytes() const;
+    size_t disk_bytes() const;
+
+private:
+    /// Body bytes owned by the heap or by a file mapping.
+    struct Body
+    {
+        const char *data = nullptr;
+        size_t size = 0;
+        std::shared_ptr<void> owner;
+    };
+
+    struct Entry
+    {
+        std::string key;
+        /// Status line and end-to-end headers.
+        std::string head;
+        Body body;
+        std::time_t stored = 0;
+        std::time_t expires = 0;
+        std::string etag;
+        std::string last_modified;
+        /// File backing [body] in the disk tier.
+        std::string path;
+        /// Lowercase names of the request headers listed by Vary.
+        std::vector<std::string> vary;
+
+        size_t size() const { return head.size() + body.size; }
+    };
+    typedef std::shared_ptr<Entry> entry_ptr;
+
+    /// A fetch in progress that identical misses wait for.
+    struct Flight
+    {
+        bool done = false;
+        entry_ptr result;
+    };
+
+    struct Tier
+    {
+        std::list<entry_ptr> lru;
+        std::unordered_map<std::string, std::list<entry_ptr>::iterator> index;
+        size_t bytes = 0;
+        size_t capacity = 0;
+    };
+
+    class CacheSink;
+
+    static bool cacheable_request(Request const &req);
+    /// Freshness lifetime in seconds of a response with [headers], or -1
+    /// if it must not be stored: no-store, private, Vary: *, or
+    /// Set-Cookie without public.
+    long lifetime(std::vector<std::pair<std::string, std::string>> const &headers,
+                  std::time_t now) const;
+
+    /// Key of the variant of [resource] for [req], made of the values
+    /// of its headers named in [vary].
+    static std::string variant_key(std::string const &resource, std::vector<std::string> const &vary,
+                                   Request const &req);
+
+    /// Find [key] in either tier and mark it recently used. Needs [m_].
+    entry_ptr lookup(std::string const &key);
+    /// Insert [e] into [tier], returning what it evicts. Needs [m_].
+    std::vector<entry_ptr> insert(Tier &tier, entry_ptr e);
+    void erase(Tier &tier, std::string const &key);
+    /// Add [e] to the memory tier and push evicted entries to disk.
+    void store(entry_ptr e);
+    /// Copy [e] into a mapped file of the disk tier.
+    entry_ptr write_to_disk(Entry const &e);
+
+    bool send_entry(Entry const &e, ResponseWriter &out, bool keep_alive);
+
+    Proxy &proxy_;
+    size_t max_entry_size_;
+    std::string disk_dir_;
+    long default_ttl_;
+
+    mutable std::mutex m_;
+    std::condition_variable cond_;
+    Tier memory_;
+    Tier disk_;
+    std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;
+    /// Vary of the last response stored for each resource key, whose
+    /// variants are keyed by [variant_key]. Forgotten all at once past
+    /// MAX_VARIED, relearned from the next misses.
+    std::unordered_map<std::string, std::vector<std::string>> vary_;
+
+    std::atomic<unsigned long long> hits_;
+    std::atomic<unsigned long long> misses_;
+    std::atomic<unsigned long long> revalidations_;
+    std::atomic<unsigned long long> collapsed_;
+    std::atomic<unsigned long long> bytes_saved_;
+};
+
+}   // namespace simple_http_server
+
+#endif
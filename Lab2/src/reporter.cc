@@ -4,45 +4,335 @@
 #include <ctime>
 #include <chrono>
 #include <cassert>
+#include <cstring>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+#include <vector>
 #include "reporter.h"
 
 namespace simple_http_server
 {
 
+namespace
+{
+
+/// Bytes of text per record. Longer records are truncated.
+const size_t RECORD_SIZE = 512;
+/// Records per thread ring.
+const size_t RING_SLOTS = 256;
+/// How often the flusher drains the rings.
+const std::chrono::milliseconds FLUSH_INTERVAL(20);
+
+struct Record
+{
+    int severity;
+    std::time_t time;
+    size_t len;
+    char text[RECORD_SIZE];
+};
+
+/// Single-producer (owning thread) single-consumer (flusher) ring.
+struct Ring
+{
+    Record slots[RING_SLOTS];
+    /// Next slot to fill, written by the producer only.
+    std::atomic<size_t> head;
+    /// Next slot to drain, written by the consumer only.
+    std::atomic<size_t> tail;
+    /// Set when the owning thread exits.
+    std::atomic<bool> orphan;
+
+    Ring() : head(0), tail(0), orphan(false) {}
+};
+
+/// Stream buffer over a fixed char array. Overflow fails, which puts the
+/// stream into bad state and silently truncates the record.
+class RecordBuf : public std::streambuf
+{
+public:
+    void reset(char *p, size_t n) { setp(p, p + n); }
+    size_t size() const { return pptr() - pbase(); }
+};
+
+/// Per-thread producer state.
+struct Producer
+{
+    std::shared_ptr<Ring> ring;
+    RecordBuf buf;
+    std::ostream os;
+    /// Guards against report() nested in an operand of report().
+    bool busy;
+
+    Producer();
+    ~Producer() { ring->orphan = true; }
+};
+
+/// All rings ever registered, guarded by [registry_m].
+std::mutex registry_m;
+std::vector<std::shared_ptr<Ring>> registry;
+
+/// Only one consumer may drain at a time.
+std::mutex drain_m;
+
+Producer::Producer()
+    : ring(new Ring()), os(&buf), busy(false)
+{
+    std::lock_guard<std::mutex> lock(registry_m);
+    registry.push_back(ring);
+}
+
+Producer &local_producer()
+{
+    static thread_local Producer producer;
+    return producer;
+}
+
+int rank(int severity)
+{
+    switch (severity)
+    {
+    case ReportSeverityERROR:   return 2;
+    case ReportSeverityWARN:    return 1;
+    default:                    return 0;
+    }
+}
+
+const char *label(int severity)
+{
+    switch (severity)
+    {
+    case ReportSeverityERROR:   return "Error ";
+    case ReportSeverityINFO:    return "Info ";
+    case ReportSeverityWARN:    return "Warn ";
+    default:
+        assert(0);
+        return "";
+    }
+}
+
+/// Cached ctime(3) of the last second seen, guarded by [drain_m].
+std::time_t cached_time = -1;
+std::string cached_str;
+
+/// ctime(3) of [t], formatted once per second.
+std::string const &timestamp(std::time_t t)
+{
+    if (t != cached_time)
+    {
+        char buf[64];
+        cached_time = t;
+        cached_str = ctime_r(&t, buf) ? buf : "\n";
+    }
+    return cached_str;
+}
+
+/// Pending output indexed by severity, guarded by [drain_m].
+std::string batch[3];
+unsigned long long reported_dropped = 0;
+
+/// Background thread draining all rings periodically.
+class Flusher
+{
+public:
+    Flusher() : stop_(false) {}
+    ~Flusher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = true;
+        }
+        cond_.notify_one();
+        if (thread_.joinable())
+            thread_.join();
+        Reporter::flush();
+    }
+
+    void start()
+    {
+        if (!thread_.joinable())
+            thread_ = std::thread(&Flusher::run, this);
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_);
+        while (!stop_)
+        {
+            cond_.wait_for(lock, FLUSH_INTERVAL);
+            lock.unlock();
+            Reporter::flush();
+            lock.lock();
+        }
+    }
+
+    std::thread thread_;
+    std::mutex m_;
+    std::condition_variable cond_;
+    bool stop_;
+};
+
+} // namespace
+
 std::ofstream Reporter::err_;
 std::ofstream Reporter::warn_;
 std::ofstream Reporter::info_;
+std::atomic<int> Reporter::level_(0);
+std::atomic<unsigned long long> Reporter::dropped_(0);
+
+/// Defined after the files so that it is destroyed, and drains, first.
+static Flusher flusher;
 
 void initialize_reporter(std::string const &err,
                         std::string const &warn,
-                        std::string const &info)
+                        std::string const &info,
+                        int level)
 {
     Reporter::err_.open(err);
-    Reporter::warn_.open(info);
+    Reporter::warn_.open(warn);
     Reporter::info_.open(info);
+    set_report_level(level);
+
+    flusher.start();
 }
 
-std::ostream &Reporter::file(const int severity)
+void set_report_level(int level)
 {
-    auto now = std::chrono::system_clock::now();
-    auto now_time = std::chrono::system_clock::to_time_t(now);
+    Reporter::level_ = rank(level);
+}
 
+std::ofstream &Reporter::file(const int severity)
+{
     switch (severity)
     {
-    case ReportSeverityERROR:   return err_ << std::ctime(&now_time) << "Error ";
-    case ReportSeverityINFO:    return info_ << std::ctime(&now_time) << "Info ";
-    case ReportSeverityWARN:    return warn_  << std::ctime(&now_time) << "Warn ";
+    case ReportSeverityERROR:   return err_;
+    case ReportSeverityINFO:    return info_;
+    case ReportSeverityWARN:    return warn_;
     default:
         assert(0);
+        return err_;
+    }
+}
+
+bool Reporter::enabled(int severity)
+{
+    return rank(severity) >= level_.load(std::memory_order_relaxed);
+}
+
+void Reporter::flush()
+{
+    std::lock_guard<std::mutex> lock(drain_m);
+
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard<std::mutex> lock(registry_m);
+        rings = registry;
+    }
+
+    for (auto &ring : rings)
+    {
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        size_t head = ring->head.load(std::memory_order_acquire);
+
+        for (; tail != head; tail++)
+        {
+            Record &r = ring->slots[tail % RING_SLOTS];
+            batch[r.severity].append(timestamp(r.time));
+            batch[r.severity].append(label(r.severity));
+            batch[r.severity].append(r.text, r.len);
+        }
+        ring->tail.store(tail, std::memory_order_release);
     }
+
+    unsigned long long dropped = dropped_;
+    if (dropped != reported_dropped)
+    {
+        std::time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        std::string &warn = batch[ReportSeverityWARN];
+        warn.append(timestamp(now));
+        warn.append(label(ReportSeverityWARN));
+        warn.append(std::to_string(dropped - reported_dropped));
+        warn.append(" log records dropped\n");
+        reported_dropped = dropped;
+    }
+
+    // One write per file for the whole batch.
+    for (int severity = 0; severity < 3; severity++)
+    {
+        if (batch[severity].empty())
+            continue;
+
+        auto &f = file(severity);
+        f.write(batch[severity].data(), batch[severity].size());
+        f.flush();
+        batch[severity].clear();
+    }
+
+    // Forget rings of exited threads once they are empty.
+    std::lock_guard<std::mutex> registry_lock(registry_m);
+    for (auto it = registry.begin(); it != registry.end(); )
+    {
+        Ring &ring = **it;
+        if (ring.orphan && ring.tail == ring.head)
+            it = registry.erase(it);
+        else
+            ++it;
+    }
+}
+
+LogLine::LogLine(int severity, int line, const char *file)
+    : severity_(severity), active_(false)
+{
+    Producer &p = local_producer();
+    if (p.busy || !Reporter::enabled(severity))
+        return;
+
+    Ring &ring = *p.ring;
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) >= RING_SLOTS)
+    {
+        Reporter::dropped_++;
+        return;
+    }
+
+    active_ = true;
+    p.busy = true;
+    p.os.clear();
+    p.buf.reset(ring.slots[head % RING_SLOTS].text, RECORD_SIZE);
+    p.os << file << " " << line << ": ";
+}
+
+LogLine::~LogLine()
+{
+    if (!active_)
+        return;
+
+    Producer &p = local_producer();
+    Ring &ring = *p.ring;
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    Record &r = ring.slots[head % RING_SLOTS];
+
+    r.severity = severity_;
+    r.time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    r.len = p.buf.size();
+    // Keep truncated records on their own line.
+    if (r.len == RECORD_SIZE && r.text[r.len - 1] != '\n')
+        r.text[r.len - 1] = '\n';
+
+    ring.head.store(head + 1, std::memory_order_release);
+    p.busy = false;
 }
 
-std::ostream &Reporter::log(int severity, int line, std::string const &filename)
+std::ostream &LogLine::stream()
 {
-    auto &f = file(severity);
+    static thread_local std::ostream null_stream(nullptr);
 
-    f << filename << " " << line << ": ";
-    return f;
+    if (!active_)
+        return null_stream;
+    return local_producer().os;
 }
 
 } // namespace simple_http_server
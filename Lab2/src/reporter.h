@@ -4,11 +4,15 @@
 #ifndef REPORTER_H
 #define REPORTER_H
 
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <string>
 
-#define report(f)  simple_http_server::Reporter::log(ReportSeverity##f, __LINE__, __FILE__)
+/// report(ERROR) << "message" << std::endl;
+/// The record is formatted into a per-thread buffer and committed when
+/// the statement ends. Writing to the log files is done asynchronously.
+#define report(f)  simple_http_server::LogLine(ReportSeverity##f, __LINE__, __FILE__).stream()
 
 enum ReportSeverity
 {
@@ -20,24 +24,42 @@ enum ReportSeverity
 namespace simple_http_server
 {
 
-/// Setup err, warn, info files.
+/// Setup err, warn, info files and start the background flusher.
+/// Records less severe than [level] are discarded at the call site.
 void initialize_reporter(std::string const &err,
                         std::string const &warn,
-                        std::string const &info);
+                        std::string const &info,
+                        int level = ReportSeverityINFO);
+
+/// Change the level filter at runtime.
+void set_report_level(int level);
 
 /// Singleton reporter class.
+///
+/// Every thread owns a lock-free single-producer ring of fixed-size
+/// records; a background thread drains all rings periodically and writes
+/// them to the files in batches. A thread whose ring is full drops the
+/// record instead of waiting.
 class Reporter
 {
 private:
     friend void initialize_reporter(std::string const &err,
                         std::string const &warn,
-                        std::string const &info);
+                        std::string const &info,
+                        int level);
+    friend void set_report_level(int level);
+    friend class LogLine;
 
     static std::ofstream info_;
     static std::ofstream warn_;
     static std::ofstream err_;
 
-    static std::ostream &file(const int severity);
+    static std::ofstream &file(const int severity);
+
+    /// Minimum severity rank that is recorded.
+    static std::atomic<int> level_;
+    /// Records dropped because a ring was full.
+    static std::atomic<unsigned long long> dropped_;
 
     /// Disallow instantiation.
     Reporter() = delete;
@@ -47,8 +69,32 @@ private:
     void operator=(Reporter&&) = delete;
 
 public:
-    static std::ostream &log(int severity, int line, std::string const &file);
+    /// Whether records of [severity] pass the level filter.
+    static bool enabled(int severity);
+    /// Number of records dropped so far.
+    static unsigned long long dropped() { return dropped_; }
+    /// Synchronously write out everything committed so far.
+    static void flush();
+};
+
+/// A single record in construction. Only meant to be used as a
+/// temporary through the report() macro.
+class LogLine
+{
+public:
+    LogLine(int severity, int line, const char *file);
+    ~LogLine();
+
+    LogLine(const LogLine&) = delete;
+    void operator=(const LogLine&) = delete;
+
+    std::ostream &stream();
+
+private:
+    int severity_;
+    /// False when filtered out or dropped.
+    bool active_;
 };
 
 }   // namespace simple_http_server
-#endif
\ No newline at end of file
+#endif
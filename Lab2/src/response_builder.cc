@@ -0,0 +1,91 @@
+/// response_builder.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <cassert>
+#include <cstdio>
+#include <sys/uio.h>
+#include "response_builder.h"
+#include "message.h"
+
+namespace simple_http_server
+{
+
+ResponseBuilder::ResponseBuilder()
+    : finished_(false)
+{
+    buf_.reserve(512);
+}
+
+ResponseBuilder &ResponseBuilder::start(int status_code, std::string const &status,
+                                        std::string const &version)
+{
+    char code[16];
+    int n = std::snprintf(code, sizeof(code), " %d ", status_code);
+
+    buf_.clear();
+    buf_.append(version);
+    buf_.append(code, n);
+    buf_.append(status);
+    buf_.append(LINE_END);
+    finished_ = false;
+    return *this;
+}
+
+ResponseBuilder &ResponseBuilder::header(std::string const &name, std::string const &value)
+{
+    assert(!finished_);
+    buf_.append(name);
+    buf_.append(": ", 2);
+    buf_.append(value);
+    buf_.append(LINE_END);
+    return *this;
+}
+
+ResponseBuilder &ResponseBuilder::header(std::string const &name, unsigned long long value)
+{
+    char num[32];
+    int n = std::snprintf(num, sizeof(num), "%llu", value);
+
+    assert(!finished_);
+    buf_.append(name);
+    buf_.append(": ", 2);
+    buf_.append(num, n);
+    buf_.append(LINE_END);
+    return *this;
+}
+
+std::string const &ResponseBuilder::finish()
+{
+    if (!finished_)
+    {
+        buf_.append(LINE_END);
+        finished_ = true;
+    }
+    return buf_;
+}
+
+int ResponseBuilder::send(TCPSocket &sock, const void *body, size_t len)
+{
+    finish();
+
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char *>(buf_.data());
+    iov[0].iov_len = buf_.length();
+    iov[1].iov_base = const_cast<void *>(body);
+    iov[1].iov_len = body ? len : 0;
+
+    return sock.sendv(iov, 2);
+}
+
+bool ResponseBuilder::send(ResponseWriter &out, const void *body, size_t len)
+{
+    return out.send(finish(), body, body ? len : 0);
+}
+
+ResponseBuilder &ResponseBuilder::local()
+{
+    static thread_local ResponseBuilder builder;
+    return builder;
+}
+
+} // namespace simple_http_server
@@ -0,0 +1,53 @@
+/// response_builder.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef RESPONSE_BUILDER_H
+#define RESPONSE_BUILDER_H
+
+#include <string>
+#include "response_writer.h"
+#include "tcp_socket.h"
+
+namespace simple_http_server
+{
+
+/// Formats the status line and headers of a response into a buffer
+/// that is reused across responses, and sends them together with the
+/// body through writev(2) so the body is never copied.
+///
+/// Usage:
+///     builder.start(200, "OK")
+///            .header("Content-length", len)
+///            .send(sock, body, len);
+class ResponseBuilder
+{
+public:
+    ResponseBuilder();
+
+    /// Begin a new response. The buffer keeps its capacity.
+    ResponseBuilder &start(int status_code, std::string const &status,
+                           std::string const &version = "HTTP/1.1");
+    ResponseBuilder &header(std::string const &name, std::string const &value);
+    ResponseBuilder &header(std::string const &name, unsigned long long value);
+
+    /// Terminate the header block and return the serialized head.
+    std::string const &finish();
+
+    /// Finish the head and send it followed by [len] bytes of [body].
+    /// Return the number of bytes sent or -1 on error.
+    int send(TCPSocket &sock, const void *body = nullptr, size_t len = 0);
+    /// Same through [out], whatever the protocol of its connection.
+    bool send(ResponseWriter &out, const void *body = nullptr, size_t len = 0);
+
+    /// Per-thread builder. A worker only builds one response at a
+    /// time, so the buffer is reused by every connection it serves.
+    static ResponseBuilder &local();
+
+private:
+    std::string buf_;
+    bool finished_;
+};
+
+}   // namespace simple_http_server
+
+#endif
@@ -0,0 +1,163 @@
+/// response_writer.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <sys/uio.h>
+#include "metrics.h"
+#include "response_writer.h"
+
+namespace simple_http_server
+{
+
+int status_code(StringRef head)
+{
+    // "HTTP/1.1 200 OK".
+    const char *sp = static_cast<const char *>(std::memchr(head.data, ' ', head.length));
+    if (!sp || head.data + head.length - sp < 4)
+        return 0;
+    int code = 0;
+    for (int i = 1; i <= 3; i++)
+    {
+        if (sp[i] < '0' || sp[i] > '9')
+            return 0;
+        code = code * 10 + (sp[i] - '0');
+    }
+    return code;
+}
+
+StringRef close_connection(StringRef head, std::string &storage)
+{
+    if (head.length < 4)
+        return head;
+
+    // The field may only follow a line end.
+    static const char field[] = "\r\nConnection:";
+    const size_t n = sizeof(field) - 1;
+    for (const char *p = head.data; p + n <= head.data + head.length; p++)
+        if (::strncasecmp(p, field, n) == 0)
+            return head;
+
+    // Before the empty line ending the head.
+    storage.assign(head.data, head.length - 2);
+    storage.append("Connection: close\r\n\r\n");
+    return StringRef(storage);
+}
+
+bool ResponseWriter::send_serialized(StringRef response)
+{
+    const char *end = static_cast<const char *>(
+        ::memmem(response.data, response.length, "\r\n\r\n", 4));
+    size_t head = end ? end + 4 - response.data : response.length;
+    return send(StringRef(response.data, head), response.data + head, response.length - head);
+}
+
+Http1Writer::Http1Writer(TCPSocket &sock, bool chunked)
+    : sock_(sock), chunked_(chunked), close_(false), chunking_(false)
+{}
+
+StringRef Http1Writer::closing(StringRef head, std::string &storage) const
+{
+    return close_ ? close_connection(head, storage) : head;
+}
+
+bool Http1Writer::send(StringRef head, const void *body, size_t len)
+{
+    Metrics::note_status(status_code(head));
+    std::string storage;
+    head = closing(head, storage);
+
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char *>(head.data);
+    iov[0].iov_len = head.length;
+    iov[1].iov_base = const_cast<void *>(body);
+    iov[1].iov_len = len;
+
+    started_ = finished_ = true;
+    failed_ = sock_.sendv(iov, len > 0 ? 2 : 1) < 0;
+    return !failed_;
+}
+
+bool Http1Writer::start(StringRef head, long long length)
+{
+    Metrics::note_status(status_code(head));
+    started_ = true;
+    chunking_ = length < 0 && chunked_;
+    head = closing(head, pending_);
+    if (head.data != pending_.data())
+        pending_.assign(head.data, head.length);
+
+    // Before the empty line ending the head.
+    if (chunking_ && pending_.length() >= 2)
+        pending_.insert(pending_.length() - 2, "Transfer-Encoding: chunked\r\n");
+    return true;
+}
+
+bool Http1Writer::write(const void *data, size_t len)
+{
+    if (failed_ || finished_)
+        return false;
+    if (len == 0)
+        return true;
+
+    char size_line[32];
+    int n = chunking_ ? std::snprintf(size_line, sizeof(size_line), "%zx\r\n", len) : 0;
+
+    struct iovec iov[4];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = const_cast<char *>(pending_.data());
+    iov[iovcnt++].iov_len = pending_.length();
+    iov[iovcnt].iov_base = size_line;
+    iov[iovcnt++].iov_len = n;
+    iov[iovcnt].iov_base = const_cast<void *>(data);
+    iov[iovcnt++].iov_len = len;
+    if (chunking_)
+    {
+        iov[iovcnt].iov_base = const_cast<char *>(LINE_END.data());
+        iov[iovcnt++].iov_len = LINE_END.length();
+    }
+
+    failed_ = sock_.sendv(iov, iovcnt) < 0;
+    pending_.clear();
+    return !failed_;
+}
+
+bool Http1Writer::write_file(int fd, off_t offset, size_t count)
+{
+    if (failed_ || finished_)
+        return false;
+    if (count == 0)
+        return true;
+
+    // Coalesced with the first segment of the file by MSG_MORE, which is
+    // never copied to user space.
+    if (chunking_)
+    {
+        char size_line[32];
+        std::snprintf(size_line, sizeof(size_line), "%zx\r\n", count);
+        pending_.append(size_line);
+    }
+    failed_ = (!pending_.empty() && sock_.send(pending_.data(), pending_.length(), MSG_MORE) < 0) ||
+              sock_.send_file(fd, offset, count) != static_cast<long long>(count);
+    pending_.clear();
+    if (chunking_)
+        pending_ = LINE_END;
+    return !failed_;
+}
+
+bool Http1Writer::finish()
+{
+    if (failed_ || finished_)
+        return !failed_;
+
+    finished_ = true;
+    if (chunking_)
+        pending_.append("0\r\n\r\n");
+    if (!pending_.empty())
+        failed_ = sock_.send(pending_.data(), pending_.length()) < 0;
+    pending_.clear();
+    return !failed_;
+}
+
+}   // namespace simple_http_server
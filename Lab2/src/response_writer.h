@@ -0,0 +1,114 @@
+/// response_writer.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef RESPONSE_WRITER_H
+#define RESPONSE_WRITER_H
+
+#include <sys/types.h>
+#include <string>
+#include "message.h"
+#include "tcp_socket.h"
+
+namespace simple_http_server
+{
+
+/// Status code of the serialized response [head], 0 if it has none.
+int status_code(StringRef head);
+
+/// [head], or a copy of it in [storage] with Connection: close added,
+/// unless it has a Connection field already.
+StringRef close_connection(StringRef head, std::string &storage);
+
+/// Where a handler sends its response, whatever the protocol of the
+/// connection. The head is the status line and header fields as
+/// HTTP/1.1 has them, built by a ResponseBuilder or stored so; the body
+/// comes from memory or from files. The connection frames them:
+/// Http1Writer sends them as they are, an HTTP/2 stream as HEADERS and
+/// DATA frames, see Http2Connection.
+///
+/// A response is either sent whole with [send], or started with
+/// [start], continued with [write] and [write_file] and ended with
+/// [finish]. Both note its status for the metrics, see
+/// Metrics::note_status.
+class ResponseWriter
+{
+public:
+    ResponseWriter() : started_(false), finished_(false), failed_(false) {}
+    virtual ~ResponseWriter() = default;
+
+    /// Send a complete response: [head], empty line included, and [len]
+    /// bytes of body at [body].
+    virtual bool send(StringRef head, const void *body, size_t len) = 0;
+    /// Same with a response serialized whole, e.g. cached.
+    bool send_serialized(StringRef response);
+
+    /// Send [head], empty line included, of a response whose body
+    /// follows. [length] is the length of the body announced by
+    /// Content-length, -1 if it is not known: the body is then framed as
+    /// it goes if the connection can, see [framed], else it ends with
+    /// the connection and [head] must say so with Connection: close.
+    virtual bool start(StringRef head, long long length) = 0;
+    /// Send [len] bytes of body. Empty writes are ignored.
+    virtual bool write(const void *data, size_t len) = 0;
+    /// Send [count] bytes of the file [fd] from [offset]. Fail if the
+    /// file ends before.
+    virtual bool write_file(int fd, off_t offset, size_t count) = 0;
+    /// End the body.
+    virtual bool finish() = 0;
+
+    /// Whether a body of unknown length ends without closing the
+    /// connection after it.
+    virtual bool framed() const = 0;
+
+    bool started() const { return started_; }
+    bool finished() const { return finished_; }
+    bool failed() const { return failed_; }
+
+protected:
+    bool started_;
+    bool finished_;
+    bool failed_;
+};
+
+/// Writes responses to an HTTP/1.x connection. Bodies of unknown length
+/// are sent as chunks, or as is up to the close of the connection to
+/// HTTP/1.0 clients, which do not know chunks.
+///
+/// The head of a started response is held until the first piece of the
+/// body, so that they leave together.
+class Http1Writer : public ResponseWriter
+{
+public:
+    /// [chunked] is false for close-delimited bodies.
+    explicit Http1Writer(TCPSocket &sock, bool chunked = true);
+
+    void set_chunked(bool chunked) { chunked_ = chunked; }
+    /// The connection is closed after the response: heads that do not
+    /// say so, e.g. cached ones, get Connection: close.
+    void set_close(bool close) { close_ = close; }
+
+    virtual bool send(StringRef head, const void *body, size_t len) override;
+    virtual bool start(StringRef head, long long length) override;
+    virtual bool write(const void *data, size_t len) override;
+    virtual bool write_file(int fd, off_t offset, size_t count) override;
+    virtual bool finish() override;
+    virtual bool framed() const override { return chunked_; }
+
+private:
+    /// [head], or a copy of it in [storage] with Connection: close
+    /// added if it is needed, see [set_close].
+    StringRef closing(StringRef head, std::string &storage) const;
+
+    TCPSocket &sock_;
+    bool chunked_;
+    bool close_;
+    /// The body of the response started is sent in chunks.
+    bool chunking_;
+    /// Bytes held to leave with the next ones: the head, the end of the
+    /// last chunk.
+    std::string pending_;
+};
+
+}   // namespace simple_http_server
+
+#endif
@@ -0,0 +1,265 @@
+/// router.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <cstdlib>
+#include "router.h"
+#include "reporter.h"
+
+namespace simple_http_server
+{
+
+namespace
+{
+
+struct MethodName
+{
+    const char *name;
+    unsigned bit;
+};
+
+const MethodName METHOD_NAMES[] = {
+    { "GET", METHOD_GET },
+    { "HEAD", METHOD_HEAD },
+    { "POST", METHOD_POST },
+    { "PUT", METHOD_PUT },
+    { "DELETE", METHOD_DELETE },
+    { "PATCH", METHOD_PATCH },
+    { "OPTIONS", METHOD_OPTIONS },
+};
+
+} // namespace
+
+unsigned method_mask(StringRef method)
+{
+    for (MethodName const &m : METHOD_NAMES)
+        if (method == m.name)
+            return m.bit;
+    return METHOD_OTHER;
+}
+
+std::string method_names(unsigned mask)
+{
+    std::string names;
+    for (MethodName const &m : METHOD_NAMES)
+    {
+        if (!(mask & m.bit))
+            continue;
+        if (!names.empty())
+            names += ", ";
+        names += m.name;
+    }
+    return names;
+}
+
+StringRef RouteMatch::param(StringRef name) const
+{
+    if (!route)
+        return StringRef();
+    for (size_t i = 0; i < route->params.size() && i < count; i++)
+        if (name == route->params[i])
+            return values[i];
+    return StringRef();
+}
+
+struct Router::Node
+{
+    enum Kind { LITERAL, PARAM, REST };
+
+    explicit Node(Kind kind) : kind(kind) {}
+
+    Kind kind;
+    /// Label of a LITERAL edge.
+    std::string prefix;
+    /// Literal children, no two starting with the same character.
+    std::vector<std::unique_ptr<Node>> children;
+    std::unique_ptr<Node> param;
+    std::unique_ptr<Node> rest;
+    /// Routes of the patterns ending here, for disjoint methods.
+    std::vector<Route> routes;
+};
+
+Router::Router()
+    : root_(new Node(Node::LITERAL))
+{
+}
+
+Router::~Router()
+{
+}
+
+Router::Node *Router::insert(Node *n, const char *s, size_t len)
+{
+    while (len > 0)
+    {
+        Node *next = nullptr;
+        for (auto &c : n->children)
+        {
+            if (c->prefix[0] == s[0])
+            {
+                next = c.get();
+                break;
+            }
+        }
+
+        if (!next)
+        {
+            std::unique_ptr<Node> leaf(new Node(Node::LITERAL));
+            leaf->prefix.assign(s, len);
+            n->children.push_back(std::move(leaf));
+            return n->children.back().get();
+        }
+
+        size_t common = 0;
+        while (common < len && common < next->prefix.length() && next->prefix[common] == s[common])
+            common++;
+
+        if (common < next->prefix.length())
+        {
+            // Split the edge: [next] keeps the tail of its label below a
+            // node labeled with the common part.
+            std::unique_ptr<Node> mid(new Node(Node::LITERAL));
+            mid->prefix = next->prefix.substr(0, common);
+            next->prefix.erase(0, common);
+            for (auto &c : n->children)
+            {
+                if (c.get() == next)
+                {
+                    mid->children.push_back(std::move(c));
+                    c = std::move(mid);
+                    next = c.get();
+                    break;
+                }
+            }
+        }
+
+        n = next;
+        s += common;
+        len -= common;
+    }
+    return n;
+}
+
+void Router::add(std::string const &pattern, Route route)
+{
+    if (pattern.empty() || pattern[0] != '/')
+    {
+        report(ERROR) << "route pattern must start with '/': " << pattern << std::endl;
+        abort();
+    }
+
+    route.params.clear();
+    Node *n = root_.get();
+    size_t i = 0;
+    while (i < pattern.length())
+    {
+        // Parameters start segments, elsewhere ':' and '*' are literal.
+        bool special = i > 0 && pattern[i - 1] == '/' && (pattern[i] == ':' || pattern[i] == '*');
+        if (!special)
+        {
+            size_t j = i + 1;
+            while (j < pattern.length() && !(pattern[j - 1] == '/' && (pattern[j] == ':' || pattern[j] == '*')))
+                j++;
+            n = insert(n, pattern.data() + i, j - i);
+            i = j;
+            continue;
+        }
+
+        size_t j = pattern.find('/', i);
+        if (j == std::string::npos)
+            j = pattern.length();
+        bool rest = pattern[i] == '*';
+        if ((rest && j != pattern.length()) || (!rest && j == i + 1) ||
+            route.params.size() == RouteMatch::MAX_PARAMS)
+        {
+            report(ERROR) << "bad route pattern " << pattern << std::endl;
+            abort();
+        }
+
+        std::unique_ptr<Node> &child = rest ? n->rest : n->param;
+        if (!child)
+            child.reset(new Node(rest ? Node::REST : Node::PARAM));
+        n = child.get();
+        route.params.push_back(pattern.substr(i + 1, j - i - 1));
+        i = j;
+    }
+
+    // The new route takes its methods over from the older ones.
+    for (auto it = n->routes.begin(); it != n->routes.end();)
+    {
+        it->methods &= ~route.methods;
+        if (it->methods)
+            ++it;
+        else
+            it = n->routes.erase(it);
+    }
+    n->routes.push_back(std::move(route));
+}
+
+bool Router::find(StringRef method, StringRef path, RouteMatch &match) const
+{
+    match = RouteMatch();
+    const char *end = static_cast<const char *>(std::memchr(path.data, '?', path.length));
+    if (!end)
+        end = path.data + path.length;
+    return find(*root_, method_mask(method), path.data, end, match);
+}
+
+bool Router::find(Node const &n, unsigned method, const char *p, const char *end,
+                  RouteMatch &match)
+{
+    size_t count = match.count;
+    if (n.kind == Node::LITERAL)
+    {
+        size_t len = n.prefix.length();
+        if (static_cast<size_t>(end - p) < len || std::memcmp(p, n.prefix.data(), len) != 0)
+            return false;
+        p += len;
+    }
+    else if (n.kind == Node::PARAM)
+    {
+        const char *q = static_cast<const char *>(std::memchr(p, '/', end - p));
+        if (!q)
+            q = end;
+        if (q == p)
+            return false;
+        match.values[match.count++] = StringRef(p, q - p);
+        p = q;
+    }
+    else
+    {
+        match.values[match.count++] = StringRef(p, end - p);
+        p = end;
+    }
+
+    if (p == end)
+    {
+        for (Route const &r : n.routes)
+        {
+            match.allowed |= r.methods;
+            if (r.methods & method)
+            {
+                match.route = &r;
+                return true;
+            }
+        }
+    }
+    else
+    {
+        for (auto const &c : n.children)
+            if (c->prefix[0] == *p)
+            {
+                if (find(*c, method, p, end, match))
+                    return true;
+                break;
+            }
+        if (n.param && find(*n.param, method, p, end, match))
+            return true;
+    }
+    if (n.rest && find(*n.rest, method, p, end, match))
+        return true;
+
+    match.count = count;
+    return false;
+}
+
+}   // namespace simple_http_server
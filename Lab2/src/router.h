@@ -0,0 +1,122 @@
+/// router.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "body_stream.h"
+#include "message.h"
+#include "response_writer.h"
+
+namespace simple_http_server
+{
+
+/// Methods a route answers, or'ed together.
+enum MethodMask
+{
+    METHOD_GET = 1 << 0,
+    METHOD_HEAD = 1 << 1,
+    METHOD_POST = 1 << 2,
+    METHOD_PUT = 1 << 3,
+    METHOD_DELETE = 1 << 4,
+    METHOD_PATCH = 1 << 5,
+    METHOD_OPTIONS = 1 << 6,
+    /// Any other method.
+    METHOD_OTHER = 1 << 7,
+    METHOD_ANY = (1 << 8) - 1
+};
+
+/// Bit of [method], METHOD_OTHER if it has none.
+unsigned method_mask(StringRef method);
+/// Comma separated names of the methods in [mask], for Allow.
+std::string method_names(unsigned mask);
+
+struct RouteMatch;
+
+/// Answers a request, returning whether the connection can be kept.
+typedef std::function<bool(Request &, ResponseWriter &, RouteMatch const &)> Handler;
+
+/// What a pattern is mapped to: a handler of buffered requests or a
+/// handler of streamed ones.
+struct Route
+{
+    unsigned methods;
+    Handler handler;
+    std::shared_ptr<StreamHandler> stream;
+    /// Answered by this server in proxy mode too, instead of forwarded.
+    bool local = false;
+    /// Names of the parameters of the pattern, in order.
+    std::vector<std::string> params;
+};
+
+/// Route found for a request and the values of its parameters, views
+/// into the path looked up.
+struct RouteMatch
+{
+    static const size_t MAX_PARAMS = 8;
+
+    /// nullptr if no route answers the method on the path.
+    Route const *route;
+    StringRef values[MAX_PARAMS];
+    size_t count;
+    /// Methods of the routes matching the path.
+    unsigned allowed;
+
+    RouteMatch() : route(nullptr), count(0), allowed(0) {}
+
+    /// Value of the parameter [name], empty if there is none.
+    StringRef param(StringRef name) const;
+};
+
+/// Maps request paths to handlers with a radix tree.
+///
+/// A pattern is made of literal characters, ":name" segments matching
+/// one non-empty path segment, and a final "*name" (or "*") matching the
+/// rest of the path, possibly empty:
+///
+///     /metrics
+///     /users/:id/posts/:post
+///     /static/*file
+///
+/// Literal edges are compressed and children are tried literal first,
+/// then parameter, then rest, backtracking on a dead end. A lookup thus
+/// costs time proportional to the length of the path, and allocates
+/// nothing. Routes are added before the server starts; lookups do not
+/// lock.
+class Router
+{
+public:
+    Router();
+    ~Router();
+
+    Router(const Router&) = delete;
+    void operator=(const Router&) = delete;
+
+    /// Map [pattern] to [route] for the methods of [route], replacing
+    /// the routes of the same pattern for them. A malformed pattern is a
+    /// fatal error.
+    void add(std::string const &pattern, Route route);
+
+    /// Look up [path] for [method], the query string excluded. Return
+    /// false if no route answers it, with [match.allowed] telling
+    /// whether the path matched for other methods.
+    bool find(StringRef method, StringRef path, RouteMatch &match) const;
+
+private:
+    struct Node;
+
+    /// Descend from [n] along the literal [s, s + len), splitting edges.
+    static Node *insert(Node *n, const char *s, size_t len);
+    static bool find(Node const &n, unsigned method, const char *p, const char *end,
+                     RouteMatch &match);
+
+    std::unique_ptr<Node> root_;
+};
+
+}   // namespace simple_http_server
+
+#endif
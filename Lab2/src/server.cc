@@ -2,49 +2,45 @@
 /// Copyright 2020 Cloud-fantasy team
 
 #include <sstream>
+#include <chrono>
+#include <csignal>
 #include <cstdlib>
+#include <cstring>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <algorithm>
+#include <thread>
 #include "server.h"
+#include "body_stream.h"
+#include "content_coding.h"
+#include "metrics.h"
 #include "reporter.h"
+#include "response_builder.h"
 
 namespace simple_http_server
 {
 
-/// Simple string splitter.
-static std::vector<std::string> split(std::string const &str, std::string const &delim)
+std::vector<std::string> Server::split(std::string const &str, std::string const &delim)
 {
     std::vector<std::string> tokens;
-    std::string str_copy = str;
-    std::string word;
-    std::size_t pos;
+    std::size_t start = 0, pos;
 
-    while ((pos = str_copy.find(delim)) != std::string::npos)
+    while ((pos = str.find(delim, start)) != std::string::npos)
     {
-        word = str_copy.substr(0, pos);
-        str_copy.erase(0, pos + delim.length());
-        tokens.emplace_back(word);
+        tokens.emplace_back(str, start, pos - start);
+        start = pos + delim.length();
     }
 
-    if (str_copy.length())
-        tokens.emplace_back(str_copy);
+    if (start < str.length())
+        tokens.emplace_back(str, start, std::string::npos);
 
     return tokens;
 }
 
-static std::string concat(std::vector<std::string> &strs, std::string const &delim)
-{
-    assert(!strs.empty());
-    std::stringstream ss;
-
-    ss << strs[0];
-    for (auto iter = strs.begin() + 1; iter != strs.end(); iter++)
-    {
-        ss << delim << *iter;
-    }
-
-    return ss.str();
-}
-
 static std::string &trim_trailing_slash(std::string &s)
 {
     if (s.empty())  return s;
@@ -55,10 +51,67 @@ static std::string &trim_trailing_slash(std::string &s)
 
 const std::string Server::server_name = "Cloud-fantasy server";
 
+/// Longest request line plus headers accepted.
+static const size_t MAX_HEAD_SIZE = 64 << 10;
+
+/// Shuts its connection down when the deadline passes, which fails the
+/// blocking call of the worker serving it.
+class Server::ConnectionTimer : public Timer
+{
+public:
+    ConnectionTimer(Server &server, TCPSocket &sock)
+        : server_(server), sock_(sock), kind_(TIMEOUT_IDLE), progress_(0) {}
+    ~ConnectionTimer() { cancel(); }
+
+    void arm(TimeoutKind kind)
+    {
+        kind_ = kind;
+        progress_ = sock_.progress();
+        server_.timers.arm(*this, server_.timeouts[kind]);
+    }
+    void cancel() { server_.timers.cancel(*this); }
+    TimeoutKind kind() const { return static_cast<TimeoutKind>(kind_.load()); }
+
+protected:
+    /// The write deadline bounds inactivity, not the whole response: it
+    /// is pushed back as long as bytes moved since it was last checked.
+    virtual unsigned long postpone() override
+    {
+        unsigned long long progress = sock_.progress();
+        if (kind_ != TIMEOUT_WRITE || progress == progress_)
+            return 0;
+        progress_ = progress;
+        return server_.timeouts[TIMEOUT_WRITE];
+    }
+
+    virtual void expire() override
+    {
+        int kind = kind_;
+        server_.timeouts_fired[kind]++;
+        // Only stop reading while a 408 can still be sent.
+        sock_.shutdown(kind == TIMEOUT_WRITE ? SHUT_RDWR : SHUT_RD);
+    }
+
+private:
+    Server &server_;
+    TCPSocket &sock_;
+    std::atomic<int> kind_;
+    /// Progress of [sock_] when last armed or postponed.
+    std::atomic<unsigned long long> progress_;
+};
+
 Server::Server(std::string const &ip, uint16_t port, 
                 std::string const &content_base, size_t n_threads)
-    : sock(new TCPSocket()), workers(*this, n_threads)
+    : ip(ip), port(port), n_threads(n_threads), n_acceptors(0), n_rings(0),
+      max_queue(1024), queue_target_delay_ms(0), drain_timeout_ms(0),
+      draining(false), accepting(false),
+      cache(new FileCache(64 << 20, 256 << 10)), compressed(new FileCache(16 << 20, 1 << 20)),
+      store_max_file_size(0), max_body_size(8 << 20)
 {
+    set_timeouts(10000, 30000, 5000, 60000);
+    for (auto &n : timeouts_fired)
+        n = 0;
+
     if (content_base == "")
     {
         char cwd_buf[1024];
@@ -79,91 +132,391 @@ Server::Server(std::string const &ip, uint16_t port,
         this->content_base = content_base;
         trim_trailing_slash(this->content_base);
     }
-    
-    sock->bind(ip, port);
+
+    using namespace std::placeholders;
+    add_handler(METHOD_GET, "/metrics", std::bind(&Server::handle_metrics, this, _1, _2), true);
+    add_handler(METHOD_POST, "/Post_show", std::bind(&Server::handle_post, this, _1, _2));
+}
+
+void Server::set_acceptors(size_t n)
+{
+    n_acceptors = n;
+}
+
+void Server::set_admission(size_t max_queue, unsigned long target_delay_ms)
+{
+    this->max_queue = max_queue;
+    queue_target_delay_ms = target_delay_ms;
+}
+
+void Server::set_io_uring(size_t n)
+{
+    n_rings = n;
+}
+
+void Server::set_hot_upgrade(std::string const &path, unsigned long drain_timeout_ms)
+{
+    upgrade.reset(new HotUpgrade(path));
+    this->drain_timeout_ms = drain_timeout_ms;
+}
+
+/// Only there to interrupt accept(2), see serve_upgrades.
+static void wake_acceptor(int)
+{
+}
+
+/// Posted on SIGHUP, see reload_static_store.
+static sem_t reload_requests;
+
+static void request_reload(int)
+{
+    ::sem_post(&reload_requests);
 }
 
 void Server::start()
 {
-    sock->listen(1024);
+    if (store_max_file_size > 0)
+    {
+        store.reset(new StaticStore(content_base, store_max_file_size, compressed->capacity() > 0,
+                                    &Server::stored_head));
+        store->reload();
+
+        ::sem_init(&reload_requests, 0, 0);
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = request_reload;
+        sa.sa_flags = SA_RESTART;
+        ::sigaction(SIGHUP, &sa, nullptr);
+        std::thread(&Server::reload_static_store, this).detach();
+    }
 
-    for (;;)
+    if (upgrade && (n_rings > 0 || n_acceptors > 0))
+    {
+        report(WARN) << "hot upgrade needs the thread pool mode, disabled" << std::endl;
+        upgrade.reset();
+    }
+
+    if (n_rings > 0)
+    {
+        if (UringEngine::supported())
+        {
+            // Workers take the requests the loops do not answer.
+            workers.reset(new thread_pool(*this, n_threads, max_queue, queue_target_delay_ms));
+            uring.reset(new UringEngine(*this, n_rings));
+            uring->run();
+            return;
+        }
+        report(WARN) << "io_uring unavailable, using the thread pool" << std::endl;
+    }
+
+    if (n_acceptors > 0)
+    {
+        start_reuseport();
+        return;
+    }
+
+    // The socket of a running server is taken over rather than bound.
+    std::vector<std::string> warm;
+    int listen_fd = upgrade ? upgrade->take_over(warm) : -1;
+    sock.reset(new TCPSocket());
+    if (listen_fd >= 0)
+        sock->adopt(listen_fd, "", 0);
+    else
+    {
+        sock->bind(ip, port);
+        sock->listen(1024);
+    }
+    workers.reset(new thread_pool(*this, n_threads, max_queue, queue_target_delay_ms));
+
+    if (listen_fd >= 0)
+    {
+        warm_up(warm);
+        upgrade->ready();
+        report(INFO) << "took over from " << upgrade->path() << ", " << warm.size() << " files cached" << std::endl;
+    }
+
+    std::thread upgrades;
+    if (upgrade && upgrade->listen())
+    {
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = wake_acceptor;
+        ::sigaction(SIGUSR2, &sa, nullptr);
+        acceptor = pthread_self();
+        accepting = true;
+        upgrades = std::thread(&Server::serve_upgrades, this);
+    }
+
+    while (!draining)
     {
         std::unique_ptr<TCPSocket> sock_client(new TCPSocket());
         std::string client_ip;
         uint16_t client_port;
 
-        // Abort on failure accepting.
+        // Abort on failure accepting, unless interrupted.
         if (!sock->accept(*sock_client, client_ip, client_port))
+        {
+            if (draining || errno == EINTR)
+                continue;
             abort();
+        }
 
         // Add it to task pool.
-        workers.add_client(std::move(sock_client));
+        workers->add_client(std::move(sock_client));
+    }
+
+    accepting = false;
+    upgrades.join();
+    // The successor holds the socket open.
+    sock.reset();
+
+    if (!drain())
+    {
+        // Cut off by the exit, the successor never sees them.
+        report(WARN) << "abandoning " << Metrics::active_connections() << " connections being served and "
+                     << workers->queue_depth() << " waiting for a worker after draining for "
+                     << drain_timeout_ms << " ms" << std::endl;
+        Reporter::flush();
+        std::_Exit(0);
     }
+    report(INFO) << "drained, exiting" << std::endl;
 }
 
-std::string &Server::trim_whitespace(std::string &s)
+void Server::warm_up(std::vector<std::string> const &paths)
 {
-    if (s.empty())  return s;
-    while (s[0] == ' ' || s[0] == '\t' || s[0] == '\r' || s[0] == '\n')
-        s = s.substr(1, s.length());
+    std::string base = content_base + "/";
+    for (std::string const &path : paths)
+    {
+        if (path.compare(0, base.length(), base) != 0)
+            continue;
 
-    if (s.empty())  return s;
-    char ch = s.back();
-    while (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+        // Only the identity cache is handed over, precompressed siblings
+        // are in [compressed].
+        FileCache::Validators validators;
+        load_cached_response(path, validators, mime_type(path));
+    }
+}
+
+void Server::serve_upgrades()
+{
+    // The cache is listed once the successor is there.
+    while (!upgrade->wait() || !upgrade->hand_over(sock->fd(), cache->paths()))
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    report(INFO) << "handed the listening socket over, draining" << std::endl;
+    draining = true;
+    // The signal may come before the acceptor blocks, so it is repeated.
+    while (accepting)
     {
-        s = s.substr(0, s.length() - 1);
-        ch = s.back();
+        pthread_kill(acceptor, SIGUSR2);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
+}
+
+bool Server::drain()
+{
+    // Idle for two checks in a row: a worker may be between taking a
+    // connection from the queue and counting it.
+    unsigned long long deadline = now_ns() + drain_timeout_ms * 1000000ULL;
+    int idle = 0;
+    while (idle < 2)
+    {
+        // Idle connections are not waited for.
+        workers->close_parked();
+        if (workers->queue_depth() == 0 && Metrics::active_connections() == 0)
+            idle++;
+        else
+            idle = 0;
+        if (now_ns() >= deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+void Server::start_reuseport()
+{
+    unsigned n_cpus = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> loops;
+
+    // Every acceptor has its own listening socket on the same port, the
+    // kernel spreads incoming connections among them.
+    for (size_t i = 0; i < n_acceptors; i++)
+    {
+        std::unique_ptr<TCPSocket> listener(new TCPSocket());
+        if (!listener->set_reuseport(true) ||
+            !listener->bind(ip, port) ||
+            !listener->listen(1024))
+            abort();
+
+        loops.emplace_back(
+            [this](TCPSocket *listener)
+            {
+                AcceptLoop(*this, std::unique_ptr<TCPSocket>(listener)).run();
+            },
+            listener.release()
+        );
+
+        // Pin the loop to a core.
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % n_cpus, &cpus);
+        if (pthread_setaffinity_np(loops.back().native_handle(), sizeof(cpus), &cpus) != 0)
+            report(WARN) << "fail pinning acceptor " << i << std::endl;
+    }
+
+    report(INFO) << n_acceptors << " SO_REUSEPORT acceptors started" << std::endl;
+    for (auto &t : loops)
+        t.join();
+}
+
+void Server::set_file_cache(size_t capacity, size_t max_entry_size)
+{
+    cache.reset(new FileCache(capacity, max_entry_size));
+}
+
+void Server::set_gzip_cache(size_t capacity, size_t max_entry_size)
+{
+    compressed.reset(new FileCache(capacity, max_entry_size));
+}
+
+void Server::set_static_store(size_t max_file_size)
+{
+    store_max_file_size = max_file_size;
+}
+
+void Server::reload_static_store()
+{
+    for (;;)
+    {
+        if (::sem_wait(&reload_requests) < 0)
+            continue;
+        // Signals arriving meanwhile are served by a single reload.
+        while (::sem_trywait(&reload_requests) == 0)
+            ;
+        report(INFO) << "reloading the static store" << std::endl;
+        store->reload();
+    }
+}
+
+void Server::set_proxy(std::string const &upstream, size_t pool_size, size_t pipeline_depth)
+{
+    upstream_cache.reset();
+    proxy.reset(new Proxy(upstream, pool_size, pipeline_depth));
+}
+
+void Server::set_proxy_cache(size_t memory_capacity, size_t max_entry_size,
+                             std::string const &disk_dir, size_t disk_capacity,
+                             long default_ttl)
+{
+    assert(proxy);
+    if (memory_capacity == 0)
+    {
+        upstream_cache.reset();
+        return;
+    }
+    upstream_cache.reset(new ProxyCache(*proxy, memory_capacity, max_entry_size,
+                                        disk_dir, disk_capacity, default_ttl));
+}
+
+void Server::set_timeouts(unsigned long header_ms, unsigned long body_ms,
+                          unsigned long idle_ms, unsigned long write_ms)
+{
+    timeouts[TIMEOUT_HEADER] = header_ms;
+    timeouts[TIMEOUT_BODY] = body_ms;
+    timeouts[TIMEOUT_IDLE] = idle_ms;
+    timeouts[TIMEOUT_WRITE] = write_ms;
+}
+
+static bool is_whitespace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+std::string &Server::trim_whitespace(std::string &s)
+{
+    // Erased in place, the string keeps its buffer.
+    size_t end = s.length();
+    while (end > 0 && is_whitespace(s[end - 1]))
+        end--;
+    s.erase(end);
+
+    size_t begin = 0;
+    while (begin < s.length() && is_whitespace(s[begin]))
+        begin++;
+    s.erase(0, begin);
 
     return s;
 }
 
-bool Server::parse_req_line(std::string &line, 
+bool Server::parse_req_line(StringRef line,
                             std::string &method,
                             std::string &uri,
                             std::string &version)
 {
-    trim_whitespace(line);
-    std::vector<std::string> v = split(line, " ");
-    if (v.size() != 3)
+    const char *p = line.data;
+    const char *end = p + line.length;
+    while (p < end && is_whitespace(*p))
+        p++;
+    while (end > p && is_whitespace(end[-1]))
+        end--;
+
+    // Exactly three parts separated by single spaces.
+    const char *sp1 = static_cast<const char *>(std::memchr(p, ' ', end - p));
+    const char *sp2 = sp1 ? static_cast<const char *>(std::memchr(sp1 + 1, ' ', end - sp1 - 1)) : nullptr;
+    if (!sp2 || sp1 == p || sp2 == sp1 + 1 || std::memchr(sp2 + 1, ' ', end - sp2 - 1))
     {
-        report(ERROR) << "invalid http request: " << line << std::endl;
+        report(ERROR) << "invalid http request: " << std::string(p, end) << std::endl;
         return false;
     }
 
-    method = v[0];
-    uri = v[1];
-    version = v[2];
+    method.assign(p, sp1);
+    uri.assign(sp1 + 1, sp2);
+    version.assign(sp2 + 1, end);
     return true;
 }
 
-std::unique_ptr<Headers> Server::parse_headers(std::string &str)
+bool Server::parse_headers(StringRef head, Headers &headers)
 {
-    auto hdr_obj = std::unique_ptr<Headers>(new Headers());
-    auto hdrs = split(str, "\n");
+    const char *p = head.data;
+    const char *end = p + head.length;
 
-    for (auto &hd : hdrs)
+    while (p < end)
     {
-        trim_whitespace(hd);
-        auto kv = split(hd, ":");
-
-        if (kv.size() > 2)
+        const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        if (!eol)
+            eol = end;
+        const char *line_end = eol;
+        if (line_end > p && line_end[-1] == '\r')
+            line_end--;
+
+        // The empty line closing the head.
+        if (line_end == p)
+            break;
+
+        const char *colon = static_cast<const char *>(std::memchr(p, ':', line_end - p));
+        if (!colon || colon == p)
         {
-            auto value = std::vector<std::string>(kv.begin() + 1, kv.end());
-            kv[1] = concat(value, ":");
-        }
-        else if (kv.size() < 2)
-        {
-            report(ERROR) << "invalid header: " << hd << std::endl;
+            report(ERROR) << "invalid header: " << std::string(p, line_end) << std::endl;
+            p = eol + 1;
             continue;
         }
 
-        trim_whitespace(kv[0]);
-        trim_whitespace(kv[1]);
-        (*hdr_obj)[kv[0]] = kv[1];
+        // Values are trimmed, names may not contain whitespace anyway.
+        const char *name_end = colon;
+        while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t'))
+            name_end--;
+        const char *value = colon + 1;
+        const char *value_end = line_end;
+        while (value < value_end && (*value == ' ' || *value == '\t'))
+            value++;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            value_end--;
+
+        headers.add(StringRef(p, name_end - p), StringRef(value, value_end - value));
+        p = eol + 1;
     }
-    return hdr_obj;
+    return true;
 }
 
 /// A complete ugly hack since I'm running out of time.
@@ -209,115 +562,806 @@ Server::parse_name_id(std::string const&data)
     return map;
 }
 
-/// Complete hack.
-void Server::recv_body(Request *req, TCPSocket *client_sock)
+bool Server::recv_body(Request *req, BodyReader &body)
+{
+    if (body.length() > static_cast<long long>(max_body_size))
+        return false;
+
+    // Chunked bodies grow piece by piece up to the limit.
+    static const size_t PIECE = 16 << 10;
+    for (;;)
+    {
+        size_t have = req->body.size();
+        size_t want = body.length() >= 0 ? body.length() - have : PIECE;
+        if (want == 0)
+            return true;
+        if (have + want > max_body_size)
+            want = max_body_size - have + 1;
+
+        req->body.resize(have + want);
+        int n = body.read(req->body.data() + have, want);
+        req->body.resize(have + std::max(n, 0));
+        if (n <= 0)
+            return n == 0;
+        if (req->body.size() > max_body_size)
+            return false;
+    }
+}
+
+bool Server::serve_stream(StreamHandler &handler, Request const &req,
+                          BodyReader &body, ResponseWriter &out)
 {
-    static std::vector<std::string> content_lens = {"content-length", "Content-Length", "Content-length"};
+    handler.handle(req, body, out);
 
-    for (auto &CL : content_lens)
-        if (req->headers->find(CL) != req->headers->end())
+    if (!out.started())
+    {
+        internal_error(out, "stream handler sent no response");
+        return false;
+    }
+    out.finish();
+
+    // What the handler left of the body would be taken for the next request.
+    if (!body.done() && !body.drain())
+        return false;
+    return req.keep_alive && !out.failed();
+}
+
+void Server::add_handler(unsigned methods, std::string const &pattern, Handler handler,
+                         bool local)
+{
+    Route route;
+    route.methods = methods;
+    route.handler = std::move(handler);
+    route.local = local;
+    routes.add(pattern, std::move(route));
+}
+
+void Server::add_stream_handler(std::string const &pattern, std::shared_ptr<StreamHandler> handler,
+                                bool local)
+{
+    Route route;
+    route.methods = METHOD_ANY;
+    route.stream = std::move(handler);
+    route.local = local;
+    routes.add(pattern, std::move(route));
+}
+
+bool Server::find_route(Request const &req, RouteMatch &match) const
+{
+    return routes.find(req.method, req.resource, match) && (!proxy || match.route->local);
+}
+
+void Server::set_max_body_size(size_t bytes)
+{
+    max_body_size = bytes;
+}
+
+void Server::serve_client(std::unique_ptr<TCPSocket> client_sock, bool resumed)
+{
+    if (!resumed)
+        Metrics::connection_opened();
+
+    // The worker is free for others until the next request comes.
+    if ((client_sock = serve_connection(std::move(client_sock), !resumed)))
+        workers->park(std::move(client_sock));
+}
+
+std::unique_ptr<TCPSocket> Server::serve_connection(std::unique_ptr<TCPSocket> client_sock, bool first)
+{
+    // Slow or idle clients must not pin a worker forever.
+    ConnectionTimer timer(*this, *client_sock);
+
+    // Requests are built in the thread's arena, reset in one step after
+    // each of them. The head buffer keeps its capacity between requests.
+    Arena &arena = Arena::local();
+    std::string head;
+    head.reserve(1 << 10);
+
+    bool keep;
+    do
+    {
+        keep = serve_request(*client_sock, timer, arena, head, first);
+        arena.reset();
+        first = false;
+
+        // Waits elsewhere for its next request, unless it is here already.
+        if (keep && client_sock->buffered() == 0)
         {
-            long long content_len = std::stoll(req->headers->find(CL)->second);
-            if (content_len > 0)
-            {
-                char *buff = new char[content_len];
-                client_sock->recv_bytes(buff, content_len);
-                req->body = std::vector<char>(buff, buff + content_len);
-                delete[] buff;
-            }
-            return;
+            timer.cancel();
+            return client_sock;
         }
+    } while (keep);
+    timer.cancel();
+    Metrics::connection_closed();
+
+    // Requests pipelined behind a Connection: close are not read.
+    if (workers && client_sock->has_input())
+        workers->linger(std::move(client_sock));
+    else
+        client_sock->close();
+    return nullptr;
 }
 
-void Server::serve_client(std::unique_ptr<TCPSocket> client_sock)
+bool Server::serve_request(TCPSocket &client_sock, ConnectionTimer &timer,
+                           Arena &arena, std::string &head, bool first)
 {
-    std::unique_ptr<Request> req(new Request());
-    std::string req_line = client_sock->recv_line();
+    // A new connection gets the header deadline from the start, a kept
+    // one may stay silent up to the idle deadline first.
+    timer.arm(first ? TIMEOUT_HEADER : TIMEOUT_IDLE);
+
+    Request *req = arena.make<Request>();
+    head.clear();
+    Http1Writer out(client_sock);
+
+    // Peer closed or timed out between requests.
+    if (!client_sock.recv_line(head, MAX_HEAD_SIZE))
+    {
+        if (timer.fired() && timer.kind() == TIMEOUT_HEADER)
+            request_timeout(out);
+        return false;
+    }
+    if (!first)
+        timer.arm(TIMEOUT_HEADER);
+
+    unsigned long long received = now_ns();
+    if (first && client_sock.accepted_at())
+        Metrics::record_phase(Metrics::ACCEPT_TO_FIRST_BYTE, received - client_sock.accepted_at());
 
     /* request line. */
-    if (!parse_req_line(req_line, req->method, req->resource, req->version))
+    size_t line_length = head.length();
+    if (!parse_req_line(head, req->method, req->resource, req->version))
+        return false;
+
+    // The line opening the HTTP/2 connection preface.
+    if (req->method == "PRI" && req->resource == "*" && req->version == "HTTP/2.0")
     {
-        client_sock->close();
-        return;
+        static const size_t line = sizeof("PRI * HTTP/2.0\r\n") - 1;
+        char rest[Http2Connection::PREFACE_LENGTH - line];
+        if (StringRef(head) != StringRef(Http2Connection::PREFACE, line) ||
+            client_sock.recv_bytes(rest, sizeof(rest)) != static_cast<int>(sizeof(rest)) ||
+            std::memcmp(rest, Http2Connection::PREFACE + line, sizeof(rest)) != 0)
+            return false;
+        return serve_http2(client_sock, timer, nullptr);
     }
 
-    if (req->version != "HTTP/1.1")
+    // HTTP/1.0 clients are answered and the connection closed. Without
+    // chunks, bodies of unknown length end with it.
+    bool http10 = req->version == "HTTP/1.0";
+    if (req->version != "HTTP/1.1" && !http10)
     {
-        version_not_supported(std::move(client_sock));
-        return;
+        version_not_supported(out);
+        return false;
     }
+    out.set_chunked(!http10);
 
     /* headers. */
-    std::stringstream header_stream;
-    std::string line = client_sock->recv_line();
-    while (line != "\r\n")
+    if (!client_sock.recv_head(head, MAX_HEAD_SIZE))
     {
-        header_stream << line;
-        line = client_sock->recv_line();
+        // Connection lost in the middle of the headers.
+        if (timer.fired())
+            request_timeout(out);
+        return false;
     }
 
-    std::string header_str = header_stream.str();
-    std::unique_ptr<Headers> headers = parse_headers(header_str);
-    if (!headers)
+    req->head = StringRef(head.data() + line_length, head.length() - line_length);
+    if (!parse_headers(req->head, req->headers))
     {
-        internal_error(std::move(client_sock), "internal error");
-        return;
+        internal_error(out, "internal error");
+        return false;
     }
-    req->headers.reset(headers.release());
+    req->keep_alive = !http10 && !req->headers.contains_token(Headers::CONNECTION, "close") && !draining;
+    out.set_close(!req->keep_alive);
+
+    BodyReader body(client_sock, req->headers);
+    if (!body.valid())
+    {
+        bad_request(out, "Unsupported body framing");
+        return false;
+    }
+
+    // Upgrades with a body are served as HTTP/1.1, as RFC 7540 allows.
+    if (!http10 && req->headers.contains_token("Upgrade", "h2c") && req->headers.get("HTTP2-Settings") &&
+        body.length() == 0)
+        return serve_http2(client_sock, timer, req);
 
     /* body. */
-    recv_body(req.get(), client_sock.get());
+    timer.arm(TIMEOUT_BODY);
+
+    RouteMatch match;
+    bool routed = find_route(*req, match);
+    bool streaming = routed && match.route->stream;
+    if (!streaming)
+    {
+        // Bodies nobody looks at are discarded piece by piece. In proxy
+        // mode they are all forwarded, or go to a local route.
+        bool wanted = proxy || routed;
+        if (!(wanted ? recv_body(req, body) : body.drain()))
+        {
+            if (timer.fired())
+                request_timeout(out);
+            else if (!body.failed())
+                payload_too_large(out);
+            return false;
+        }
+    }
+
+    unsigned long long parsed = now_ns();
+    Metrics::record_phase(Metrics::PARSE, parsed - received);
 
     /* dispatch. */
-    if (req->method == "GET")
-        handle_get(std::move(req), std::move(client_sock));
-    else if (req->method == "POST")
-        handle_post(std::move(req), std::move(client_sock));
-    else
-        method_not_supported(std::move(client_sock), req->method);
+    unsigned long long send_before = client_sock.send_time_ns();
+    Metrics::note_status(0);
+
+    // Streamed bodies are received under the write deadline too: it only
+    // passes once nothing moves either way for that long.
+    timer.arm(TIMEOUT_WRITE);
+    bool keep_alive = streaming ? serve_stream(*match.route->stream, *req, body, out)
+                                : dispatch(*req, out);
+    timer.cancel();
+
+    unsigned long long done = now_ns();
+    unsigned long long sending = client_sock.send_time_ns() - send_before;
+    Metrics::record_phase(Metrics::SEND, sending);
+    Metrics::record_phase(Metrics::HANDLER, done - parsed > sending ? done - parsed - sending : 0);
+    Metrics::record_request(req->method, Metrics::last_status(), done - received);
+    return keep_alive;
+}
+
+bool Server::serve_http2(TCPSocket &client_sock, ConnectionTimer &timer, Request *upgrade)
+{
+    // Deadlines are kept by the HTTP/2 connection from now on.
+    timer.cancel();
+
+    StringRef settings;
+    if (upgrade)
+    {
+        settings = *upgrade->headers.get("HTTP2-Settings");
+        upgrade->headers.erase("Upgrade");
+        upgrade->headers.erase("HTTP2-Settings");
+        upgrade->headers.erase("Connection");
+        upgrade->keep_alive = true;
+
+        static const char switching[] =
+            "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        if (client_sock.send(switching, sizeof(switching) - 1) < 0)
+            return false;
+    }
+
+    Http2Connection(*this, client_sock).serve(upgrade, settings);
+    return false;
+}
+
+bool Server::dispatch(Request &req, ResponseWriter &out)
+{
+    // Only local routes are served by this server in proxy mode.
+    RouteMatch match;
+    if (find_route(req, match) && match.route->handler)
+        return match.route->handler(req, out, match);
+
+    if (upstream_cache)
+        return upstream_cache->serve(req, out);
+    if (proxy)
+        return proxy->forward(req, out);
+
+    if (match.allowed)
+    {
+        method_not_allowed(out, match.allowed);
+        return false;
+    }
+    if (req.method == "GET")
+        return handle_get(req, out);
+    if (req.method == "POST")
+    {
+        page_not_found(out, req.resource);
+        return false;
+    }
+
+    method_not_supported(out, req.method);
+    return false;
+}
+
+/// Content-type [type], Content-Encoding [encoding] if any, and Vary
+/// when the response depends on the Accept-Encoding of the request.
+static ResponseBuilder &representation(ResponseBuilder &builder, const char *type,
+                                       const char *encoding)
+{
+    builder.header("Content-type", type);
+    if (encoding)
+        builder.header("Content-Encoding", encoding);
+    if (compressible(type))
+        builder.header("Vary", "Accept-Encoding");
+    return builder;
+}
+
+/// Start the 304 answering [req] with the version described by
+/// [validators] of a file of [type].
+static ResponseBuilder &not_modified_response(Request const &req,
+                                              FileCache::Validators const &validators,
+                                              const char *type)
+{
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::NOT_MODIFIED, "Not Modified")
+           .header("Server", Server::server_name)
+           .header("ETag", validators.etag)
+           .header("Last-Modified", validators.last_modified);
+    if (compressible(type))
+        builder.header("Vary", "Accept-Encoding");
+    if (!req.keep_alive)
+        builder.header("Connection", "close");
+    return builder;
+}
+
+/// Read [len] bytes of [fd] from its start into [buf].
+static bool read_file(int fd, char *buf, size_t len)
+{
+    size_t nread = 0;
+    while (nread < len)
+    {
+        ssize_t n = ::pread(fd, buf + nread, len - nread, nread);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        nread += n;
+    }
+    return true;
+}
+
+FileCache::response_ptr Server::load_cached_response(std::string const &filename,
+                                                     FileCache::Validators &validators,
+                                                     const char *type, const char *encoding)
+{
+    FileCache &files = encoding ? *compressed : *cache;
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !files.cacheable(st))
+    {
+        if (fd >= 0)
+            ::close(fd);
+        return nullptr;
+    }
+
+    validators = FileCache::Validators::of(st);
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::OK, "OK")
+           .header("Server", server_name);
+    representation(builder, type, encoding)
+           .header("Content-length", st.st_size)
+           .header("ETag", validators.etag)
+           .header("Last-Modified", validators.last_modified);
+    if (!encoding)
+        builder.header("Accept-Ranges", "bytes");
+
+    std::shared_ptr<std::string> response(new std::string(builder.finish()));
+    size_t header_len = response->length();
+    response->resize(header_len + st.st_size);
+
+    bool ok = read_file(fd, &(*response)[header_len], st.st_size);
+    ::close(fd);
+    if (!ok)
+        return nullptr;
+
+    files.put(filename, st, response, validators);
+    return response;
+}
+
+FileCache::response_ptr Server::gzip_response(Request const &req, std::string const &filename,
+                                              struct stat const &st, const char *type)
+{
+    if (!compressed->cacheable(st))
+        return nullptr;
+
+    // The entity tag differs from the one of the identity response, as
+    // the bytes do.
+    FileCache::Validators validators;
+    FileCache::response_ptr cached = compressed->get(filename, st, &validators);
+    if (!cached)
+    {
+        validators = FileCache::Validators::of(st);
+        validators.etag.insert(validators.etag.length() - 1, "-gzip");
+    }
+    // An empty response stands for a file that does not compress.
+    else if (cached->empty())
+        return nullptr;
+
+    if (not_modified(req, st.st_mtime, validators))
+        return std::make_shared<const std::string>(
+            not_modified_response(req, validators, type).finish());
+    if (cached)
+        return cached;
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat fst;
+    if (fd < 0 || ::fstat(fd, &fst) < 0 || !S_ISREG(fst.st_mode) || !compressed->cacheable(fst))
+    {
+        if (fd >= 0)
+            ::close(fd);
+        return nullptr;
+    }
+
+    std::string plain(fst.st_size, '\0');
+    bool ok = read_file(fd, &plain[0], plain.length());
+    ::close(fd);
+    std::string body;
+    if (!ok || !gzip_compress(plain.data(), plain.length(), body))
+        return nullptr;
+
+    validators = FileCache::Validators::of(fst);
+    validators.etag.insert(validators.etag.length() - 1, "-gzip");
+    if (body.length() >= plain.length())
+    {
+        compressed->put(filename, fst, std::make_shared<const std::string>(), validators);
+        return nullptr;
+    }
+
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::OK, "OK")
+           .header("Server", server_name);
+    representation(builder, type, "gzip")
+           .header("Content-length", body.length())
+           .header("ETag", validators.etag)
+           .header("Last-Modified", validators.last_modified);
+
+    std::shared_ptr<std::string> response(new std::string(builder.finish()));
+    response->append(body);
+    compressed->put(filename, fst, response, validators);
+    return response;
 }
 
-void Server::handle_get(std::unique_ptr<Request> req, std::unique_ptr<TCPSocket> client_sock)
+/// Whether one of the entity tags listed in [header] matches [etag]
+/// (weak comparison).
+static bool etag_matches(StringRef header, std::string const &etag)
 {
-    std::unique_ptr<Response> res(new Response());
-    std::string filename = parse_uri(req->resource);
+    StringRef strong(etag);
+    const char *p = header.data;
+    const char *end = header.data + header.length;
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *b = p;
+        while (p < end && *p != ',')
+            p++;
+        const char *e = p;
+        while (e > b && (e[-1] == ' ' || e[-1] == '\t'))
+            e--;
+
+        StringRef tag(b, e - b);
+        if (tag == "*")
+            return true;
+        if (tag.length > 2 && tag.data[0] == 'W' && tag.data[1] == '/')
+            tag = StringRef(tag.data + 2, tag.length - 2);
+        if (tag == strong)
+            return true;
+    }
+    return false;
+}
+
+bool Server::not_modified(Request const &req, std::time_t mtime,
+                          FileCache::Validators const &validators)
+{
+    // If-None-Match takes precedence, If-Modified-Since is then ignored.
+    if (StringRef const *inm = req.headers.get(Headers::IF_NONE_MATCH))
+        return etag_matches(*inm, validators.etag);
+
+    std::time_t since;
+    StringRef const *ims = req.headers.get(Headers::IF_MODIFIED_SINCE);
+    return ims && parse_http_date(ims->str(), since) && mtime <= since;
+}
+
+std::string Server::stored_head(StaticStore::Representation const &r)
+{
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::OK, "OK")
+           .header("Server", server_name);
+    representation(builder, r.type, r.encoding)
+           .header("Content-length", r.size)
+           .header("ETag", r.validators.etag)
+           .header("Last-Modified", r.validators.last_modified);
+    if (!r.encoding)
+        builder.header("Accept-Ranges", "bytes");
+    return builder.finish();
+}
+
+bool Server::stored_response(Request const &req, StaticStore::index_ptr &index,
+                             FileCache::response_ptr &head, StaticStore::Representation const *&r)
+{
+    if (!store || req.headers.get(Headers::RANGE))
+        return false;
 
-    std::ifstream file(filename);
+    index = store->index();
+    StaticStore::File const *file = index->find(parse_uri(req.resource));
     if (!file)
+        return false;
+
+    r = &file->identity;
+    if (file->has_gzip && accepts_gzip(req.headers.get(Headers::ACCEPT_ENCODING)))
+        r = &file->gzip;
+
+    if (not_modified(req, r->mtime, r->validators))
     {
-        page_not_found(std::move(client_sock), req->resource);
-        return;
+        head = std::make_shared<const std::string>(
+            not_modified_response(req, r->validators, r->type).finish());
+        r = nullptr;
+        return true;
     }
 
-    std::string content((std::istreambuf_iterator<char>(file)),
-        std::istreambuf_iterator<char>());
+    head = r->head;
+    return true;
+}
+
+FileCache::response_ptr Server::static_response(Request const &req)
+{
+    std::string filename = parse_uri(req.resource);
 
-    res->status_code = 200;
-    res->status = "OK";
-    res->body = std::vector<char>(content.begin(), content.end());
-    res->headers->insert(std::make_pair("Server", server_name));
-    res->headers->insert(std::make_pair("Content-type", "text/html"));
-    res->headers->insert(std::make_pair("Content-length", std::to_string(content.length())));
+    struct stat st;
+    if (filename.empty() || req.headers.get(Headers::RANGE) || ::stat(filename.c_str(), &st) < 0 ||
+        !S_ISREG(st.st_mode) || !cache->cacheable(st))
+        return nullptr;
 
-    std::string html = res->serialize();
-    client_sock->send(html.c_str(), html.length());
+    const char *type = mime_type(filename);
+    if (compressible(type) && accepts_gzip(req.headers.get(Headers::ACCEPT_ENCODING)))
+    {
+        // Precompressed files are left to handle_get.
+        struct stat gz;
+        if (::stat((filename + ".gz").c_str(), &gz) == 0 && S_ISREG(gz.st_mode))
+            return nullptr;
+        if (FileCache::response_ptr response = gzip_response(req, filename, st, type))
+            return response;
+    }
+
+    FileCache::Validators validators;
+    FileCache::response_ptr cached = cache->get(filename, st, &validators);
+    if (!cached)
+        validators = FileCache::Validators::of(st);
+
+    if (not_modified(req, st.st_mtime, validators))
+        return std::make_shared<const std::string>(
+            not_modified_response(req, validators, type).finish());
+
+    if (!cached)
+        cached = load_cached_response(filename, validators, type);
+    return cached;
 }
 
-/// I know this is ugly. But I'm running out of time.
-void Server::handle_post(std::unique_ptr<Request> req, std::unique_ptr<TCPSocket> client_sock)
+bool Server::if_range_matches(Request const &req, FileCache::Validators const &validators)
 {
-    std::unique_ptr<Response> res(new Response());
-    std::string uri = req->resource;
-    auto data = parse_name_id(std::string(req->body.begin(), req->body.end()));
+    // Absent, or naming the current version by its entity tag or date.
+    StringRef const *if_range = req.headers.get("If-Range");
+    return !if_range || *if_range == validators.etag || *if_range == validators.last_modified;
+}
+
+/// "bytes first-last/size".
+static std::string content_range(ByteRange const &r, long long size)
+{
+    return "bytes " + std::to_string(r.first) + "-" + std::to_string(r.last) + "/" + std::to_string(size);
+}
 
-    if (uri != "/Post_show" || !data.count("Name") || !data.count("ID"))
+bool Server::send_ranges(Request const &req, ResponseWriter &out, int fd,
+                         struct stat const &st, FileCache::Validators const &validators,
+                         std::vector<ByteRange> const &ranges, const char *type)
+{
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::PARTIAL_CONTENT, "Partial Content")
+           .header("Server", server_name)
+           .header("Accept-Ranges", "bytes")
+           .header("ETag", validators.etag)
+           .header("Last-Modified", validators.last_modified);
+
+    if (ranges.size() == 1)
     {
-        page_not_found(std::move(client_sock), uri);
-        return;
+        ByteRange const &r = ranges.front();
+        representation(builder, type, nullptr)
+               .header("Content-Range", content_range(r, st.st_size))
+               .header("Content-length", r.length());
+        if (!req.keep_alive)
+            builder.header("Connection", "close");
+
+        return out.start(builder.finish(), r.length()) &&
+               out.write_file(fd, r.first, r.length()) && out.finish();
+    }
+
+    // multipart/byteranges: every part has its own head, the length of
+    // the whole is known up front so the connection can be kept.
+    static std::atomic<unsigned long long> boundaries(0);
+    std::stringstream bs;
+    bs << std::hex << now_ns() << boundaries++;
+    std::string boundary = bs.str();
+
+    std::vector<std::string> heads;
+    long long length = 0;
+    for (ByteRange const &r : ranges)
+    {
+        heads.push_back("\r\n--" + boundary + "\r\nContent-type: " + type + "\r\nContent-Range: " +
+                        content_range(r, st.st_size) + "\r\n\r\n");
+        length += heads.back().length() + r.length();
+    }
+    std::string closing = "\r\n--" + boundary + "--\r\n";
+    length += closing.length();
+
+    builder.header("Content-type", "multipart/byteranges; boundary=" + boundary)
+           .header("Content-length", length);
+    if (compressible(type))
+        builder.header("Vary", "Accept-Encoding");
+    if (!req.keep_alive)
+        builder.header("Connection", "close");
+
+    if (!out.start(builder.finish(), length))
+        return false;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        if (!out.write(heads[i].data(), heads[i].length()) ||
+            !out.write_file(fd, ranges[i].first, ranges[i].length()))
+            return false;
+    }
+    return out.write(closing.data(), closing.length()) && out.finish();
+}
+
+bool Server::handle_get(Request &req, ResponseWriter &out)
+{
+    // Mapped files are sent without touching the file system.
+    StaticStore::index_ptr index;
+    FileCache::response_ptr head;
+    StaticStore::Representation const *stored = nullptr;
+    if (stored_response(req, index, head, stored))
+    {
+        if (!out.send(*head, stored ? stored->body : nullptr, stored ? stored->size : 0))
+        {
+            report(ERROR) << "fail sending " << req.resource << std::endl;
+            return false;
+        }
+        return req.keep_alive;
+    }
+
+    std::string filename = parse_uri(req.resource);
+
+    struct stat st;
+    if (filename.empty() || ::stat(filename.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        page_not_found(out, req.resource);
+        return false;
+    }
+
+    // Compressible files are sent gzip encoded to clients accepting it,
+    // from a precompressed ".gz" next to the file if there is one, else
+    // compressed once per version. Ranges are of the identity encoding.
+    const char *type = mime_type(filename);
+    const char *encoding = nullptr;
+    StringRef const *range = req.headers.get(Headers::RANGE);
+    if (compressible(type) && !range && accepts_gzip(req.headers.get(Headers::ACCEPT_ENCODING)))
+    {
+        std::string sibling = filename + ".gz";
+        struct stat gz;
+        if (::stat(sibling.c_str(), &gz) == 0 && S_ISREG(gz.st_mode))
+        {
+            filename = sibling;
+            st = gz;
+            encoding = "gzip";
+        }
+        else if (FileCache::response_ptr response = gzip_response(req, filename, st, type))
+        {
+            if (!out.send_serialized(*response))
+            {
+                report(ERROR) << "fail sending " << filename << std::endl;
+                return false;
+            }
+            return req.keep_alive;
+        }
+    }
+
+    // A precompressed sibling is cached apart from the file of its name,
+    // whose GETs get it as is.
+    FileCache &files = encoding ? *compressed : *cache;
+    FileCache::Validators validators;
+    FileCache::response_ptr cached;
+    if (files.cacheable(st))
+        cached = files.get(filename, st, &validators);
+    if (!cached)
+        validators = FileCache::Validators::of(st);
+
+    // The client's copy is current, the file is not even opened.
+    if (not_modified(req, st.st_mtime, validators))
+    {
+        if (!not_modified_response(req, validators, type).send(out))
+            return false;
+        return req.keep_alive;
     }
 
-    res->status_code = 200;
-    res->status = "OK";
+    // Ranges are served from the file, whatever its size.
+    bool ranged = range && if_range_matches(req, validators);
+
+    // Small files are answered with a single send of the cached response.
+    if (!ranged && files.cacheable(st))
+    {
+        if (!cached)
+            cached = load_cached_response(filename, validators, type, encoding);
+
+        if (cached)
+        {
+            if (!out.send_serialized(*cached))
+            {
+                report(ERROR) << "fail sending " << filename << std::endl;
+                return false;
+            }
+            return req.keep_alive;
+        }
+    }
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0 || ::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        if (fd >= 0)
+            ::close(fd);
+        page_not_found(out, req.resource);
+        return false;
+    }
+    validators = FileCache::Validators::of(st);
+
+    // Against the size of the file as opened.
+    std::vector<ByteRange> ranges;
+    RangeResult result = ranged ? parse_range(range->str(), st.st_size, ranges) : RANGE_IGNORED;
+    if (result == RANGE_UNSATISFIABLE)
+    {
+        ::close(fd);
+        ResponseBuilder &builder = ResponseBuilder::local();
+        builder.start(Response::RANGE_NOT_SATISFIABLE, "Range Not Satisfiable")
+               .header("Server", server_name)
+               .header("Content-Range", "bytes */" + std::to_string(st.st_size))
+               .header("Content-length", 0ULL);
+        if (!req.keep_alive)
+            builder.header("Connection", "close");
+        if (!builder.send(out))
+            return false;
+        return req.keep_alive;
+    }
+    if (result == RANGE_SATISFIABLE)
+    {
+        bool ok = send_ranges(req, out, fd, st, validators, ranges, type);
+        if (!ok)
+            report(ERROR) << "fail sending ranges of " << filename << std::endl;
+        ::close(fd);
+        return ok && req.keep_alive;
+    }
+
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::OK, "OK")
+           .header("Server", server_name);
+    representation(builder, type, encoding)
+           .header("Content-length", st.st_size)
+           .header("ETag", validators.etag)
+           .header("Last-Modified", validators.last_modified);
+    // Ranges are only served of the identity encoding.
+    if (!encoding)
+        builder.header("Accept-Ranges", "bytes");
+    if (!req.keep_alive)
+        builder.header("Connection", "close");
+
+    // The head leaves with the first segment of the file, which is sent
+    // as it is read, however large.
+    bool ok = true;
+    if (!out.start(builder.finish(), st.st_size) || !out.write_file(fd, 0, st.st_size) ||
+        !out.finish())
+    {
+        // Failed, or cut short by a file truncated meanwhile: the
+        // response is incomplete, the connection cannot be kept.
+        report(ERROR) << "fail sending " << filename << std::endl;
+        ok = false;
+    }
+
+    ::close(fd);
+    return ok && req.keep_alive;
+}
+
+/// I know this is ugly. But I'm running out of time.
+bool Server::handle_post(Request &req, ResponseWriter &out)
+{
+    auto data = parse_name_id(std::string(req.body.begin(), req.body.end()));
+
+    if (!data.count("Name") || !data.count("ID"))
+    {
+        page_not_found(out, req.resource);
+        return false;
+    }
 
     std::stringstream ss;
     ss << "<html><title>POST method</title><body bgcolor=ffffff>\r\n";
@@ -325,59 +1369,187 @@ void Server::handle_post(std::unique_ptr<Request> req, std::unique_ptr<TCPSocket
     ss << "ID:  " << data["ID"] << "\r\n";
     ss << "<hr><em>Http Web server</em>\r\n";
     ss << "</body></html>\r\n";
-    std::string content = ss.str();
 
-    res->headers->insert(std::make_pair("Server", server_name));
-    res->headers->insert(std::make_pair("Content-type", "text/html"));
-    res->headers->insert(std::make_pair("Content-length", std::to_string(content.length())));
-    res->body = std::vector<char>(content.begin(), content.end());
+    send_html(out, Response::OK, "OK", ss.str(), req.keep_alive);
+    return req.keep_alive;
+}
+
+bool Server::handle_metrics(Request &req, ResponseWriter &out)
+{
+    std::string body;
+    body.reserve(16 << 10);
+    Metrics::render(body);
+
+    std::stringstream ss;
+    if (workers)
+    {
+        ss << "# HELP httpserver_queue_depth Accepted connections waiting for a worker.\n";
+        ss << "# TYPE httpserver_queue_depth gauge\n";
+        ss << "httpserver_queue_depth " << workers->queue_depth() << "\n";
+        ss << "# HELP httpserver_parked_connections Kept-alive connections waiting for a request without a worker.\n";
+        ss << "# TYPE httpserver_parked_connections gauge\n";
+        ss << "httpserver_parked_connections " << workers->parked() << "\n";
+        ss << "# HELP httpserver_shed_total Connections answered 503 without being served.\n";
+        ss << "# TYPE httpserver_shed_total counter\n";
+        ss << "httpserver_shed_total{reason=\"queue_full\"} " << workers->shed_full() << "\n";
+        ss << "httpserver_shed_total{reason=\"queue_delay\"} " << workers->shed_delay() << "\n";
+    }
 
-    std::string html = res->serialize();
-    client_sock->send(html.c_str(), html.length());
-    client_sock->close();
+    ss << "# TYPE httpserver_h2_connections_total counter\n";
+    ss << "httpserver_h2_connections_total " << Http2Connection::connections() << "\n";
+    ss << "# TYPE httpserver_h2_streams_total counter\n";
+    ss << "httpserver_h2_streams_total " << Http2Connection::streams() << "\n";
+
+    if (uring)
+    {
+        ss << "# HELP httpserver_uring_enters_total io_uring_enter(2) calls of the io_uring loops.\n";
+        ss << "# TYPE httpserver_uring_enters_total counter\n";
+        ss << "httpserver_uring_enters_total " << uring->enters() << "\n";
+        ss << "# TYPE httpserver_uring_requests_total counter\n";
+        ss << "httpserver_uring_requests_total " << uring->requests() << "\n";
+        ss << "# TYPE httpserver_uring_handoffs_total counter\n";
+        ss << "httpserver_uring_handoffs_total " << uring->handoffs() << "\n";
+    }
+
+    ss << "# TYPE httpserver_file_cache_hits_total counter\n";
+    ss << "httpserver_file_cache_hits_total " << cache->hits() << "\n";
+    ss << "# TYPE httpserver_file_cache_misses_total counter\n";
+    ss << "httpserver_file_cache_misses_total " << cache->misses() << "\n";
+    ss << "# TYPE httpserver_file_cache_evictions_total counter\n";
+    ss << "httpserver_file_cache_evictions_total " << cache->evictions() << "\n";
+    ss << "# TYPE httpserver_file_cache_bytes gauge\n";
+    ss << "httpserver_file_cache_bytes " << cache->bytes() << "\n";
+    ss << "# TYPE httpserver_file_cache_entries gauge\n";
+    ss << "httpserver_file_cache_entries " << cache->entries() << "\n";
+    ss << "# TYPE httpserver_gzip_cache_hits_total counter\n";
+    ss << "httpserver_gzip_cache_hits_total " << compressed->hits() << "\n";
+    ss << "# TYPE httpserver_gzip_cache_misses_total counter\n";
+    ss << "httpserver_gzip_cache_misses_total " << compressed->misses() << "\n";
+    ss << "# TYPE httpserver_gzip_cache_bytes gauge\n";
+    ss << "httpserver_gzip_cache_bytes " << compressed->bytes() << "\n";
+
+    if (store)
+    {
+        StaticStore::index_ptr index = store->index();
+        ss << "# TYPE httpserver_static_store_files gauge\n";
+        ss << "httpserver_static_store_files " << index->files.size() << "\n";
+        ss << "# TYPE httpserver_static_store_bytes gauge\n";
+        ss << "httpserver_static_store_bytes " << index->bytes << "\n";
+        ss << "# TYPE httpserver_static_store_reloads_total counter\n";
+        ss << "httpserver_static_store_reloads_total " << store->reloads() << "\n";
+    }
+
+    if (upstream_cache)
+    {
+        ss << "# TYPE httpserver_proxy_cache_hits_total counter\n";
+        ss << "httpserver_proxy_cache_hits_total " << upstream_cache->hits() << "\n";
+        ss << "# TYPE httpserver_proxy_cache_misses_total counter\n";
+        ss << "httpserver_proxy_cache_misses_total " << upstream_cache->misses() << "\n";
+        ss << "# TYPE httpserver_proxy_cache_revalidations_total counter\n";
+        ss << "httpserver_proxy_cache_revalidations_total " << upstream_cache->revalidations() << "\n";
+        ss << "# TYPE httpserver_proxy_cache_collapsed_total counter\n";
+        ss << "httpserver_proxy_cache_collapsed_total " << upstream_cache->collapsed() << "\n";
+        ss << "# TYPE httpserver_proxy_cache_bytes_saved_total counter\n";
+        ss << "httpserver_proxy_cache_bytes_saved_total " << upstream_cache->bytes_saved() << "\n";
+        ss << "# TYPE httpserver_proxy_cache_bytes gauge\n";
+        ss << "httpserver_proxy_cache_bytes{tier=\"memory\"} " << upstream_cache->memory_bytes() << "\n";
+        ss << "httpserver_proxy_cache_bytes{tier=\"disk\"} " << upstream_cache->disk_bytes() << "\n";
+    }
+
+    static const char *timeout_kinds[] = { "header", "body", "idle", "write" };
+    ss << "# HELP httpserver_timeouts_total Connections shut down for missing a deadline.\n";
+    ss << "# TYPE httpserver_timeouts_total counter\n";
+    for (int k = 0; k < TIMEOUT_KINDS; k++)
+        ss << "httpserver_timeouts_total{kind=\"" << timeout_kinds[k] << "\"} " << timeouts_fired[k] << "\n";
+
+    ss << "# HELP httpserver_log_dropped_total Log records dropped because a ring was full.\n";
+    ss << "# TYPE httpserver_log_dropped_total counter\n";
+    ss << "httpserver_log_dropped_total " << Reporter::dropped() << "\n";
+    body.append(ss.str());
+
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::OK, "OK")
+           .header("Server", server_name)
+           .header("Content-type", "text/plain; version=0.0.4")
+           .header("Content-length", body.length());
+    if (!req.keep_alive)
+        builder.header("Connection", "close");
+
+    if (!builder.send(out, body.data(), body.length()))
+    {
+        report(ERROR) << "fail sending metrics" << std::endl;
+        return false;
+    }
+    return req.keep_alive;
 }
 
-void Server::page_not_found(std::unique_ptr<TCPSocket> client_sock, std::string const &f)
+void Server::send_html(ResponseWriter &out, int status_code,
+                       std::string const &status, std::string const &body,
+                       bool keep_alive)
 {
-    std::unique_ptr<Response> res(new Response());
-    res->status_code = 404;
-    res->status = "Page Not Found";
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(status_code, status)
+           .header("Server", server_name)
+           .header("Content-type", "text/html")
+           .header("Content-length", body.length());
+    if (!keep_alive)
+        builder.header("Connection", "close");
+
+    if (!builder.send(out, body.data(), body.length()))
+        report(ERROR) << "fail sending " << status_code << " response" << std::endl;
+}
 
+void Server::page_not_found(ResponseWriter &out, std::string const &f)
+{
     std::stringstream ss;
     ss << "<html><title>404 Not Found</title><body bgcolor=\"FFFFFF\">\r\n";
     ss << " Not Found\r\n";
     ss << "<p>Couldn't find this file: " << f << "\r\n";
     ss << "<hr><em>HTTP Web server</em>\r\n";
     ss << "</body></html>\r\n";
-    std::string body = ss.str();
 
-    res->headers->insert(std::make_pair("Server", server_name));
-    res->headers->insert(std::make_pair("Content-type", "text/html"));
-    res->headers->insert(std::make_pair("Content-length", std::to_string(body.length())));
-    res->body = std::vector<char>(body.begin(), body.end());
+    send_html(out, Response::NOT_FOUND, "Page Not Found", ss.str(), false);
+}
 
-    std::string html = res->serialize();
-    client_sock->send(html.c_str(), html.length());
-    client_sock->close();
+void Server::internal_error(ResponseWriter &out, std::string const &msg)
+{
+    send_html(out, 501, "Not Implemented", msg, false);
 }
 
-void Server::internal_error(std::unique_ptr<TCPSocket> client_sock, std::string const &msg)
+void Server::bad_request(ResponseWriter &out, std::string const &msg)
 {
-    std::unique_ptr<Response> res(new Response());
-    res->status_code = 501;
-    res->status = "Not Implemented";
+    std::stringstream ss;
+    ss << "<html><title>400 Bad Request</title><body bgcolor=\"FFFFFF\">\r\n";
+    ss << " " << msg << "\r\n";
+    ss << "<hr><em>HTTP Web server</em>\r\n";
+    ss << "</body></html>\r\n";
 
-    res->headers->insert(std::make_pair("Server", server_name));
-    res->headers->insert(std::make_pair("Content-type", "text/html"));
-    res->headers->insert(std::make_pair("Content-length", std::to_string(msg.length())));
-    res->body = std::vector<char>(msg.begin(), msg.end());
+    send_html(out, Response::BAD_REQUEST, "Bad Request", ss.str(), false);
+}
 
-    std::string html = res->serialize();
-    client_sock->send(html.c_str(), html.length());
-    client_sock->close();
+void Server::payload_too_large(ResponseWriter &out)
+{
+    std::stringstream ss;
+    ss << "<html><title>413 Payload Too Large</title><body bgcolor=\"FFFFFF\">\r\n";
+    ss << " Request body exceeds " << max_body_size << " bytes\r\n";
+    ss << "<hr><em>HTTP Web server</em>\r\n";
+    ss << "</body></html>\r\n";
+
+    send_html(out, Response::PAYLOAD_TOO_LARGE, "Payload Too Large", ss.str(), false);
+}
+
+void Server::request_timeout(ResponseWriter &out)
+{
+    std::stringstream ss;
+    ss << "<html><title>408 Request Timeout</title><body bgcolor=\"FFFFFF\">\r\n";
+    ss << " Request Timeout\r\n";
+    ss << "<hr><em>HTTP Web server</em>\r\n";
+    ss << "</body></html>\r\n";
+
+    send_html(out, Response::REQUEST_TIMEOUT, "Request Timeout", ss.str(), false);
 }
 
-void Server::version_not_supported(std::unique_ptr<TCPSocket> client_sock)
+void Server::version_not_supported(ResponseWriter &out)
 {
     std::stringstream ss;
     ss << "<html><title>HTTP version not supported</title>";
@@ -385,10 +1557,29 @@ void Server::version_not_supported(std::unique_ptr<TCPSocket> client_sock)
     ss << "</body></html>\r\n";
     std::string body = ss.str();
 
-    internal_error(std::move(client_sock), body);
+    internal_error(out, body);
+}
+
+void Server::method_not_allowed(ResponseWriter &out, unsigned allowed)
+{
+    static const char body[] =
+        "<html><title>405 Method Not Allowed</title><body>\r\n"
+        " Method Not Allowed\r\n"
+        "<hr><em>HTTP Web server</em>\r\n"
+        "</body></html>\r\n";
+
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::METHOD_NOT_ALLOWED, "Method Not Allowed")
+           .header("Server", server_name)
+           .header("Allow", method_names(allowed))
+           .header("Content-type", "text/html")
+           .header("Content-length", sizeof(body) - 1)
+           .header("Connection", "close");
+    if (!builder.send(out, body, sizeof(body) - 1))
+        report(ERROR) << "fail sending 405 response" << std::endl;
 }
 
-void Server::method_not_supported(std::unique_ptr<TCPSocket> client_sock, std::string &m)
+void Server::method_not_supported(ResponseWriter &out, std::string &m)
 {
     std::stringstream ss;
     ss << "<html><title>501 Not implemented</title>";
@@ -398,7 +1589,7 @@ void Server::method_not_supported(std::unique_ptr<TCPSocket> client_sock, std::s
     ss << "</body></html>\r\n";
     std::string body = ss.str();
 
-    internal_error(std::move(client_sock), body);
+    internal_error(out, body);
 }
 
 } // namespace simple_http_serve
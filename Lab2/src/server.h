@@ -3,12 +3,27 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <pthread.h>
+#include <atomic>
 #include <string>
 #include <memory>
 #include <functional>
+#include <unordered_map>
 #include "thread_pool.h"
+#include "accept_loop.h"
 #include "tcp_socket.h"
 #include "message.h"
+#include "file_cache.h"
+#include "proxy.h"
+#include "proxy_cache.h"
+#include "timer_wheel.h"
+#include "body_stream.h"
+#include "arena.h"
+#include "uring_engine.h"
+#include "http2.h"
+#include "router.h"
+#include "hot_upgrade.h"
+#include "static_store.h"
 
 namespace simple_http_server
 {
@@ -21,48 +36,260 @@ public:
     Server(const std::string &ip, uint16_t port, 
             std::string const &content_base = "", size_t n_threads = 8);
 
+    /// Serve until the process is upgraded, see [set_hot_upgrade]:
+    /// return once the connections are drained, exit if they are not
+    /// within the drain timeout. Otherwise never returns.
     void start();
-    void serve_client(std::unique_ptr<TCPSocket> client_sock);
+    /// Use [n] SO_REUSEPORT listening sockets, each accepted and served
+    /// by its own loop pinned to a core, instead of the thread pool.
+    /// Each loop waits on its connections with epoll, see AcceptLoop.
+    /// 0 (the default) keeps the single acceptor and thread pool.
+    void set_acceptors(size_t n);
+    /// Bound the queue of connections waiting for a worker and shed
+    /// connections that waited over [target_delay_ms] (0 disables), see
+    /// thread_pool. Must precede [start].
+    void set_admission(size_t max_queue, unsigned long target_delay_ms);
+    /// Serve from [n] io_uring loops, see UringEngine. Falls back to the
+    /// thread pool when the kernel lacks io_uring. 0 disables.
+    void set_io_uring(size_t n);
+    /// Replace the static content cache. [capacity] of 0 disables it.
+    void set_file_cache(size_t capacity, size_t max_entry_size);
+    FileCache const &file_cache() const { return *cache; }
+    /// Replace the cache of gzip compressed static responses. Files of a
+    /// compressible type up to [max_entry_size] bytes are compressed once
+    /// per version and kept within [capacity], with the precompressed
+    /// ".gz" files sent in their place. 0 disables compression,
+    /// precompressed files are then sent from disk.
+    void set_gzip_cache(size_t capacity, size_t max_entry_size);
+    FileCache const &gzip_cache() const { return *compressed; }
+    /// Map the files of [content_base] up to [max_file_size] bytes when
+    /// starting and answer GETs of them from the mappings, see
+    /// StaticStore, reloading them on SIGHUP. For content that does not
+    /// change between reloads. 0 (the default) disables it.
+    void set_static_store(size_t max_file_size);
+    /// nullptr unless the static store is enabled.
+    StaticStore const *static_store() const { return store.get(); }
+    /// Forward every request to [upstream] ("host:port") instead of
+    /// serving [content_base].
+    void set_proxy(std::string const &upstream, size_t pool_size, size_t pipeline_depth);
+    /// Cache upstream responses, see ProxyCache. Requires [set_proxy].
+    /// [memory_capacity] of 0 disables the cache.
+    void set_proxy_cache(size_t memory_capacity, size_t max_entry_size,
+                         std::string const &disk_dir, size_t disk_capacity,
+                         long default_ttl);
+    /// nullptr unless the proxy cache is enabled.
+    ProxyCache const *proxy_cache() const { return upstream_cache.get(); }
+    /// Deadlines in milliseconds for receiving the request line and
+    /// headers, receiving the body, waiting for the next request on a
+    /// kept-alive connection and producing and sending a response, the
+    /// last one counted from the last byte sent or received. A
+    /// connection missing one is shut down.
+    void set_timeouts(unsigned long header_ms, unsigned long body_ms,
+                      unsigned long idle_ms, unsigned long write_ms);
+
+    /// Let [handler] answer the requests of [methods] (MethodMask) for
+    /// the paths matching [pattern], see Router, with their bodies
+    /// buffered. In proxy mode only [local] routes are answered, the
+    /// others are forwarded like the requests without a route, which are
+    /// otherwise looked up in [content_base].
+    void add_handler(unsigned methods, std::string const &pattern, Handler handler,
+                     bool local = false);
+    /// Let [handler] answer every request for [pattern], reading the body
+    /// and writing the response in bounded pieces. [local] as above.
+    void add_stream_handler(std::string const &pattern, std::shared_ptr<StreamHandler> handler,
+                            bool local = false);
+    /// Largest request body buffered for the proxy and the form handler.
+    void set_max_body_size(size_t bytes);
+    /// Take the listening socket over from the server listening on the
+    /// Unix socket [path], if any, and listen there for a successor, see
+    /// HotUpgrade. Once handed over, stop accepting and let the
+    /// connections end for up to [drain_timeout_ms]. Thread pool mode
+    /// only. Must precede [start].
+    void set_hot_upgrade(std::string const &path, unsigned long drain_timeout_ms);
+
+    /// Serve requests on [client_sock] until the connection is closed
+    /// or parked in the thread pool between requests. [resumed]
+    /// is set for a parked connection whose next request has come.
+    void serve_client(std::unique_ptr<TCPSocket> client_sock, bool resumed = false);
 
 private:
+    /// Deadline of a connection, kept by [timers].
+    class ConnectionTimer;
+    enum TimeoutKind { TIMEOUT_HEADER, TIMEOUT_BODY, TIMEOUT_IDLE, TIMEOUT_WRITE, TIMEOUT_KINDS };
+
+    /// Accept loops of the SO_REUSEPORT mode. Never returns.
+    void start_reuseport();
+    /// Serve the requests of [client_sock] as long as they come back to
+    /// back. Return it when kept and idle, closed otherwise. [first] is
+    /// set until it sent a request.
+    std::unique_ptr<TCPSocket> serve_connection(std::unique_ptr<TCPSocket> client_sock, bool first);
+    /// Load the files at [paths] into the file cache.
+    void warm_up(std::vector<std::string> const &paths);
+    /// Hand the listening socket over to the first successor ready, then
+    /// get the acceptor out of accept(2).
+    void serve_upgrades();
+    /// Wait for the connections being served to end. Return false if
+    /// some are left after the drain timeout.
+    bool drain();
+
+    /// Simple string splitter.
+    static std::vector<std::string> split(std::string const &str, std::string const &delim);
     std::string &trim_whitespace(std::string &s);
-    bool parse_req_line(std::string &line, 
+    /// Split the request [line] into its three parts.
+    bool parse_req_line(StringRef line,
                         std::string &method,
                         std::string &uri,
                         std::string &version);
-    std::unique_ptr<Headers> parse_headers(std::string &line);
+    /// Add the fields of [head] to [headers] as views into [head].
+    bool parse_headers(StringRef head, Headers &headers);
     /// Parse [uri] and return a file name.
     std::string parse_uri(std::string const &uri);
     /// Complete hack.
     std::unordered_map<std::string, std::string> parse_name_id(std::string const&data);
-    void recv_body(Request *req, TCPSocket *client_sock);
+    /// Read the whole body into [req]. Return false on error or if it
+    /// exceeds [max_body_size].
+    bool recv_body(Request *req, BodyReader &body);
+    /// Run a stream handler. Return whether the connection can be kept.
+    bool serve_stream(StreamHandler &handler, Request const &req,
+                      BodyReader &body, ResponseWriter &out);
+
+    /// Read and answer one request. Return whether the connection
+    /// should be kept for the next one. [first] is set for the first
+    /// request of the connection. The request is built in [arena] and
+    /// its head received into [head], both reused by the next request.
+    bool serve_request(TCPSocket &client_sock, ConnectionTimer &timer,
+                       Arena &arena, std::string &head, bool first);
+    /// Look up the route answering [req] here, see [add_handler]. False
+    /// if there is none, or in proxy mode if it is not local.
+    bool find_route(Request const &req, RouteMatch &match) const;
+    /// Pass a parsed request to its handler, which answers to [out].
+    bool dispatch(Request &req, ResponseWriter &out);
+    /// Serve the rest of the connection as HTTP/2, see Http2Connection.
+    /// [upgrade] is the request asking for it, nullptr if the client
+    /// sent the connection preface. Return false.
+    bool serve_http2(TCPSocket &client_sock, ConnectionTimer &timer, Request *upgrade);
+
+    /// Send a complete text/html response. [keep_alive] set to false
+    /// announces that the connection is closed afterwards.
+    void send_html(ResponseWriter &out, int status_code,
+                   std::string const &status, std::string const &body,
+                   bool keep_alive = true);
+
+    /* Error handlers. They all close the connection. */
+    void page_not_found(ResponseWriter &out, std::string const &f);
+    void method_not_supported(ResponseWriter &out, std::string &m);
+    /// 405 listing the methods of the routes of the path in Allow.
+    void method_not_allowed(ResponseWriter &out, unsigned allowed);
+    void version_not_supported(ResponseWriter &out);
+    void internal_error(ResponseWriter &out, std::string const &msg);
+    void bad_request(ResponseWriter &out, std::string const &msg);
+    void payload_too_large(ResponseWriter &out);
+    void request_timeout(ResponseWriter &out);
 
-    /* Error handlers. */
-    void page_not_found(std::unique_ptr<TCPSocket> client_sock, std::string const &f);
-    void method_not_supported(std::unique_ptr<TCPSocket> client_sock, std::string &m);
-    void version_not_supported(std::unique_ptr<TCPSocket> client_sock);
-    void internal_error(std::unique_ptr<TCPSocket> client_sock, std::string const &msg);
+    /// Read [filename] and build its complete response for [cache], or
+    /// [compressed] with an [encoding], setting the [validators] it was
+    /// built with. Return nullptr on failure. [type] is the Content-type,
+    /// [encoding] the Content-Encoding if any.
+    FileCache::response_ptr load_cached_response(std::string const &filename,
+                                                 FileCache::Validators &validators,
+                                                 const char *type, const char *encoding = nullptr);
+    /// Gzip compressed response to a GET of [filename], of [type], or its
+    /// 304, from [compressed] or compressed and added to it. nullptr if
+    /// the file is not cacheable there or does not compress.
+    FileCache::response_ptr gzip_response(Request const &req, std::string const &filename,
+                                          struct stat const &st, const char *type);
+    /// Whether the conditional headers of [req] let a 304 answer a GET
+    /// of the file last modified at [mtime].
+    static bool not_modified(Request const &req, std::time_t mtime,
+                             FileCache::Validators const &validators);
+    /// Answer to [req] from [store]: [head] alone for a 304, else [head]
+    /// and the body of [r], both kept alive by [index]. False if the file
+    /// is not stored or a range is asked for.
+    bool stored_response(Request const &req, StaticStore::index_ptr &index,
+                         FileCache::response_ptr &head, StaticStore::Representation const *&r);
+    /// Head of the 200 response of [r], see StaticStore.
+    static std::string stored_head(StaticStore::Representation const &r);
+    /// Rebuild the static store on every SIGHUP.
+    void reload_static_store();
 
-    void handle_get(std::unique_ptr<Request> req, std::unique_ptr<TCPSocket> client_sock);
-    void handle_post(std::unique_ptr<Request> req, std::unique_ptr<TCPSocket> client_sock);
+    /// Whether the If-Range header of [req], if any, names the version
+    /// described by [validators], so that its Range applies.
+    static bool if_range_matches(Request const &req, FileCache::Validators const &validators);
+    /// Send the 206 response carrying [ranges] of the open file [fd]
+    /// described by [st], of [type], as multipart/byteranges if there are
+    /// several. Return false on failure.
+    bool send_ranges(Request const &req, ResponseWriter &out, int fd,
+                     struct stat const &st, FileCache::Validators const &validators,
+                     std::vector<ByteRange> const &ranges, const char *type);
+
+    /// Complete response to a GET of a cacheable static file, or its
+    /// 304, built without touching the connection. nullptr otherwise,
+    /// e.g. for ranges.
+    FileCache::response_ptr static_response(Request const &req);
+
+    /// Handlers return whether the connection can be kept alive.
+    bool handle_get(Request &req, ResponseWriter &out);
+    bool handle_post(Request &req, ResponseWriter &out);
+    /// GET /metrics, in Prometheus text format.
+    bool handle_metrics(Request &req, ResponseWriter &out);
 private:
     friend class thread_pool;
+    friend class AcceptLoop;
+    friend class UringEngine;
+    friend class Http2Connection;
+    /// Benchmarks the parsers, see tools/microbench.cc.
+    friend class Microbench;
+
+    /// Address to listen on.
+    std::string ip;
+    uint16_t port;
+    size_t n_threads;
+    /// Number of SO_REUSEPORT accept loops, 0 for the thread pool mode.
+    size_t n_acceptors;
+    /// Number of io_uring loops, 0 to do without.
+    size_t n_rings;
+    std::unique_ptr<UringEngine> uring;
 
     /// Listen fd.
     std::unique_ptr<TCPSocket> sock;
     /// Pool of workers.
-    thread_pool workers;
+    std::unique_ptr<thread_pool> workers;
+    size_t max_queue;
+    unsigned long queue_target_delay_ms;
 
-    // using Handlers = std::unordered_map<
-    //     std::string, 
-    //     std::function<void(std::unique_ptr<Request> req, std::unique_ptr<TCPSocket>)> >;
+    /// Set for hot upgrades.
+    std::unique_ptr<HotUpgrade> upgrade;
+    unsigned long drain_timeout_ms;
+    /// The listening socket was handed over: connections are closed
+    /// after the request being served.
+    std::atomic<bool> draining;
+    /// The acceptor is in its loop, [acceptor] is its thread.
+    std::atomic<bool> accepting;
+    pthread_t acceptor;
 
     /// Base dir to serve content.
     std::string content_base;
 
-    // /// Handlers.
-    // Handlers get_handlers;
-    // Handlers post_handlers;
+    /// Pre-serialized responses of small static files.
+    std::unique_ptr<FileCache> cache;
+    /// Same, gzip compressed.
+    std::unique_ptr<FileCache> compressed;
+    /// Mapped content, if enabled. Built by [start].
+    size_t store_max_file_size;
+    std::unique_ptr<StaticStore> store;
+
+    /// Set in proxy mode.
+    std::unique_ptr<Proxy> proxy;
+    std::unique_ptr<ProxyCache> upstream_cache;
+
+    /// Handlers by path, of buffered or streamed requests.
+    Router routes;
+    size_t max_body_size;
+
+    /// Connection deadlines, in milliseconds by TimeoutKind.
+    TimerWheel timers;
+    unsigned long timeouts[TIMEOUT_KINDS];
+    std::atomic<unsigned long long> timeouts_fired[TIMEOUT_KINDS];
 };
 
 } // namespace simple_http_server
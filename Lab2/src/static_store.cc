@@ -0,0 +1,193 @@
+/// static_store.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "static_store.h"
+#include "content_coding.h"
+#include "reporter.h"
+
+namespace simple_http_server
+{
+
+namespace
+{
+
+/// Deeper directories are left out.
+const int MAX_DEPTH = 32;
+
+bool has_suffix(std::string const &s, const char *suffix)
+{
+    size_t n = std::strlen(suffix);
+    return s.length() >= n && s.compare(s.length() - n, n, suffix) == 0;
+}
+
+} // namespace
+
+StaticStore::File const *StaticStore::Index::find(std::string const &path) const
+{
+    auto it = files.find(path);
+    return it == files.end() ? nullptr : &it->second;
+}
+
+StaticStore::StaticStore(std::string const &root, size_t max_file_size, bool compress,
+                         HeadRenderer render)
+    : root_(root),
+      max_file_size_(max_file_size),
+      compress_(compress),
+      render_(std::move(render)),
+      index_(std::make_shared<const Index>()),
+      reloads_(0)
+{
+}
+
+StaticStore::index_ptr StaticStore::index() const
+{
+    return std::atomic_load(&index_);
+}
+
+bool StaticStore::reload()
+{
+    std::shared_ptr<Index> index = std::make_shared<Index>();
+    if (!walk(root_, *index, 0))
+    {
+        report(ERROR) << "fail indexing " << root_ << ", the static store is left as is" << std::endl;
+        return false;
+    }
+    add_gzip(*index);
+
+    for (auto &f : index->files)
+    {
+        f.second.identity.head = std::make_shared<const std::string>(render_(f.second.identity));
+        if (f.second.has_gzip)
+            f.second.gzip.head = std::make_shared<const std::string>(render_(f.second.gzip));
+    }
+
+    report(INFO) << "static store: " << index->files.size() << " files, "
+                 << index->bytes << " bytes from " << root_ << std::endl;
+    std::atomic_store(&index_, index_ptr(std::move(index)));
+    reloads_++;
+    return true;
+}
+
+bool StaticStore::walk(std::string const &dir, Index &index, int depth)
+{
+    DIR *d = ::opendir(dir.c_str());
+    if (!d)
+    {
+        report(WARN) << "fail opening " << dir << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    while (struct dirent *entry = ::readdir(d))
+    {
+        if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        std::string path = dir + "/" + entry->d_name;
+        struct stat st;
+        if (::lstat(path.c_str(), &st) < 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+        {
+            // A subdirectory that cannot be read is only left out.
+            if (depth + 1 < MAX_DEPTH)
+                walk(path, index, depth + 1);
+            continue;
+        }
+
+        Representation r;
+        if (map(path, r))
+        {
+            index.bytes += r.size;
+            index.files[path].identity = std::move(r);
+        }
+    }
+
+    ::closedir(d);
+    return true;
+}
+
+bool StaticStore::map(std::string const &path, Representation &r)
+{
+    // Links to files are followed.
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        static_cast<size_t>(st.st_size) > max_file_size_)
+    {
+        if (fd >= 0)
+            ::close(fd);
+        return false;
+    }
+
+    if (st.st_size > 0)
+    {
+        size_t size = st.st_size;
+        void *addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            report(WARN) << "fail mapping " << path << ": " << strerror(errno) << std::endl;
+            ::close(fd);
+            return false;
+        }
+        // Read ahead now rather than on the first requests.
+        ::madvise(addr, size, MADV_WILLNEED);
+        r.body = static_cast<const char *>(addr);
+        r.size = size;
+        r.owner = std::shared_ptr<void>(addr, [size](void *p) { ::munmap(p, size); });
+    }
+    ::close(fd);
+
+    r.type = mime_type(path);
+    r.mtime = st.st_mtime;
+    r.validators = FileCache::Validators::of(st);
+    return true;
+}
+
+void StaticStore::add_gzip(Index &index)
+{
+    for (auto &f : index.files)
+    {
+        std::string const &path = f.first;
+        Representation const &identity = f.second.identity;
+        if (!compressible(identity.type) || has_suffix(path, ".gz"))
+            continue;
+
+        Representation gzip;
+        if (File const *sibling = index.find(path + ".gz"))
+        {
+            // Served with the validators of the sibling, as by the server.
+            gzip = sibling->identity;
+        }
+        else
+        {
+            std::string out;
+            if (!compress_ || !gzip_compress(identity.body, identity.size, out) ||
+                out.length() >= identity.size)
+                continue;
+
+            std::shared_ptr<std::string> body = std::make_shared<std::string>(std::move(out));
+            gzip.body = body->data();
+            gzip.size = body->length();
+            gzip.owner = body;
+            gzip.mtime = identity.mtime;
+            gzip.validators = identity.validators;
+            gzip.validators.etag.insert(gzip.validators.etag.length() - 1, "-gzip");
+            index.bytes += gzip.size;
+        }
+
+        gzip.type = identity.type;
+        gzip.encoding = "gzip";
+        f.second.gzip = std::move(gzip);
+        f.second.has_gzip = true;
+    }
+}
+
+}   // namespace simple_http_server
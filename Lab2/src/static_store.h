@@ -0,0 +1,112 @@
+/// static_store.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef STATIC_STORE_H
+#define STATIC_STORE_H
+
+#include <atomic>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "file_cache.h"
+
+namespace simple_http_server
+{
+
+/// Immutable index of the files of a content directory, each mapped
+/// with the head of its 200 response rendered, for read-only content.
+///
+/// The directory is walked once by [reload]; requests for indexed files
+/// are then answered without any system call but the send, since files
+/// are assumed not to change until the next reload. A reload builds a
+/// new index and swaps it in atomically; requests being answered keep
+/// the index they started with alive. Files are to be replaced, e.g.
+/// renamed over, rather than truncated in place while mapped.
+class StaticStore
+{
+public:
+    /// A response body and its head.
+    struct Representation
+    {
+        /// Of the file, whatever the encoding.
+        const char *type = nullptr;
+        /// nullptr for the identity encoding.
+        const char *encoding = nullptr;
+        std::time_t mtime = 0;
+        FileCache::Validators validators;
+        /// Status line and headers of the 200 response, the blank line
+        /// included.
+        FileCache::response_ptr head;
+        const char *body = nullptr;
+        size_t size = 0;
+        /// Mapping or buffer holding [body].
+        std::shared_ptr<void> owner;
+    };
+
+    struct File
+    {
+        Representation identity;
+        /// From a precompressed ".gz" sibling, else compressed when
+        /// loaded if it got smaller. Only of compressible types.
+        bool has_gzip = false;
+        Representation gzip;
+    };
+
+    struct Index
+    {
+        /// By resolved path.
+        std::unordered_map<std::string, File> files;
+        /// Bytes of the bodies.
+        size_t bytes = 0;
+
+        /// nullptr if [path] is not indexed.
+        File const *find(std::string const &path) const;
+    };
+    typedef std::shared_ptr<const Index> index_ptr;
+
+    /// Renders the head of [r], see Representation::head.
+    typedef std::function<std::string(Representation const &r)> HeadRenderer;
+
+    /// Index the regular files under [root] up to [max_file_size] bytes,
+    /// compressing those without a ".gz" sibling if [compress]. Symbolic
+    /// links to directories are not followed.
+    StaticStore(std::string const &root, size_t max_file_size, bool compress,
+                HeadRenderer render);
+
+    StaticStore(const StaticStore&) = delete;
+    void operator=(const StaticStore&) = delete;
+
+    /// Walk [root] and swap the new index in. On failure the current
+    /// index is kept and false returned.
+    bool reload();
+
+    /// The current index, never nullptr.
+    index_ptr index() const;
+
+    /// Statistics.
+    unsigned long long reloads() const { return reloads_; }
+
+private:
+    /// Index the files under [dir], [dir] included in their paths.
+    bool walk(std::string const &dir, Index &index, int depth);
+    /// Map the file at [path] into [r]. Return false if it is not a
+    /// regular file within [max_file_size_].
+    bool map(std::string const &path, Representation &r);
+    /// Add the gzip representations of the compressible files of [index].
+    void add_gzip(Index &index);
+
+    std::string root_;
+    size_t max_file_size_;
+    bool compress_;
+    HeadRenderer render_;
+
+    /// Accessed with std::atomic_load and std::atomic_store.
+    index_ptr index_;
+    std::atomic<unsigned long long> reloads_;
+};
+
+}   // namespace simple_http_server
+
+#endif
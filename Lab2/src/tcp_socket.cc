@@ -5,16 +5,42 @@
 #include <iostream>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <cstring>
+#include <algorithm>
 #include "tcp_socket.h"
+#include "metrics.h"
 #include "reporter.h"
 
 namespace simple_http_server
 {
 
+namespace
+{
+
+/// Most bytes handed to one blocking send call, so that a large body
+/// counts as progress while it leaves, not only once it is all gone.
+const size_t MAX_SEND_SIZE = 256 << 10;
+
+/// Accounts the lifetime of the object to a send time counter.
+class SendTimer
+{
+public:
+    explicit SendTimer(unsigned long long &acc) : acc_(acc), start_(now_ns()) {}
+    ~SendTimer() { acc_ += now_ns() - start_; }
+
+private:
+    unsigned long long &acc_;
+    unsigned long long start_;
+};
+
+} // namespace
+
 TCPSocket::TCPSocket()
+    : accepted_at_(0), send_ns_(0), progress_(0), rpos_(0), rend_(0)
 {
     socket_ = ::socket(AF_INET, SOCK_STREAM, 0);
     if (socket_ < 0)
@@ -99,12 +125,46 @@ bool TCPSocket::accept(TCPSocket &sock, std::string &ip, uint16_t &port)
 
     ip.assign(client_ip);
     port = ntohs(client_addr.sin_port);
+    // Release the fd [sock] was constructed with.
+    sock.close();
     sock.socket_ = sock_client;
+    sock.accepted_at_ = now_ns();
 
     report(INFO) << "accepting " << ip << ":" << port << std::endl;
     return true;
 }
 
+void TCPSocket::adopt(int fd, const char *data, size_t n)
+{
+    close();
+    socket_ = fd;
+    accepted_at_ = now_ns();
+
+    rbuf_.reset(new char[n > RECV_BUFFER_SIZE ? n : RECV_BUFFER_SIZE]);
+    std::memcpy(rbuf_.get(), data, n);
+    rpos_ = 0;
+    rend_ = n;
+}
+
+bool TCPSocket::set_reuseport(bool flag)
+{
+    int optval = flag ? 1 : 0;
+    if (::setsockopt(socket_, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
+    {
+        report(ERROR) << "fail setting SO_REUSEPORT: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool TCPSocket::set_recv_timeout(int ms)
+{
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    return ::setsockopt(socket_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0;
+}
+
 bool TCPSocket::set_blocking(bool flag)
 {
     int opts;
@@ -130,14 +190,15 @@ bool TCPSocket::set_blocking(bool flag)
 }
 
 /// Send [len] bytes from data robustly.
-int TCPSocket::send(const void *data, size_t len)
+int TCPSocket::send(const void *data, size_t len, int flags)
 {
+    SendTimer timer(send_ns_);
     const char *data_buf = reinterpret_cast<const char*>(data);
     std::size_t data_len = len;
 
     while (data_len > 0)
     {
-        int n = ::send(socket_, data_buf, data_len, 0);
+        int n = ::send(socket_, data_buf, std::min(data_len, MAX_SEND_SIZE), flags);
         if (n <= 0)
         {
             if (errno == EINTR)
@@ -148,21 +209,128 @@ int TCPSocket::send(const void *data, size_t len)
 
         data_len -= n;
         data_buf += n;
+        progress_.fetch_add(n, std::memory_order_relaxed);
     }
 
     return (len - data_len);
 }
 
+int TCPSocket::sendv(struct iovec *iov, int iovcnt)
+{
+    SendTimer timer(send_ns_);
+    size_t total = 0;
+
+    while (iovcnt > 0)
+    {
+        // The buffers up to MAX_SEND_SIZE, the last one cut for the call.
+        int count = 0;
+        size_t len = 0;
+        while (count < iovcnt && len < MAX_SEND_SIZE)
+            len += iov[count++].iov_len;
+        size_t cut = len > MAX_SEND_SIZE ? len - MAX_SEND_SIZE : 0;
+        iov[count - 1].iov_len -= cut;
+        ssize_t n = ::writev(socket_, iov, count);
+        iov[count - 1].iov_len += cut;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += n;
+        progress_.fetch_add(n, std::memory_order_relaxed);
+
+        // Skip what has been fully written and adjust the first partial one.
+        while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = reinterpret_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return total;
+}
+
+long long TCPSocket::send_file(int fd, off_t offset, size_t count)
+{
+    SendTimer timer(send_ns_);
+    size_t nleft = count;
+
+    while (nleft > 0)
+    {
+        ssize_t n = ::sendfile(socket_, fd, &offset, std::min(nleft, MAX_SEND_SIZE));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        else if (n == 0)
+            // File shrinked underneath us.
+            break;
+
+        nleft -= n;
+        progress_.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    if (nleft > 0)
+        // The body falls short of what was announced: nothing can follow
+        // it on this connection, the peer is told by the end of stream.
+        ::shutdown(socket_, SHUT_WR);
+    return (count - nleft);
+}
+
 int TCPSocket::send_line(std::string const &data)
 {
     return send((data + "\n").c_str(), data.length() + 1);
 }
 
+int TCPSocket::fill()
+{
+    if (!rbuf_)
+        rbuf_.reset(new char[RECV_BUFFER_SIZE]);
+    rpos_ = rend_ = 0;
+
+    for (;;)
+    {
+        ssize_t n = ::recv(socket_, rbuf_.get(), RECV_BUFFER_SIZE, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n > 0)
+        {
+            rend_ = n;
+            progress_.fetch_add(n, std::memory_order_relaxed);
+        }
+        return n;
+    }
+}
+
 int TCPSocket::recv(void *buffer, size_t buffer_size)
 {
     char *data_buf = reinterpret_cast<char*>(buffer);
     int n = 0;
 
+    // Buffered bytes first, then small reads go through the buffer.
+    if (rpos_ == rend_ && buffer_size < RECV_BUFFER_SIZE)
+    {
+        int got = fill();
+        if (got <= 0)
+            return got;
+    }
+    if (rpos_ < rend_)
+    {
+        size_t take = std::min(buffer_size, rend_ - rpos_);
+        std::memcpy(data_buf, rbuf_.get() + rpos_, take);
+        rpos_ += take;
+        return take;
+    }
+
     // Make sure we'll always recv'ed something from socket_.
     while (n == 0)
     {
@@ -178,6 +346,7 @@ int TCPSocket::recv(void *buffer, size_t buffer_size)
             return 0;
     }
 
+    progress_.fetch_add(n, std::memory_order_relaxed);
     return n;
 }
 
@@ -201,27 +370,95 @@ int TCPSocket::recv_bytes(void *buffer, size_t n)
     return (n - nleft);
 }
 
-std::string TCPSocket::recv_line()
+std::string TCPSocket::recv_line(size_t limit)
+{
+    std::string line;
+    if (!recv_line(line, limit))
+        return "";
+    return line;
+}
+
+bool TCPSocket::recv_line(std::string &line, size_t limit)
 {
-    std::stringstream ss;
-    char buffer[2];
+    size_t start = line.length();
 
     for (;;)
     {
-        int n = recv(buffer, 1);
-        if (n == 1)
+        if (rpos_ == rend_)
         {
-            ss << *buffer;
-            if (*buffer == '\n')
+            int n = fill();
+            if (n == 0)
                 break;
+            else if (n < 0)
+                // Error reading a line.
+                return false;
         }
-        else if (n == 0)
+
+        const char *begin = rbuf_.get() + rpos_;
+        const char *nl = static_cast<const char *>(std::memchr(begin, '\n', rend_ - rpos_));
+        size_t take = nl ? nl - begin + 1 : rend_ - rpos_;
+        if (line.length() + take > limit)
+            return false;
+        line.append(begin, take);
+        rpos_ += take;
+        if (nl)
             break;
-        else
-            // Error reading a line.
-            return "";
     }
-    return ss.str();
+    return line.length() > start;
+}
+
+bool TCPSocket::recv_head(std::string &head, size_t limit)
+{
+    // Start of the line being received.
+    size_t line = head.length();
+
+    for (;;)
+    {
+        if (rpos_ == rend_ && fill() <= 0)
+            return false;
+
+        const char *begin = rbuf_.get() + rpos_;
+        const char *nl = static_cast<const char *>(std::memchr(begin, '\n', rend_ - rpos_));
+        size_t take = nl ? nl - begin + 1 : rend_ - rpos_;
+        if (head.length() + take > limit)
+            return false;
+        head.append(begin, take);
+        rpos_ += take;
+        if (!nl)
+            continue;
+
+        // "\r\n" or "\n" alone ends the head.
+        size_t len = head.length() - line;
+        if (len == 1 || (len == 2 && head[line] == '\r'))
+            return true;
+        line = head.length();
+    }
+}
+
+bool TCPSocket::peer_closed()
+{
+    if (rpos_ < rend_ || socket_ < 0)
+        return false;
+
+    struct pollfd pfd;
+    pfd.fd = socket_;
+    pfd.events = POLLIN;
+    if (::poll(&pfd, 1, 0) <= 0)
+        return false;
+
+    char c;
+    return ::recv(socket_, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+bool TCPSocket::has_input()
+{
+    if (rpos_ < rend_)
+        return true;
+    if (socket_ < 0)
+        return false;
+
+    char c;
+    return ::recv(socket_, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
 }
 
 bool TCPSocket::shutdown(int how)
@@ -235,6 +472,7 @@ void TCPSocket::close()
     {
         ::close(socket_);
         socket_ = -1;
+        rpos_ = rend_ = 0;
     }
 }
 
@@ -5,7 +5,12 @@
 #define TCP_SOCKET_H
 
 #include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace simple_http_server
 {
@@ -16,6 +21,21 @@ class TCPSocket
 private:
     /// Underlying socket
     int socket_;
+    /// When the connection was accepted, see [now_ns].
+    unsigned long long accepted_at_;
+    /// Total time spent in the send functions.
+    unsigned long long send_ns_;
+    /// Bytes sent and received so far, see [progress].
+    std::atomic<unsigned long long> progress_;
+
+    /// Bytes received but not consumed yet are in [rbuf_ + rpos_, rbuf_ + rend_).
+    std::unique_ptr<char[]> rbuf_;
+    size_t rpos_;
+    size_t rend_;
+
+    /// Read what is available into [rbuf_], which must be empty.
+    /// Return like ::recv.
+    int fill();
 
     /// Disallow copy.
     TCPSocket(const TCPSocket &) = delete;
@@ -33,26 +53,70 @@ public:
     bool listen(int backlog = 1024);
     bool accept(TCPSocket &socket, std::string &client_ip, uint16_t &client_port);
 
+    /// Allow several sockets to bind the same port. Must precede [bind].
+    bool set_reuseport(bool flag);
+    /// Fail blocking receives after [ms] milliseconds of silence. 0 disables.
+    bool set_recv_timeout(int ms);
     /// [flag] set to true to make socket non-blocking.
     bool set_blocking(bool flag);
     bool shutdown(int how);
+    /// Whether the peer has closed its end, without consuming any data.
+    bool peer_closed();
+    /// Whether bytes were received, into the buffer or not, and not
+    /// consumed yet. Does not block.
+    bool has_input();
     void close();
+    /// Take over the connected [fd], e.g. from the io_uring engine. The
+    /// [n] bytes at [data] were received from it already, they are read
+    /// first. With an [fd] of -1 they are all there is to read, e.g. the
+    /// body of an HTTP/2 request.
+    void adopt(int fd, const char *data, size_t n);
+    int fd() const { return socket_; }
+    /// Bytes received and not consumed yet.
+    size_t buffered() const { return rend_ - rpos_; }
+
+    /// Monotonic time in nanoseconds at which [accept] returned this
+    /// connection, 0 if it was not accepted.
+    unsigned long long accepted_at() const { return accepted_at_; }
+    /// Nanoseconds spent so far sending on this socket.
+    unsigned long long send_time_ns() const { return send_ns_; }
+    /// Bytes sent and received so far. Read from any thread, e.g. by a
+    /// deadline telling a stalled connection from a slow one.
+    unsigned long long progress() const { return progress_.load(std::memory_order_relaxed); }
 
     /* 
-    Send and receive robustly(unbuffered).
+    Send robustly(unbuffered) and receive robustly(buffered).
     See CSAPP chapter 10.
     */
 
-    /// Send [len] bytes from data robustly.
-    int send(const void *data, size_t len);
+    /// Size of the receive buffer.
+    static const size_t RECV_BUFFER_SIZE = 16 << 10;
+
+    /// Send [len] bytes from data robustly. [flags] is passed to ::send,
+    /// e.g. MSG_MORE to coalesce with the next write.
+    int send(const void *data, size_t len, int flags = 0);
+    /// Gather-send all [iovcnt] buffers of [iov] robustly with writev(2).
+    /// [iov] is consumed in place on partial writes.
+    int sendv(struct iovec *iov, int iovcnt);
+    /// Send [count] bytes of file [fd] starting at [offset] with sendfile(2).
+    /// The file content never enters user space. Return the bytes sent:
+    /// fewer than [count] if the file was truncated meanwhile, in which
+    /// case the connection is shut down for writing.
+    long long send_file(int fd, off_t offset, size_t count);
     /// Send [data] + "\n" robustly.
     int send_line(std::string const &data);
     /// Receive some bytes <= buffer_size.
     int recv(void *buffer, size_t buffer_size);
     /// Receive [n] bytes.
     int recv_bytes(void *buffer, size_t n);
-    /// Receive a line with "\n" stripped.
-    std::string recv_line();
+    /// Receive a line, "\n" included. Fail with "" if it exceeds [limit].
+    std::string recv_line(size_t limit = std::string::npos);
+    /// Append one line to [line]. Fail on error, on EOF before any byte
+    /// or when [line] would exceed [limit] bytes.
+    bool recv_line(std::string &line, size_t limit);
+    /// Append lines to [head] up to and including the first empty one.
+    /// Fail on EOF, error or when [head] would exceed [limit] bytes.
+    bool recv_head(std::string &head, size_t limit);
 };
 
 }   // namespace simple_http_server
@@ -1,14 +1,29 @@
 /// thread_pool.cc
 /// Copyright 2020 Cloud-fantasy team
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "metrics.h"
+#include "reporter.h"
+#include "response_builder.h"
 #include "server.h"
 #include "thread_pool.h"
 
 namespace simple_http_server
 {
 
-thread_pool::thread_pool(Server &server, size_t size)
-:   server(server), done(false)
+/// How long a shed connection is given to close its end.
+static const unsigned long long LINGER_NS = 2000000000ULL;
+
+thread_pool::thread_pool(Server &server, size_t size, size_t max_queue,
+                         unsigned long target_delay_ms)
+:   server(server), max_queue(max_queue),
+    target_delay_ns(target_delay_ms * 1000000ULL),
+    shed_full_(0), shed_delay_(0), done(false),
+    idle_ns(server.timeouts[Server::TIMEOUT_IDLE] * 1000000ULL)
 {
     // Initialize each worker.
     for (size_t i = 0; i < size; i++)
@@ -19,12 +34,12 @@ thread_pool::thread_pool(Server &server, size_t size)
             {
                 for (;;)
                 {
-                    std::unique_ptr<TCPSocket> client_sock;
+                    Task task;
                     {
                         // Acquire lock.
                         std::unique_lock<std::mutex> lock(this->m);
                         this->condition.wait(
-                            lock, 
+                            lock,
                             [this]{ return !this->client_socks.empty() || this->done; }
                         );
 
@@ -33,16 +48,35 @@ thread_pool::thread_pool(Server &server, size_t size)
                             return;
 
                         // Pull task from the queue.
-                        client_sock = std::move(this->client_socks.front());
+                        task = std::move(this->client_socks.front());
                         this->client_socks.pop();
                     }
 
+                    if (this->overdue(task, now_ns()))
+                    {
+                        this->shed_delay_++;
+                        this->shed(std::move(task));
+                        continue;
+                    }
+
                     // Call back to server.
-                    this->server.serve_client(std::move(client_sock));
+                    this->server.serve_client(std::move(task.sock), task.resumed);
                 }
             }
         );
     }
+
+    epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd;
+    if (epoll_fd < 0 || wake_fd < 0 || ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0)
+    {
+        report(ERROR) << "fail creating the idle poller: " << strerror(errno) << std::endl;
+        abort();
+    }
+    poller = std::thread(&thread_pool::poll, this);
 }
 
 thread_pool::~thread_pool()
@@ -57,14 +91,223 @@ thread_pool::~thread_pool()
     condition.notify_all();
     for (auto &t : workers)
         t.join();
+
+    uint64_t one = 1;
+    if (::write(wake_fd, &one, sizeof(one)) < 0)
+        report(ERROR) << "fail waking the idle poller" << std::endl;
+    poller.join();
+    close_parked();
+    ::close(wake_fd);
+    ::close(epoll_fd);
 }
 
 void thread_pool::add_client(std::unique_ptr<TCPSocket> sock)
+{
+    enqueue(std::move(sock), false);
+}
+
+void thread_pool::enqueue(std::unique_ptr<TCPSocket> sock, bool resumed)
+{
+    Task task{ std::move(sock), resumed, now_ns() };
+    {
+        std::unique_lock<std::mutex> lock(m);
+        if (client_socks.size() < max_queue &&
+            (client_socks.empty() || !overdue(client_socks.front(), task.queued_at)))
+        {
+            client_socks.push(std::move(task));
+            condition.notify_one();
+            return;
+        }
+
+        if (client_socks.size() >= max_queue)
+            shed_full_++;
+        else
+            shed_delay_++;
+    }
+
+    // Outside the lock, workers keep pulling meanwhile.
+    shed(std::move(task));
+}
+
+bool thread_pool::overdue(Task const &task, unsigned long long now) const
+{
+    return target_delay_ns > 0 && now - task.queued_at > target_delay_ns;
+}
+
+void thread_pool::shed(Task task)
+{
+    ResponseBuilder &builder = ResponseBuilder::local();
+    builder.start(Response::SERVICE_UNAVALABLE, "Service Unavailable")
+           .header("Server", Server::server_name)
+           .header("Retry-After", 1)
+           .header("Content-length", 0ULL)
+           .header("Connection", "close");
+
+    // A fresh connection has room in its send buffer, never wait for it.
+    std::string const &head = builder.finish();
+    task.sock->send(head.data(), head.length(), MSG_DONTWAIT);
+    if (task.resumed)
+        Metrics::connection_closed();
+    linger(std::move(task.sock));
+}
+
+void thread_pool::linger(std::unique_ptr<TCPSocket> sock)
+{
+    sock->shutdown(SHUT_WR);
+
+    int fd = sock->fd();
+    std::unique_lock<std::mutex> lock(parked_m);
+    auto it = lingering_socks.insert(lingering_socks.end(),
+                                     Parked{ std::move(sock), now_ns() + LINGER_NS, true });
+
+    // Level triggered, whatever comes is read and dropped.
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd;
+    if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        // Closed at once then.
+        lingering_socks.erase(it);
+        return;
+    }
+    parked_fds[fd] = it;
+}
+
+void thread_pool::park(std::unique_ptr<TCPSocket> sock)
+{
+    int fd = sock->fd();
+    std::unique_lock<std::mutex> lock(parked_m);
+    auto it = parked_socks.insert(parked_socks.end(), Parked{ std::move(sock), now_ns() + idle_ns, false });
+
+    // One shot: the poller owns the connection until it is readable.
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        sock = std::move(it->sock);
+        parked_socks.erase(it);
+        lock.unlock();
+        report(ERROR) << "fail parking connection: " << strerror(errno) << std::endl;
+        close_connection(std::move(sock));
+        return;
+    }
+    parked_fds[fd] = it;
+}
+
+std::unique_ptr<TCPSocket> thread_pool::unpark(std::list<Parked>::iterator it)
+{
+    std::unique_ptr<TCPSocket> sock = std::move(it->sock);
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock->fd(), nullptr);
+    parked_fds.erase(sock->fd());
+    (it->lingering ? lingering_socks : parked_socks).erase(it);
+    return sock;
+}
+
+void thread_pool::poll()
+{
+    static const int MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;)
+    {
+        // Until the oldest parked or lingering connection is due.
+        int timeout = -1;
+        {
+            std::unique_lock<std::mutex> lock(parked_m);
+            for (auto list : { &parked_socks, &lingering_socks })
+            {
+                if (list->empty())
+                    continue;
+                unsigned long long now = now_ns(), deadline = list->front().deadline;
+                int ms = deadline > now ? (deadline - now) / 1000000 + 1 : 0;
+                if (timeout < 0 || ms < timeout)
+                    timeout = ms;
+            }
+        }
+
+        int n = ::epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR)
+        {
+            report(ERROR) << "idle poller failed: " << strerror(errno) << std::endl;
+            return;
+        }
+
+        std::vector<std::unique_ptr<TCPSocket>> ready, expired;
+        {
+            std::unique_lock<std::mutex> lock(parked_m);
+            for (int i = 0; i < n; i++)
+            {
+                if (events[i].data.fd == wake_fd)
+                    return;
+
+                // Closed meanwhile, see [close_parked].
+                auto found = parked_fds.find(events[i].data.fd);
+                if (found == parked_fds.end())
+                    continue;
+                if (!found->second->lingering)
+                {
+                    ready.push_back(unpark(found->second));
+                    continue;
+                }
+
+                // Dropped until the end, in bounded rounds.
+                char buf[4 << 10];
+                ssize_t got = 0;
+                for (int round = 0; round < 16; round++)
+                    if ((got = ::recv(found->first, buf, sizeof(buf), MSG_DONTWAIT)) <= 0)
+                        break;
+                if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                    unpark(found->second);
+            }
+
+            unsigned long long now = now_ns();
+            while (!parked_socks.empty() && parked_socks.front().deadline <= now)
+                expired.push_back(unpark(parked_socks.begin()));
+            while (!lingering_socks.empty() && lingering_socks.front().deadline <= now)
+                unpark(lingering_socks.begin());
+        }
+
+        // A closed peer is readable too, the worker sees the end.
+        for (auto &sock : ready)
+            enqueue(std::move(sock), true);
+        for (auto &sock : expired)
+        {
+            server.timeouts_fired[Server::TIMEOUT_IDLE]++;
+            close_connection(std::move(sock));
+        }
+    }
+}
+
+void thread_pool::close_parked()
+{
+    std::vector<std::unique_ptr<TCPSocket>> socks;
+    {
+        std::unique_lock<std::mutex> lock(parked_m);
+        while (!parked_socks.empty())
+            socks.push_back(unpark(parked_socks.begin()));
+    }
+
+    for (auto &sock : socks)
+        close_connection(std::move(sock));
+}
+
+void thread_pool::close_connection(std::unique_ptr<TCPSocket> sock)
+{
+    sock->close();
+    Metrics::connection_closed();
+}
+
+size_t thread_pool::queue_depth()
 {
     std::unique_lock<std::mutex> lock(m);
-    client_socks.push(std::move(sock));
+    return client_socks.size();
+}
 
-    condition.notify_one();
+size_t thread_pool::parked()
+{
+    std::unique_lock<std::mutex> lock(parked_m);
+    return parked_socks.size();
 }
 
 } // namespace simple_http_server
@@ -5,10 +5,13 @@
 #define THREAD_POOL_H
 
 #include <iostream>
+#include <atomic>
 #include <functional>
+#include <list>
 #include <vector>
 #include <queue>
 #include <mutex>
+#include <unordered_map>
 #include <thread>
 #include <condition_variable>
 
@@ -20,15 +23,80 @@ namespace simple_http_server
 class Server;
 
 /// A very simple thread pool implementation.
+///
+/// Accepted connections wait in a queue bounded by [max_queue]. A
+/// connection arriving when it is full, or when the oldest waiting one
+/// has waited more than [target_delay_ms], is shed: it gets a 503 at
+/// once, and is closed once the client has closed its end or after a
+/// short delay. Workers shed connections that waited that long too,
+/// their clients are likely gone already.
+///
+/// Kept-alive connections waiting for their next request do not hold a
+/// worker: they are parked in an epoll set watched by a poller thread,
+/// queued again once readable and closed after the idle timeout of the
+/// server.
 class thread_pool
 {
 public:
-    thread_pool(Server &server, size_t size);
+    /// [target_delay_ms] of 0 disables delay based shedding.
+    thread_pool(Server &server, size_t size, size_t max_queue = 1024,
+                unsigned long target_delay_ms = 0);
     ~thread_pool();
 
     void add_client(std::unique_ptr<TCPSocket> sock);
+    /// Wait for the next request of the kept-alive [sock] without a
+    /// worker. Nothing of it must be buffered.
+    void park(std::unique_ptr<TCPSocket> sock);
+    /// Close the parked connections, e.g. when draining.
+    void close_parked();
+    /// Close [sock] once the peer has closed its end or after a short
+    /// delay. Closing with the request unread would reset the connection
+    /// and could destroy the response before the client reads it.
+    void linger(std::unique_ptr<TCPSocket> sock);
+
+    /// Connections accepted but not yet picked up by a worker.
+    size_t queue_depth();
+    /// Connections parked between requests.
+    size_t parked();
+
+    /// Connections shed because the queue was full.
+    unsigned long long shed_full() const { return shed_full_; }
+    /// Connections shed because of the queueing delay.
+    unsigned long long shed_delay() const { return shed_delay_; }
 
 private:
+    /// Connection waiting for a worker. [resumed] is set when it comes
+    /// back from being parked.
+    struct Task
+    {
+        std::unique_ptr<TCPSocket> sock;
+        bool resumed;
+        unsigned long long queued_at;
+    };
+
+    /// Parked connection, closed at [deadline] (see [now_ns]).
+    /// [lingering] is set for a shed one whose input is discarded.
+    struct Parked
+    {
+        std::unique_ptr<TCPSocket> sock;
+        unsigned long long deadline;
+        bool lingering;
+    };
+
+    /// Queue [sock] for a worker or shed it.
+    void enqueue(std::unique_ptr<TCPSocket> sock, bool resumed);
+    /// Answer 503 and close, see [linger].
+    void shed(Task task);
+    /// Unregister the parked [it] from the poller and take its socket.
+    /// Needs [parked_m].
+    std::unique_ptr<TCPSocket> unpark(std::list<Parked>::iterator it);
+    /// Whether [task] has waited in the queue past the target delay.
+    bool overdue(Task const &task, unsigned long long now) const;
+    /// Body of the poller thread.
+    void poll();
+    /// Close a connection that was opened to the server.
+    void close_connection(std::unique_ptr<TCPSocket> sock);
+
     /// HTTP server.
     Server &server;
 
@@ -36,12 +104,31 @@ private:
     std::vector<std::thread> workers;
 
     /// TCP sockets to serve.
-    std::queue<std::unique_ptr<TCPSocket>> client_socks;
+    std::queue<Task> client_socks;
+
+    /// Admission limits.
+    size_t max_queue;
+    unsigned long long target_delay_ns;
+    std::atomic<unsigned long long> shed_full_;
+    std::atomic<unsigned long long> shed_delay_;
 
     /// Synchronization primitives.
     bool done;
     std::mutex m;
     std::condition_variable condition;
+
+    /// Parked and lingering connections in the order they were parked,
+    /// which is the order of their deadlines, and by descriptor. Guarded
+    /// by [parked_m].
+    std::list<Parked> parked_socks;
+    std::list<Parked> lingering_socks;
+    std::unordered_map<int, std::list<Parked>::iterator> parked_fds;
+    unsigned long long idle_ns;
+    std::mutex parked_m;
+    /// The epoll set of the poller, and an eventfd in it stopping it.
+    int epoll_fd;
+    int wake_fd;
+    std::thread poller;
 };
 
 }   // namespace simple_http_server
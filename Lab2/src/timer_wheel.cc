@@ -0,0 +1,161 @@
+/// timer_wheel.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <chrono>
+#include "timer_wheel.h"
+
+namespace simple_http_server
+{
+
+Timer::Timer()
+    : prev_(nullptr), next_(nullptr), slot_(nullptr), wheel_(nullptr),
+      expires_(0), fired_(false)
+{}
+
+Timer::~Timer()
+{
+    if (wheel_)
+        wheel_->cancel(*this);
+}
+
+TimerWheel::TimerWheel(unsigned tick_ms)
+    : tick_ms_(tick_ms ? tick_ms : 1), now_(0), done_(false), expired_(0)
+{
+    for (auto &level : slots_)
+        for (auto &slot : level)
+            slot = nullptr;
+
+    thread_ = std::thread(&TimerWheel::run, this);
+}
+
+TimerWheel::~TimerWheel()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        done_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+}
+
+void TimerWheel::arm(Timer &t, unsigned long ms)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    if (t.slot_)
+        unlink(t);
+
+    t.wheel_ = this;
+    t.expires_ = now_ + ticks(ms);
+    t.fired_ = false;
+    link(t);
+}
+
+unsigned long long TimerWheel::ticks(unsigned long ms) const
+{
+    unsigned long long n = (ms + tick_ms_ - 1) / tick_ms_;
+    return n ? n : 1;
+}
+
+void TimerWheel::cancel(Timer &t)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    if (t.slot_)
+        unlink(t);
+}
+
+void TimerWheel::link(Timer &t)
+{
+    static const unsigned long long MAX_DELTA = (1ULL << (LEVEL_BITS * LEVELS)) - 1;
+
+    if (t.expires_ < now_)
+        t.expires_ = now_;
+    if (t.expires_ - now_ > MAX_DELTA)
+        t.expires_ = now_ + MAX_DELTA;
+
+    // Coarsest level that still tells the deadline apart from now.
+    unsigned long long delta = t.expires_ - now_;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ULL << (LEVEL_BITS * (level + 1))))
+        level++;
+
+    Timer **slot = &slots_[level][(t.expires_ >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+    t.prev_ = nullptr;
+    t.next_ = *slot;
+    if (*slot)
+        (*slot)->prev_ = &t;
+    *slot = &t;
+    t.slot_ = slot;
+}
+
+void TimerWheel::unlink(Timer &t)
+{
+    if (t.prev_)
+        t.prev_->next_ = t.next_;
+    else
+        *t.slot_ = t.next_;
+    if (t.next_)
+        t.next_->prev_ = t.prev_;
+
+    t.prev_ = t.next_ = nullptr;
+    t.slot_ = nullptr;
+}
+
+void TimerWheel::tick()
+{
+    now_++;
+
+    // Redistribute the slots of the levels that come due, coarsest first
+    // so that what they cascade is itself cascaded further.
+    for (int level = LEVELS - 1; level > 0; level--)
+    {
+        if (now_ & ((1ULL << (LEVEL_BITS * level)) - 1))
+            continue;
+
+        Timer **slot = &slots_[level][(now_ >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+        Timer *t = *slot;
+        *slot = nullptr;
+        while (t)
+        {
+            Timer *next = t->next_;
+            link(*t);
+            t = next;
+        }
+    }
+
+    Timer **slot = &slots_[0][now_ & (SLOTS - 1)];
+    while (*slot)
+    {
+        Timer &t = **slot;
+        unlink(t);
+
+        // Never lands in this slot again, it is at least a tick ahead.
+        if (unsigned long ms = t.postpone())
+        {
+            t.expires_ = now_ + ticks(ms);
+            link(t);
+            continue;
+        }
+        t.fired_ = true;
+        expired_++;
+        t.expire();
+    }
+}
+
+void TimerWheel::run()
+{
+    auto start = std::chrono::steady_clock::now();
+    auto tick = std::chrono::milliseconds(tick_ms_);
+
+    std::unique_lock<std::mutex> lock(m_);
+    while (!done_)
+    {
+        cond_.wait_for(lock, tick);
+
+        // Catch up if the thread was delayed.
+        unsigned long long target = (std::chrono::steady_clock::now() - start) / tick;
+        while (now_ < target)
+            this->tick();
+    }
+}
+
+} // namespace simple_http_server
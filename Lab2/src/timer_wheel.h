@@ -0,0 +1,108 @@
+/// timer_wheel.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace simple_http_server
+{
+
+class TimerWheel;
+
+/// A deadline kept by a TimerWheel. Embedded in its owner, so arming
+/// never allocates.
+class Timer
+{
+public:
+    Timer();
+    virtual ~Timer();
+
+    Timer(const Timer&) = delete;
+    void operator=(const Timer&) = delete;
+
+    /// Whether the timer expired since it was last armed.
+    bool fired() const { return fired_; }
+
+protected:
+    /// Called on the wheel thread when the deadline passes. Must be
+    /// short, it runs with the wheel locked.
+    virtual void expire() = 0;
+    /// Called on the wheel thread before [expire]: return a number of
+    /// milliseconds to push the deadline back by instead of expiring,
+    /// e.g. while what it guards still makes progress. Same constraints.
+    virtual unsigned long postpone() { return 0; }
+
+private:
+    friend class TimerWheel;
+
+    Timer *prev_;
+    Timer *next_;
+    /// Head of the slot list [this] is linked in, nullptr if unarmed.
+    Timer **slot_;
+    TimerWheel *wheel_;
+    unsigned long long expires_;
+    std::atomic<bool> fired_;
+};
+
+/// Hierarchical timer wheel.
+///
+/// [LEVELS] wheels of [SLOTS] slots each, the first one advancing every
+/// [tick_ms]. A timer goes into the coarsest level that still resolves
+/// its deadline and cascades down as lower levels wrap around. Slots are
+/// intrusive doubly-linked lists, so arming and cancelling are O(1)
+/// whatever the number of timers. Deadlines are rounded up to a tick.
+class TimerWheel
+{
+public:
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS = 1 << LEVEL_BITS;
+    static const int LEVELS = 4;
+
+    explicit TimerWheel(unsigned tick_ms = 10);
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel&) = delete;
+    void operator=(const TimerWheel&) = delete;
+
+    /// (Re)arm [t] to expire [ms] milliseconds from now.
+    void arm(Timer &t, unsigned long ms);
+    /// Disarm [t]. Once this returns, [t] does not expire unless armed
+    /// again, even if its deadline was being processed.
+    void cancel(Timer &t);
+
+    /// Timers that expired so far.
+    unsigned long long expired() const { return expired_; }
+
+private:
+    /// [ms] rounded up to whole ticks, at least one.
+    unsigned long long ticks(unsigned long ms) const;
+    /// Link [t] into the slot of its deadline. Needs [m_].
+    void link(Timer &t);
+    void unlink(Timer &t);
+    /// Advance one tick, cascading and firing due timers. Needs [m_].
+    void tick();
+    /// Body of the wheel thread.
+    void run();
+
+    unsigned tick_ms_;
+    /// Ticks elapsed since construction.
+    unsigned long long now_;
+
+    /// Heads of the slot lists.
+    Timer *slots_[LEVELS][SLOTS];
+
+    std::mutex m_;
+    std::condition_variable cond_;
+    bool done_;
+    std::atomic<unsigned long long> expired_;
+    std::thread thread_;
+};
+
+}   // namespace simple_http_server
+
+#endif
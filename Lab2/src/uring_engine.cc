@@ -0,0 +1,903 @@
+/// uring_engine.cc
+/// Copyright 2020 Cloud-fantasy team
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include "uring_engine.h"
+#include "arena.h"
+#include "metrics.h"
+#include "reporter.h"
+#include "response_builder.h"
+#include "server.h"
+
+namespace simple_http_server
+{
+
+/// Minimal io_uring over the raw system calls, there is no liburing.
+/// One thread submits and reaps.
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    void operator=(const IoUring&) = delete;
+
+    /// Set up a ring of [entries] submissions. False if the kernel has
+    /// no io_uring or forbids it.
+    bool init(unsigned entries);
+    /// Whether the kernel implements [op].
+    bool supports(int op);
+
+    /// Next submission entry, zeroed. Submits pending ones first when
+    /// the queue is full.
+    struct io_uring_sqe *sqe();
+    /// Submit what was queued and wait for [wait] completions.
+    int submit(unsigned wait);
+
+    /// Completions are looked at through [peek] and released with [advance].
+    struct io_uring_cqe *peek();
+    void advance();
+
+    /// Register [count] receive buffers of [size] bytes as group [bgid],
+    /// for receives with IOSQE_BUFFER_SELECT. [count] is a power of two.
+    bool provide_buffers(unsigned short bgid, unsigned count, unsigned size);
+    char *buffer(unsigned short bid) { return bufs_ + static_cast<size_t>(bid) * buf_size_; }
+    /// Give buffer [bid] back to the kernel.
+    void recycle(unsigned short bid);
+
+    /// io_uring_enter(2) calls so far.
+    unsigned long long enters() const { return enters_; }
+
+private:
+    int fd_;
+    struct io_uring_params params_;
+
+    void *sq_ring_;
+    size_t sq_ring_size_;
+    void *cq_ring_;
+    size_t cq_ring_size_;
+    struct io_uring_sqe *sqes_;
+
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned sq_mask_;
+    /// Tail of the entries handed out by [sqe], published by [submit].
+    unsigned sqe_tail_;
+    unsigned submitted_;
+
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    struct io_uring_cqe *cqes_;
+
+    /// Provided buffer ring and the buffers themselves.
+    struct io_uring_buf_ring *br_;
+    size_t br_size_;
+    unsigned br_mask_;
+    unsigned short br_tail_;
+    char *bufs_;
+    size_t bufs_size_;
+    unsigned buf_size_;
+
+    std::atomic<unsigned long long> enters_;
+};
+
+IoUring::IoUring()
+    : fd_(-1), sq_ring_(MAP_FAILED), sq_ring_size_(0), cq_ring_(MAP_FAILED),
+      cq_ring_size_(0), sqes_(static_cast<struct io_uring_sqe *>(MAP_FAILED)),
+      sq_head_(nullptr), sq_tail_(nullptr), sq_mask_(0), sqe_tail_(0), submitted_(0),
+      cq_head_(nullptr), cq_tail_(nullptr), cq_mask_(0), cqes_(nullptr),
+      br_(nullptr), br_size_(0), br_mask_(0), br_tail_(0), bufs_(nullptr),
+      bufs_size_(0), buf_size_(0), enters_(0)
+{
+    std::memset(&params_, 0, sizeof(params_));
+}
+
+IoUring::~IoUring()
+{
+    if (bufs_)
+        ::munmap(bufs_, bufs_size_);
+    if (br_)
+        ::munmap(br_, br_size_);
+    if (sqes_ != MAP_FAILED)
+        ::munmap(sqes_, params_.sq_entries * sizeof(struct io_uring_sqe));
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+        ::munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED)
+        ::munmap(sq_ring_, sq_ring_size_);
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+bool IoUring::init(unsigned entries)
+{
+    // Completions outnumber submissions, a multishot op has many.
+    params_.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params_.cq_entries = entries * 4;
+    fd_ = ::syscall(__NR_io_uring_setup, entries, &params_);
+    if (fd_ < 0 && errno == EINVAL)
+    {
+        // Older kernel, plain ring.
+        std::memset(&params_, 0, sizeof(params_));
+        fd_ = ::syscall(__NR_io_uring_setup, entries, &params_);
+    }
+    if (fd_ < 0)
+        return false;
+
+    sq_ring_size_ = params_.sq_off.array + params_.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params_.cq_off.cqes + params_.cq_entries * sizeof(struct io_uring_cqe);
+    if (params_.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+    sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED)
+        return false;
+    if (params_.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring_ = sq_ring_;
+    else
+    {
+        cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED)
+            return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe *>(
+        ::mmap(nullptr, params_.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED)
+        return false;
+
+    char *sq = static_cast<char *>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params_.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params_.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params_.sq_off.ring_mask);
+    sqe_tail_ = submitted_ = *sq_tail_;
+
+    // Entries are used in order, the indirection array is the identity.
+    unsigned *array = reinterpret_cast<unsigned *>(sq + params_.sq_off.array);
+    for (unsigned i = 0; i < params_.sq_entries; i++)
+        array[i] = i;
+
+    char *cq = static_cast<char *>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params_.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params_.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params_.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params_.cq_off.cqes);
+    return true;
+}
+
+bool IoUring::supports(int op)
+{
+    static const unsigned OPS = 256;
+    std::vector<char> mem(sizeof(struct io_uring_probe) + OPS * sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(mem.data());
+
+    if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, OPS) < 0)
+        return false;
+    return op <= probe->last_op && op < probe->ops_len &&
+           (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+struct io_uring_sqe *IoUring::sqe()
+{
+    // The kernel consumes submissions when entered, make room that way.
+    while (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= params_.sq_entries)
+        submit(0);
+
+    struct io_uring_sqe *e = &sqes_[sqe_tail_ & sq_mask_];
+    sqe_tail_++;
+    std::memset(e, 0, sizeof(*e));
+    return e;
+}
+
+int IoUring::submit(unsigned wait)
+{
+    unsigned to_submit = sqe_tail_ - submitted_;
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    submitted_ = sqe_tail_;
+    if (to_submit == 0 && wait == 0)
+        return 0;
+
+    for (;;)
+    {
+        enters_++;
+        int n = ::syscall(__NR_io_uring_enter, fd_, to_submit, wait,
+                          wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n;
+    }
+}
+
+struct io_uring_cqe *IoUring::peek()
+{
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+        return nullptr;
+    return &cqes_[head & cq_mask_];
+}
+
+void IoUring::advance()
+{
+    __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+bool IoUring::provide_buffers(unsigned short bgid, unsigned count, unsigned size)
+{
+    br_size_ = count * sizeof(struct io_uring_buf);
+    void *br = ::mmap(nullptr, br_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED)
+        return false;
+    br_ = static_cast<struct io_uring_buf_ring *>(br);
+
+    bufs_size_ = static_cast<size_t>(count) * size;
+    void *bufs = ::mmap(nullptr, bufs_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED)
+        return false;
+    bufs_ = static_cast<char *>(bufs);
+    buf_size_ = size;
+    br_mask_ = count - 1;
+
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uintptr_t>(br_);
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+
+    for (unsigned i = 0; i < count; i++)
+        recycle(i);
+    return true;
+}
+
+void IoUring::recycle(unsigned short bid)
+{
+    // Only addr, len and bid: the resv field of the first entry is the
+    // tail. Entries are indexed by hand, the flexible array member of the
+    // kernel header is misplaced when compiled as C++.
+    struct io_uring_buf *b = reinterpret_cast<struct io_uring_buf *>(br_) + (br_tail_ & br_mask_);
+    b->addr = reinterpret_cast<uintptr_t>(buffer(bid));
+    b->len = buf_size_;
+    b->bid = bid;
+    br_tail_++;
+    __atomic_store_n(&br_->tail, br_tail_, __ATOMIC_RELEASE);
+}
+
+/// Submission queue entries per loop.
+static const unsigned RING_ENTRIES = 1024;
+/// Provided receive buffers per loop.
+static const unsigned RECV_BUFFERS = 256;
+static const unsigned RECV_BUFFER_SIZE = 4 << 10;
+static const unsigned short BUFFER_GROUP = 0;
+/// Longest head answered in the loop, see the same limit of the workers.
+static const size_t MAX_HEAD_SIZE = 64 << 10;
+/// Deadlines are checked this often.
+static const long TICK_MS = 100;
+
+static unsigned long long now_ms()
+{
+    return now_ns() / 1000000;
+}
+
+/// [response] with Connection: close in its head, see close_connection.
+static FileCache::response_ptr closing(FileCache::response_ptr const &response)
+{
+    size_t end = response->find("\r\n\r\n");
+    if (end == std::string::npos)
+        return response;
+
+    std::string storage;
+    StringRef head = close_connection(StringRef(response->data(), end + 4), storage);
+    if (head.data == response->data())
+        return response;
+    storage.append(*response, end + 4, std::string::npos);
+    return std::make_shared<const std::string>(std::move(storage));
+}
+
+class UringEngine::Loop
+{
+public:
+    Loop(UringEngine &engine, Server &server)
+        : engine_(engine), server_(server), conns_(nullptr), accept_paused_(false)
+    {
+        tick_.tv_sec = TICK_MS / 1000;
+        tick_.tv_nsec = (TICK_MS % 1000) * 1000000;
+    }
+
+    /// Set up the ring and the listener. False on failure.
+    bool init()
+    {
+        if (!ring_.init(RING_ENTRIES) ||
+            !ring_.provide_buffers(BUFFER_GROUP, RECV_BUFFERS, RECV_BUFFER_SIZE))
+            return false;
+
+        ResponseBuilder builder;
+        builder.start(Response::REQUEST_TIMEOUT, "Request Timeout")
+               .header("Server", Server::server_name)
+               .header("Content-length", 0ULL)
+               .header("Connection", "close");
+        timeout_response_ = std::make_shared<const std::string>(builder.finish());
+
+        return listener_.set_reuseport(true) &&
+               listener_.bind(server_.ip, server_.port) &&
+               listener_.listen(1024);
+    }
+
+    void run();
+    unsigned long long enters() const { return ring_.enters(); }
+
+private:
+    enum Op { OP_ACCEPT = 1, OP_TICK, OP_RECV, OP_SEND, OP_SHUTDOWN, OP_CLOSE, OP_CANCEL };
+    static const uintptr_t OP_MASK = 7;
+
+    /// Bytes of a response, kept alive by [owner].
+    struct Piece
+    {
+        std::shared_ptr<const void> owner;
+        const char *data;
+        size_t length;
+
+        Piece(FileCache::response_ptr const &s)
+            : owner(s), data(s->data()), length(s->length()) {}
+        Piece(std::shared_ptr<const void> owner, const char *data, size_t length)
+            : owner(std::move(owner)), data(data), length(length) {}
+    };
+
+    struct Conn
+    {
+        int fd;
+        /// Bytes received and not answered yet.
+        std::string in;
+        /// Responses to send, the first one from offset [sent].
+        std::deque<Piece> out;
+        size_t sent;
+        /// Operations whose last completion has not arrived yet.
+        unsigned pending;
+        bool receiving;
+        bool sending;
+        /// Shutdown and close submitted.
+        bool closing;
+        /// The fd is closed or belongs to a worker.
+        bool gone;
+        /// Close once [out] is sent: peer gone, error, deadline or
+        /// Connection: close.
+        bool finishing;
+        bool handing_off;
+        bool cancelling;
+        /// The send in flight stalled past its deadline and is cancelled.
+        bool aborting;
+        /// Some request was answered already.
+        bool served;
+        unsigned long long deadline;
+        Conn *prev;
+        Conn *next;
+    };
+
+    static uint64_t tag(Conn *c, Op op) { return reinterpret_cast<uintptr_t>(c) | op; }
+
+    void arm_accept();
+    void arm_tick();
+    void arm_recv(Conn *c);
+    void send_next(Conn *c);
+    void close_conn(Conn *c);
+    /// Cancel the operation [op] of [c] in flight.
+    void cancel(Conn *c, Op op);
+
+    void complete(struct io_uring_cqe const &cqe);
+    void on_accept(struct io_uring_cqe const &cqe);
+    void on_recv(Conn *c, struct io_uring_cqe const &cqe);
+    void on_send(Conn *c, int res);
+    /// Answer the complete requests in [c->in].
+    void process(Conn *c);
+    /// Move [c] along once its operations completed.
+    void settle(Conn *c);
+    void handoff(Conn *c);
+    void release(Conn *c);
+    void sweep();
+
+    UringEngine &engine_;
+    Server &server_;
+    IoUring ring_;
+    TCPSocket listener_;
+    struct __kernel_timespec tick_;
+    /// Open connections, for the deadline sweep.
+    Conn *conns_;
+    /// Sent to clients too slow to send their head.
+    FileCache::response_ptr timeout_response_;
+    /// Out of descriptors: accepting resumes at the next tick.
+    bool accept_paused_;
+};
+
+void UringEngine::Loop::arm_accept()
+{
+    struct io_uring_sqe *e = ring_.sqe();
+    e->opcode = IORING_OP_ACCEPT;
+    e->fd = listener_.fd();
+    e->ioprio = IORING_ACCEPT_MULTISHOT;
+    e->user_data = tag(nullptr, OP_ACCEPT);
+}
+
+void UringEngine::Loop::arm_tick()
+{
+    struct io_uring_sqe *e = ring_.sqe();
+    e->opcode = IORING_OP_TIMEOUT;
+    e->fd = -1;
+    e->addr = reinterpret_cast<uintptr_t>(&tick_);
+    e->len = 1;
+    e->user_data = tag(nullptr, OP_TICK);
+}
+
+void UringEngine::Loop::arm_recv(Conn *c)
+{
+    struct io_uring_sqe *e = ring_.sqe();
+    e->opcode = IORING_OP_RECV;
+    e->fd = c->fd;
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = BUFFER_GROUP;
+    e->user_data = tag(c, OP_RECV);
+    c->receiving = true;
+    c->pending++;
+}
+
+void UringEngine::Loop::send_next(Conn *c)
+{
+    Piece const &front = c->out.front();
+    bool last = c->finishing && c->out.size() == 1 && !c->handing_off;
+
+    struct io_uring_sqe *e = ring_.sqe();
+    e->opcode = IORING_OP_SEND;
+    e->fd = c->fd;
+    e->addr = reinterpret_cast<uintptr_t>(front.data + c->sent);
+    e->len = front.length - c->sent;
+    // Short sends are retried by the kernel.
+    e->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    e->user_data = tag(c, OP_SEND);
+    c->sending = true;
+    c->pending++;
+    c->deadline = now_ms() + server_.timeouts[Server::TIMEOUT_WRITE];
+
+    // The last response is chained to the close, the chain holds even
+    // if the send fails.
+    if (last)
+    {
+        e->flags = IOSQE_IO_HARDLINK;
+        close_conn(c);
+    }
+}
+
+void UringEngine::Loop::close_conn(Conn *c)
+{
+    // Shutting down ends the multishot receive, which holds the socket
+    // open past the close otherwise.
+    struct io_uring_sqe *e = ring_.sqe();
+    e->opcode = IORING_OP_SHUTDOWN;
+    e->fd = c->fd;
+    e->len = SHUT_RDWR;
+    e->flags = IOSQE_IO_HARDLINK;
+    e->user_data = tag(c, OP_SHUTDOWN);
+
+    e = ring_.sqe();
+    e->opcode = IORING_OP_CLOSE;
+    e->fd = c->fd;
+    e->user_data = tag(c, OP_CLOSE);
+
+    c->closing = true;
+    c->pending += 2;
+}
+
+void UringEngine::Loop::cancel(Conn *c, Op op)
+{
+    struct io_uring_sqe *e = ring_.sqe();
+    e->opcode = IORING_OP_ASYNC_CANCEL;
+    e->fd = -1;
+    e->addr = tag(c, op);
+    e->user_data = tag(c, OP_CANCEL);
+    c->pending++;
+}
+
+void UringEngine::Loop::run()
+{
+    arm_accept();
+    arm_tick();
+
+    for (;;)
+    {
+        // Block only when nothing is left to reap.
+        if (ring_.submit(ring_.peek() ? 0 : 1) < 0 && errno != EBUSY)
+        {
+            report(ERROR) << "io_uring_enter: " << strerror(errno) << std::endl;
+            abort();
+        }
+
+        while (struct io_uring_cqe *cqe = ring_.peek())
+        {
+            struct io_uring_cqe copy = *cqe;
+            ring_.advance();
+            complete(copy);
+        }
+    }
+}
+
+void UringEngine::Loop::complete(struct io_uring_cqe const &cqe)
+{
+    Conn *c = reinterpret_cast<Conn *>(cqe.user_data & ~OP_MASK);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    switch (cqe.user_data & OP_MASK)
+    {
+    case OP_ACCEPT:
+        on_accept(cqe);
+        // Out of descriptors, rearming at once would spin on the error.
+        if (!more && (cqe.res == -EMFILE || cqe.res == -ENFILE))
+            accept_paused_ = true;
+        else if (!more)
+            arm_accept();
+        return;
+    case OP_TICK:
+        sweep();
+        arm_tick();
+        if (accept_paused_)
+        {
+            accept_paused_ = false;
+            arm_accept();
+        }
+        return;
+    case OP_RECV:
+        if (!more)
+        {
+            c->receiving = false;
+            c->pending--;
+        }
+        on_recv(c, cqe);
+        break;
+    case OP_SEND:
+        c->sending = false;
+        c->pending--;
+        on_send(c, cqe.res);
+        break;
+    case OP_SHUTDOWN:
+        c->pending--;
+        break;
+    case OP_CLOSE:
+        c->pending--;
+        c->gone = true;
+        break;
+    case OP_CANCEL:
+        c->pending--;
+        break;
+    }
+    settle(c);
+}
+
+void UringEngine::Loop::on_accept(struct io_uring_cqe const &cqe)
+{
+    if (cqe.res < 0)
+    {
+        report(WARN) << "io_uring accept: " << strerror(-cqe.res) << std::endl;
+        if (cqe.res == -EMFILE || cqe.res == -ENFILE)
+            report(WARN) << "accepting again in " << TICK_MS << " ms" << std::endl;
+        return;
+    }
+
+    Conn *c = new Conn();
+    c->fd = cqe.res;
+    c->sent = 0;
+    c->pending = 0;
+    c->receiving = c->sending = c->closing = c->gone = false;
+    c->finishing = c->handing_off = c->cancelling = c->aborting = c->served = false;
+    c->deadline = now_ms() + server_.timeouts[Server::TIMEOUT_HEADER];
+    c->prev = nullptr;
+    c->next = conns_;
+    if (conns_)
+        conns_->prev = c;
+    conns_ = c;
+
+    Metrics::connection_opened();
+    arm_recv(c);
+}
+
+void UringEngine::Loop::on_recv(Conn *c, struct io_uring_cqe const &cqe)
+{
+    if (cqe.res > 0)
+    {
+        unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        c->in.append(ring_.buffer(bid), cqe.res);
+        ring_.recycle(bid);
+        if (!c->finishing && !c->handing_off && !c->closing)
+            process(c);
+        return;
+    }
+
+    // Out of buffers ends the receive without harm, it is armed again.
+    if (cqe.res == -ENOBUFS || cqe.res == -ECANCELED)
+        return;
+
+    // Peer closed or error: what was answered is still sent.
+    c->finishing = true;
+}
+
+void UringEngine::Loop::on_send(Conn *c, int res)
+{
+    // Failed or cancelled, what was not sent is dropped. The kernel is
+    // done with the piece now.
+    if (res < 0 || c->aborting)
+    {
+        c->out.clear();
+        c->finishing = true;
+        return;
+    }
+    if (c->out.empty())
+        return;
+
+    c->sent += res;
+    if (c->sent >= c->out.front().length)
+    {
+        c->out.pop_front();
+        c->sent = 0;
+    }
+    if (c->out.empty())
+        c->deadline = now_ms() + server_.timeouts[c->in.empty() ? Server::TIMEOUT_IDLE
+                                                                : Server::TIMEOUT_HEADER];
+}
+
+void UringEngine::Loop::process(Conn *c)
+{
+    Arena &arena = Arena::local();
+    size_t pos = 0;
+
+    while (pos < c->in.length())
+    {
+        size_t end = c->in.find("\r\n\r\n", pos);
+        size_t end_lf = c->in.find("\n\n", pos);
+        if (end != std::string::npos)
+            end += 4;
+        if (end_lf != std::string::npos && (end == std::string::npos || end_lf + 2 < end))
+            end = end_lf + 2;
+        if (end == std::string::npos)
+        {
+            // Incomplete head, wait for more unless it is too long.
+            if (c->in.length() - pos > MAX_HEAD_SIZE)
+                c->handing_off = true;
+            break;
+        }
+
+        unsigned long long received = now_ns();
+        const char *head = c->in.data() + pos;
+        const char *eol = static_cast<const char *>(std::memchr(head, '\n', end - pos));
+        size_t line = eol - head + 1;
+
+        Request *req = arena.make<Request>();
+        FileCache::response_ptr response;
+        StaticStore::index_ptr index;
+        StaticStore::Representation const *stored = nullptr;
+        if (server_.parse_req_line(StringRef(head, line), req->method, req->resource, req->version) &&
+            req->version == "HTTP/1.1" && req->method == "GET" &&
+            server_.parse_headers(StringRef(head + line, end - pos - line), req->headers))
+        {
+            req->keep_alive = !req->headers.contains_token(Headers::CONNECTION, "close");
+
+            // Bodies, the proxy, the other handlers and upgrades to
+            // HTTP/2 need a worker, and so does conflicting framing,
+            // for the worker to reject it.
+            StringRef const *length = req->headers.get(Headers::CONTENT_LENGTH);
+            bool bodyless = !req->headers.get(Headers::TRANSFER_ENCODING) &&
+                            (!length || (*length == "0" && req->headers.consistent(Headers::CONTENT_LENGTH)));
+            RouteMatch match;
+            if (bodyless && !server_.proxy && !req->headers.contains_token("Upgrade", "h2c") &&
+                !server_.routes.find(req->method, req->resource, match) && !match.allowed &&
+                !server_.stored_response(*req, index, response, stored))
+                response = server_.static_response(*req);
+        }
+
+        if (!response)
+        {
+            arena.reset();
+            c->handing_off = true;
+            break;
+        }
+
+        // As Http1Writer::closing does for the workers.
+        if (!req->keep_alive)
+            response = closing(response);
+        c->out.push_back(response);
+        // Straight from the mapping.
+        if (stored && stored->size > 0)
+            c->out.push_back(Piece(index, stored->body, stored->size));
+        c->served = true;
+        pos = end;
+        engine_.requests_++;
+        Metrics::record_request(req->method, status_code(*response), now_ns() - received);
+
+        bool keep_alive = req->keep_alive;
+        arena.reset();
+        if (!keep_alive)
+        {
+            c->finishing = true;
+            break;
+        }
+    }
+
+    // A request that does not progress keeps its header deadline.
+    if (pos > 0)
+        c->deadline = now_ms() + server_.timeouts[pos == c->in.length() ? Server::TIMEOUT_IDLE
+                                                                        : Server::TIMEOUT_HEADER];
+    c->in.erase(0, pos);
+}
+
+void UringEngine::Loop::settle(Conn *c)
+{
+    if (c->gone)
+    {
+        if (c->pending == 0)
+            release(c);
+        return;
+    }
+    if (c->closing)
+        return;
+
+    if (!c->sending && !c->out.empty())
+    {
+        send_next(c);
+        return;
+    }
+    if (c->sending)
+        return;
+
+    // Even if the peer is gone, a worker answers what it sent.
+    if (c->handing_off)
+    {
+        // The receive is stopped first, bytes it still brings are kept.
+        if (c->receiving && !c->cancelling)
+        {
+            cancel(c, OP_RECV);
+            c->cancelling = true;
+        }
+        else if (!c->receiving && c->pending == 0)
+            handoff(c);
+        return;
+    }
+
+    if (c->finishing)
+    {
+        close_conn(c);
+        return;
+    }
+
+    // Multishot receives end when buffers run short.
+    if (!c->receiving)
+        arm_recv(c);
+}
+
+void UringEngine::Loop::handoff(Conn *c)
+{
+    std::unique_ptr<TCPSocket> sock(new TCPSocket());
+    sock->adopt(c->fd, c->in.data(), c->in.length());
+    c->gone = true;
+    engine_.handoffs_++;
+
+    server_.workers->add_client(std::move(sock));
+    release(c);
+}
+
+void UringEngine::Loop::release(Conn *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        conns_ = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    Metrics::connection_closed();
+    delete c;
+}
+
+void UringEngine::Loop::sweep()
+{
+    unsigned long long now = now_ms();
+    for (Conn *c = conns_; c; )
+    {
+        Conn *next = c->next;
+        if (c->gone || now < c->deadline)
+        {
+            c = next;
+            continue;
+        }
+
+        // A stalled send, possibly linked to the close. The kernel still
+        // reads the piece in flight, which stays until it completes; the
+        // rest is dropped and the completion closes the connection.
+        if (c->sending && !c->aborting)
+        {
+            server_.timeouts_fired[Server::TIMEOUT_WRITE]++;
+            c->out.erase(c->out.begin() + 1, c->out.end());
+            c->finishing = true;
+            c->aborting = true;
+            cancel(c, OP_SEND);
+        }
+        else if (!c->sending && !c->closing && !c->handing_off && !c->finishing)
+        {
+            Server::TimeoutKind kind = !c->out.empty() ? Server::TIMEOUT_WRITE
+                                     : c->in.empty() && c->served ? Server::TIMEOUT_IDLE
+                                     : Server::TIMEOUT_HEADER;
+            server_.timeouts_fired[kind]++;
+            c->out.clear();
+            if (kind == Server::TIMEOUT_HEADER && !c->in.empty())
+                c->out.push_back(timeout_response_);
+            c->finishing = true;
+            settle(c);
+        }
+        c = next;
+    }
+}
+
+UringEngine::UringEngine(Server &server, size_t n_loops)
+    : server_(server), requests_(0), handoffs_(0)
+{
+    for (size_t i = 0; i < n_loops; i++)
+        loops_.emplace_back(new Loop(*this, server));
+}
+
+UringEngine::~UringEngine()
+{}
+
+bool UringEngine::supported()
+{
+    IoUring ring;
+    // Multishot receive came with zero-copy send, in Linux 6.0.
+    return ring.init(8) &&
+           ring.supports(IORING_OP_SEND_ZC) &&
+           ring.supports(IORING_OP_SHUTDOWN) &&
+           ring.provide_buffers(BUFFER_GROUP, 2, 64);
+}
+
+unsigned long long UringEngine::enters() const
+{
+    unsigned long long n = 0;
+    for (auto &loop : loops_)
+        n += loop->enters();
+    return n;
+}
+
+void UringEngine::run()
+{
+    unsigned n_cpus = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < loops_.size(); i++)
+    {
+        if (!loops_[i]->init())
+        {
+            report(ERROR) << "fail setting up io_uring loop " << i << std::endl;
+            abort();
+        }
+
+        threads.emplace_back(&Loop::run, loops_[i].get());
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % n_cpus, &cpus);
+        if (pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpus), &cpus) != 0)
+            report(WARN) << "fail pinning io_uring loop " << i << std::endl;
+    }
+
+    report(INFO) << loops_.size() << " io_uring loops started" << std::endl;
+    for (auto &t : threads)
+        t.join();
+}
+
+} // namespace simple_http_server
@@ -0,0 +1,62 @@
+/// uring_engine.h
+/// Copyright 2020 Cloud-fantasy team
+
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace simple_http_server
+{
+
+class Server;
+
+/// I/O engine serving connections from io_uring event loops instead of
+/// one blocked worker per connection.
+///
+/// Each loop owns a ring and a SO_REUSEPORT listener. Connections come
+/// from a multishot accept, bytes from a multishot receive into buffers
+/// provided to the kernel, and responses leave through sends linked to
+/// the shutdown and close of the socket when it is not kept alive. A
+/// loop only enters the kernel once per batch of completions, so at
+/// high connection counts a request costs a fraction of a system call.
+///
+/// GETs of cacheable static files are answered in the loop from the
+/// file cache. Any other request is handed with the bytes already
+/// received to the blocking workers, which serve the connection from
+/// then on. Connections past their deadline are closed.
+class UringEngine
+{
+public:
+    UringEngine(Server &server, size_t n_loops);
+    ~UringEngine();
+
+    /// Whether io_uring and the features the loops rely on (multishot
+    /// accept and receive, provided buffer rings) are available.
+    static bool supported();
+
+    /// Run the loops on the port of the server. Never returns.
+    void run();
+
+    /// io_uring_enter(2) calls of all loops.
+    unsigned long long enters() const;
+    /// Requests answered by the loops.
+    unsigned long long requests() const { return requests_; }
+    /// Connections handed to the workers.
+    unsigned long long handoffs() const { return handoffs_; }
+
+private:
+    class Loop;
+
+    Server &server_;
+    std::vector<std::unique_ptr<Loop>> loops_;
+    std::atomic<unsigned long long> requests_;
+    std::atomic<unsigned long long> handoffs_;
+};
+
+}   // namespace simple_http_server
+
+#endif
@@ -0,0 +1,222 @@
+/// hpack_test.cc
+/// Copyright 2020 Cloud-fantasy team
+///
+/// Tests of the HPACK coder of the HTTP/2 connections: the examples of
+/// RFC 7541 appendix C decoded and encoded back, and malformed blocks
+/// that must fail with a compression error. Prints the failed checks and
+/// exits non-zero if there is any. Built and run by `make test`.
+
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "../src/hpack.h"
+using namespace simple_http_server;
+
+static int failures = 0;
+
+#define CHECK(cond, what)                                                      \
+    do                                                                         \
+    {                                                                          \
+        if (!(cond))                                                           \
+        {                                                                      \
+            std::cerr << "FAIL " << (what) << ": " #cond << std::endl;         \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+/// Bytes of the hexadecimal [hex], spaces ignored.
+static std::string bytes(std::string const &hex)
+{
+    std::string out, digits;
+    for (char c : hex)
+        if (c != ' ')
+            digits.push_back(c);
+    for (size_t i = 0; i + 1 < digits.length(); i += 2)
+        out.push_back(static_cast<char>(std::strtoul(digits.substr(i, 2).c_str(), nullptr, 16)));
+    return out;
+}
+
+static bool decode(HpackDecoder &decoder, std::string const &block, std::vector<HeaderField> &fields)
+{
+    fields.clear();
+    return decoder.decode(reinterpret_cast<const uint8_t *>(block.data()), block.length(), fields);
+}
+
+static bool same(std::vector<HeaderField> const &a, std::vector<HeaderField> const &b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++)
+        if (a[i].name != b[i].name || a[i].value != b[i].value)
+            return false;
+    return true;
+}
+
+/// One header block of an example and the fields it stands for.
+struct Block
+{
+    const char *hex;
+    std::vector<HeaderField> fields;
+};
+
+/// Decode the [blocks] of [name] in order on one connection, then encode
+/// their fields and decode them back on another.
+static void run_example(const char *name, size_t capacity, std::vector<Block> const &blocks)
+{
+    HpackDecoder decoder(capacity);
+    HpackEncoder encoder;
+    encoder.set_max_capacity(capacity);
+    HpackDecoder peer(capacity);
+
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        std::string what = std::string(name) + " block " + std::to_string(i + 1);
+        std::vector<HeaderField> fields;
+        CHECK(decode(decoder, bytes(blocks[i].hex), fields), what);
+        CHECK(same(fields, blocks[i].fields), what);
+
+        std::string block;
+        encoder.encode(blocks[i].fields, block);
+        CHECK(decode(peer, block, fields), what + " round trip");
+        CHECK(same(fields, blocks[i].fields), what + " round trip");
+    }
+}
+
+static void test_integers()
+{
+    // C.1.1 to C.1.3.
+    std::string out;
+    hpack_encode_int(out, 0, 5, 10);
+    CHECK(out == bytes("0a"), "C.1.1");
+    out.clear();
+    hpack_encode_int(out, 0, 5, 1337);
+    CHECK(out == bytes("1f9a0a"), "C.1.2");
+    out.clear();
+    hpack_encode_int(out, 0, 8, 42);
+    CHECK(out == bytes("2a"), "C.1.3");
+
+    for (uint64_t value : { 0ULL, 30ULL, 31ULL, 127ULL, 1337ULL, (1ULL << 28) - 1 })
+    {
+        out.clear();
+        hpack_encode_int(out, 0, 5, value);
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(out.data());
+        uint64_t decoded;
+        CHECK(hpack_decode_int(p, p + out.length(), 5, decoded) && decoded == value,
+              "integer " + std::to_string(value));
+    }
+}
+
+static void test_examples()
+{
+    // C.2, each on its own connection.
+    run_example("C.2.1", 4096, { { "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+                                   { { "custom-key", "custom-header" } } } });
+    run_example("C.2.2", 4096, { { "040c 2f73 616d 706c 652f 7061 7468",
+                                   { { ":path", "/sample/path" } } } });
+    run_example("C.2.3", 4096, { { "1008 7061 7373 776f 7264 0673 6563 7265 74",
+                                   { { "password", "secret" } } } });
+    run_example("C.2.4", 4096, { { "82", { { ":method", "GET" } } } });
+
+    std::vector<HeaderField> first = { { ":method", "GET" }, { ":scheme", "http" },
+                                       { ":path", "/" }, { ":authority", "www.example.com" } };
+    std::vector<HeaderField> second = first;
+    second.emplace_back("cache-control", "no-cache");
+    std::vector<HeaderField> third = { { ":method", "GET" }, { ":scheme", "https" },
+                                       { ":path", "/index.html" }, { ":authority", "www.example.com" },
+                                       { "custom-key", "custom-value" } };
+
+    run_example("C.3", 4096, {
+        { "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", first },
+        { "8286 84be 5808 6e6f 2d63 6163 6865", second },
+        { "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", third } });
+    run_example("C.4", 4096, {
+        { "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", first },
+        { "8286 84be 5886 a8eb 1064 9cbf", second },
+        { "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", third } });
+
+    // C.5 and C.6 evict with a 256 byte table.
+    std::vector<HeaderField> r1 = { { ":status", "302" }, { "cache-control", "private" },
+                                    { "date", "Mon, 21 Oct 2013 20:13:21 GMT" },
+                                    { "location", "https://www.example.com" } };
+    std::vector<HeaderField> r2 = r1;
+    r2[0].value = "307";
+    std::vector<HeaderField> r3 = { { ":status", "200" }, { "cache-control", "private" },
+                                    { "date", "Mon, 21 Oct 2013 20:13:22 GMT" },
+                                    { "location", "https://www.example.com" },
+                                    { "content-encoding", "gzip" },
+                                    { "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" } };
+
+    run_example("C.5", 256, {
+        { "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 "
+          "2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 "
+          "6c65 2e63 6f6d", r1 },
+        { "4803 3330 37c1 c0bf", r2 },
+        { "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d "
+          "54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 "
+          "5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e "
+          "3d31", r3 } });
+    run_example("C.6", 256, {
+        { "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 "
+          "2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3", r1 },
+        { "4883 640e ffc1 c0bf", r2 },
+        { "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab "
+          "77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f "
+          "9587 3160 65c0 03ed 4ee5 b106 3d50 07", r3 } });
+}
+
+/// [hex] must fail to decode on a fresh connection.
+static void malformed(const char *what, const char *hex)
+{
+    HpackDecoder decoder;
+    std::vector<HeaderField> fields;
+    CHECK(!decode(decoder, bytes(hex), fields), what);
+}
+
+static void test_malformed()
+{
+    // "a" is 00011, padded with ones it is 0x1f.
+    std::string out;
+    CHECK(huffman_decode(reinterpret_cast<const uint8_t *>("\x1f"), 1, out) && out == "a", "huffman a");
+    out.clear();
+    CHECK(!huffman_decode(reinterpret_cast<const uint8_t *>("\x18"), 1, out), "padding with zeros");
+    out.clear();
+    CHECK(!huffman_decode(reinterpret_cast<const uint8_t *>("\x1f\xff"), 2, out), "padding of 8 bits");
+    malformed("literal name with bad padding", "0081 1801 61");
+    malformed("literal value with bad padding", "0001 6181 18");
+
+    // Longer than any header needs, or cut short.
+    const uint8_t overflow[] = { 0x1f, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 };
+    const uint8_t *p = overflow;
+    uint64_t value;
+    CHECK(!hpack_decode_int(p, overflow + sizeof(overflow), 5, value), "integer overflow");
+    malformed("index overflow", "ffff ffff ffff 01");
+    malformed("string length overflow", "0001 61ff ffff ffff ff01");
+    malformed("truncated integer", "ff80");
+    malformed("string past the block", "0001 610a 61");
+
+    // Size updates come first and within the SETTINGS_HEADER_TABLE_SIZE.
+    malformed("size update after a field", "8220");
+    malformed("size update above the maximum", "3fe9 26");
+    HpackDecoder decoder;
+    std::vector<HeaderField> fields;
+    CHECK(decode(decoder, bytes("2082"), fields) && fields.size() == 1, "size update first");
+
+    malformed("index 0", "80");
+    malformed("index past the table", "be");
+}
+
+int main()
+{
+    test_integers();
+    test_examples();
+    test_malformed();
+
+    if (failures)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "hpack: all checks passed" << std::endl;
+    return 0;
+}
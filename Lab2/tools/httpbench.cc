@@ -0,0 +1,600 @@
+/// httpbench.cc
+/// Copyright 2020 Cloud-fantasy team
+///
+/// Load generator for httpserver. Every thread drives its share of the
+/// connections with epoll. In fixed rate mode requests are scheduled
+/// ahead of time and latency is measured from the scheduled time, so a
+/// stalled server is not hidden by the client waiting on it (coordinated
+/// omission).
+
+#include <iostream>
+#include <getopt.h>
+#include <csignal>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "../src/metrics.h"
+using namespace simple_http_server;
+
+static struct option long_options[] = {
+    { "ip", required_argument, NULL, 'i' },
+    { "port", required_argument, NULL, 'p' },
+    { "connections", required_argument, NULL, 'c' },
+    { "threads", required_argument, NULL, 't' },
+    { "duration", required_argument, NULL, 'd' },
+    { "pipeline", required_argument, NULL, 'D' },
+    { "rate", required_argument, NULL, 'R' },
+    { "path", required_argument, NULL, 'u' },
+    { "post-ratio", required_argument, NULL, 'm' },
+    { "no-keep-alive", no_argument, NULL, 'k' },
+    { 0, 0, 0, 0 }
+};
+
+static void print_usage(char *const prog)
+{
+    std::cerr << "Usage: " << prog << " [OPTION]" << std::endl;
+    std::cerr << "[OPTION] can be the following:" << std::endl;
+    std::cerr << "\t" << "--ip " << "ip_address" << std::endl;
+    std::cerr << "\t" << "--port " << "port_number" << std::endl;
+    std::cerr << "\t" << "--connections " << "n" << std::endl;
+    std::cerr << "\t" << "--threads " << "n" << std::endl;
+    std::cerr << "\t" << "--duration " << "seconds" << std::endl;
+    std::cerr << "\t" << "--pipeline " << "n (outstanding requests per connection)" << std::endl;
+    std::cerr << "\t" << "--rate " << "requests/s (all connections, 0 sends as fast as possible)" << std::endl;
+    std::cerr << "\t" << "--path " << "GET resource" << std::endl;
+    std::cerr << "\t" << "--post-ratio " << "0..1 (share of POST /Post_show requests)" << std::endl;
+    std::cerr << "\t" << "--no-keep-alive " << "(one request per connection)" << std::endl;
+}
+
+struct Config
+{
+    std::string ip = "127.0.0.1";
+    uint16_t port = 8888;
+    size_t connections = 64;
+    size_t threads = 4;
+    double duration = 10;
+    size_t pipeline = 1;
+    double rate = 0;
+    std::string path = "/index.html";
+    double post_ratio = 0;
+    bool keep_alive = true;
+};
+
+/// Results of one thread.
+struct Stats
+{
+    Histogram latency;
+    unsigned long long completed = 0;
+    unsigned long long errors = 0;
+    unsigned long long non_2xx = 0;
+    unsigned long long bytes = 0;
+};
+
+struct Connection
+{
+    int fd = -1;
+    bool connecting = false;
+    std::string out;
+    size_t out_off = 0;
+    std::string in;
+    /// Start time of every request sent and not yet answered.
+    std::deque<unsigned long long> started;
+    /// Next scheduled request in fixed rate mode.
+    unsigned long long next_at = 0;
+    /// Requests sent on this connection, for the GET/POST mix.
+    unsigned long long sent = 0;
+
+    /* Response being parsed. */
+    bool in_body = false;
+    long long body_left = 0;
+    bool close_delimited = false;
+    /// The server announced it closes the connection after it.
+    bool closing = false;
+    int status = 0;
+};
+
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int)
+{
+    stopping = true;
+}
+
+class Worker
+{
+public:
+    Worker(Config const &conf, size_t n_conns, double rate)
+        : conf_(conf), conns_(n_conns), interval_ns_(0)
+    {
+        if (rate > 0)
+            interval_ns_ = static_cast<unsigned long long>(1e9 * n_conns / rate);
+
+        // The form data of the POST handler.
+        post_ = "POST /Post_show HTTP/1.1\r\nHost: " + conf.ip +
+                "\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                "Content-Length: 17\r\n";
+        get_ = "GET " + conf.path + " HTTP/1.1\r\nHost: " + conf.ip + "\r\n";
+        std::string tail = conf.keep_alive ? "\r\n" : "Connection: close\r\n\r\n";
+        post_ += tail + "Name=bench&ID=007";
+        get_ += tail;
+    }
+
+    void run(unsigned long long begin, unsigned long long end)
+    {
+        epfd_ = ::epoll_create1(0);
+        for (size_t i = 0; i < conns_.size(); i++)
+        {
+            // Spread the schedules of the connections over one interval.
+            conns_[i].next_at = begin + interval_ns_ * i / conns_.size();
+            open(i);
+        }
+
+        // Sends are paced by a timer of nanosecond resolution: the
+        // millisecond timeout of epoll_wait would spin on sends due
+        // within the millisecond, or delay them.
+        timer_fd_ = -1;
+        if (interval_ns_)
+        {
+            timer_fd_ = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = conns_.size();
+            ::epoll_ctl(epfd_, EPOLL_CTL_ADD, timer_fd_, &ev);
+        }
+
+        std::vector<struct epoll_event> events(conns_.size() + 1);
+        while (!stopping)
+        {
+            unsigned long long now = now_ns();
+            if (now >= end)
+                break;
+
+            for (size_t i = 0; i < conns_.size(); i++)
+                fill(i, now);
+
+            int timeout = static_cast<int>(std::min<unsigned long long>((end - now) / 1000000 + 1, 100));
+            if (interval_ns_)
+                arm_timer();
+
+            int n = ::epoll_wait(epfd_, events.data(), events.size(), timeout);
+            for (int k = 0; k < n; k++)
+            {
+                size_t i = events[k].data.u64;
+                // The pacing timer: the sends due go out on the next turn.
+                if (i == conns_.size())
+                {
+                    uint64_t expirations;
+                    ssize_t got = ::read(timer_fd_, &expirations, sizeof(expirations));
+                    (void) got;
+                    continue;
+                }
+                if (events[k].events & (EPOLLERR | EPOLLHUP) && conns_[i].connecting)
+                {
+                    fail(i);
+                    continue;
+                }
+                if (events[k].events & EPOLLOUT)
+                    flush(i);
+                if (conns_[i].fd >= 0 && events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    drain(i);
+            }
+        }
+
+        for (auto &c : conns_)
+            if (c.fd >= 0)
+                ::close(c.fd);
+        if (timer_fd_ >= 0)
+            ::close(timer_fd_);
+        ::close(epfd_);
+    }
+
+    Stats const &stats() const { return stats_; }
+
+private:
+    void open(size_t i)
+    {
+        Connection &c = conns_[i];
+        c.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int one = 1;
+        ::setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(conf_.port);
+        inet_pton(AF_INET, conf_.ip.c_str(), &addr.sin_addr);
+
+        c.connecting = true;
+        if (::connect(c.fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 &&
+            errno != EINPROGRESS)
+        {
+            stats_.errors++;
+            ::close(c.fd);
+            c.fd = -1;
+            return;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u64 = i;
+        ::epoll_ctl(epfd_, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+
+    void reopen(size_t i)
+    {
+        Connection &c = conns_[i];
+        if (c.fd >= 0)
+            ::close(c.fd);
+        c.fd = -1;
+        c.out.clear();
+        c.out_off = 0;
+        c.in.clear();
+        c.in_body = false;
+        c.close_delimited = false;
+        c.closing = false;
+        c.started.clear();
+        open(i);
+    }
+
+    /// Give up the outstanding requests of [i] and reconnect.
+    void fail(size_t i)
+    {
+        stats_.errors += std::max<size_t>(1, conns_[i].started.size());
+        reopen(i);
+    }
+
+    size_t window() const
+    {
+        return conf_.keep_alive ? conf_.pipeline : 1;
+    }
+
+    /// Queue the requests [i] may send at [now].
+    void fill(size_t i, unsigned long long now)
+    {
+        Connection &c = conns_[i];
+        if (c.fd < 0)
+        {
+            open(i);
+            return;
+        }
+
+        bool queued = false;
+        while (c.started.size() < window())
+        {
+            unsigned long long start = now;
+            if (interval_ns_)
+            {
+                if (c.next_at > now)
+                    break;
+                // Latency counts from when the request was due.
+                start = c.next_at;
+                c.next_at += interval_ns_;
+            }
+
+            bool post = conf_.post_ratio > 0 &&
+                        std::floor((c.sent + 1) * conf_.post_ratio) > std::floor(c.sent * conf_.post_ratio);
+            c.out += post ? post_ : get_;
+            c.started.push_back(start);
+            c.sent++;
+            queued = true;
+        }
+
+        if (queued && !c.connecting)
+            flush(i);
+    }
+
+    void flush(size_t i)
+    {
+        Connection &c = conns_[i];
+        if (c.connecting)
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            ::getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err)
+            {
+                fail(i);
+                return;
+            }
+            c.connecting = false;
+        }
+
+        while (c.out_off < c.out.size())
+        {
+            ssize_t n = ::send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN)
+                    fail(i);
+                break;
+            }
+            c.out_off += n;
+        }
+
+        if (c.fd >= 0 && c.out_off == c.out.size())
+        {
+            c.out.clear();
+            c.out_off = 0;
+        }
+
+        // Only wait for writability while something is pending.
+        if (c.fd >= 0)
+        {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | (c.out.empty() ? 0 : EPOLLOUT);
+            ev.data.u64 = i;
+            ::epoll_ctl(epfd_, EPOLL_CTL_MOD, c.fd, &ev);
+        }
+    }
+
+    void drain(size_t i)
+    {
+        char buf[64 << 10];
+        for (;;)
+        {
+            Connection &c = conns_[i];
+            ssize_t n = ::recv(c.fd, buf, sizeof(buf), 0);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN)
+                    fail(i);
+                return;
+            }
+            if (n == 0)
+            {
+                if (c.in_body && c.close_delimited)
+                    complete(i);
+                else if (!c.started.empty())
+                    fail(i);
+                else
+                    reopen(i);
+                return;
+            }
+
+            stats_.bytes += n;
+            c.in.append(buf, n);
+            if (!parse(i))
+                return;
+        }
+    }
+
+    /// Consume complete responses from the input of [i]. Return false if
+    /// the connection was replaced.
+    bool parse(size_t i)
+    {
+        Connection &c = conns_[i];
+        for (;;)
+        {
+            if (!c.in_body)
+            {
+                size_t end = c.in.find("\r\n\r\n");
+                if (end == std::string::npos)
+                    return true;
+
+                if (c.in.compare(0, 5, "HTTP/") != 0 || c.in.size() < 12)
+                {
+                    fail(i);
+                    return false;
+                }
+                c.status = std::atoi(c.in.c_str() + 9);
+                c.body_left = -1;
+                c.closing = false;
+                size_t pos = 0;
+                while ((pos = c.in.find("\r\n", pos)) != std::string::npos && pos < end)
+                {
+                    pos += 2;
+                    if (strncasecmp(c.in.c_str() + pos, "Content-length:", 15) == 0)
+                        c.body_left = std::atoll(c.in.c_str() + pos + 15);
+                    else if (strncasecmp(c.in.c_str() + pos, "Connection: close", 17) == 0)
+                        c.closing = true;
+                }
+                c.close_delimited = c.body_left < 0;
+                c.in_body = true;
+                c.in.erase(0, end + 4);
+            }
+
+            if (c.close_delimited)
+            {
+                c.in.clear();
+                return true;
+            }
+
+            size_t take = std::min<size_t>(c.body_left, c.in.size());
+            c.in.erase(0, take);
+            c.body_left -= take;
+            if (c.body_left > 0)
+                return true;
+
+            if (!complete(i))
+                return false;
+        }
+    }
+
+    /// Account the response at the head of [i]. Return false if the
+    /// connection was replaced.
+    bool complete(size_t i)
+    {
+        Connection &c = conns_[i];
+        c.in_body = false;
+        if (c.started.empty())
+        {
+            fail(i);
+            return false;
+        }
+
+        unsigned long long now = now_ns();
+        stats_.latency.record((now - c.started.front()) / 1000);
+        c.started.pop_front();
+        stats_.completed++;
+        if (c.status / 100 != 2)
+            stats_.non_2xx++;
+
+        // Requests pipelined behind a closing response are not answered.
+        if (!conf_.keep_alive || c.close_delimited || c.closing)
+        {
+            reopen(i);
+            return false;
+        }
+        return true;
+    }
+
+    /// Set the timer to the next send due, on a connection with room in
+    /// its window. Disarmed if there is none.
+    void arm_timer()
+    {
+        unsigned long long next = 0;
+        for (auto &c : conns_)
+            if (c.started.size() < window() && (next == 0 || c.next_at < next))
+                next = c.next_at;
+        if (next == armed_at_)
+            return;
+
+        // An absolute time of 0 would disarm the timer rather than fire.
+        struct itimerspec spec;
+        std::memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = next / 1000000000;
+        spec.it_value.tv_nsec = next % 1000000000;
+        ::timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+        armed_at_ = next;
+    }
+
+    Config const &conf_;
+    std::vector<Connection> conns_;
+    unsigned long long interval_ns_;
+    std::string get_;
+    std::string post_;
+    int epfd_;
+    /// Pacing timer of fixed rate mode, set to [armed_at_] (0 when
+    /// disarmed), -1 otherwise.
+    int timer_fd_;
+    unsigned long long armed_at_ = 0;
+    Stats stats_;
+};
+
+int main(int argc, char *const argv[])
+{
+    Config conf;
+
+    int oc;
+    while ((oc = getopt_long(argc, argv, ":", long_options, NULL)) != -1) {
+        switch (oc) {
+        case 'i':
+            conf.ip = std::string(optarg);
+            break;
+        case 'p':
+            conf.port = std::stoi(std::string(optarg));
+            break;
+        case 'c':
+            conf.connections = std::stoul(std::string(optarg));
+            break;
+        case 't':
+            conf.threads = std::stoul(std::string(optarg));
+            break;
+        case 'd':
+            conf.duration = std::stod(std::string(optarg));
+            break;
+        case 'D':
+            conf.pipeline = std::max(1ul, std::stoul(std::string(optarg)));
+            break;
+        case 'R':
+            conf.rate = std::stod(std::string(optarg));
+            break;
+        case 'u':
+            conf.path = std::string(optarg);
+            break;
+        case 'm':
+            conf.post_ratio = std::min(1.0, std::max(0.0, std::stod(std::string(optarg))));
+            break;
+        case 'k':
+            conf.keep_alive = false;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    conf.threads = std::max<size_t>(1, std::min(conf.threads, conf.connections));
+    signal(SIGINT, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t t = 0; t < conf.threads; t++)
+    {
+        size_t n = conf.connections / conf.threads + (t < conf.connections % conf.threads ? 1 : 0);
+        workers.emplace_back(new Worker(conf, n, conf.rate * n / conf.connections));
+    }
+
+    std::cout << "httpbench " << conf.ip << ":" << conf.port << conf.path
+              << ", " << conf.connections << " connections, " << conf.threads << " threads, pipeline "
+              << conf.pipeline << (conf.keep_alive ? "" : ", no keep-alive");
+    if (conf.rate > 0)
+        std::cout << ", " << conf.rate << " req/s";
+    std::cout << ", " << conf.duration << "s" << std::endl;
+
+    unsigned long long begin = now_ns();
+    unsigned long long end = begin + static_cast<unsigned long long>(conf.duration * 1e9);
+    std::vector<std::thread> threads;
+    for (auto &w : workers)
+        threads.emplace_back([&w, begin, end] { w->run(begin, end); });
+    for (auto &t : threads)
+        t.join();
+    double elapsed = (now_ns() - begin) / 1e9;
+
+    // Merge the results of all threads.
+    std::vector<unsigned long long> counts(Histogram::BUCKETS, 0);
+    unsigned long long sum = 0;
+    Stats total;
+    for (auto &w : workers)
+    {
+        Stats const &s = w->stats();
+        s.latency.merge_into(counts.data(), sum);
+        total.completed += s.completed;
+        total.errors += s.errors;
+        total.non_2xx += s.non_2xx;
+        total.bytes += s.bytes;
+    }
+
+    std::cout << "requests:   " << total.completed << " (" << total.non_2xx << " non-2xx, "
+              << total.errors << " errors)" << std::endl;
+    std::cout << "throughput: " << total.completed / elapsed << " req/s, "
+              << total.bytes / elapsed / (1 << 20) << " MiB/s" << std::endl;
+    if (total.completed == 0)
+        return 1;
+
+    std::cout << "latency:    mean " << sum / total.completed << "us";
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+    const char *names[] = { "p50", "p90", "p99", "p99.9", "max" };
+    for (int q = 0; q < 5; q++)
+    {
+        unsigned long long rank = static_cast<unsigned long long>(std::ceil(quantiles[q] * total.completed));
+        unsigned long long seen = 0;
+        int b = 0;
+        while (b < Histogram::BUCKETS - 1 && (seen += counts[b]) < rank)
+            b++;
+        // Upper end of the bucket, i.e. within 12.5% above the true value.
+        unsigned long long us = b + 1 < Histogram::BUCKETS ? Histogram::lower_bound(b + 1) : Histogram::lower_bound(b);
+        std::cout << " " << names[q] << " " << us << "us";
+    }
+    std::cout << std::endl;
+    return 0;
+}
@@ -0,0 +1,283 @@
+/// microbench.cc
+/// Copyright 2020 Cloud-fantasy team
+///
+/// Microbenchmarks of the request parsing and response serialization
+/// hot paths of the server, fed with a corpus of captured requests. Every
+/// benchmark prints the time and the heap allocations (operator new) per
+/// operation, an operation being one request of the corpus. Built and run
+/// by `make bench`.
+
+#include <iostream>
+#include <iomanip>
+#include <getopt.h>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <strings.h>
+#include "../src/server.h"
+#include "../src/response_builder.h"
+using namespace simple_http_server;
+
+/// Heap allocations made so far. The benchmarks run on a single thread.
+static unsigned long long allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+static struct option long_options[] = {
+    { "corpus", required_argument, NULL, 'c' },
+    { "time", required_argument, NULL, 't' },
+    { "filter", required_argument, NULL, 'f' },
+    { 0, 0, 0, 0 }
+};
+
+static void print_usage(char *const prog)
+{
+    std::cerr << "Usage: " << prog << " [OPTION]" << std::endl;
+    std::cerr << "[OPTION] can be the following:" << std::endl;
+    std::cerr << "\t" << "--corpus " << "file (captured requests back to back, default tools/corpus.http)" << std::endl;
+    std::cerr << "\t" << "--time " << "ms (per benchmark)" << std::endl;
+    std::cerr << "\t" << "--filter " << "substring (of the benchmarks to run)" << std::endl;
+}
+
+/// A request of the corpus, cut the way the server cuts it.
+struct Sample
+{
+    /// Request line, line end included.
+    std::string line;
+    /// Header fields up to and including the blank line.
+    std::string fields;
+    std::string resource;
+    std::string body;
+    /// Values of the fields, as received with their whitespace.
+    std::vector<std::string> values;
+};
+
+/// Split the concatenated requests of [data], bodies delimited by their
+/// Content-Length.
+static bool load_corpus(std::string const &data, std::vector<Sample> &samples)
+{
+    size_t pos = 0;
+    while (pos < data.length())
+    {
+        size_t end = data.find("\r\n\r\n", pos);
+        if (end == std::string::npos)
+            return false;
+        end += 4;
+
+        Sample s;
+        size_t eol = data.find('\n', pos) + 1;
+        s.line = data.substr(pos, eol - pos);
+        s.fields = data.substr(eol, end - eol);
+        s.resource = s.line.substr(s.line.find(' ') + 1);
+        s.resource.erase(s.resource.find(' '));
+
+        size_t length = 0;
+        std::istringstream lines(s.fields);
+        std::string field;
+        while (std::getline(lines, field) && field != "\r")
+        {
+            size_t colon = field.find(':');
+            if (colon == std::string::npos)
+                return false;
+            std::string value = field.substr(colon + 1);
+            value.erase(value.length() - 1);
+            if (strncasecmp(field.c_str(), "Content-Length", colon) == 0 && colon == 14)
+                length = std::stoul(value);
+            s.values.push_back(value);
+        }
+
+        if (end + length > data.length())
+            return false;
+        s.body = data.substr(end, length);
+        samples.push_back(s);
+        pos = end + length;
+    }
+    return !samples.empty();
+}
+
+namespace simple_http_server
+{
+
+/// Reaches into the private parsers of Server.
+class Microbench
+{
+public:
+    explicit Microbench(std::vector<Sample> const &samples)
+        : samples_(samples), server_("127.0.0.1", 0, "", 1), sink_(0) {}
+
+    void run_all(std::string const &filter, unsigned long ms);
+
+private:
+    /// Run [op] on the samples for about [ms] and print its cost.
+    void run(std::string const &name, unsigned long ms, std::function<void(Sample const &)> op);
+
+    std::vector<Sample> const &samples_;
+    Server server_;
+    /// Results are folded in here so that they are not optimized away.
+    size_t sink_;
+};
+
+void Microbench::run(std::string const &name, unsigned long ms,
+                     std::function<void(Sample const &)> op)
+{
+    typedef std::chrono::steady_clock clock;
+
+    // Warm up, then grow the rounds until one lasts long enough.
+    size_t rounds = 1;
+    for (;;)
+    {
+        clock::time_point start = clock::now();
+        for (size_t r = 0; r < rounds; r++)
+            for (Sample const &s : samples_)
+                op(s);
+        if (clock::now() - start >= std::chrono::milliseconds(ms / 10 + 1))
+            break;
+        rounds *= 2;
+    }
+    rounds *= 10;
+
+    unsigned long long allocs = allocations;
+    clock::time_point start = clock::now();
+    for (size_t r = 0; r < rounds; r++)
+        for (Sample const &s : samples_)
+            op(s);
+    double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    allocs = allocations - allocs;
+
+    double ops = static_cast<double>(rounds) * samples_.size();
+    std::cout << std::left << std::setw(24) << name << std::right << std::fixed
+              << std::setw(12) << std::setprecision(1) << ns / ops << " ns/op"
+              << std::setw(10) << std::setprecision(2) << allocs / ops << " allocs/op" << std::endl;
+}
+
+void Microbench::run_all(std::string const &filter, unsigned long ms)
+{
+    struct Case
+    {
+        const char *name;
+        std::function<void(Sample const &)> op;
+    };
+
+    std::vector<Case> cases = {
+        { "parse_req_line", [this](Sample const &s) {
+            std::string method, uri, version;
+            sink_ += server_.parse_req_line(StringRef(s.line), method, uri, version) + uri.length();
+        } },
+        { "parse_headers", [this](Sample const &s) {
+            Headers headers;
+            sink_ += server_.parse_headers(StringRef(s.fields), headers) + headers.size();
+        } },
+        { "split", [this](Sample const &s) {
+            sink_ += Server::split(s.body.empty() ? s.resource : s.body, "&").size();
+        } },
+        { "trim_whitespace", [this](Sample const &s) {
+            // Into a string whose capacity is reused, as only the trim
+            // is measured.
+            static std::string value;
+            for (std::string const &v : s.values)
+            {
+                value.assign(v);
+                sink_ += server_.trim_whitespace(value).length();
+            }
+        } },
+        { "parse_uri", [this](Sample const &s) {
+            sink_ += server_.parse_uri(s.resource).length();
+        } },
+        { "parse_name_id", [this](Sample const &s) {
+            if (!s.body.empty())
+                sink_ += server_.parse_name_id(s.body).size();
+        } },
+        { "Response::serialize", [this](Sample const &s) {
+            Response response;
+            response.version = "HTTP/1.1";
+            response.status_code = Response::OK;
+            response.status = "OK";
+            response.headers.set("Server", Server::server_name);
+            response.headers.set("Content-type", "text/html");
+            response.headers.set("Content-length", std::to_string(s.line.length()));
+            response.body.assign(s.line.begin(), s.line.end());
+            sink_ += response.serialize().length();
+        } },
+        { "ResponseBuilder", [this](Sample const &s) {
+            ResponseBuilder &builder = ResponseBuilder::local();
+            builder.start(Response::OK, "OK")
+                   .header("Server", Server::server_name)
+                   .header("Content-type", "text/html")
+                   .header("Content-length", s.line.length());
+            sink_ += builder.finish().length();
+        } },
+    };
+
+    for (Case const &c : cases)
+        if (filter.empty() || std::string(c.name).find(filter) != std::string::npos)
+            run(c.name, ms, c.op);
+    if (sink_ == 0)
+        std::cout << std::endl;
+}
+
+}   // namespace simple_http_server
+
+int main(int argc, char *const argv[])
+{
+    std::string corpus = "tools/corpus.http";
+    std::string filter;
+    unsigned long ms = 200;
+
+    int oc;
+    while ((oc = getopt_long(argc, argv, ":", long_options, NULL)) != -1) {
+        switch (oc) {
+        case 'c':
+            corpus = std::string(optarg);
+            break;
+        case 't':
+            ms = std::stoul(std::string(optarg));
+            break;
+        case 'f':
+            filter = std::string(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::ifstream in(corpus, std::ios::binary);
+    std::stringstream data;
+    data << in.rdbuf();
+    std::vector<Sample> samples;
+    if (!in || !load_corpus(data.str(), samples))
+    {
+        std::cerr << "fail loading the requests of " << corpus << std::endl;
+        return 1;
+    }
+
+    std::cout << samples.size() << " requests from " << corpus << std::endl;
+    Microbench bench(samples);
+    bench.run_all(filter, ms);
+}
@@ -0,0 +1,98 @@
+#!/bin/bash
+# upgrade_test.sh
+# Copyright 2020 Cloud-fantasy team
+#
+# Hot upgrade under load: httpbench runs against a server while a second
+# one takes its listening socket over through --upgrade-socket. Every
+# request must be answered with a 2xx, by one process or the other, and
+# the old one must drain and exit. Run by `make test`, from Lab2.
+
+set -u
+
+SERVER=$(pwd)/httpserver
+BENCH=$(pwd)/httpbench
+PORT=${PORT:-18481}
+DIR=$(mktemp -d)
+failures=0
+
+cleanup()
+{
+    for p in ${old:-} ${new:-} ${bench:-}; do
+        kill "$p" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL $*" >&2
+    failures=$((failures + 1))
+}
+
+# Starts a server on the upgrade socket in the directory [1], where it
+# logs and finds its files.
+serve()
+{
+    mkdir -p "$DIR/$1"
+    printf 'hello' > "$DIR/$1/a.txt"
+    cd "$DIR/$1" || exit 1
+    "$SERVER" --port "$PORT" --upgrade-socket "$DIR/upgrade.sock" --drain-timeout 5000 \
+        --log-level info > /dev/null 2>&1 &
+    cd "$DIR" || exit 1
+}
+
+serve old
+old=$!
+for _ in $(seq 50); do
+    curl -s -o /dev/null "http://127.0.0.1:$PORT/a.txt" && break
+    sleep 0.1
+done
+
+# Kept-alive and pipelined connections, and one connection per request.
+"$BENCH" --port "$PORT" --connections 32 --threads 2 --duration 4 --path /a.txt \
+    --pipeline 4 > "$DIR/kept.txt" 2>&1 &
+bench=$!
+"$BENCH" --port "$PORT" --connections 8 --threads 1 --duration 4 --path /a.txt \
+    --no-keep-alive > "$DIR/fresh.txt" 2>&1 &
+fresh=$!
+
+sleep 1.5
+serve new
+new=$!
+
+wait "$bench" "$fresh"
+bench=
+
+for run in kept fresh; do
+    line=$(grep '^requests:' "$DIR/$run.txt")
+    # "requests:   N (X non-2xx, Y errors)"
+    read -r total non_2xx errors <<< "$(echo "$line" | tr -d '(),' | awk '{ print $2, $3, $5 }')"
+    [ "${total:-0}" -gt 0 ] || fail "$run: no request answered"
+    [ "${non_2xx:-1}" -eq 0 ] || fail "$run: $non_2xx non-2xx responses"
+    [ "${errors:-1}" -eq 0 ] || fail "$run: $errors errors"
+    echo "$run: $line"
+done
+
+# The old process hands over, drains and exits; the new one serves.
+for _ in $(seq 50); do
+    kill -0 "$old" 2>/dev/null || break
+    sleep 0.1
+done
+if kill -0 "$old" 2>/dev/null; then
+    fail "the old server is still running"
+else
+    old=
+fi
+grep -q 'took over' "$DIR/new/info_server.log" || fail "the new server did not take the socket over"
+grep -q 'drained, exiting' "$DIR/old/info_server.log" || fail "the old server did not drain"
+body=$(curl -s "http://127.0.0.1:$PORT/a.txt")
+[ "$body" = hello ] || fail "the new server answers '$body'"
+
+if [ "$failures" -gt 0 ]; then
+    tail -n +1 "$DIR"/old/*.log "$DIR"/new/*.log "$DIR/kept.txt" "$DIR/fresh.txt" >&2
+    echo "$failures checks failed" >&2
+    exit 1
+fi
+echo "upgrade: all checks passed"
@@ -0,0 +1,90 @@
+#!/bin/bash
+# write_timeout_test.sh
+# Copyright 2020 Cloud-fantasy team
+#
+# --write-timeout bounds inactivity, not whole responses: ranges of a
+# file too large for the cache, sent with sendfile(2), to a client
+# reading slower than the timeout must arrive whole, and a client that
+# stops reading must be cut off. Run by `make test`, from Lab2.
+
+set -u
+
+SERVER=$(pwd)/httpserver
+PORT=${PORT:-18480}
+TIMEOUT_MS=1000
+DIR=$(mktemp -d)
+failures=0
+
+cleanup()
+{
+    [ -n "${pid:-}" ] && kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL $*" >&2
+    failures=$((failures + 1))
+}
+
+# Above --cache-max-entry, and the ranges above the 4 MB a send buffer
+# can hold.
+head -c $((16 << 20)) /dev/urandom > "$DIR/big.bin"
+cd "$DIR" || exit 1
+"$SERVER" --port "$PORT" --write-timeout "$TIMEOUT_MS" --cache-max-entry 65536 \
+    --log-level error > "$DIR/server.log" 2>&1 &
+pid=$!
+for _ in $(seq 50); do
+    curl -s -o /dev/null "http://127.0.0.1:$PORT/" && break
+    sleep 0.1
+done
+
+# Reads [range] of big.bin at about 4 MB/s through a small receive
+# buffer, or stops reading for [stall] seconds first; prints the bytes
+# got up to the end of the connection.
+slow_get()
+{
+    python3 - "$PORT" "$1" "${2:-0}" <<'EOF'
+import socket, sys, time
+port, rng, stall = int(sys.argv[1]), sys.argv[2], float(sys.argv[3])
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 65536)
+s.connect(("127.0.0.1", port))
+s.sendall(("GET /big.bin HTTP/1.1\r\nHost: x\r\nRange: bytes=%s\r\n"
+           "Connection: close\r\n\r\n" % rng).encode())
+time.sleep(stall)
+got = 0
+try:
+    while True:
+        d = s.recv(65536)
+        if not d:
+            break
+        got += len(d)
+        time.sleep(0.016)
+except ConnectionResetError:
+    pass
+print(got)
+EOF
+}
+
+# About 3 s per response, three times the timeout; heads included.
+got=$(slow_get 0-11999999)
+[ "$got" -gt 12000000 ] || fail "slow single range: $got bytes"
+
+got=$(slow_get 0-5999999,8000000-13999999)
+[ "$got" -gt 12000000 ] || fail "slow multipart ranges: $got bytes"
+
+# Stalled for three times the timeout: what was in flight, then the end.
+got=$(slow_get 0-15999999 3)
+[ "$got" -lt 16000000 ] || fail "stalled client got the whole range: $got bytes"
+
+fired=$(curl -s "http://127.0.0.1:$PORT/metrics" | grep 'httpserver_timeouts_total{kind="write"}' | cut -d' ' -f2)
+[ "${fired:-0}" -eq 1 ] || fail "write timeouts fired: ${fired:-none}, expected 1"
+
+if [ "$failures" -gt 0 ]; then
+    cat "$DIR/server.log" >&2
+    echo "$failures checks failed" >&2
+    exit 1
+fi
+echo "write timeout: all checks passed"
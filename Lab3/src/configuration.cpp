@@ -45,7 +45,9 @@ coordinator_configuration::coordinator_configuration()
 coordinator_configuration::coordinator_configuration(coordinator_configuration &&conf)
     : configuration(COORDINATOR)
     , participant_addrs(std::move(conf.participant_addrs))
-    , participant_ports(std::move(conf.participant_ports)) {
+    , participant_ports(std::move(conf.participant_ports))
+    , use_event_loops(conf.use_event_loops)
+    , event_loops(conf.event_loops) {
         addr = std::move(conf.addr);
         port = conf.port;
     }
@@ -57,6 +59,8 @@ coordinator_configuration &coordinator_configuration::operator=(coordinator_conf
 
     participant_addrs = std::move(conf.participant_addrs);
     participant_ports = std::move(conf.participant_ports);
+    use_event_loops = conf.use_event_loops;
+    event_loops = conf.event_loops;
     addr = std::move(conf.addr);
     port = conf.port;
     return *this;
@@ -82,6 +86,7 @@ configuration_manager::configuration_manager()
     m["participant_info"] = std::bind(&configuration_manager::participant_info, this, std::placeholders::_1, std::placeholders::_2);
     m["num_workers"] = std::bind(&configuration_manager::num_workers, this, std::placeholders::_1, std::placeholders::_2);
     m["storage_path"] = std::bind(&configuration_manager::storage_path, this, std::placeholders::_1, std::placeholders::_2);
+    m["event_loops"] = std::bind(&configuration_manager::event_loops, this, std::placeholders::_1, std::placeholders::_2);
 }
 
 std::unique_ptr<configuration>
@@ -210,4 +215,18 @@ configuration_manager::storage_path(configuration *conf, const std::string &valu
     static_cast<participant_configuration*>(conf)->storage_path = value;
 }
 
+void
+configuration_manager::event_loops(configuration *conf, const std::string &value)
+{
+    if (conf->mode != configuration::COORDINATOR)
+        __CONF_THROW("event loops specified in participant configuration");
+
+    auto coor_conf = static_cast<coordinator_configuration*>(conf);
+    try
+    {
+        coor_conf->event_loops = std::stoul(value);
+        coor_conf->use_event_loops = true;
+    } catch (std::exception &e) { __CONF_THROW("invalid number of event loops"); }
+}
+
 }   // namespace cdb
\ No newline at end of file
@@ -38,6 +38,7 @@ private:
     */
     void num_workers(configuration *conf, const std::string &value);
     void storage_path(configuration *conf, const std::string &value);
+    void event_loops(configuration *conf, const std::string &value);
 
     bool get_option(const std::string &line, std::string &op, std::string &value);
 
@@ -79,6 +80,11 @@ struct coordinator_configuration : public configuration {
     /// IP address and ports of participants.
     std::vector<std::string> participant_addrs;
     std::vector<std::uint16_t> participant_ports;
+
+    /// Number of event loops serving the clients, one per core if 0.
+    /// Clients are served by the default reactor if not specified.
+    bool use_event_loops = false;
+    std::size_t event_loops = 0;
 };
 
 /// Used by participants.
@@ -23,6 +23,9 @@ void coordinator::start()
 
     is_started_ = true;
 
+    if (conf_.use_event_loops)
+        svr_.set_event_loops(conf_.event_loops);
+
     svr_.start(conf_.addr, 
                conf_.port,
                std::bind(&coordinator::handle_new_client, this, std::placeholders::_1));
@@ -39,6 +42,9 @@ void coordinator::async_start()
 
     is_started_ = true;
 
+    if (conf_.use_event_loops)
+        svr_.set_event_loops(conf_.event_loops);
+
     svr_.start(conf_.addr,
                conf_.port,
                std::bind(&coordinator::handle_new_client, this, std::placeholders::_1));
@@ -1,4 +1,7 @@
-#include <sys/select.h>
+#include <cerrno>
+#include <pthread.h>
+#include <unistd.h>
+#include "exceptions.hpp"
 #include "reactor.hpp"
 
 namespace tcp_server_lib
@@ -17,6 +20,23 @@ reactor::reactor(std::size_t thread_num)
     : callback_workers_(thread_num)
     , poll_stop_(false)
 {
+#ifdef __linux__
+    epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0)
+        __TCP_THROW("epoll_create1() failure");
+
+    // The notifier is always polled.
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = notifier_.get_read_fd();
+    if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0)
+    {
+        ::close(epoll_fd_);
+        __TCP_THROW("epoll_ctl() failure");
+    }
+    events_.resize(64);
+#endif
+
     poll_worker_ = std::thread(std::bind(&reactor::poll, this));
 }
 
@@ -26,6 +46,10 @@ reactor::~reactor()
 
     if (poll_worker_.joinable())
         poll_worker_.join();
+
+#ifdef __linux__
+    ::close(epoll_fd_);
+#endif
 }
 
 void reactor::stop()
@@ -52,11 +76,13 @@ void reactor::register_fd(int fd,
     info.wr_callback = wr_callback;
     info.marked_untrack = false;
 
-    notifier_.notify();
+    update_interest(fd, info);
 }
 
 std::size_t reactor::register_num()
 {
+    std::lock_guard<std::mutex> lock(tracked_fds_mutex_);
+
     return tracked_fds_.size();
 }
 
@@ -65,6 +91,19 @@ void reactor::set_thread_num(std::size_t thread_num)
     callback_workers_.set_thread_num(thread_num);
 }
 
+bool reactor::pin(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return ::pthread_setaffinity_np(poll_worker_.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
 void reactor::set_rd_callback(int fd, const event_handler_t &cb)
 {
     std::lock_guard<std::mutex> lock(tracked_fds_mutex_);
@@ -72,8 +111,7 @@ void reactor::set_rd_callback(int fd, const event_handler_t &cb)
     auto &info = tracked_fds_[fd];
     info.rd_callback = cb;
 
-    // Force poll_worker_ to wake up.
-    notifier_.notify();
+    update_interest(fd, info);
 }
 
 void reactor::set_wr_callback(int fd, const event_handler_t &cb)
@@ -83,7 +121,7 @@ void reactor::set_wr_callback(int fd, const event_handler_t &cb)
     auto &info = tracked_fds_[fd];
     info.wr_callback = cb;
 
-    notifier_.notify();
+    update_interest(fd, info);
 }
 
 void reactor::unregister(int fd)
@@ -95,20 +133,17 @@ void reactor::unregister(int fd)
         return;
 
     auto &info = tracked_fds_[fd];
-    if (info.is_executing_rd_cb || info.is_executing_wr_cb)
-    {
-        // Let the callback worker erase it.
-        info.marked_untrack = true;
-    }
-    else
+    // No callback is dispatched from now on.
+    info.marked_untrack = true;
+    update_interest(fd, info);
+
+    if (!info.is_executing_rd_cb && !info.is_executing_wr_cb)
     {
-        // Remove it immediately.
+        // Remove it immediately, else the callback worker erases it.
         auto it = tracked_fds_.find(fd);
         tracked_fds_.erase(it);
         removal_cond.notify_all();
     }
-
-    notifier_.notify();
 }
 
 void reactor::wait_on_removal_cond(int fd)
@@ -121,15 +156,33 @@ void reactor::wait_on_removal_cond(int fd)
     });
 }
 
-/// TODO: Add epoll for linux.
 void reactor::poll()
 {
     while (!poll_stop_)
     {
+#ifdef __linux__
+        int ret = ::epoll_wait(epoll_fd_, events_.data(), static_cast<int>(events_.size()), -1);
+#else
         int nfds = init_select_fds();
         int ret = ::select(nfds, &rd_set_, &wr_set_, NULL, NULL);
+#endif
         if (ret > 0)
-            dispatch();
+        {
+            dispatch(ret);
+
+            // Run the callbacks left by the dispatch, without holding
+            // [tracked_fds_mutex_] as they may take it.
+            std::vector<thread_pool::task_t> tasks;
+            tasks.swap(ready_tasks_);
+            for (auto &task : tasks)
+            {
+                try {
+                    task();
+                } catch (const std::exception &) {
+                    // TODO: add log.
+                }
+            }
+        }
         else if (errno == EINTR)
             continue;
         else
@@ -139,6 +192,92 @@ void reactor::poll()
     }
 }
 
+#ifdef __linux__
+
+void reactor::update_interest(int fd, fd_info &info)
+{
+    std::uint32_t events = 0;
+    if (!info.marked_untrack)
+    {
+        if (info.rd_callback && !info.is_executing_rd_cb)
+            events |= EPOLLIN;
+        if (info.wr_callback && !info.is_executing_wr_cb)
+            events |= EPOLLOUT;
+    }
+    if (events == info.events)
+        return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (events == 0)
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, &ev);
+    // A closed fd leaves the epoll set by itself, its number may
+    // then be registered again.
+    else if (info.events == 0)
+    {
+        if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0 && errno == EEXIST)
+            ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+    }
+    else if (::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT)
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+
+    info.events = events;
+}
+
+void reactor::dispatch(int ready)
+{
+    dispatch_epoll(ready);
+}
+
+void reactor::dispatch_epoll(int ready)
+{
+    std::lock_guard<std::mutex> lock(tracked_fds_mutex_);
+
+    for (int i = 0; i < ready; i++)
+    {
+        int fd = events_[i].data.fd;
+        std::uint32_t events = events_[i].events;
+
+        // Ignore notifier.
+        if (fd == notifier_.get_read_fd())
+        {
+            notifier_.clear_pipe();
+            continue;
+        }
+
+        auto it = tracked_fds_.find(fd);
+        if (it == tracked_fds_.end())
+            continue;
+
+        // Errors and hang-ups are reported to whichever callback waits.
+        auto &info = it->second;
+        bool failed = events & (EPOLLERR | EPOLLHUP);
+        if ((events & EPOLLIN || failed) && (info.events & EPOLLIN))
+            dispatch_read(fd);
+
+        if ((events & EPOLLOUT || failed) && (info.events & EPOLLOUT))
+            dispatch_write(fd);
+    }
+
+    // Every slot was used, more fds may be ready.
+    if (static_cast<std::size_t>(ready) == events_.size())
+        events_.resize(events_.size() * 2);
+}
+
+#else
+
+void reactor::update_interest(int, fd_info &)
+{
+    // [poll_worker_] rebuilds its fd sets once woken up.
+    notifier_.notify();
+}
+
+void reactor::dispatch(int)
+{
+    dispatch_select();
+}
+
 int reactor::init_select_fds()
 {
     std::lock_guard<std::mutex> lock(tracked_fds_mutex_);
@@ -176,11 +315,6 @@ int reactor::init_select_fds()
     return nfds + 1;
 }
 
-void reactor::dispatch()
-{
-    dispatch_select();
-}
-
 void reactor::dispatch_select()
 {
     std::lock_guard<std::mutex> lock(tracked_fds_mutex_);
@@ -213,6 +347,8 @@ void reactor::dispatch_select()
     }
 }
 
+#endif
+
 void reactor::dispatch_read(int fd)
 {
     if (!tracked_fds_.count(fd))
@@ -223,9 +359,10 @@ void reactor::dispatch_read(int fd)
     // Update info.
     auto rd_callback = info.rd_callback;
     info.is_executing_rd_cb = true;
+    update_interest(fd, info);
 
     // Call the user provided callback.
-    callback_workers_.add_task([=] {
+    run_callback([=] {
         rd_callback(fd);
 
         // Update info associated with this fd.
@@ -245,9 +382,9 @@ void reactor::dispatch_read(int fd)
             // Wake the thread that blocks on [wait_on_removal_cond].
             this->removal_cond.notify_all();
         }
-
-        // Wake poll_worker_
-        this->notifier_.notify();
+        else
+            // Poll [fd] again.
+            this->update_interest(fd, info);
     });
 }
 
@@ -260,9 +397,10 @@ void reactor::dispatch_write(int fd)
 
     auto wr_callback = info.wr_callback;
     info.is_executing_wr_cb = true;
+    update_interest(fd, info);
 
     // Call the user provided callback.
-    callback_workers_.add_task([=] {
+    run_callback([=] {
         wr_callback(fd);
 
         // Update info associated with this fd.
@@ -278,10 +416,17 @@ void reactor::dispatch_write(int fd)
             this->tracked_fds_.erase(it);
             this->removal_cond.notify_all();
         }
-
-        // Wake poll_worker_
-        this->notifier_.notify();
+        else
+            this->update_interest(fd, info);
     });
 }
 
+void reactor::run_callback(const thread_pool::task_t &task)
+{
+    if (callback_workers_.get_thread_num() == 0)
+        ready_tasks_.push_back(task);
+    else
+        callback_workers_.add_task(task);
+}
+
 } // namespace tcp_server_lib
@@ -2,12 +2,19 @@
 #define TCP_SERVER_REACTOR_HPP
 
 #include <atomic>
+#include <cstdint>
 #include <functional>
 #include <unordered_map>
 #include <vector>
 #include "thread_pool.hpp"
 #include "pipe.hpp"
 
+#ifdef __linux__
+    #include <sys/epoll.h>
+#else
+    #include <sys/select.h>
+#endif
+
 namespace tcp_server_lib {
 
 /// Forward declaration.
@@ -20,10 +27,20 @@ reactor *get_default_reactor();
 /// paper's description. The reactor consists of a
 /// single polling thread that calls multiplexing I/O
 /// syscall and a thread pool for dispatching handlers.
+///
+/// On Linux the syscall is epoll: the interest of an fd is
+/// updated when its callbacks change or start/finish running,
+/// so each wakeup costs time in the number of ready fds only.
+/// Elsewhere select is used, rebuilding its fd sets from all
+/// the tracked fds on every wakeup.
+///
+/// With no thread worker, the callbacks run on the polling
+/// thread itself once the ready fds are dispatched, which makes
+/// the reactor a single-threaded event loop (see [reactor_group]).
 class reactor
 {
 public:
-    /// Constructors.
+    /// Constructors. [thread_num] may be 0, see above.
     reactor(std::size_t thread_num);
     ~reactor();
 
@@ -42,6 +59,10 @@ public:
     /// Change the number of underlying thread workers.
     void set_thread_num(std::size_t thread_num);
 
+    /// Pin the polling thread to [cpu]. Return false if it could
+    /// not be pinned, or pinning is not supported.
+    bool pin(int cpu);
+
     /// Register [fd] to the reactor. 
     void register_fd(int fd,
                      const event_handler_t &rd_callback = nullptr,
@@ -76,6 +97,8 @@ private:
         std::atomic<bool> is_executing_wr_cb = ATOMIC_VAR_INIT(false);
         event_handler_t rd_callback;
         event_handler_t wr_callback;
+        /// Events [fd] is registered for with epoll, 0 if none.
+        std::uint32_t events = 0;
 
         fd_info()
             : rd_callback(nullptr)
@@ -89,12 +112,21 @@ private:
     /// nfds.
     int init_select_fds();
 
-    /// Dispatch handlers.
-    void dispatch();
+    /// Make the polling of [fd] reflect [info], which has changed.
+    /// Needs [tracked_fds_mutex_].
+    void update_interest(int fd, fd_info &info);
+
+    /// Dispatch handlers, [ready] being the result of the syscall.
+    void dispatch(int ready);
     void dispatch_select();
+    void dispatch_epoll(int ready);
     void dispatch_read(int fd);
     void dispatch_write(int fd);
 
+    /// Run [task] on a callback worker, or queue it to
+    /// [ready_tasks_] if there is none.
+    void run_callback(const thread_pool::task_t &task);
+
 private:
     /// fd and callback info map.
     std::unordered_map<int, fd_info> tracked_fds_;
@@ -104,12 +136,22 @@ private:
     std::thread poll_worker_;
     thread_pool callback_workers_;
 
+    /// Callbacks run by [poll_worker_] after a dispatch when there
+    /// is no callback worker.
+    std::vector<thread_pool::task_t> ready_tasks_;
+
+#ifdef __linux__
+    int epoll_fd_;
+    /// Filled by [epoll_wait].
+    std::vector<struct epoll_event> events_;
+#else
     /// fds that are polled.
     std::vector<int> polled_fds_;
     
     /// Read/write fd sets used by [select].
     fd_set rd_set_;
     fd_set wr_set_;
+#endif
 
     /// Flag to force instructs [poll_worker_] to stop.
     std::atomic<bool> poll_stop_;
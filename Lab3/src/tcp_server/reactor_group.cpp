@@ -0,0 +1,57 @@
+#include <thread>
+#include "reactor_group.hpp"
+
+namespace tcp_server_lib
+{
+
+reactor_group::reactor_group(std::size_t loop_num, policy_t policy)
+    : policy_(policy)
+    , next_(0)
+{
+    std::size_t cores = std::thread::hardware_concurrency();
+    if (cores == 0)
+        cores = 1;
+    if (loop_num == 0)
+        loop_num = cores;
+
+    loops_.reserve(loop_num);
+    for (std::size_t i = 0; i < loop_num; i++)
+    {
+        loops_.emplace_back(new reactor{0});
+        // Best effort, an unpinned loop works all the same.
+        loops_.back()->pin(static_cast<int>(i % cores));
+    }
+}
+
+reactor_group::~reactor_group()
+{
+    stop();
+}
+
+reactor *reactor_group::next()
+{
+    if (policy_ == ROUND_ROBIN)
+        return loops_[next_.fetch_add(1) % loops_.size()].get();
+
+    // Loads may change meanwhile, this is only a hint.
+    reactor *least = loops_.front().get();
+    std::size_t least_num = least->register_num();
+    for (std::size_t i = 1; i < loops_.size() && least_num > 0; i++)
+    {
+        std::size_t num = loops_[i]->register_num();
+        if (num < least_num)
+        {
+            least = loops_[i].get();
+            least_num = num;
+        }
+    }
+    return least;
+}
+
+void reactor_group::stop()
+{
+    for (auto &loop : loops_)
+        loop->stop();
+}
+
+} // namespace tcp_server_lib
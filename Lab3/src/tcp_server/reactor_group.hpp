@@ -0,0 +1,55 @@
+#ifndef TCP_SERVER_REACTOR_GROUP_HPP
+#define TCP_SERVER_REACTOR_GROUP_HPP
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "reactor.hpp"
+
+namespace tcp_server_lib {
+
+/// A fixed set of event loops, each a reactor without callback
+/// workers whose polling thread is pinned to a core. Connections
+/// are spread over the loops by [next], and stay on the loop
+/// they were given: all their callbacks run on its thread, so the
+/// locks taken on their way are never contended.
+///
+/// A callback that blocks holds up every connection of its loop.
+class reactor_group
+{
+public:
+    /// How [next] picks a loop.
+    enum policy_t {
+        ROUND_ROBIN,
+        /// The loop tracking the fewest fds.
+        LEAST_LOADED
+    };
+
+    /// [loop_num] loops, one per core if 0.
+    reactor_group(std::size_t loop_num, policy_t policy = ROUND_ROBIN);
+    ~reactor_group();
+
+    reactor_group(const reactor_group &) = delete;
+    reactor_group &operator=(const reactor_group &) = delete;
+
+public:
+    /// The loop for a new connection.
+    reactor *next();
+
+    /// Number of loops.
+    std::size_t size() const { return loops_.size(); }
+
+    /// Stop all the loops.
+    void stop();
+
+private:
+    std::vector<std::unique_ptr<reactor>> loops_;
+    policy_t policy_;
+
+    /// Round-robin position.
+    std::atomic<std::size_t> next_;
+};
+
+} // namespace tcp_server_lib
+
+#endif
@@ -13,7 +13,10 @@ tcp_client::~tcp_client()
 }
 
 tcp_client::tcp_client(tcp_socket&& socket)
-    : reactor_(get_default_reactor())
+    : tcp_client(std::move(socket), get_default_reactor()) {}
+
+tcp_client::tcp_client(tcp_socket&& socket, reactor *r)
+    : reactor_(r)
     , socket_(std::move(socket))
     , is_connected_(true)
     , on_disconnection_(nullptr) {}
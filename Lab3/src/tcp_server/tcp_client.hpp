@@ -19,6 +19,8 @@ public:
     /// Explicitly disallow move/copy.
     tcp_client(const tcp_client&) = delete;
     tcp_client(tcp_socket&& socket);
+    /// A connected [socket] whose callbacks are run by [r].
+    tcp_client(tcp_socket&& socket, reactor *r);
     tcp_client(tcp_client&&) = delete;
     tcp_client &operator=(const tcp_client&) = delete;
     tcp_client &operator=(tcp_client&&) = delete;
@@ -30,13 +30,22 @@ void tcp_server::start(const std::string &host, std::uint32_t port, const on_new
     is_running_ = true;
 }
 
+void tcp_server::set_event_loops(std::size_t loop_num, reactor_group::policy_t policy)
+{
+    if (is_running_)
+        __TCP_THROW("tcp_server is already running");
+
+    loops_.reset(new reactor_group{loop_num, policy});
+}
+
 // The fd will always be the listening fd.
 void tcp_server::on_read_available(int)
 {
     try
     {
         // NOTE: we're limited to C++11 here, so make_shared is not available.
-        std::shared_ptr<tcp_client> client{new tcp_client(socket_.accept())};
+        reactor *r = loops_ ? loops_->next() : reactor_;
+        std::shared_ptr<tcp_client> client{new tcp_client(socket_.accept(), r)};
 
         if (on_new_connection_cb_)
             on_new_connection_cb_(client);
@@ -56,8 +65,11 @@ void tcp_server::on_read_available(int)
                 client, 
                 nullptr);
 
-        // Append the client to internal client list.
-        clients_.emplace_back(client);
+        // Append the client to internal client list, unless its
+        // reactor has disconnected it already.
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+        if (client->is_connected())
+            clients_.emplace_back(client);
     }
     catch(const std::exception& e)
     {
@@ -8,6 +8,7 @@
 #include "tcp_socket.hpp"
 #include "tcp_client.hpp"
 #include "reactor.hpp"
+#include "reactor_group.hpp"
 
 namespace tcp_server_lib
 {
@@ -31,6 +32,12 @@ public:
     /// Stop TCP server.
     void stop();
 
+    /// Serve the accepted connections on [loop_num] event loops
+    /// of their own, one per core if 0, instead of the default
+    /// reactor. Must be called before [start].
+    void set_event_loops(std::size_t loop_num,
+                         reactor_group::policy_t policy = reactor_group::ROUND_ROBIN);
+
     /* GETTER. */
     tcp_socket &socket() { return socket_; }
     const tcp_socket &socket() const { return socket_; }
@@ -43,8 +50,12 @@ private:
     void on_client_disconnect(std::shared_ptr<tcp_client>, const tcp_client::on_disconnection_t &user_cb = nullptr);
 
 private:
+    /// Polls the listening socket.
     reactor *reactor_;
 
+    /// Event loops of the clients, nullptr for [reactor_].
+    std::unique_ptr<reactor_group> loops_;
+
     /// Indicator.
     std::atomic<bool> is_running_ = ATOMIC_VAR_INIT(false);
 